@@ -5,21 +5,141 @@
  * - A basic kernel
  * - Simple memory management
  * - Process management
- * - File system operations
+ * - File system operations with directories
  * - Basic command shell
  */
 
+ #define _GNU_SOURCE // For O_DIRECT
  #include <stdint.h>
  #include <stdbool.h>
+ #include <stddef.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ 
+ // Disk images are memory-mapped where the host supports it
+ #if defined(__unix__) || defined(__APPLE__)
+ #include <fcntl.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #define HAVE_MMAP 1
+ #endif
+ 
+ // Image I/O is submitted through io_uring where the kernel headers have it
+ #if defined(__linux__) && defined(__has_include)
+ #if __has_include(<linux/io_uring.h>)
+ #include <linux/io_uring.h>
+ #include <sys/syscall.h>
+ #undef BLOCK_SIZE // Pulled in from <linux/fs.h>; ours is defined below
+ #define HAVE_IO_URING 1
+ #endif
+ #endif
+ 
+ // Checksums use the SSE4.2 or ARMv8 CRC32C instructions where the compiler can emit them
+ #if defined(__GNUC__) && defined(__x86_64__)
+ #include <nmmintrin.h>
+ #define HAVE_CRC32C_X86 1 // Used only if the CPU reports SSE4.2 at run time
+ #elif defined(__ARM_FEATURE_CRC32)
+ #include <arm_acle.h>
+ #define HAVE_CRC32C_ARM 1
+ #endif
+ 
+ // Pick how simulated processes get a host execution context
+ #if defined(__x86_64__) && defined(__ELF__)
+ #define CONTEXT_ASM 1
+ #elif defined(_WIN32)
+ #include <windows.h>
+ #define CONTEXT_FIBER 1
+ #else
+ #include <ucontext.h>
+ #define CONTEXT_UCONTEXT 1
+ #endif
  
  /* ======= CONSTANTS ======= */
  #define MAX_PROCESSES 16
- #define MAX_FILES 32
  #define MAX_FILENAME_LEN 32
+ #define FS_ROOT 0 // FileEntry of the root directory
+ #define FS_ENTRIES_PER_PAGE 4 // FileEntries in one metadata page
+ #define DIR_LEAF_KEYS 63 // Entries in a directory B-tree leaf
+ #define DIR_NODE_KEYS 41 // Separator keys in an interior node
+ #define DIR_MAX_HEIGHT 12 // Far more levels than any directory can fill
+ #define META_MIN_PAGES 64 // Metadata pages a new file system starts with
+ #define DCACHE_SIZE 256 // Dentry cache slots; a power of two
+ #define NAME_KEY_LEN (4 + MAX_FILENAME_LEN) // Name index keys: the parent directory's number, then the padded name
+ #define NAME_LEAF 0x80000000u // Marks a name index link holding an entry number instead of a node
+ #define MAX_FDS 16 // Descriptors per thread group
+ #define MAX_OPEN_FILES 64 // Open files across all processes and the shell
+ #define FD_CREATE 1 // fd_open: create the file if it does not exist
+ #define FD_TRUNCATE 2 // fd_open: empty the file
+ #define FD_APPEND 4 // Every write goes to the end of the file
+ #define MAX_MOUNTS 8 // File systems mounted at once, the disk at "/" included
+ #define TMPFS_CHUNK 4096 // tmpfs file data is allocated this many bytes at a time
+ #define TMPFS_MAX_SIZE (64 * 1024 * 1024) // Bytes of file data one tmpfs mount may hold
  #define MAX_PATH_LEN 128
+ #define MAX_FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE) // No file can outgrow the disk
+ #define BLOCK_SIZE 512
+ #define NUM_BLOCKS 4096 // 2MB of file storage
+ #define DISK_MAGIC 0x314F5353 // "SSO1" little-endian
+ #define DISK_VERSION 10 // Bump whenever the DiskImage layout changes
+ #define JOURNAL_SIZE 131072 // Bytes of metadata log in a disk image
+ #define JOURNAL_CHUNK 64 // Metadata is logged in chunks of this many bytes
+ #define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+ #define FS_INLINE_EXTENTS 10 // Extents kept in the FileEntry before it needs a leaf
+ #define FS_INLINE_DATA (FS_INLINE_EXTENTS * 6) // Files up to this size keep their data in the FileEntry
+ #define EXTENTS_PER_LEAF 64
+ #define EXTENT_LEAVES 32 // Extent tree leaves shared by all files
+ #define ALLOC_SPREAD_BLOCKS 16 // Allocations this large are placed with room to grow
+ #define FREE_CLASSES 13 // Free-space index size classes: runs of 2^k to 2^(k+1)-1 blocks
+ #define LFS_FILE_BLOCKS 128 // The log layout's inode map covers files up to 64KB
+ #define COMPRESS_CLUSTER_BLOCKS 32 // File blocks compressed together as one cluster
+ #define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+ #define COMPRESS_CLUSTERS (NUM_BLOCKS / COMPRESS_CLUSTER_BLOCKS) // One metadata page of cluster map covers MAX_FILE_SIZE
+ #define LZ_HASH_BITS 12 // Match finder table of the compression codec
+ #define LZ_MIN_MATCH 4
+ #define DEDUP_MAP_ENTRIES (BLOCK_SIZE / sizeof(uint16_t)) // Block map entries in one page of a deduplicated file's map
+ #define DEDUP_MAP_LEAVES (NUM_BLOCKS / DEDUP_MAP_ENTRIES)  // Map pages a file of MAX_FILE_SIZE needs
+ #define DEDUP_RESERVED 0x8000 // Block map flag: a block is held in reserve for the page's next writeback
+ #define DEDUP_INDEX_SIZE (NUM_BLOCKS * 2) // Fingerprint index slots; a power of two
+ #define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bits reflected
+ #define CRC32C_STRIDE 168 // Bytes per stream when three CRCs run interleaved; 3 * 168 + 8 fills a block
+ #define META_HEADER_RECORDS 128 // Checksummed BLOCK_SIZE pieces of the DiskImage metadata, then metadata page 0
+ #define META_CRC_GROUP (BLOCK_SIZE / sizeof(uint32_t) + 1) // Metadata pages per checksum page, itself included
+ #define SCRUB_BATCH 64 // Blocks and metadata records the background scrub checks per tick
+ #define FSCK_MAX_THREADS 16 // Host threads a consistency check spreads its walk over
+ #define FSCK_SLICE 256 // Directories or leaves a thread takes at least; smaller levels stay on one thread
+ #define FSCK_MAX_PASSES 8 // Repair rounds before fsck gives up on reaching a clean pass
+ #define MAX_SNAPSHOTS 16
+ #define SNAPSHOT_LIST_ENTRIES ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(SnapshotCopy)) // Copies listed per list page
+ #define SNAPSHOT_HEADER UINT32_MAX // SnapshotCopy.page of the copied DiskImage pieces
+ #define SNAPSHOT_BATCH 32 // Metadata pages copied or freed per journal operation
+ #define SEGMENT_BLOCKS 64 // The log-structured layout writes the disk a segment at a time
+ #define NUM_SEGMENTS (NUM_BLOCKS / SEGMENT_BLOCKS)
+ #define LFS_RESERVE_SEGMENTS 3 // Held back from free space so the cleaner always has room
+ #define LFS_CLEAN_LOW 8 // Background cleaning starts below this many free segments
+ #define LFS_CLEAN_MIN 2 // Writers clean synchronously below this many
+ #define CACHE_PAGES 512 // 256KB page cache, one block per page
+ #define CACHE_HASH_SIZE 1024 // Page lookup buckets; a power of two
+ #define CACHE_GHOSTS 1024 // Recently evicted keys remembered by 2Q; a power of two
+ #define CACHE_FLUSH_BATCH 16 // Pages the background flusher writes per tick
+ #define READAHEAD_MIN_PAGES 4 // First window is this many times the request
+ #define READAHEAD_MAX_PAGES 32 // Default limit the window doubles up to
+ #define READAHEAD_FILES 64 // Files whose access pattern is tracked at once; a power of two
+ #define IO_QUEUE_DEPTH 256 // Image reads and writes in flight at once
+ #define IO_THREADS 4 // Host threads of the thread pool I/O backend
+ #define IO_SUBMIT_TRIES 4 // io_uring submissions of a batch before the rest runs in the host
  #define MEMORY_SIZE 65536 // 64KB total system memory
  #define PROCESS_MEMORY_SIZE 4096 // 4KB per process
  #define SHELL_BUFFER_SIZE 256
+ #define SHELL_MAX_STEPS 100000 // Most scheduler slices one step command runs
+ #define PROCESS_STACK_SIZE 65536 // Host stack for each process coroutine
+ #define FUTEX_HASH_BITS 6 // 64 futex wait-queue buckets
+ #define FUTEX_BUCKETS (1 << FUTEX_HASH_BITS)
+ #define EXIT_KILLED 137 // Exit status reported for killed processes
+ #define BENCH_MAX_SAMPLES 65536 // Latency samples kept per benchmark run
  
  /* ======= DATA STRUCTURES ======= */
  
@@ -28,9 +148,33 @@
      PROCESS_READY,
      PROCESS_RUNNING,
      PROCESS_BLOCKED,
-     PROCESS_TERMINATED
+     PROCESS_ZOMBIE,     // Exited, waiting for the parent to collect its status
+     PROCESS_REAPED,     // Status collected, slot freed after a grace period
+     PROCESS_TERMINATED  // Slot free
  } ProcessState;
  
+ // Saved host execution context of a coroutine
+ #if CONTEXT_ASM
+ typedef struct {
+     void* sp;
+ } Context;
+ #elif CONTEXT_FIBER
+ typedef struct {
+     LPVOID fiber;
+ } Context;
+ #else
+ typedef ucontext_t Context;
+ #endif
+ 
+ // Code run by a process; the return value becomes its exit status
+ typedef int (*ProgramEntry)(uint8_t pid);
+ 
+ // Built-in program that "run" can start
+ typedef struct {
+     const char* name;
+     ProgramEntry entry;
+ } Program;
+ 
  // Process Control Block
  typedef struct {
      uint8_t id;
@@ -38,30 +182,638 @@
      uint16_t memory_start;
      uint16_t memory_size;
      uint16_t program_counter;
+     uint8_t parent_id;      // 0xFF when owned by the shell
+     uint8_t tgid;           // Thread group; equal to id for the group leader
+     int exit_status;
+     uint32_t retire_epoch;  // Grace period in which the slot was reaped
+     ProgramEntry entry;     // NULL for processes that only occupy a slot
+     uint16_t futex_addr;    // Address waited on, 0xFFFF when not in a futex queue
+     uint8_t futex_next;     // Next waiter in the same bucket
+     int16_t io_slot;        // I/O request slept on, -1 when not waiting for I/O
+     int8_t fds[MAX_FDS];    // Open files by descriptor, -1 when closed; threads use the leader's
+     Context context;
+     uint8_t* stack;         // Kept across slot reuse so spawning never allocates
      char name[32];
  } Process;
  
- // File system entry
+ // A run of length blocks starting at start holding file blocks logical onwards
+ typedef struct {
+     uint16_t logical;
+     uint16_t start;
+     uint16_t length;
+ } Extent;
+ 
+ // File system entry; FS_ENTRIES_PER_PAGE of them fill a metadata page
  typedef struct {
-     char filename[MAX_FILENAME_LEN];
-     uint16_t start_block;
-     uint16_t size;
+     char filename[MAX_FILENAME_LEN]; // Zero-padded so names compare as fixed-width keys
+     uint64_t size;
+     uint32_t name_hash;
+     int32_t parent;        // Directory containing this entry; the next free entry while unused
+     uint32_t child_count;  // Entries inside a directory
+     uint32_t dir_root;     // Metadata page of a directory's B-tree root, 0 until it has entries
+     uint32_t map_page;     // Metadata page of the log layout's inode map or a compressed file's cluster map
      bool in_use;
+     bool is_dir;
+     bool is_inline;        // Contents are in inline_data and the file has no blocks
+     bool is_compressed;    // Data is stored in compressed clusters instead of extents
+     bool is_deduped;       // Blocks are found through a block map and may be shared with other files
+     uint8_t extent_count;
+     uint8_t extent_leaf;   // Leaf holding the extents plus one, 0 while they fit in extents
+     union {
+         Extent extents[FS_INLINE_EXTENTS];
+         uint8_t inline_data[FS_INLINE_DATA];
+     };
  } FileEntry;
  
+ // Where one cluster of a compressed file is stored; a cluster map page holds COMPRESS_CLUSTERS of them
+ typedef struct {
+     uint16_t start;        // First block, or the gang header of a scattered cluster; 0 if nothing is stored
+     uint8_t blocks : 6;    // Blocks taken, gang header included
+     uint8_t raw : 1;       // The pages are stored as they are because they did not compress
+     uint8_t gang : 1;      // The blocks are listed in a header block at start instead of being contiguous
+     uint8_t charged;       // Blocks counted against free_blocks: blocks, or every page while it has unwritten data
+ } Cluster;
+ 
+ // One metadata page a snapshot copied, and where the copy is
+ typedef struct {
+     uint32_t page;         // SNAPSHOT_HEADER for the DiskImage metadata, whose pieces come first and in order
+     uint32_t copy;
+ } SnapshotCopy;
+ 
+ // A metadata page listing the copies of a snapshot
+ typedef struct {
+     uint32_t next;         // Next list page, 0 after the last
+     uint32_t count;
+     SnapshotCopy copies[SNAPSHOT_LIST_ENTRIES];
+ } SnapshotList;
+ 
+ // The file system as it was when a snapshot was taken: copies of its metadata, sharing its data blocks
+ typedef struct {
+     char name[MAX_FILENAME_LEN];
+     uint64_t created;      // Host time in seconds
+     uint32_t list;         // First page listing the copies, 0 when the slot is unused
+     uint32_t pages;        // Metadata pages it takes, list pages included
+     uint32_t file_count;
+     uint16_t reserved;     // Blocks its files were charged for
+     bool complete;         // Cleared while it is being taken or deleted; mounting deletes it then
+ } Snapshot;
+ 
+ // Directory B-tree key: entries are ordered by name hash, then by entry number
+ typedef struct {
+     uint32_t hash;
+     int32_t id;
+ } DirKey;
+ 
+ // One metadata page of a directory B-tree. Leaves hold the directory's entries
+ // and are chained in key order; interior nodes hold count keys and count + 1
+ // children, child i covering keys from keys[i - 1] up to but not including keys[i].
+ typedef struct {
+     uint16_t count;
+     bool leaf;
+     uint32_t next;         // Next leaf, 0 after the last
+     union {
+         DirKey entries[DIR_LEAF_KEYS];
+         struct {
+             DirKey keys[DIR_NODE_KEYS];
+             uint32_t children[DIR_NODE_KEYS + 1];
+         };
+     };
+ } DirNode;
+ 
+ // Position of a directory listing between calls to dir_next
+ typedef struct {
+     uint32_t page;         // Leaf to continue in, 0 at the end
+     DirKey last;           // Key of the entry returned last
+     bool started;
+ } DirCursor;
+ 
+ // Page cache queues: 2Q keeps first-time pages in A1in and re-used ones in Am
+ typedef enum {
+     CACHE_FREE,
+     CACHE_A1IN,
+     CACHE_AM,
+     CACHE_LISTS
+ } CacheList;
+ 
+ // One cached block of file data
+ typedef struct {
+     int32_t file;          // FileEntry number, -1 when free
+     uint16_t index;        // Page number within the file
+     uint8_t list;
+     bool dirty;
+     bool readahead;        // Read ahead and not used yet
+     bool ra_marker;        // Reaching this page starts the next readahead window
+     bool damaged;          // The block it was read from failed its checksum; reads fail until it is rewritten
+     int16_t io;            // Request still filling the page, -1 once its data is valid
+     int16_t prev;          // Towards the most recently used end of its list
+     int16_t next;
+     int16_t hash_next;
+     uint8_t data[BLOCK_SIZE];
+ } CachePage;
+ 
+ // Life of an asynchronous I/O request
+ typedef enum {
+     IO_FREE,
+     IO_QUEUED,     // Waiting for io_flush to hand it to the backend
+     IO_INFLIGHT,
+     IO_DONE        // Waiting for io_wait to collect the result
+ } IoState;
+ 
+ typedef enum {
+     IO_READ,
+     IO_WRITE
+ } IoOp;
+ 
+ // How requests reach the host file
+ typedef enum {
+     IO_BACKEND_SYNC,     // pread and pwrite as each batch is flushed
+     IO_BACKEND_THREADS,  // A pool of host threads
+     IO_BACKEND_URING     // io_uring submission and completion rings
+ } IoBackend;
+ 
+ // One read or write of a host file
+ typedef struct {
+     uint8_t state;
+     uint8_t op;
+     bool detached;         // Nobody waits; the slot is freed on completion
+     int16_t page;          // Page cache page being filled, -1 if none
+     int16_t next;          // Free list, and the thread pool's work queue
+     int fd;
+     void* buffer;
+     uint32_t len;
+     uint64_t offset;
+     int32_t result;        // Bytes transferred or a negative errno
+     uint32_t seq;          // Bumped on every completion
+     uint64_t submit_ns;
+     uint64_t latency_ns;
+ } IoRequest;
+ 
+ // Sequential access detection for one file
+ typedef struct {
+     int32_t file;          // File the state belongs to, -1 when unused
+     uint16_t start;        // First page of the current readahead window
+     uint16_t size;         // Pages in the window, 0 after a random access
+     uint16_t async_size;   // Pages from the marker to the end of the window
+     uint16_t limit;        // Largest window that has not been evicted before use, 0 if none yet
+     uint16_t next;         // Page a sequential reader would read next
+ } Readahead;
+ 
+ // Cached result of looking up one path component in a directory
+ typedef struct {
+     int32_t parent;        // -1 when the slot is empty
+     int32_t child;         // -1 for a negative entry (name known not to exist)
+     uint32_t hash;
+     uint8_t len;
+     char name[MAX_FILENAME_LEN];
+ } Dentry;
+ 
+ // An entry and its name index key, gathered to build the index in key order
+ typedef struct {
+     uint8_t key[NAME_KEY_LEN];
+     int32_t id;
+ } NameRecord;
+ 
+ // Interior node of the name index. Keys below it agree up to the masked bit of
+ // byte and split on it; each child is another node, or NAME_LEAF plus an entry.
+ typedef struct {
+     uint32_t child[2];     // Keys with the bit clear, then set
+     uint16_t byte;
+     uint8_t mask;          // The highest bit of byte in which the two sides differ
+ } NameNode;
+ 
+ // What a consistency check can find wrong; each kind has a line in its report
+ typedef enum {
+     FSCK_STRAY_KEY,      // Directory entry naming an unused entry or one in another directory
+     FSCK_BAD_NAME,       // Name or name hash a lookup would not find
+     FSCK_BAD_TREE,       // Directory tree with an impossible node; its entries are relinked
+     FSCK_BAD_CHAIN,      // Directory leaves not chained in key order
+     FSCK_BAD_COUNT,      // Entries counted in a directory or in the file system
+     FSCK_BAD_FILE,       // Extents, clusters, maps or a size pointing outside the disk
+     FSCK_ORPHAN,         // Entry in use but in no directory
+     FSCK_CROSSLINK,      // Block or extent leaf owned by two files; reported, not repaired
+     FSCK_BLOCK_LEAK,     // Block marked used that no file owns
+     FSCK_BLOCK_LOST,     // Block a file owns marked free
+     FSCK_BAD_REFS,       // Block map references counted wrong
+     FSCK_BAD_SUMMARY,    // Log segment summary or live count
+     FSCK_BAD_PINS,       // Snapshot bitmap not the union of the snapshots' bitmaps
+     FSCK_BAD_FREE,       // Free block count
+     FSCK_BAD_LEAVES,     // Extent leaf missing from the free stack, or on it while in use
+     FSCK_PAGE_LEAK,      // Metadata page neither used nor free, or a broken free list
+     FSCK_PAGE_CONFLICT,  // Metadata page used for two things; reported, not repaired
+     FSCK_ENTRY_LEAK,     // Unused FileEntry not on the free list, or a broken free list
+     FSCK_PROBLEMS
+ } FsckProblem;
+ 
+ // Repairs a worker finds; they are applied once the whole file system has been walked
+ typedef enum {
+     FSCK_FIX_KEY,        // Remove key from directory id
+     FSCK_FIX_NAME,       // Normalize the name of entry id and re-file it, under key, in directory at
+     FSCK_FIX_TREE,       // Empty the tree of directory id
+     FSCK_FIX_CHAIN,      // Make directory leaf at point at leaf id
+     FSCK_FIX_DROP,       // Remove entry id, whose data cannot be found, from directory at, where key files it
+     FSCK_FIX_FREE,       // Free entry id, which is in use but holds nothing recognizable
+     FSCK_FIX_SIZE,       // Cut inline entry id to what fits in it
+     FSCK_FIX_EXTENTS,    // Keep the first at extents of entry id
+     FSCK_FIX_CLUSTER,    // Forget cluster at of entry id
+     FSCK_FIX_MAP,        // Clear the block of page at in the inode or block map of entry id
+     FSCK_FIX_MAP_PAGE,   // Clear block map page at of entry id
+     FSCK_FIX_SUMMARY,    // Record log block id as page at of entry key.id
+     FSCK_FIX_COUNT       // Set the child count of directory id to at
+ } FsckFixKind;
+ 
+ typedef struct {
+     uint8_t kind;
+     int32_t id;
+     uint32_t at;
+     DirKey key;
+ } FsckFix;
+ 
+ // A directory tree leaf for a check level to read, and which of the level's directories it belongs to
+ typedef struct {
+     uint32_t page;
+     uint32_t dir;
+ } FsckLeaf;
+ 
+ // One host thread's share of a consistency check pass
+ typedef struct {
+     uint32_t first;                      // Items of the current step it takes
+     uint32_t last;
+     uint64_t claimed[NUM_BLOCKS / 64];   // Blocks of extents, clusters and inode maps it reached
+     uint64_t crossed[NUM_BLOCKS / 64];   // Of those, blocks it reached twice
+     uint32_t refs[NUM_BLOCKS];           // Block map entries pointing at each block
+     uint32_t leaves;                     // Extent leaves in use, one bit each
+     uint32_t leaves_crossed;
+     uint64_t charged;                    // Blocks its files are counted for in free_blocks
+     uint64_t entries;                    // Entries reached, root excluded
+     uint32_t problems[FSCK_PROBLEMS];
+     FsckLeaf* leaf_list;                 // Leaves found by the tree step
+     uint32_t leaf_count;
+     uint32_t leaf_size;
+     uint32_t* dir_list;                  // Directories found for the next level
+     uint32_t dir_count;
+     uint32_t dir_size;
+     FsckFix* fixes;
+     uint32_t fix_count;
+     uint32_t fix_size;
+     bool failed;                         // Out of memory
+ } FsckWorker;
+ 
+ // What fsck_run found and how long it took
+ typedef struct {
+     uint32_t found[FSCK_PROBLEMS];       // Problems the first pass found
+     uint32_t left;                       // Problems the last pass found; 0 once the file system is clean
+     uint32_t passes;
+     int threads;
+     uint64_t entries;                    // Entries reached, root excluded
+     uint64_t bytes;                      // Size of the metadata checked: the DiskImage and its metadata pages
+     uint64_t check_ns;                   // Time of the first pass
+     uint64_t total_ns;                   // Every pass and repair
+ } FsckReport;
+ 
+ // A file opened through fd_open, with the position descriptors read and write at
+ typedef struct {
+     bool in_use;
+     uint8_t flags;
+     uint8_t mount;         // Mount the file is on
+     int32_t file;          // Entry number there, so I/O skips the path lookup; -1 once the file is gone
+     uint64_t offset;
+ } OpenFile;
+ 
+ // File or directory of a tmpfs mount
+ typedef struct {
+     char name[MAX_FILENAME_LEN];   // Padded like FileEntry names
+     uint32_t hash;                 // fs_hash of the parent and name
+     int32_t parent;
+     int32_t chain;                 // Next node in the same hash bucket, or on the free list; -1 ends
+     int32_t prev;                  // Siblings in creation order, -1 at either end
+     int32_t next;
+     int32_t first;                 // Children of a directory, -1 when it is empty
+     int32_t last;
+     uint32_t child_count;
+     uint64_t size;
+     uint8_t** chunks;              // Data in TMPFS_CHUNK-byte pieces, NULL where nothing was written
+     uint32_t chunk_count;          // Slots in chunks
+     bool in_use;
+     bool is_dir;
+ } TmpfsNode;
+ 
+ // A file system that lives in host memory only
+ typedef struct {
+     TmpfsNode* nodes;              // Grown as needed; node 0 is the root
+     int32_t size;                  // Nodes allocated
+     int32_t used;                  // Nodes handed out at least once
+     int32_t free;                  // Freed nodes, chained through chain; -1 when empty
+     int32_t* buckets;              // Hash chains by parent and name, -1 when empty
+     uint32_t bucket_count;         // A power of two, kept at least the number of files
+     uint32_t files;                // Files and directories, root excluded
+     uint64_t bytes;                // Data chunks allocated, at most TMPFS_MAX_SIZE
+ } Tmpfs;
+ 
+ // A file or directory anywhere in the mounted file systems
+ typedef struct {
+     int32_t mount;
+     int32_t id;            // Entry number within the mount's file system; its root is FS_ROOT
+ } VfsNode;
+ 
+ // What every file system reports about an entry
+ typedef struct {
+     const char* name;      // Points into the file system; "" for a root
+     uint64_t size;
+     bool is_dir;
+ } VfsStat;
+ 
+ /* Operations a mounted file system provides, on entries by number. mount
+  * returns the private state the others are handed, or NULL if out of
+  * memory, and unmount frees it. Names are path components, not yet padded.
+  * create returns the new entry, -1 if the file system is full or -2 if the
+  * name exists; read, write and truncate return what the disk functions of
+  * the same name do. */
+ typedef struct {
+     const char* type;
+     void* (*mount)();
+     void (*unmount)(void* fs);
+     int32_t (*lookup)(void* fs, int32_t dir, const char* name, size_t len);
+     int32_t (*parent)(void* fs, int32_t id);
+     int32_t (*create)(void* fs, int32_t dir, const char* name, bool is_dir);
+     bool (*remove)(void* fs, int32_t id);
+     int (*read)(void* fs, int32_t id, uint64_t offset, void* data, uint32_t len);
+     int (*write)(void* fs, int32_t id, uint64_t offset, const void* data, uint32_t len);
+     int (*truncate)(void* fs, int32_t id, uint64_t size);
+     int32_t (*next)(void* fs, int32_t dir, DirCursor* cursor);
+     void (*stat)(void* fs, int32_t id, VfsStat* stat);
+     int32_t (*glob)(void* fs, int32_t dir, const char* pattern, int32_t** ids);
+ } FsOps;
+ 
+ // A file system attached to the tree at path
+ typedef struct {
+     bool in_use;
+     const FsOps* ops;
+     void* fs;                      // Private state handed to each operation
+     int32_t cwd;                   // Shell working directory while it is inside this mount, the disk's excepted
+     char path[MAX_PATH_LEN + 1];   // Absolute, without "." or ".." components; "/" for the disk
+     size_t path_len;
+ } Mount;
+ 
+ // Everything the file system keeps, laid out exactly as in a disk image file
+ // Where file blocks live on disk
+ typedef enum {
+     FS_LAYOUT_INPLACE, // Each file is one contiguous run, rewritten in place
+     FS_LAYOUT_LOG      // Blocks are appended to a log and found through the inode map
+ } FsLayout;
+ 
+ typedef struct {
+     // Superblock
+     uint32_t magic;
+     uint32_t version;
+     uint32_t block_size;
+     uint32_t num_blocks;
+     uint32_t clean;                      // Set by a clean unmount, cleared while mounted
+     uint32_t journal_seq;                // Sequence number of the first live journal record
+     uint32_t layout;                     // FsLayout chosen at format time
+     uint16_t free_blocks;                // Blocks files may still grow into; allocation is delayed
+     uint32_t file_count;                 // Files and directories, not counting the root
+     uint32_t meta_pages;                 // Metadata pages handed out so far, freed ones included
+     uint32_t meta_free;                  // List of freed metadata pages, linked through their first word
+     uint32_t meta_free_count;
+     int32_t free_entry;                  // List of unused FileEntries, linked through parent; -1 when empty
+     
+     // Metadata
+     uint8_t block_bitmap[NUM_BLOCKS / 8];
+     uint16_t block_refs[NUM_BLOCKS];     // Block map entries pointing at each deduplicated block
+     uint32_t block_crc[NUM_BLOCKS];      // CRC32C of each block's data as last written
+     Extent extent_leaves[EXTENT_LEAVES][EXTENTS_PER_LEAF];
+     uint8_t free_leaves[EXTENT_LEAVES];  // Stack of unused extent leaves
+     uint8_t free_leaf_count;
+     
+     // Log-structured layout
+     uint16_t lfs_head;                                    // Next block of the log, 0 when no segment is open
+     uint32_t lfs_write_seq;                               // Advances on every write; dates segments
+     int32_t summary_file[NUM_BLOCKS];                     // Which file block each log block was written for,
+     uint8_t summary_index[NUM_BLOCKS];                    //   live only while the inode map still points at it
+     uint16_t segment_live[NUM_SEGMENTS];
+     uint32_t segment_age[NUM_SEGMENTS];                   // lfs_write_seq of the newest data in the segment
+     
+     // Snapshots; not part of what they copy
+     Snapshot snapshots[MAX_SNAPSHOTS];
+     uint8_t snapshot_bitmap[NUM_BLOCKS / 8];              // Blocks a snapshot uses; never rewritten or reused
+     uint32_t snapshot_restoring;                          // Snapshot being restored plus one, so mounting finishes it
+     
+     // CRC32C of each BLOCK_SIZE piece of the metadata above, then of metadata page 0; the other
+     // pages have theirs in checksum pages. All of them are updated as the journal commits.
+     uint32_t meta_crc[META_HEADER_RECORDS];
+     
+     // Metadata journal
+     uint8_t journal[JOURNAL_SIZE];
+     
+     // Data; block 0 is reserved so start_block 0 means "no blocks"
+     uint8_t blocks[NUM_BLOCKS][BLOCK_SIZE];
+     
+     // Followed by block-sized metadata pages, as many as the image has grown to
+ } DiskImage;
+ 
+ // Everything before the journal is metadata and is only changed through it,
+ // and so are the metadata pages
+ #define META_SIZE offsetof(DiskImage, journal)
+ #define META_PAGES_OFFSET ((sizeof(DiskImage) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+ #define META_HEADER_PIECES ((offsetof(DiskImage, meta_crc) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+ 
+ // The DiskImage metadata a snapshot copies; snapshots are only taken in the in-place layout,
+ // so the log layout's part is left out
+ #define SNAPSHOT_HEADER_START offsetof(DiskImage, free_blocks)
+ #define SNAPSHOT_HEADER_SIZE (offsetof(DiskImage, lfs_head) - SNAPSHOT_HEADER_START)
+ #define SNAPSHOT_HEADER_PIECES ((SNAPSHOT_HEADER_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+ #define JOURNAL_MAX_CHUNKS ((JOURNAL_SIZE - sizeof(JournalHeader)) / (sizeof(uint32_t) + JOURNAL_CHUNK))
+ 
+ // Start of a journal record; followed by chunk numbers, then chunk contents
+ typedef struct {
+     uint32_t magic;
+     uint32_t seq;
+     uint32_t chunks;
+     uint32_t checksum;   // CRC32C of chunk numbers and contents; a torn record fails it
+ } JournalHeader;
+ 
+ _Static_assert(offsetof(DiskImage, meta_crc) <= (META_HEADER_RECORDS - 1) * BLOCK_SIZE,
+                "META_HEADER_RECORDS is too small for the DiskImage metadata");
+ 
  // OS state
  typedef struct {
      // Memory
      uint8_t memory[MEMORY_SIZE];
-     bool memory_map[MEMORY_SIZE / PROCESS_MEMORY_SIZE];
+     uint8_t memory_map[MEMORY_SIZE / PROCESS_MEMORY_SIZE]; // Users of each block, 0 when free
      
      // Process management
      Process processes[MAX_PROCESSES];
      uint8_t current_process;
-     uint8_t process_count;
+     uint8_t process_count;   // Slots not yet reclaimed, including zombies
+     uint8_t running;         // Process whose coroutine is executing, 0xFF in the scheduler
+     Context scheduler_context;
+     
+     // Deferred reclamation
+     uint32_t rcu_epoch;
+     uint8_t rcu_readers;
+     
+     // Futex wait queues, hashed by address
+     uint8_t futex_head[FUTEX_BUCKETS];
+     uint8_t futex_tail[FUTEX_BUCKETS];
+     uint64_t futex_waits;
+     uint64_t futex_wakes;
+     
+     // Mounted file system; points at ram_disk unless an image is mounted
+     DiskImage* disk;
+     size_t disk_size;          // Bytes of disk, metadata pages included
+     bool disk_mapped;          // disk is a private mapping of disk_path
+ #if HAVE_MMAP
+     int disk_fd;
+ #else
+     FILE* disk_file;
+ #endif
+     char disk_path[MAX_PATH_LEN];
+     
+     // Asynchronous I/O engine
+     IoRequest io[IO_QUEUE_DEPTH];
+     int16_t io_free;
+     int16_t io_queue[IO_QUEUE_DEPTH];                // Submitted but not yet flushed
+     uint16_t io_queued;
+     uint16_t io_inflight;
+     uint8_t io_plug_ticks;                           // Scheduler ticks the queued requests have waited
+     IoBackend io_backend;
+     uint64_t io_submitted;
+     uint64_t io_completed;
+     uint64_t io_batches;                             // Flushes that handed requests to the backend
+     uint64_t io_errors;                              // Requests that failed or came up short
+     uint64_t io_latency_ns;                          // Summed over completed requests
+ #if HAVE_MMAP
+     pthread_t io_threads[IO_THREADS];
+     pthread_mutex_t io_lock;
+     pthread_cond_t io_work;                          // Requests queued for the thread pool
+     pthread_cond_t io_done;                          // Completions waiting to be reaped
+     int16_t io_work_head;
+     int16_t io_work_tail;
+     int16_t io_done_list[IO_QUEUE_DEPTH];
+     uint16_t io_done_count;
+     bool io_threads_started;
+ #endif
+ #if HAVE_IO_URING
+     int uring_fd;                                    // -1 if the kernel refused io_uring
+     uint32_t* uring_sq_tail;
+     uint32_t* uring_sq_mask;
+     uint32_t* uring_sq_array;
+     struct io_uring_sqe* uring_sqes;
+     uint32_t* uring_cq_head;
+     uint32_t* uring_cq_tail;
+     uint32_t* uring_cq_mask;
+     struct io_uring_cqe* uring_cqes;
+ #endif
+     
+     // Free-space index over the block bitmap, rebuilt on attach
+     uint16_t free_run_len[NUM_BLOCKS];               // At the first block of each free run
+     uint16_t free_run_head[NUM_BLOCKS];              // At the last block of each free run, its first
+     uint16_t free_run_next[NUM_BLOCKS];              // Runs in the same size class; 0 ends the list
+     uint16_t free_run_prev[NUM_BLOCKS];
+     uint16_t free_class[FREE_CLASSES];
+     
+     // Device statistics
+     uint64_t block_writes;
+     uint64_t block_seeks;                            // Writes not following the previous one
+     uint16_t block_last_write;
+     
+     // Log-structured layout
+     bool lfs_pending[NUM_SEGMENTS];                  // Emptied since the last commit; not reusable yet
+     bool lfs_cleaning;
+     uint64_t lfs_cleaned_blocks;
+     uint64_t lfs_cleaned_segments;
+     
+     // Metadata journal
+     uint8_t* journal_running;                        // Bitmap of chunks changed since the last commit
+     size_t journal_bitmap_size;
+     uint32_t journal_chunks[JOURNAL_MAX_CHUNKS];     // The same chunks as a list
+     uint32_t journal_count;
+     uint32_t journal_head;                           // Bytes of the journal area in use
+     uint32_t journal_seq;                            // Sequence number of the next record
+     uint32_t journal_ops;                            // Operations in the running transaction
+     uint32_t journal_interval_ms;                    // Group commit interval, 0 commits every operation
+     uint64_t journal_last_commit;
+     uint64_t journal_commits;
+     uint64_t journal_total_ops;
+     uint64_t journal_fsyncs;
+     
+     // Page cache
+     CachePage cache[CACHE_PAGES];
+     int16_t cache_hash[CACHE_HASH_SIZE];
+     int16_t cache_head[CACHE_LISTS];
+     int16_t cache_tail[CACHE_LISTS];
+     uint16_t cache_len[CACHE_LISTS];
+     uint64_t cache_ghosts[CACHE_GHOSTS];   // Keys evicted from A1in, 0 when empty
+     uint16_t cache_dirty;
+     uint16_t cache_flush_hand;
+     uint8_t dirty_background_ratio;        // Percent dirty before the flusher starts
+     uint8_t dirty_ratio;                   // Percent dirty before writers flush themselves
+     uint64_t cache_hits;
+     uint64_t cache_misses;
+     uint64_t cache_writebacks;
+     uint64_t cache_write_errors;           // Pages dropped because no block could be allocated
+     Readahead readahead[READAHEAD_FILES];  // Indexed by file number
+     uint16_t readahead_max;                // Largest readahead window in pages, 0 disables readahead
+     uint64_t readahead_pages;
+     uint64_t readahead_hits;               // Read-ahead pages that were used
+     uint64_t readahead_wasted;             // Read-ahead pages evicted or dropped unused
      
      // File system
-     FileEntry file_table[MAX_FILES];
+     int32_t cwd;                         // Shell working directory, when it is on the disk
+     bool inline_enabled;                 // New files start with inline data
+     
+     // Transparent compression
+     bool compress_enabled;                              // New files in the in-place layout are compressed
+     uint8_t cluster_data[COMPRESS_CLUSTER_SIZE];        // One cluster uncompressed, as last read or written
+     int32_t cluster_file;                               // Whose cluster cluster_data holds, -1 for none
+     uint16_t cluster_index;
+     uint8_t cluster_packed[COMPRESS_CLUSTER_SIZE];      // A cluster as stored on disk
+     uint16_t lz_table[1 << LZ_HASH_BITS];               // Last position plus one of each hashed 4-byte string
+     uint64_t compress_bytes_in;                         // Cluster bytes written back
+     uint64_t compress_bytes_out;                        // Bytes of blocks they were stored in
+     
+     // Deduplication; the index is rebuilt from block_refs on attach
+     bool dedup_enabled;                                 // New files in the in-place layout are deduplicated
+     uint16_t dedup_index[DEDUP_INDEX_SIZE];             // Deduplicated blocks by fingerprint, 0 when empty
+     uint64_t dedup_prints[NUM_BLOCKS];                  // Fingerprint of each block in the index
+     uint64_t dedup_hits;                                // Writebacks that found their data already on disk
+     uint64_t dedup_misses;
+     
+     // Checksums
+     bool crc32c_hardware;                               // The CPU has CRC32C instructions
+     uint32_t crc32c_table[8][256];                      // Slicing-by-8 tables for CPUs without them
+     uint32_t crc32c_shift[4][256];                      // Advances a CRC over CRC32C_STRIDE zero bytes
+     bool checksums_enabled;                             // Only benchmarks turn them off, on scratch disks
+     uint64_t checksum_errors;                           // Blocks and records that failed verification
+     char checksum_last_error[48];                       // Where the last one was
+     bool scrub_running;                                 // A background pass is in progress
+     uint32_t scrub_next;                                // Data blocks, then header records, then metadata pages
+     uint32_t scrub_passes;
+     uint64_t scrub_checked;                             // Blocks and records verified by the scrub
+     uint64_t scrub_errors;
+     
+     // Dentry cache
+     Dentry dcache[DCACHE_SIZE];
+     bool dcache_enabled;
+     uint64_t dcache_hits;
+     uint64_t dcache_misses;
+     
+     // Name index; built from the directories by the first search after attach
+     NameNode* names;                     // Grown as needed; node 0 is unused so 0 can end the free chain
+     uint32_t names_size;                 // Nodes allocated
+     uint32_t names_used;                 // Nodes handed out at least once
+     uint32_t names_free;                 // Freed nodes, chained through child[0]
+     uint32_t names_root;                 // Meaningless while names_count is 0
+     uint32_t names_count;                // Entries in the index
+     bool names_valid;                    // The index matches the file system; if not, the next search builds it
+     
+     // Open files
+     OpenFile open_files[MAX_OPEN_FILES];
+     int8_t shell_fds[MAX_FDS];           // Descriptors of the shell, which is not a process
+     
+     // Mount table; slot 0 is the disk at "/"
+     Mount mounts[MAX_MOUNTS];
+     uint8_t cwd_mount;                   // Mount of the shell's working directory
      
      // System state
      bool system_running;
@@ -69,13 +821,38 @@
  
  /* ======= GLOBAL VARIABLES ======= */
  OS simple_os;
+ DiskImage* ram_disk; // File system used when no image is mounted
+ size_t ram_disk_size;
+ 
+ /* ======= FORWARD DECLARATIONS ======= */
+ ProgramEntry program_lookup(const char* name);
+ int program_spin(uint8_t pid);
+ void futex_cancel(uint8_t pid);
+ void io_cancel(uint8_t pid);
+ void fd_close_all(uint8_t pid);
+ void fd_revoke(int32_t id);
+ void fd_revoke_mount(int32_t mount, int32_t id);
+ void cache_tick();
+ void journal_tick();
+ void journal_commit();
+ void checksum_seal();
+ void lfs_tick();
+ void io_tick();
+ void io_idle_wait();
+ void scrub_tick();
+ bool block_verify(uint16_t block, const void* data);
+ bool block_matches(uint16_t block, uint32_t crc);
+ int16_t block_read_async(uint16_t block, void* buffer);
+ int32_t io_wait(int16_t slot);
+ uint64_t bench_now_ns();
+ void process_trampoline();
  
  /* ======= MEMORY MANAGEMENT ======= */
  
  // Initialize memory
  void memory_init() {
      for (int i = 0; i < MEMORY_SIZE / PROCESS_MEMORY_SIZE; i++) {
-         simple_os.memory_map[i] = false; // Mark all memory blocks as free
+         simple_os.memory_map[i] = 0; // Mark all memory blocks as free
      }
  }
  
@@ -83,100 +860,451 @@
  uint16_t memory_allocate() {
      for (int i = 0; i < MEMORY_SIZE / PROCESS_MEMORY_SIZE; i++) {
          if (!simple_os.memory_map[i]) {
-             simple_os.memory_map[i] = true; // Mark as used
+             simple_os.memory_map[i] = 1; // Mark as used
              return i * PROCESS_MEMORY_SIZE;
          }
      }
      return 0xFFFF; // No memory available
  }
  
- // Free memory used by a process
+ // Add another user to an allocated memory block
+ void memory_share(uint16_t start_address) {
+     uint16_t block = start_address / PROCESS_MEMORY_SIZE;
+     if (block < MEMORY_SIZE / PROCESS_MEMORY_SIZE && simple_os.memory_map[block]) {
+         simple_os.memory_map[block]++;
+     }
+ }
+ 
+ // Drop one user of a memory block; the block is free once nobody uses it
  void memory_free(uint16_t start_address) {
      uint16_t block = start_address / PROCESS_MEMORY_SIZE;
-     if (block < MEMORY_SIZE / PROCESS_MEMORY_SIZE) {
-         simple_os.memory_map[block] = false;
+     if (block < MEMORY_SIZE / PROCESS_MEMORY_SIZE && simple_os.memory_map[block]) {
+         simple_os.memory_map[block]--;
+     }
+ }
+ 
+ /* ======= EXECUTION CONTEXTS ======= */
+ 
+ /* Each process with a program runs on its own host stack. Switching saves
+  * only what the calling convention requires, so a switch costs a handful of
+  * instructions; ucontext and Windows fibers are used where the hand-written
+  * switch is not available. */
+ 
+ #if CONTEXT_ASM
+ 
+ // Save callee-saved registers, store the stack pointer in *from_sp and resume to_sp
+ void context_swap(void** from_sp, void* to_sp);
+ __asm__(
+     ".text\n"
+     ".globl context_swap\n"
+     ".type context_swap, @function\n"
+     "context_swap:\n"
+     "    pushq %rbp\n"
+     "    pushq %rbx\n"
+     "    pushq %r12\n"
+     "    pushq %r13\n"
+     "    pushq %r14\n"
+     "    pushq %r15\n"
+     "    movq %rsp, (%rdi)\n"
+     "    movq %rsi, %rsp\n"
+     "    popq %r15\n"
+     "    popq %r14\n"
+     "    popq %r13\n"
+     "    popq %r12\n"
+     "    popq %rbx\n"
+     "    popq %rbp\n"
+     "    ret\n"
+     ".size context_swap, .-context_swap\n");
+ 
+ // Prepare a context that starts executing entry on the given stack
+ void context_make(Context* ctx, uint8_t* stack, size_t size, void (*entry)()) {
+     uintptr_t top = ((uintptr_t)(stack + size)) & ~(uintptr_t)15;
+     void** sp = (void**)top;
+     *--sp = NULL;            // Fake return address for entry
+     *--sp = (void*)entry;    // Popped by the ret in context_swap
+     for (int i = 0; i < 6; i++) {
+         *--sp = NULL;        // rbp, rbx, r12-r15
+     }
+     ctx->sp = sp;
+ }
+ 
+ void context_switch(Context* from, Context* to) {
+     context_swap(&from->sp, to->sp);
+ }
+ 
+ #elif CONTEXT_FIBER
+ 
+ LPVOID context_thread_fiber; // The host thread, once a switch away from it has made it a fiber
+ 
+ VOID WINAPI context_fiber_start(LPVOID entry) {
+     ((void (*)())entry)();
+ }
+ 
+ void context_make(Context* ctx, uint8_t* stack, size_t size, void (*entry)()) {
+     (void)stack; // Fibers allocate their own stack
+     if (ctx->fiber) {
+         DeleteFiber(ctx->fiber);
      }
+     ctx->fiber = CreateFiber(size, context_fiber_start, (LPVOID)entry);
  }
  
+ void context_switch(Context* from, Context* to) {
+     if (!from->fiber) {
+         // Every context saved from the host thread is its one fiber; a thread converts only once
+         if (!context_thread_fiber) {
+             context_thread_fiber = ConvertThreadToFiber(NULL);
+         }
+         from->fiber = context_thread_fiber;
+     }
+     SwitchToFiber(to->fiber);
+ }
+ 
+ #else
+ 
+ void context_make(Context* ctx, uint8_t* stack, size_t size, void (*entry)()) {
+     getcontext(ctx);
+     ctx->uc_stack.ss_sp = stack;
+     ctx->uc_stack.ss_size = size;
+     ctx->uc_link = NULL;
+     makecontext(ctx, entry, 0);
+ }
+ 
+ void context_switch(Context* from, Context* to) {
+     swapcontext(from, to);
+ }
+ 
+ #endif
+ 
  /* ======= PROCESS MANAGEMENT ======= */
  
+ /* Reaped process slots are not reused straight away. Readers such as ps walk
+  * the process table inside rcu_read_lock()/rcu_read_unlock() without taking
+  * any other lock, and a slot is only recycled once every reader that could
+  * have seen it has finished. The scheduler is the quiescent point. */
+ 
+ void rcu_read_lock() {
+     simple_os.rcu_readers++;
+ }
+ 
+ void rcu_read_unlock() {
+     simple_os.rcu_readers--;
+ }
+ 
+ // End the current grace period if no readers remain, freeing retired slots
+ void rcu_quiescent() {
+     if (simple_os.rcu_readers != 0) {
+         return;
+     }
+     for (int i = 0; i < MAX_PROCESSES; i++) {
+         Process* p = &simple_os.processes[i];
+         if (p->state == PROCESS_REAPED && p->retire_epoch <= simple_os.rcu_epoch) {
+             memory_free(p->memory_start);
+             p->state = PROCESS_TERMINATED;
+             simple_os.process_count--;
+         }
+     }
+     simple_os.rcu_epoch++;
+ }
+ 
+ // Check whether a process is still able to run
+ bool process_alive(uint8_t pid) {
+     if (pid >= MAX_PROCESSES) {
+         return false;
+     }
+     ProcessState state = simple_os.processes[pid].state;
+     return state == PROCESS_READY || state == PROCESS_RUNNING || state == PROCESS_BLOCKED;
+ }
+ 
  // Initialize process management
  void process_init() {
      simple_os.process_count = 0;
      simple_os.current_process = 0;
+     simple_os.running = 0xFF;
+     simple_os.rcu_epoch = 0;
+     simple_os.rcu_readers = 0;
+     for (int i = 0; i < FUTEX_BUCKETS; i++) {
+         simple_os.futex_head[i] = 0xFF;
+         simple_os.futex_tail[i] = 0xFF;
+     }
      
      // Mark all processes as terminated initially
      for (int i = 0; i < MAX_PROCESSES; i++) {
          simple_os.processes[i].state = PROCESS_TERMINATED;
+         simple_os.processes[i].io_slot = -1;
+         memset(simple_os.processes[i].fds, -1, sizeof(simple_os.processes[i].fds));
+     }
+ }
+ 
+ // Create several identical children of parent in one step
+ // Returns the number created; their PIDs are written to pids
+ uint8_t process_create_batch(uint8_t parent, const char* name, uint8_t count, uint8_t* pids) {
+     uint8_t slots[MAX_PROCESSES];
+     uint16_t mems[MAX_PROCESSES];
+     uint8_t n = 0;
+     
+     if (count > MAX_PROCESSES - simple_os.process_count) {
+         count = MAX_PROCESSES - simple_os.process_count;
+     }
+     
+     // Reserve free process slots
+     for (uint8_t pid = 0; pid < MAX_PROCESSES && n < count; pid++) {
+         if (simple_os.processes[pid].state == PROCESS_TERMINATED) {
+             slots[n++] = pid;
+         }
+     }
+     
+     // Reserve one memory block per slot in a single pass over the map
+     uint8_t reserved = 0;
+     for (int i = 0; i < MEMORY_SIZE / PROCESS_MEMORY_SIZE && reserved < n; i++) {
+         if (!simple_os.memory_map[i]) {
+             simple_os.memory_map[i] = 1;
+             mems[reserved++] = i * PROCESS_MEMORY_SIZE;
+         }
+     }
+     n = reserved;
+     
+     // Look the program up once for the whole batch
+     ProgramEntry entry = program_lookup(name);
+     
+     // Give each process a host stack; if one cannot be allocated the batch ends there
+     for (uint8_t i = 0; i < n && entry; i++) {
+         Process* p = &simple_os.processes[slots[i]];
+         if (!p->stack) {
+             p->stack = malloc(PROCESS_STACK_SIZE);
+         }
+         if (!p->stack) {
+             for (uint8_t j = i; j < n; j++) {
+                 memory_free(mems[j]);
+             }
+             n = i;
+         }
+     }
+     
+     // Measure the name once and reuse it for every PCB
+     size_t name_len = strlen(name);
+     if (name_len > 31) {
+         name_len = 31;
+     }
+     
+     // Fill in the PCBs before any of them becomes schedulable
+     for (uint8_t i = 0; i < n; i++) {
+         Process* p = &simple_os.processes[slots[i]];
+         p->id = slots[i];
+         p->memory_start = mems[i];
+         p->memory_size = PROCESS_MEMORY_SIZE;
+         p->program_counter = 0;
+         p->parent_id = parent;
+         p->tgid = slots[i];
+         p->exit_status = 0;
+         p->entry = entry;
+         p->futex_addr = 0xFFFF;
+         p->io_slot = -1;
+         memset(p->fds, -1, sizeof(p->fds));
+         if (entry) {
+             context_make(&p->context, p->stack, PROCESS_STACK_SIZE, process_trampoline);
+         }
+         memcpy(p->name, name, name_len);
+         p->name[name_len] = '\0';
+     }
+     
+     // Publish the whole batch to the scheduler at once
+     for (uint8_t i = 0; i < n; i++) {
+         simple_os.processes[slots[i]].state = PROCESS_READY;
+         if (pids) {
+             pids[i] = slots[i];
+         }
      }
+     simple_os.process_count += n;
+     return n;
  }
  
  // Create a new process
  uint8_t process_create(const char* name) {
+     uint8_t pid;
+     if (process_create_batch(0xFF, name, 1, &pid) != 1) {
+         return 0xFF; // Error: no free process slot or out of memory
+     }
+     return pid;
+ }
+ 
+ // Start a new thread in process tgid, sharing its memory
+ uint8_t thread_create(uint8_t tgid, ProgramEntry entry) {
+     if (!process_alive(tgid) || simple_os.processes[tgid].tgid != tgid || !entry) {
+         return 0xFF; // Error: not a live group leader
+     }
      if (simple_os.process_count >= MAX_PROCESSES) {
          return 0xFF; // Error: max processes reached
      }
      
-     // Find available process slot
-     uint8_t pid = 0;
-     while (pid < MAX_PROCESSES && simple_os.processes[pid].state != PROCESS_TERMINATED) {
-         pid++;
+     uint8_t tid = 0;
+     while (tid < MAX_PROCESSES && simple_os.processes[tid].state != PROCESS_TERMINATED) {
+         tid++;
      }
-     
-     if (pid >= MAX_PROCESSES) {
-         return 0xFF; // Error: no free process slots
+     if (tid >= MAX_PROCESSES) {
+         return 0xFF;
+     }
+     Process* t = &simple_os.processes[tid];
+     if (!t->stack) {
+         t->stack = malloc(PROCESS_STACK_SIZE);
      }
+     if (!t->stack) {
+         return 0xFF; // Error: out of host memory; the slot is still free
+     }
+     
+     // Everything except the execution context comes from the leader
+     Process* leader = &simple_os.processes[tgid];
+     t->id = tid;
+     t->tgid = tgid;
+     t->parent_id = leader->parent_id;
+     t->memory_start = leader->memory_start;
+     t->memory_size = leader->memory_size;
+     t->program_counter = 0;
+     t->exit_status = 0;
+     t->entry = entry;
+     t->futex_addr = 0xFFFF;
+     t->io_slot = -1;
+     memcpy(t->name, leader->name, sizeof(t->name));
+     memory_share(t->memory_start);
+     context_make(&t->context, t->stack, PROCESS_STACK_SIZE, process_trampoline);
      
-     // Allocate memory for the process
-     uint16_t mem_start = memory_allocate();
-     if (mem_start == 0xFFFF) {
-         return 0xFF; // Error: out of memory
+     t->state = PROCESS_READY;
+     simple_os.process_count++;
+     return tid;
+ }
+ 
+ // Give the CPU back to the scheduler; called from a process coroutine
+ void process_yield() {
+     uint8_t pid = simple_os.running;
+     if (pid == 0xFF) {
+         return; // Not inside a process
+     }
+     context_switch(&simple_os.processes[pid].context, &simple_os.scheduler_context);
+ }
+ 
+ // Sleep until process_wake(); called from a process coroutine
+ void process_block() {
+     if (simple_os.running == 0xFF) {
+         return;
+     }
+     simple_os.processes[simple_os.running].state = PROCESS_BLOCKED;
+     process_yield();
+ }
+ 
+ // Make a blocked process runnable again
+ void process_wake(uint8_t pid) {
+     if (pid < MAX_PROCESSES && simple_os.processes[pid].state == PROCESS_BLOCKED) {
+         simple_os.processes[pid].state = PROCESS_READY;
      }
+ }
+ 
+ // Exit a process, leaving a zombie until its parent waits for it
+ // Threads are reaped immediately; a group leader takes its threads with it
+ void process_exit(uint8_t pid, int status) {
+     if (!process_alive(pid)) {
+         return; // Invalid PID or already exited
+     }
+     Process* self = &simple_os.processes[pid];
      
-     // Setup process
-     Process* p = &simple_os.processes[pid];
-     p->id = pid;
-     p->state = PROCESS_READY;
-     p->memory_start = mem_start;
-     p->memory_size = PROCESS_MEMORY_SIZE;
-     p->program_counter = 0;
+     for (int i = 0; i < MAX_PROCESSES; i++) {
+         Process* p = &simple_os.processes[i];
+         if (p->state == PROCESS_TERMINATED) {
+             continue;
+         }
+         // Orphaned children are handed to the shell
+         if (p->parent_id == pid) {
+             p->parent_id = 0xFF;
+         }
+         if (self->tgid == pid && i != pid && p->tgid == pid && process_alive(i)) {
+             futex_cancel(i);
+             io_cancel(i);
+             p->exit_status = status;
+             p->retire_epoch = simple_os.rcu_epoch;
+             p->state = PROCESS_REAPED;
+         }
+     }
      
-     // Copy process name
-     int i = 0;
-     while (name[i] != '\0' && i < 31) {
-         p->name[i] = name[i];
-         i++;
+     futex_cancel(pid);
+     io_cancel(pid);
+     self->exit_status = status;
+     if (self->tgid == pid) {
+         fd_close_all(pid); // The descriptor table goes with the thread group
+         self->state = PROCESS_ZOMBIE;
+     } else {
+         self->retire_epoch = simple_os.rcu_epoch;
+         self->state = PROCESS_REAPED;
      }
-     p->name[i] = '\0';
      
-     simple_os.process_count++;
-     return pid;
+     // A process exiting itself never gets scheduled again
+     if (simple_os.running != 0xFF && !process_alive(simple_os.running)) {
+         process_yield();
+     }
+ }
+ 
+ // First code run on a new process stack
+ void process_trampoline() {
+     uint8_t pid = simple_os.running;
+     process_exit(pid, simple_os.processes[pid].entry(pid));
  }
  
  // Terminate a process
  void process_terminate(uint8_t pid) {
-     if (pid >= MAX_PROCESSES || simple_os.processes[pid].state == PROCESS_TERMINATED) {
-         return; // Invalid PID or already terminated
+     process_exit(pid, EXIT_KILLED);
+ }
+ 
+ // Collect the exit status of a zombie child; pid 0xFF waits for any child
+ // Returns the reaped PID, -1 if there is no such child, -2 if none has exited yet
+ int process_wait(uint8_t parent, uint8_t pid, int* status) {
+     bool has_child = false;
+     for (int i = 0; i < MAX_PROCESSES; i++) {
+         Process* p = &simple_os.processes[i];
+         if ((pid != 0xFF && i != pid) || p->parent_id != parent || p->tgid != i) {
+             continue; // Not a child, or a thread rather than a process
+         }
+         if (p->state == PROCESS_ZOMBIE) {
+             if (status) {
+                 *status = p->exit_status;
+             }
+             // Readers may still hold the slot; reclaim it after the next grace period
+             p->retire_epoch = simple_os.rcu_epoch;
+             p->state = PROCESS_REAPED;
+             return i;
+         }
+         if (process_alive(i)) {
+             has_child = true;
+         }
      }
-     
-     // Free memory
-     memory_free(simple_os.processes[pid].memory_start);
-     
-     // Mark process as terminated
-     simple_os.processes[pid].state = PROCESS_TERMINATED;
-     simple_os.process_count--;
+     return has_child ? -2 : -1;
+ }
+ 
+ // Run a process coroutine until it yields, blocks or exits
+ void process_dispatch(uint8_t pid) {
+     Process* p = &simple_os.processes[pid];
+     if (!p->entry) {
+         return; // Nothing to execute
+     }
+     simple_os.running = pid;
+     context_switch(&simple_os.scheduler_context, &p->context);
+     simple_os.running = 0xFF;
  }
  
  // Schedule next process to run
  void process_schedule() {
+     rcu_quiescent();
+     io_tick();
+     cache_tick();
+     lfs_tick();
+     journal_tick();
+     scrub_tick();
+     
      if (simple_os.process_count == 0) {
          return; // No processes to schedule
      }
      
-     // Simple round-robin scheduling
-     uint8_t next_process = (simple_os.current_process + 1) % MAX_PROCESSES;
-     while (next_process != simple_os.current_process) {
-         if (simple_os.processes[next_process].state == PROCESS_READY) {
+     // Simple round-robin scheduling; the current process runs again if nothing else is ready
+     for (int i = 1; i <= MAX_PROCESSES; i++) {
+         uint8_t next_process = (simple_os.current_process + i) % MAX_PROCESSES;
+         ProcessState state = simple_os.processes[next_process].state;
+         if (state == PROCESS_READY || (next_process == simple_os.current_process && state == PROCESS_RUNNING)) {
              // Set current process to ready if it was running
              if (simple_os.processes[simple_os.current_process].state == PROCESS_RUNNING) {
                  simple_os.processes[simple_os.current_process].state = PROCESS_READY;
@@ -185,92 +1313,8892 @@
              // Set next process to running
              simple_os.current_process = next_process;
              simple_os.processes[next_process].state = PROCESS_RUNNING;
+             process_dispatch(next_process);
              return;
          }
-         next_process = (next_process + 1) % MAX_PROCESSES;
      }
+     
+     // Every process is asleep; if some are waiting for I/O, sleep in the host until it completes
+     io_idle_wait();
  }
  
- /* ======= FILE SYSTEM ======= */
+ /* ======= SYNCHRONIZATION ======= */
  
- // Initialize file system
- void fs_init() {
-     for (int i = 0; i < MAX_FILES; i++) {
-         simple_os.file_table[i].in_use = false;
+ /* Futexes let processes sleep on a 32-bit word in simulated memory. The
+  * kernel only keeps wait queues; the lock state itself lives in process
+  * memory and is changed with atomic instructions, so mutex_lock() and
+  * mutex_unlock() only call into the kernel when another process is waiting. */
+ 
+ // Word at a futex address, or NULL if the address is invalid
+ uint32_t* futex_word(uint16_t addr) {
+     if ((addr & 3) != 0 || (uint32_t)addr + sizeof(uint32_t) > MEMORY_SIZE) {
+         return NULL;
      }
+     return (uint32_t*)&simple_os.memory[addr];
  }
  
- // Create a new file
- int fs_create(const char* filename) {
-     // Find free file entry
-     int file_id = -1;
-     for (int i = 0; i < MAX_FILES; i++) {
-         if (!simple_os.file_table[i].in_use) {
-             file_id = i;
-             break;
-         }
-     }
-     
-     if (file_id == -1) {
-         return -1; // No free file slots
+ uint32_t futex_hash(uint16_t addr) {
+     return ((uint32_t)(addr >> 2) * 2654435761u) >> (32 - FUTEX_HASH_BITS);
+ }
+ 
+ // Sleep while the word at addr still holds expected
+ // Returns 0 once woken, -1 if the value changed or the caller cannot sleep
+ int futex_wait(uint16_t addr, uint32_t expected) {
+     uint32_t* word = futex_word(addr);
+     uint8_t pid = simple_os.running;
+     if (!word || pid == 0xFF) {
+         return -1;
      }
-     
-     // Check if filename already exists
-     for (int i = 0; i < MAX_FILES; i++) {
-         if (simple_os.file_table[i].in_use) {
-             bool match = true;
-             for (int j = 0; j < MAX_FILENAME_LEN; j++) {
-                 if (simple_os.file_table[i].filename[j] != filename[j]) {
-                     match = false;
-                     break;
-                 }
-                 if (filename[j] == '\0') {
-                     break;
-                 }
-             }
-             if (match) {
-                 return -2; // File already exists
-             }
-         }
+     if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != expected) {
+         return -1;
      }
      
-     // Create the file
-     FileEntry* file = &simple_os.file_table[file_id];
-     int i = 0;
-     while (filename[i] != '\0' && i < MAX_FILENAME_LEN - 1) {
-         file->filename[i] = filename[i];
-         i++;
+     // Append to the bucket so waiters are woken in arrival order
+     uint32_t bucket = futex_hash(addr);
+     Process* p = &simple_os.processes[pid];
+     p->futex_addr = addr;
+     p->futex_next = 0xFF;
+     if (simple_os.futex_tail[bucket] == 0xFF) {
+         simple_os.futex_head[bucket] = pid;
+     } else {
+         simple_os.processes[simple_os.futex_tail[bucket]].futex_next = pid;
      }
-     file->filename[i] = '\0';
-     file->start_block = 0; // Allocate actual storage as needed
-     file->size = 0;
-     file->in_use = true;
+     simple_os.futex_tail[bucket] = pid;
+     simple_os.futex_waits++;
      
-     return file_id;
+     process_block();
+     return 0;
  }
  
- // Delete a file
- bool fs_delete(const char* filename) {
-     // Find the file
-     for (int i = 0; i < MAX_FILES; i++) {
-         if (simple_os.file_table[i].in_use) {
-             bool match = true;
-             for (int j = 0; j < MAX_FILENAME_LEN; j++) {
-                 if (simple_os.file_table[i].filename[j] != filename[j]) {
-                     match = false;
-                     break;
-                 }
-                 if (filename[j] == '\0') {
-                     break;
-                 }
-             }
-             if (match) {
-                 simple_os.file_table[i].in_use = false;
-                 return true;
+ // Unlink pid from its bucket; returns false if it was not queued
+ bool futex_dequeue(uint8_t pid) {
+     Process* p = &simple_os.processes[pid];
+     if (p->futex_addr == 0xFFFF) {
+         return false;
+     }
+     uint32_t bucket = futex_hash(p->futex_addr);
+     uint8_t prev = 0xFF;
+     uint8_t cur = simple_os.futex_head[bucket];
+     while (cur != 0xFF && cur != pid) {
+         prev = cur;
+         cur = simple_os.processes[cur].futex_next;
+     }
+     if (cur == 0xFF) {
+         return false;
+     }
+     if (prev == 0xFF) {
+         simple_os.futex_head[bucket] = p->futex_next;
+     } else {
+         simple_os.processes[prev].futex_next = p->futex_next;
+     }
+     if (simple_os.futex_tail[bucket] == pid) {
+         simple_os.futex_tail[bucket] = prev;
+     }
+     p->futex_addr = 0xFFFF;
+     return true;
+ }
+ 
+ // Wake up to count processes waiting on addr; returns how many were woken
+ int futex_wake(uint16_t addr, int count) {
+     uint32_t bucket = futex_hash(addr);
+     int woken = 0;
+     uint8_t cur = simple_os.futex_head[bucket];
+     simple_os.futex_wakes++;
+     while (cur != 0xFF && woken < count) {
+         uint8_t next = simple_os.processes[cur].futex_next;
+         if (simple_os.processes[cur].futex_addr == addr) {
+             futex_dequeue(cur);
+             process_wake(cur);
+             woken++;
+         }
+         cur = next;
+     }
+     return woken;
+ }
+ 
+ // Drop a process from any futex queue when it exits
+ void futex_cancel(uint8_t pid) {
+     futex_dequeue(pid);
+ }
+ 
+ /* Mutex word: 0 unlocked, 1 locked, 2 locked with possible waiters.
+  * Condition variable word: sequence number bumped on every signal. */
+ 
+ void mutex_lock(uint16_t addr) {
+     uint32_t* word = futex_word(addr);
+     uint32_t c = 0;
+     if (__atomic_compare_exchange_n(word, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         return; // Uncontended
+     }
+     if (c != 2) {
+         c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+     }
+     while (c != 0) {
+         futex_wait(addr, 2);
+         c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+     }
+ }
+ 
+ void mutex_unlock(uint16_t addr) {
+     uint32_t* word = futex_word(addr);
+     if (__atomic_exchange_n(word, 0, __ATOMIC_RELEASE) == 2) {
+         futex_wake(addr, 1);
+     }
+ }
+ 
+ void cond_wait(uint16_t cond, uint16_t mutex) {
+     uint32_t seq = __atomic_load_n(futex_word(cond), __ATOMIC_ACQUIRE);
+     mutex_unlock(mutex);
+     futex_wait(cond, seq);
+     
+     // Waiters may still be queued on the mutex, so keep the contended state
+     uint32_t* word = futex_word(mutex);
+     while (__atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE) != 0) {
+         futex_wait(mutex, 2);
+     }
+ }
+ 
+ void cond_signal(uint16_t cond) {
+     __atomic_fetch_add(futex_word(cond), 1, __ATOMIC_RELEASE);
+     futex_wake(cond, 1);
+ }
+ 
+ void cond_broadcast(uint16_t cond) {
+     __atomic_fetch_add(futex_word(cond), 1, __ATOMIC_RELEASE);
+     futex_wake(cond, MAX_PROCESSES);
+ }
+ 
+ /* ======= PROGRAMS ======= */
+ 
+ // Address of a process's memory in the simulated RAM
+ uint8_t* process_memory(uint8_t pid) {
+     return &simple_os.memory[simple_os.processes[pid].memory_start];
+ }
+ 
+ // Print a greeting and exit
+ int program_hello(uint8_t pid) {
+     printf("Hello from process %d\n", pid);
+     return 0;
+ }
+ 
+ // Count to ten, one step per time slice, keeping the count in process memory
+ int program_counter(uint8_t pid) {
+     uint8_t* mem = process_memory(pid);
+     for (mem[0] = 0; mem[0] < 10; mem[0]++) {
+         process_yield();
+     }
+     return mem[0];
+ }
+ 
+ // Yield forever
+ int program_spin(uint8_t pid) {
+     (void)pid;
+     for (;;) {
+         process_yield();
+     }
+     return 0;
+ }
+ 
+ // Yield the number of times stored at the start of process memory
+ int program_yield(uint8_t pid) {
+     uint32_t count;
+     memcpy(&count, process_memory(pid), sizeof(count));
+     for (uint32_t i = 0; i < count; i++) {
+         process_yield();
+     }
+     return 0;
+ }
+ 
+ // Add 100 to the counter shared by the whole thread group
+ int program_worker(uint8_t pid) {
+     uint16_t* shared = (uint16_t*)process_memory(pid);
+     for (int i = 0; i < 100; i++) {
+         shared[0]++;
+         process_yield();
+     }
+     return 0;
+ }
+ 
+ // Start four worker threads and wait until the ones that started have all finished
+ int program_workers(uint8_t pid) {
+     uint16_t* shared = (uint16_t*)process_memory(pid);
+     shared[0] = 0;
+     int workers = 0;
+     for (int i = 0; i < 4; i++) {
+         if (thread_create(pid, program_worker) != 0xFF) {
+             workers++;
+         }
+     }
+     if (workers == 0) {
+         return 0; // The process table is full
+     }
+     while (shared[0] < workers * 100) {
+         process_yield();
+     }
+     return shared[0] / workers;
+ }
+ 
+ // Layout of the shared block used by the "contend" program
+ #define CONTEND_MUTEX 0
+ #define CONTEND_COND 4
+ #define CONTEND_COUNTER 8
+ #define CONTEND_DONE 12
+ #define CONTEND_ROUNDS 16 // Requested rounds, consumed at start
+ #define CONTEND_LIMIT 20  // Rounds each worker runs
+ 
+ // Increment the shared counter under the group mutex, yielding while holding it
+ int program_lock_worker(uint8_t pid) {
+     uint16_t base = simple_os.processes[pid].memory_start;
+     uint32_t* shared = (uint32_t*)process_memory(pid);
+     for (uint32_t i = 0; i < shared[CONTEND_LIMIT / 4]; i++) {
+         mutex_lock(base + CONTEND_MUTEX);
+         uint32_t value = shared[CONTEND_COUNTER / 4];
+         process_yield();
+         shared[CONTEND_COUNTER / 4] = value + 1;
+         mutex_unlock(base + CONTEND_MUTEX);
+     }
+     mutex_lock(base + CONTEND_MUTEX);
+     shared[CONTEND_DONE / 4]++;
+     cond_signal(base + CONTEND_COND);
+     mutex_unlock(base + CONTEND_MUTEX);
+     return 0;
+ }
+ 
+ // Run four lock workers and sleep on a condition variable until they finish
+ int program_contend(uint8_t pid) {
+     uint16_t base = simple_os.processes[pid].memory_start;
+     uint32_t* shared = (uint32_t*)process_memory(pid);
+     memset(shared, 0, CONTEND_ROUNDS);
+     
+     // A round count left by the caller is used once, otherwise default to 100
+     uint32_t rounds = shared[CONTEND_ROUNDS / 4];
+     shared[CONTEND_ROUNDS / 4] = 0;
+     shared[CONTEND_LIMIT / 4] = rounds ? rounds : 100;
+     int workers = 0;
+     for (int i = 0; i < 4; i++) {
+         if (thread_create(pid, program_lock_worker) != 0xFF) {
+             workers++;
+         }
+     }
+     if (workers == 0) {
+         return 0; // The process table is full
+     }
+     mutex_lock(base + CONTEND_MUTEX);
+     while (shared[CONTEND_DONE / 4] < (uint32_t)workers) {
+         cond_wait(base + CONTEND_COND, base + CONTEND_MUTEX);
+     }
+     mutex_unlock(base + CONTEND_MUTEX);
+     return shared[CONTEND_COUNTER / 4] / workers;
+ }
+ 
+ #define IOREAD_COUNT 0 // Reads requested, consumed at start
+ #define IOREAD_DONE 4
+ 
+ // Read random blocks of the mounted image, sleeping until each read completes
+ int program_ioread(uint8_t pid) {
+     uint32_t* shared = (uint32_t*)process_memory(pid);
+     uint32_t count = shared[IOREAD_COUNT / 4] ? shared[IOREAD_COUNT / 4] : 1000;
+     shared[IOREAD_COUNT / 4] = 0;
+     shared[IOREAD_DONE / 4] = 0;
+     if (!simple_os.disk_mapped) {
+         return 1;
+     }
+     uint8_t buffer[BLOCK_SIZE];
+     uint32_t seed = pid * 2654435761u + 1;
+     for (uint32_t i = 0; i < count; i++) {
+         seed = seed * 1103515245 + 12345;
+         int16_t slot = block_read_async(1 + (seed >> 8) % (NUM_BLOCKS - 1), buffer);
+         if (slot >= 0 && io_wait(slot) != BLOCK_SIZE) {
+             return 2;
+         }
+         shared[IOREAD_DONE / 4]++;
+     }
+     return 0;
+ }
+ 
+ const Program programs[] = {
+     { "hello", program_hello },
+     { "counter", program_counter },
+     { "spin", program_spin },
+     { "yield", program_yield },
+     { "workers", program_workers },
+     { "contend", program_contend },
+     { "ioread", program_ioread },
+ };
+ 
+ // Find a built-in program by name; other names run without code
+ ProgramEntry program_lookup(const char* name) {
+     for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+         if (strcmp(programs[i].name, name) == 0) {
+             return programs[i].entry;
+         }
+     }
+     return NULL;
+ }
+ 
+ /* ======= ASYNC I/O ======= */
+ 
+ /* Reads and writes of a mounted image go through an asynchronous engine, so
+  * a process that misses in the page cache sleeps while the host does the
+  * read instead of stalling every other process. io_submit queues a request,
+  * io_flush hands everything queued to the backend as one batch, and io_reap
+  * collects completions and wakes the processes sleeping on them. The
+  * backend is io_uring, driven with raw system calls since liburing is not
+  * assumed; where the kernel refuses it, a pool of host threads runs pread
+  * and pwrite instead.
+  *
+  * A completed request either waits for io_wait to collect its result, frees
+  * itself (detached writes), or marks the page cache page it filled as valid.
+  * Requests on the same bytes of a file never run at the same time:
+  * io_submit first waits for any earlier overlapping write. */
+ 
+ #if HAVE_MMAP
+ 
+ #if HAVE_IO_URING
+ // Map the submission and completion rings; returns false if the kernel refuses io_uring
+ bool uring_init() {
+     struct io_uring_params params;
+     memset(&params, 0, sizeof(params));
+     int fd = (int)syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+     if (fd < 0) {
+         return false;
+     }
+     size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+     size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+     if (single && cq_size > sq_size) {
+         sq_size = cq_size;
+     }
+     uint8_t* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+     uint8_t* cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                      IORING_OFF_CQ_RING);
+     void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+     if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+         close(fd);
+         return false;
+     }
+     simple_os.uring_fd = fd;
+     simple_os.uring_sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+     simple_os.uring_sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+     simple_os.uring_sq_array = (uint32_t*)(sq + params.sq_off.array);
+     simple_os.uring_sqes = sqes;
+     simple_os.uring_cq_head = (uint32_t*)(cq + params.cq_off.head);
+     simple_os.uring_cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+     simple_os.uring_cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+     simple_os.uring_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+     return true;
+ }
+ 
+ // Fill one submission queue entry per request and submit them all with one system call
+ // Returns how many the kernel took, from the front; the entries of the rest are withdrawn
+ uint16_t uring_submit(const int16_t* slots, uint16_t count) {
+     uint32_t first = *simple_os.uring_sq_tail;
+     uint32_t tail = first;
+     uint32_t mask = *simple_os.uring_sq_mask;
+     for (uint16_t i = 0; i < count; i++) {
+         IoRequest* req = &simple_os.io[slots[i]];
+         uint32_t index = tail & mask;
+         struct io_uring_sqe* sqe = &simple_os.uring_sqes[index];
+         memset(sqe, 0, sizeof(*sqe));
+         sqe->opcode = req->op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+         sqe->fd = req->fd;
+         sqe->addr = (uint64_t)(uintptr_t)req->buffer;
+         sqe->len = req->len;
+         sqe->off = req->offset;
+         sqe->user_data = (uint64_t)slots[i];
+         simple_os.uring_sq_array[index] = index;
+         tail++;
+     }
+     __atomic_store_n(simple_os.uring_sq_tail, tail, __ATOMIC_RELEASE);
+     uint16_t submitted = 0;
+     while (submitted < count) {
+         long taken = syscall(__NR_io_uring_enter, simple_os.uring_fd, count - submitted, 0, 0, NULL, 0);
+         if (taken > 0) {
+             submitted += (uint16_t)taken;
+         } else if (taken == 0 || errno != EINTR) {
+             break; // EAGAIN and EBUSY clear only once completions are reaped
+         }
+     }
+     if (submitted < count) {
+         // The kernel reads entries only inside io_uring_enter, so those it left can be taken back
+         __atomic_store_n(simple_os.uring_sq_tail, first + submitted, __ATOMIC_RELEASE);
+     }
+     return submitted;
+ }
+ #endif
+ 
+ // Thread pool backend: run queued requests until the host process exits
+ void* io_thread(void* arg) {
+     (void)arg;
+     pthread_mutex_lock(&simple_os.io_lock);
+     for (;;) {
+         while (simple_os.io_work_head < 0) {
+             pthread_cond_wait(&simple_os.io_work, &simple_os.io_lock);
+         }
+         int16_t slot = simple_os.io_work_head;
+         IoRequest* req = &simple_os.io[slot];
+         simple_os.io_work_head = req->next;
+         if (simple_os.io_work_head < 0) {
+             simple_os.io_work_tail = -1;
+         }
+         pthread_mutex_unlock(&simple_os.io_lock);
+         
+         ssize_t n = req->op == IO_READ ? pread(req->fd, req->buffer, req->len, (off_t)req->offset)
+                                        : pwrite(req->fd, req->buffer, req->len, (off_t)req->offset);
+         int32_t result = n < 0 ? -errno : (int32_t)n;
+         
+         pthread_mutex_lock(&simple_os.io_lock);
+         req->result = result;
+         simple_os.io_done_list[simple_os.io_done_count++] = slot;
+         pthread_cond_signal(&simple_os.io_done);
+     }
+     return NULL;
+ }
+ 
+ // Start the thread pool; returns false if no thread could be created
+ bool io_threads_start() {
+     if (simple_os.io_threads_started) {
+         return true;
+     }
+     pthread_mutex_init(&simple_os.io_lock, NULL);
+     pthread_cond_init(&simple_os.io_work, NULL);
+     pthread_cond_init(&simple_os.io_done, NULL);
+     simple_os.io_work_head = -1;
+     simple_os.io_work_tail = -1;
+     simple_os.io_done_count = 0;
+     int started = 0;
+     for (int i = 0; i < IO_THREADS; i++) {
+         if (pthread_create(&simple_os.io_threads[i], NULL, io_thread, NULL) == 0) {
+             pthread_detach(simple_os.io_threads[i]);
+             started++;
+         }
+     }
+     simple_os.io_threads_started = started > 0;
+     return simple_os.io_threads_started;
+ }
+ 
+ // Set up the request slots and pick the best backend the host offers
+ void io_init() {
+     for (int i = 0; i < IO_QUEUE_DEPTH; i++) {
+         simple_os.io[i].state = IO_FREE;
+         simple_os.io[i].next = i + 1 < IO_QUEUE_DEPTH ? i + 1 : -1;
+     }
+     simple_os.io_free = 0;
+     simple_os.io_queued = 0;
+     simple_os.io_inflight = 0;
+ #if HAVE_IO_URING
+     simple_os.uring_fd = -1;
+     if (uring_init()) {
+         simple_os.io_backend = IO_BACKEND_URING;
+         return;
+     }
+ #endif
+     simple_os.io_backend = io_threads_start() ? IO_BACKEND_THREADS : IO_BACKEND_SYNC;
+ }
+ 
+ void io_release(int16_t slot) {
+     simple_os.io[slot].state = IO_FREE;
+     simple_os.io[slot].next = simple_os.io_free;
+     simple_os.io_free = slot;
+ }
+ 
+ // Finish a request and wake whoever is waiting for it
+ void io_complete(int16_t slot, int32_t result) {
+     IoRequest* req = &simple_os.io[slot];
+     req->result = result;
+     req->latency_ns = bench_now_ns() - req->submit_ns;
+     req->seq++;
+     simple_os.io_inflight--;
+     simple_os.io_completed++;
+     simple_os.io_latency_ns += req->latency_ns;
+     if (result != (int32_t)req->len) {
+         simple_os.io_errors++;
+     }
+     for (int i = 0; i < MAX_PROCESSES; i++) {
+         if (simple_os.processes[i].io_slot == slot) {
+             simple_os.processes[i].io_slot = -1;
+             process_wake(i);
+         }
+     }
+     if (req->page >= 0) {
+         CachePage* page = &simple_os.cache[req->page];
+         if (result != (int32_t)req->len) {
+             memset(page->data, 0, BLOCK_SIZE); // Never leave another block's data behind
+         } else if (!block_verify((uint16_t)((req->offset - offsetof(DiskImage, blocks)) / BLOCK_SIZE), page->data)) {
+             memset(page->data, 0, BLOCK_SIZE);
+             page->damaged = true;
+         }
+         page->io = -1;
+     }
+     if (req->detached || req->page >= 0) {
+         io_release(slot);
+     } else {
+         req->state = IO_DONE;
+     }
+ }
+ 
+ // Process completed requests, first waiting for at least one if wait is set
+ void io_reap(bool wait) {
+     if (simple_os.io_inflight == 0) {
+         return;
+     }
+ #if HAVE_IO_URING
+     if (simple_os.io_backend == IO_BACKEND_URING) {
+         uint32_t head = *simple_os.uring_cq_head;
+         if (wait && head == __atomic_load_n(simple_os.uring_cq_tail, __ATOMIC_ACQUIRE)) {
+             syscall(__NR_io_uring_enter, simple_os.uring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+         }
+         uint32_t tail = __atomic_load_n(simple_os.uring_cq_tail, __ATOMIC_ACQUIRE);
+         while (head != tail) {
+             struct io_uring_cqe* cqe = &simple_os.uring_cqes[head & *simple_os.uring_cq_mask];
+             int16_t slot = (int16_t)cqe->user_data;
+             int32_t result = cqe->res;
+             head++;
+             __atomic_store_n(simple_os.uring_cq_head, head, __ATOMIC_RELEASE);
+             io_complete(slot, result);
+         }
+         return;
+     }
+ #endif
+     if (simple_os.io_backend == IO_BACKEND_THREADS) {
+         int16_t done[IO_QUEUE_DEPTH];
+         pthread_mutex_lock(&simple_os.io_lock);
+         while (wait && simple_os.io_done_count == 0) {
+             pthread_cond_wait(&simple_os.io_done, &simple_os.io_lock);
+         }
+         uint16_t count = simple_os.io_done_count;
+         memcpy(done, simple_os.io_done_list, count * sizeof(done[0]));
+         simple_os.io_done_count = 0;
+         pthread_mutex_unlock(&simple_os.io_lock);
+         for (uint16_t i = 0; i < count; i++) {
+             io_complete(done[i], simple_os.io[done[i]].result);
+         }
+     }
+ }
+ 
+ // Do requests in the host, completing each before the next starts
+ void io_run(const int16_t* slots, uint16_t count) {
+     for (uint16_t i = 0; i < count; i++) {
+         IoRequest* req = &simple_os.io[slots[i]];
+         ssize_t n = req->op == IO_READ ? pread(req->fd, req->buffer, req->len, (off_t)req->offset)
+                                        : pwrite(req->fd, req->buffer, req->len, (off_t)req->offset);
+         io_complete(slots[i], n < 0 ? -errno : (int32_t)n);
+     }
+ }
+ 
+ // Hand every queued request to the backend in one batch
+ void io_flush() {
+     uint16_t count = simple_os.io_queued;
+     if (count == 0) {
+         return;
+     }
+     simple_os.io_queued = 0;
+     simple_os.io_plug_ticks = 0;
+     simple_os.io_batches++;
+     simple_os.io_inflight += count;
+     for (uint16_t i = 0; i < count; i++) {
+         simple_os.io[simple_os.io_queue[i]].state = IO_INFLIGHT;
+     }
+     
+     switch (simple_os.io_backend) {
+ #if HAVE_IO_URING
+     case IO_BACKEND_URING: {
+         uint16_t submitted = uring_submit(simple_os.io_queue, count);
+         for (int tries = 1; submitted < count && tries < IO_SUBMIT_TRIES; tries++) {
+             io_reap(false); // Frees room in the completion queue
+             submitted += uring_submit(simple_os.io_queue + submitted, count - submitted);
+         }
+         // Whatever the kernel still refuses runs in the host, so no one waits on a request never submitted
+         io_run(simple_os.io_queue + submitted, count - submitted);
+         break;
+     }
+ #endif
+     case IO_BACKEND_THREADS:
+         pthread_mutex_lock(&simple_os.io_lock);
+         for (uint16_t i = 0; i < count; i++) {
+             int16_t slot = simple_os.io_queue[i];
+             simple_os.io[slot].next = -1;
+             if (simple_os.io_work_tail >= 0) {
+                 simple_os.io[simple_os.io_work_tail].next = slot;
+             } else {
+                 simple_os.io_work_head = slot;
+             }
+             simple_os.io_work_tail = slot;
+         }
+         pthread_cond_broadcast(&simple_os.io_work);
+         pthread_mutex_unlock(&simple_os.io_lock);
+         break;
+     default:
+         io_run(simple_os.io_queue, count);
+         break;
+     }
+ }
+ 
+ // Wait until the request in slot completes. A process sleeps so others can run, and
+ // may be woken early, so callers check again; outside a process this waits in the host.
+ // A sleeping process leaves its request queued so the scheduler can batch it with others.
+ void io_sleep(int16_t slot, bool may_sleep) {
+     uint8_t pid = simple_os.running;
+     if (may_sleep && pid != 0xFF) {
+         simple_os.processes[pid].io_slot = slot;
+         process_block();
+         simple_os.processes[pid].io_slot = -1;
+         return;
+     }
+     uint32_t seq = simple_os.io[slot].seq; // Before the flush, which may complete it inline
+     io_flush();
+     while (simple_os.io[slot].seq == seq) {
+         io_reap(true);
+     }
+ }
+ 
+ // Wait for requests overlapping the given bytes: writes, or any request if writing
+ void io_fence(int fd, uint64_t offset, uint32_t len, bool writing) {
+     for (int16_t i = 0; i < IO_QUEUE_DEPTH; i++) {
+         IoRequest* req = &simple_os.io[i];
+         while ((req->state == IO_QUEUED || req->state == IO_INFLIGHT) && req->fd == fd &&
+                (writing || req->op == IO_WRITE) && req->offset < offset + len && offset < req->offset + req->len) {
+             io_sleep(i, false);
+         }
+     }
+ }
+ 
+ // Queue a read or write of a host file; io_flush or any wait sends it to the backend
+ int16_t io_submit(IoOp op, int fd, void* buffer, uint32_t len, uint64_t offset) {
+     io_fence(fd, offset, len, op == IO_WRITE);
+     while (simple_os.io_free < 0) {
+         io_flush();
+         io_reap(true);
+     }
+     int16_t slot = simple_os.io_free;
+     IoRequest* req = &simple_os.io[slot];
+     simple_os.io_free = req->next;
+     req->state = IO_QUEUED;
+     req->op = op;
+     req->detached = false;
+     req->page = -1;
+     req->fd = fd;
+     req->buffer = buffer;
+     req->len = len;
+     req->offset = offset;
+     req->result = 0;
+     req->submit_ns = bench_now_ns();
+     simple_os.io_queue[simple_os.io_queued++] = slot;
+     simple_os.io_submitted++;
+     return slot;
+ }
+ 
+ // Wait for a request and collect its result
+ int32_t io_wait(int16_t slot) {
+     while (simple_os.io[slot].state != IO_DONE) {
+         io_sleep(slot, true);
+     }
+     int32_t result = simple_os.io[slot].result;
+     io_release(slot);
+     return result;
+ }
+ 
+ // Wait for every request in flight
+ void io_drain() {
+     io_flush();
+     while (simple_os.io_inflight > 0) {
+         io_reap(true);
+     }
+ }
+ 
+ // Reap finished requests, run from the scheduler. Queued requests are sent once every
+ // process has had a time slice to add its own to the batch.
+ void io_tick() {
+     io_reap(false);
+     if (simple_os.io_queued > 0 && ++simple_os.io_plug_ticks >= simple_os.process_count) {
+         io_flush();
+     }
+ }
+ 
+ // Called when no process can run: wait in the host for a completion that may wake one
+ void io_idle_wait() {
+     io_flush();
+     if (simple_os.io_inflight > 0) {
+         io_reap(true);
+     }
+ }
+ 
+ // Let an exiting process's I/O finish; its stack may be the target of a read
+ void io_cancel(uint8_t pid) {
+     int16_t slot = simple_os.processes[pid].io_slot;
+     if (slot >= 0) {
+         simple_os.processes[pid].io_slot = -1;
+         if (simple_os.io[slot].state == IO_QUEUED || simple_os.io[slot].state == IO_INFLIGHT) {
+             io_sleep(slot, false);
+         }
+         if (simple_os.io[slot].state == IO_DONE) {
+             io_release(slot);
+         }
+     }
+ }
+ 
+ // Switch backends once nothing is in flight; returns false if the backend is unavailable
+ bool io_set_backend(IoBackend backend) {
+ #if HAVE_IO_URING
+     if (backend == IO_BACKEND_URING && simple_os.uring_fd < 0) {
+         return false;
+     }
+ #else
+     if (backend == IO_BACKEND_URING) {
+         return false;
+     }
+ #endif
+     if (backend == IO_BACKEND_THREADS && !io_threads_start()) {
+         return false;
+     }
+     io_drain();
+     simple_os.io_backend = backend;
+     return true;
+ }
+ 
+ #else
+ 
+ // Without a host file to read there is nothing to do asynchronously
+ void io_init() {}
+ void io_tick() {}
+ void io_idle_wait() {}
+ void io_drain() {}
+ void io_flush() {}
+ void io_cancel(uint8_t pid) { (void)pid; }
+ void io_sleep(int16_t slot, bool may_sleep) { (void)slot; (void)may_sleep; }
+ int32_t io_wait(int16_t slot) { (void)slot; return BLOCK_SIZE; }
+ 
+ #endif
+ 
+ /* ======= DISK I/O ======= */
+ 
+ /* A mounted image is mapped privately: stores into simple_os.disk never reach
+  * the host file by themselves. Data blocks are written out when the page
+  * cache writes them back, and metadata only through the journal, so what is
+  * on disk is always a state the journal can recover. */
+ 
+ // Write len bytes to the host file at offset
+ void disk_write(size_t offset, const void* src, size_t len) {
+ #if HAVE_MMAP
+     io_fence(simple_os.disk_fd, offset, (uint32_t)len, true);
+     while (len > 0) {
+         ssize_t n = pwrite(simple_os.disk_fd, src, len, offset);
+         if (n <= 0) {
+             return;
+         }
+         src = (const uint8_t*)src + n;
+         offset += n;
+         len -= n;
+     }
+ #else
+     fseek(simple_os.disk_file, (long)offset, SEEK_SET);
+     fwrite(src, 1, len, simple_os.disk_file);
+ #endif
+ }
+ 
+ // Write part of the in-memory image back to the same place in the host file
+ void disk_write_at(const void* src, size_t len) {
+     disk_write((const uint8_t*)src - (const uint8_t*)simple_os.disk, src, len);
+ }
+ 
+ // Wait until everything written to the host file is durable
+ void disk_barrier() {
+     simple_os.journal_fsyncs++;
+ #if HAVE_MMAP
+     io_drain();
+     fsync(simple_os.disk_fd);
+ #else
+     fflush(simple_os.disk_file);
+ #endif
+ }
+ 
+ /* ======= CHECKSUMS ======= */
+ 
+ /* Data blocks, metadata and journal records carry CRC32C checksums, so damage
+  * to an image is reported instead of being read back as file contents. On
+  * CPUs with CRC32C instructions a buffer is split into three streams that are
+  * checksummed interleaved: each instruction takes three cycles, but a new one
+  * can start every cycle. The three results are joined by advancing a CRC over
+  * CRC32C_STRIDE zero bytes, which is a multiplication by a fixed polynomial
+  * and so a lookup in four tables. Other CPUs use slicing-by-8 tables. */
+ 
+ // a * b modulo the CRC32C polynomial, bits reflected
+ uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+     uint32_t product = 0;
+     for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+         if (a & bit) {
+             product ^= b;
+         }
+         b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+     }
+     return product;
+ }
+ 
+ void checksum_init() {
+     for (uint32_t b = 0; b < 256; b++) {
+         uint32_t crc = b;
+         for (int k = 0; k < 8; k++) {
+             crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+         }
+         simple_os.crc32c_table[0][b] = crc;
+     }
+     for (uint32_t b = 0; b < 256; b++) {
+         for (int t = 1; t < 8; t++) {
+             uint32_t prev = simple_os.crc32c_table[t - 1][b];
+             simple_os.crc32c_table[t][b] = (prev >> 8) ^ simple_os.crc32c_table[0][prev & 0xFF];
+         }
+     }
+     
+     // x^(8 * CRC32C_STRIDE), what a CRC is multiplied by to advance it over that many zero bytes
+     uint32_t power = 1u << 31;
+     for (int i = 0; i < 8 * CRC32C_STRIDE; i++) {
+         power = power & 1 ? (power >> 1) ^ CRC32C_POLY : power >> 1;
+     }
+     for (int k = 0; k < 4; k++) {
+         for (uint32_t b = 0; b < 256; b++) {
+             simple_os.crc32c_shift[k][b] = crc32c_multiply(power, b << (8 * k));
+         }
+     }
+ #if HAVE_CRC32C_X86
+     simple_os.crc32c_hardware = __builtin_cpu_supports("sse4.2");
+ #elif HAVE_CRC32C_ARM
+     simple_os.crc32c_hardware = true;
+ #endif
+     simple_os.checksums_enabled = true;
+ }
+ 
+ // The CRC of what crc covered followed by CRC32C_STRIDE zero bytes
+ uint32_t crc32c_advance(uint32_t crc) {
+     return simple_os.crc32c_shift[0][crc & 0xFF] ^ simple_os.crc32c_shift[1][(crc >> 8) & 0xFF] ^
+            simple_os.crc32c_shift[2][(crc >> 16) & 0xFF] ^ simple_os.crc32c_shift[3][crc >> 24];
+ }
+ 
+ uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+     uint32_t (*table)[256] = simple_os.crc32c_table;
+     for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+         uint64_t word;
+         memcpy(&word, p, sizeof(word));
+         word ^= crc;
+         crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^ table[5][(word >> 16) & 0xFF] ^
+               table[4][(word >> 24) & 0xFF] ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+               table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+     }
+     for (; len > 0; p++, len--) {
+         crc = table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+     }
+     return crc;
+ }
+ 
+ #if HAVE_CRC32C_X86 || HAVE_CRC32C_ARM
+ #if HAVE_CRC32C_X86
+ #define CRC32C_WORD(crc, word) (uint32_t)_mm_crc32_u64(crc, word)
+ #define CRC32C_BYTE(crc, byte) _mm_crc32_u8(crc, byte)
+ #define CRC32C_TARGET __attribute__((target("sse4.2")))
+ #else
+ #define CRC32C_WORD(crc, word) __crc32cd(crc, word)
+ #define CRC32C_BYTE(crc, byte) __crc32cb(crc, byte)
+ #define CRC32C_TARGET
+ #endif
+ CRC32C_TARGET uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+     while (len >= 3 * CRC32C_STRIDE) {
+         uint32_t crc1 = 0;
+         uint32_t crc2 = 0;
+         for (const uint8_t* end = p + CRC32C_STRIDE; p < end; p += sizeof(uint64_t)) {
+             uint64_t word0, word1, word2;
+             memcpy(&word0, p, sizeof(uint64_t));
+             memcpy(&word1, p + CRC32C_STRIDE, sizeof(uint64_t));
+             memcpy(&word2, p + 2 * CRC32C_STRIDE, sizeof(uint64_t));
+             crc = CRC32C_WORD(crc, word0);
+             crc1 = CRC32C_WORD(crc1, word1);
+             crc2 = CRC32C_WORD(crc2, word2);
+         }
+         crc = crc32c_advance(crc32c_advance(crc) ^ crc1) ^ crc2;
+         p += 2 * CRC32C_STRIDE;
+         len -= 3 * CRC32C_STRIDE;
+     }
+     for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+         uint64_t word;
+         memcpy(&word, p, sizeof(word));
+         crc = CRC32C_WORD(crc, word);
+     }
+     for (; len > 0; p++, len--) {
+         crc = CRC32C_BYTE(crc, *p);
+     }
+     return crc;
+ }
+ 
+ // crc32c_hw that also stores each word it loads to d
+ CRC32C_TARGET uint32_t crc32c_copy_hw(uint32_t crc, uint8_t* d, const uint8_t* p, size_t len) {
+     while (len >= 3 * CRC32C_STRIDE) {
+         uint32_t crc1 = 0;
+         uint32_t crc2 = 0;
+         for (const uint8_t* end = p + CRC32C_STRIDE; p < end; p += sizeof(uint64_t), d += sizeof(uint64_t)) {
+             uint64_t word0, word1, word2;
+             memcpy(&word0, p, sizeof(uint64_t));
+             memcpy(&word1, p + CRC32C_STRIDE, sizeof(uint64_t));
+             memcpy(&word2, p + 2 * CRC32C_STRIDE, sizeof(uint64_t));
+             memcpy(d, &word0, sizeof(uint64_t));
+             memcpy(d + CRC32C_STRIDE, &word1, sizeof(uint64_t));
+             memcpy(d + 2 * CRC32C_STRIDE, &word2, sizeof(uint64_t));
+             crc = CRC32C_WORD(crc, word0);
+             crc1 = CRC32C_WORD(crc1, word1);
+             crc2 = CRC32C_WORD(crc2, word2);
+         }
+         crc = crc32c_advance(crc32c_advance(crc) ^ crc1) ^ crc2;
+         p += 2 * CRC32C_STRIDE;
+         d += 2 * CRC32C_STRIDE;
+         len -= 3 * CRC32C_STRIDE;
+     }
+     for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), d += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+         uint64_t word;
+         memcpy(&word, p, sizeof(word));
+         memcpy(d, &word, sizeof(word));
+         crc = CRC32C_WORD(crc, word);
+     }
+     for (; len > 0; p++, d++, len--) {
+         *d = *p;
+         crc = CRC32C_BYTE(crc, *p);
+     }
+     return crc;
+ }
+ #endif
+ 
+ // CRC32C of len bytes following those crc was computed over; crc is 0 to start
+ uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+ #if HAVE_CRC32C_X86 || HAVE_CRC32C_ARM
+     if (simple_os.crc32c_hardware) {
+         return ~crc32c_hw(~crc, data, len);
+     }
+ #endif
+     return ~crc32c_sw(~crc, data, len);
+ }
+ 
+ // Copy len bytes from src to dst and return crc32c(crc, src, len), reading the data only once
+ uint32_t crc32c_copy(uint32_t crc, void* dst, const void* src, size_t len) {
+ #if HAVE_CRC32C_X86 || HAVE_CRC32C_ARM
+     if (simple_os.crc32c_hardware) {
+         return ~crc32c_copy_hw(~crc, dst, src, len);
+     }
+ #endif
+     memcpy(dst, src, len); // The tables are slow enough that a second pass adds little
+     return crc32c(crc, dst, len);
+ }
+ 
+ /* ======= JOURNAL ======= */
+ 
+ /* Metadata changes are collected into a running transaction as a set of
+  * dirty JOURNAL_CHUNK-byte chunks. Committing appends one record with the
+  * current contents of those chunks to the journal and issues a single fsync,
+  * so every operation since the last commit shares it (group commit). A
+  * commit happens once journal_interval_ms has passed since the previous one.
+  * Checkpointing copies the logged chunks to their home locations and empties
+  * the journal; mounting replays any records a crash left behind. Only
+  * metadata is journaled: file data written shortly before a crash may be
+  * stale, but the file entries, directories and bitmap are always consistent.
+  * A transaction is committed early once it fills half the journal, so the
+  * metadata pages can grow without bound while every record still fits. */
+ 
+ // Bytes of metadata in chunk c, 0 if it holds none
+ size_t journal_chunk_len(uint32_t c) {
+     size_t offset = (size_t)c * JOURNAL_CHUNK;
+     if (offset < META_SIZE) {
+         return offset + JOURNAL_CHUNK > META_SIZE ? META_SIZE - offset : JOURNAL_CHUNK;
+     }
+     return offset >= META_PAGES_OFFSET && offset < simple_os.disk_size ? JOURNAL_CHUNK : 0;
+ }
+ 
+ // Size the running transaction's bitmap for the mounted image; returns false if out of memory
+ bool journal_resize() {
+     size_t size = (simple_os.disk_size / JOURNAL_CHUNK + 7) / 8;
+     if (size <= simple_os.journal_bitmap_size) {
+         return true;
+     }
+     uint8_t* bitmap = realloc(simple_os.journal_running, size);
+     if (!bitmap) {
+         return false;
+     }
+     memset(bitmap + simple_os.journal_bitmap_size, 0, size - simple_os.journal_bitmap_size);
+     simple_os.journal_running = bitmap;
+     simple_os.journal_bitmap_size = size;
+     return true;
+ }
+ 
+ // Forget the running transaction
+ void journal_reset() {
+     for (uint32_t i = 0; i < simple_os.journal_count; i++) {
+         uint32_t c = simple_os.journal_chunks[i];
+         simple_os.journal_running[c / 8] &= (uint8_t)~(1 << (c % 8));
+     }
+     simple_os.journal_count = 0;
+ }
+ 
+ // Add changed metadata to the running transaction
+ void journal_dirty(const void* p, size_t len) {
+     if (!simple_os.disk_mapped) {
+         return;
+     }
+     size_t offset = (const uint8_t*)p - (const uint8_t*)simple_os.disk;
+     for (size_t c = offset / JOURNAL_CHUNK; c <= (offset + len - 1) / JOURNAL_CHUNK; c++) {
+         uint8_t bit = (uint8_t)(1 << (c % 8));
+         if (simple_os.journal_running[c / 8] & bit) {
+             continue;
+         }
+         if (simple_os.journal_count == JOURNAL_MAX_CHUNKS) {
+             journal_commit(); // Operations are far smaller than the journal; never reached in practice
+         }
+         simple_os.journal_running[c / 8] |= bit;
+         simple_os.journal_chunks[simple_os.journal_count++] = (uint32_t)c;
+     }
+ }
+ 
+ // Whether any of the bytes have changed in the running transaction
+ bool journal_pending(size_t offset, size_t len) {
+     for (size_t c = offset / JOURNAL_CHUNK; c <= (offset + len - 1) / JOURNAL_CHUNK; c++) {
+         if (simple_os.journal_running[c / 8] & (1 << (c % 8))) {
+             return true;
+         }
+     }
+     return false;
+ }
+ 
+ // Copy every committed record to the home locations and empty the journal
+ void journal_checkpoint() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t pos = 0;
+     while (pos < simple_os.journal_head) {
+         JournalHeader* header = (JournalHeader*)&disk->journal[pos];
+         uint32_t* numbers = (uint32_t*)(header + 1);
+         uint8_t* contents = (uint8_t*)(numbers + header->chunks);
+         for (uint32_t i = 0; i < header->chunks; i++) {
+             // Home locations are written from the log, never from live metadata
+             // that may hold changes of a transaction still running
+             disk_write((size_t)numbers[i] * JOURNAL_CHUNK, contents + i * JOURNAL_CHUNK, journal_chunk_len(numbers[i]));
+         }
+         pos += sizeof(JournalHeader) + header->chunks * (sizeof(uint32_t) + JOURNAL_CHUNK);
+     }
+     disk_barrier();
+     
+     // Records before journal_seq are ignored from now on
+     disk->journal_seq = simple_os.journal_seq;
+     disk_write_at(&disk->journal_seq, sizeof(disk->journal_seq));
+     disk_barrier();
+     simple_os.journal_head = 0;
+ }
+ 
+ // Write the running transaction to the journal as one record
+ void journal_commit() {
+     if (!simple_os.disk_mapped) {
+         return;
+     }
+     simple_os.journal_last_commit = bench_now_ns();
+     if (simple_os.journal_count == 0) {
+         return;
+     }
+     checksum_seal(); // The changed metadata's checksums go in the same record
+     uint32_t count = simple_os.journal_count;
+     
+     uint32_t size = sizeof(JournalHeader) + count * (sizeof(uint32_t) + JOURNAL_CHUNK);
+     if (simple_os.journal_head + size > JOURNAL_SIZE) {
+         journal_checkpoint();
+     }
+     DiskImage* disk = simple_os.disk;
+     JournalHeader* header = (JournalHeader*)&disk->journal[simple_os.journal_head];
+     uint32_t* record_numbers = (uint32_t*)(header + 1);
+     uint8_t* contents = (uint8_t*)(record_numbers + count);
+     memcpy(record_numbers, simple_os.journal_chunks, count * sizeof(uint32_t));
+     for (uint32_t i = 0; i < count; i++) {
+         memset(contents + i * JOURNAL_CHUNK, 0, JOURNAL_CHUNK);
+         memcpy(contents + i * JOURNAL_CHUNK, (uint8_t*)disk + (size_t)record_numbers[i] * JOURNAL_CHUNK,
+                journal_chunk_len(record_numbers[i]));
+     }
+     header->magic = JOURNAL_MAGIC;
+     header->seq = simple_os.journal_seq++;
+     header->chunks = count;
+     header->checksum = crc32c(0, record_numbers, size - sizeof(JournalHeader));
+     disk_write_at(header, size);
+     disk_barrier();
+     
+     simple_os.journal_head += size;
+     journal_reset();
+     memset(simple_os.lfs_pending, 0, sizeof(simple_os.lfs_pending));
+     simple_os.journal_commits++;
+     simple_os.journal_ops = 0;
+ }
+ 
+ // Finish one file system operation, committing if the interval has passed
+ void journal_end_op() {
+     if (!simple_os.disk_mapped) {
+         return;
+     }
+     simple_os.journal_ops++;
+     simple_os.journal_total_ops++;
+     if (simple_os.journal_interval_ms == 0 || simple_os.journal_count > JOURNAL_MAX_CHUNKS / 2 ||
+         bench_now_ns() - simple_os.journal_last_commit >= (uint64_t)simple_os.journal_interval_ms * 1000000) {
+         journal_commit();
+     }
+ }
+ 
+ // Commit from the scheduler so a quiet system does not hold changes back
+ void journal_tick() {
+     if (simple_os.journal_ops > 0 &&
+         bench_now_ns() - simple_os.journal_last_commit >= (uint64_t)simple_os.journal_interval_ms * 1000000) {
+         journal_commit();
+     }
+ }
+ 
+ // Apply records left by a crash; returns how many were replayed
+ int journal_recover() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t pos = 0;
+     uint32_t seq = disk->journal_seq;
+     int replayed = 0;
+     while (pos + sizeof(JournalHeader) <= JOURNAL_SIZE) {
+         JournalHeader* header = (JournalHeader*)&disk->journal[pos];
+         if (header->magic != JOURNAL_MAGIC || header->seq != seq || header->chunks > JOURNAL_MAX_CHUNKS) {
+             break;
+         }
+         uint32_t size = sizeof(JournalHeader) + header->chunks * (sizeof(uint32_t) + JOURNAL_CHUNK);
+         if (pos + size > JOURNAL_SIZE ||
+             crc32c(0, header + 1, size - sizeof(JournalHeader)) != header->checksum) {
+             break; // Torn or never-committed record
+         }
+         uint32_t* numbers = (uint32_t*)(header + 1);
+         uint8_t* contents = (uint8_t*)(numbers + header->chunks);
+         for (uint32_t i = 0; i < header->chunks; i++) {
+             size_t len = journal_chunk_len(numbers[i]);
+             if (len > 0) {
+                 memcpy((uint8_t*)disk + (size_t)numbers[i] * JOURNAL_CHUNK, contents + i * JOURNAL_CHUNK, len);
+             }
+         }
+         pos += size;
+         seq++;
+         replayed++;
+     }
+     
+     // Make the replayed state the new home copy
+     simple_os.journal_head = pos;
+     simple_os.journal_seq = seq;
+     if (replayed > 0) {
+         journal_checkpoint();
+     }
+     return replayed;
+ }
+ 
+ /* ======= METADATA PAGES ======= */
+ 
+ /* File entries, directory B-tree nodes and the log layout's inode maps live in
+  * block-sized metadata pages after the data blocks. A file system starts with
+  * META_MIN_PAGES of them and doubles the image whenever they run out, so the
+  * number of files is bounded by host memory and disk rather than by the
+  * format. Pages are handed out past the last one in use or from a list of
+  * freed ones, and change only through the journal like the rest of the
+  * metadata. Growing can move the image in memory, so an operation reserves
+  * every page it may need before it takes any pointers into it. Page 1 and
+  * every META_CRC_GROUP-th page after it hold the checksums of the pages that
+  * follow them and are never handed out. */
+ 
+ uint8_t* meta_page(uint32_t page) {
+     return (uint8_t*)simple_os.disk + META_PAGES_OFFSET + (size_t)page * BLOCK_SIZE;
+ }
+ 
+ // Metadata pages the mounted file system has room for
+ uint32_t meta_capacity() {
+     return (uint32_t)((simple_os.disk_size - META_PAGES_OFFSET) / BLOCK_SIZE);
+ }
+ 
+ FileEntry* fs_entry(int32_t id) {
+     return (FileEntry*)meta_page((uint32_t)id / FS_ENTRIES_PER_PAGE) + id % FS_ENTRIES_PER_PAGE;
+ }
+ 
+ // Make room for at least pages metadata pages; returns false if the host is out of space
+ bool meta_grow(uint32_t pages) {
+     uint32_t capacity = meta_capacity() * 2;
+     if (capacity < pages) {
+         capacity = pages;
+     }
+     size_t size = META_PAGES_OFFSET + (size_t)capacity * BLOCK_SIZE;
+     DiskImage* disk;
+     if (!simple_os.disk_mapped) {
+         disk = realloc(simple_os.disk, size); // New pages are cleared as they are handed out
+         if (!disk) {
+             return false;
+         }
+         if (simple_os.disk == ram_disk) {
+             ram_disk = disk;
+             ram_disk_size = size;
+         }
+     } else {
+ #if HAVE_MMAP
+         io_drain(); // Writes in flight point into the mapping
+         if (ftruncate(simple_os.disk_fd, (off_t)size) != 0) {
+             return false;
+         }
+ #ifdef MREMAP_MAYMOVE
+         disk = mremap(simple_os.disk, simple_os.disk_size, size, MREMAP_MAYMOVE);
+         if (disk == MAP_FAILED) {
+             return false;
+         }
+ #else
+         // A new mapping only sees the file, so every change has to be there first
+         journal_commit();
+         journal_checkpoint();
+         disk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, simple_os.disk_fd, 0);
+         if (disk == MAP_FAILED) {
+             return false;
+         }
+         munmap(simple_os.disk, simple_os.disk_size);
+ #endif
+ #else
+         disk = realloc(simple_os.disk, size);
+         if (!disk) {
+             return false;
+         }
+ #endif
+     }
+     simple_os.disk = disk;
+     simple_os.disk_size = size;
+     return !simple_os.disk_mapped || journal_resize();
+ }
+ 
+ // Make sure count pages can be handed out without growing; returns false if the file system cannot grow
+ bool meta_reserve(uint32_t count) {
+     DiskImage* disk = simple_os.disk;
+     uint32_t need = count + count / (META_CRC_GROUP - 1) + 1; // New pages may start checksum pages
+     if (disk->meta_free_count + (meta_capacity() - disk->meta_pages) >= need) {
+         return true;
+     }
+     return meta_grow(disk->meta_pages + need);
+ }
+ 
+ bool meta_is_checksum_page(uint32_t page) {
+     return page % META_CRC_GROUP == 1;
+ }
+ 
+ // Where the checksum of a metadata page is kept
+ uint32_t* meta_checksum(uint32_t page) {
+     if (page == 0) {
+         return &simple_os.disk->meta_crc[META_HEADER_RECORDS - 1];
+     }
+     uint32_t holder = page - (page - 1) % META_CRC_GROUP;
+     return (uint32_t*)meta_page(holder) + (page - holder - 1);
+ }
+ 
+ // Take a reserved page, cleared
+ uint32_t meta_alloc() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t page = disk->meta_free;
+     if (page != 0) {
+         memcpy(&disk->meta_free, meta_page(page), sizeof(uint32_t));
+         disk->meta_free_count--;
+         journal_dirty(&disk->meta_free, sizeof(uint32_t));
+         journal_dirty(&disk->meta_free_count, sizeof(uint32_t));
+     } else {
+         page = disk->meta_pages++;
+         if (meta_is_checksum_page(page)) {
+             memset(meta_page(page), 0, BLOCK_SIZE);
+             journal_dirty(meta_page(page), BLOCK_SIZE);
+             page = disk->meta_pages++;
+         }
+         journal_dirty(&disk->meta_pages, sizeof(uint32_t));
+     }
+     memset(meta_page(page), 0, BLOCK_SIZE);
+     journal_dirty(meta_page(page), BLOCK_SIZE);
+     return page;
+ }
+ 
+ void meta_release(uint32_t page) {
+     DiskImage* disk = simple_os.disk;
+     memcpy(meta_page(page), &disk->meta_free, sizeof(uint32_t));
+     disk->meta_free = page;
+     disk->meta_free_count++;
+     journal_dirty(meta_page(page), sizeof(uint32_t));
+     journal_dirty(&disk->meta_free, sizeof(uint32_t));
+     journal_dirty(&disk->meta_free_count, sizeof(uint32_t));
+ }
+ 
+ /* ======= BLOCK DEVICE ======= */
+ 
+ bool block_used(uint16_t block) {
+     return simple_os.disk->block_bitmap[block / 8] & (1 << (block % 8));
+ }
+ 
+ // Whether a snapshot uses the block, which then keeps its contents until the snapshot is deleted
+ bool block_pinned(uint16_t block) {
+     return simple_os.disk->snapshot_bitmap[block / 8] & (1 << (block % 8));
+ }
+ 
+ // Whether the block is unavailable for allocation
+ bool block_taken(uint16_t block) {
+     return block_used(block) || block_pinned(block);
+ }
+ 
+ // Blocks only snapshots use; they count neither as free nor against any file
+ uint16_t block_held() {
+     DiskImage* disk = simple_os.disk;
+     uint16_t count = 0;
+     for (size_t i = 0; i < sizeof(disk->block_bitmap); i += sizeof(uint64_t)) {
+         uint64_t used, pinned;
+         memcpy(&used, disk->block_bitmap + i, sizeof(used));
+         memcpy(&pinned, disk->snapshot_bitmap + i, sizeof(pinned));
+         count += (uint16_t)__builtin_popcountll(pinned & ~used);
+     }
+     return count;
+ }
+ 
+ void block_mark(uint16_t start, uint16_t count, bool used) {
+     for (uint16_t b = start; b < start + count; b++) {
+         if (used) {
+             simple_os.disk->block_bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+         } else {
+             simple_os.disk->block_bitmap[b / 8] &= (uint8_t)~(1 << (b % 8));
+         }
+     }
+     journal_dirty(&simple_os.disk->block_bitmap[start / 8], (start + count - 1) / 8 - start / 8 + 1);
+ }
+ 
+ /* Free space is indexed by run size: every maximal run of free blocks sits
+  * on the list of size class floor(log2(length)), so the allocator finds a
+  * best fit by looking at one or two short lists instead of scanning the
+  * bitmap. The index is derived from the bitmap and rebuilt when a disk is
+  * attached. Block 0 is never free, so 0 ends a list. Blocks a snapshot
+  * uses are not free even once no file uses them. */
+ 
+ int block_class(uint16_t length) {
+     int c = 0;
+     while (length >>= 1) {
+         c++;
+     }
+     return c;
+ }
+ 
+ void block_run_insert(uint16_t start, uint16_t length) {
+     int c = block_class(length);
+     simple_os.free_run_len[start] = length;
+     simple_os.free_run_head[start + length - 1] = start;
+     simple_os.free_run_prev[start] = 0;
+     simple_os.free_run_next[start] = simple_os.free_class[c];
+     if (simple_os.free_class[c] != 0) {
+         simple_os.free_run_prev[simple_os.free_class[c]] = start;
+     }
+     simple_os.free_class[c] = start;
+ }
+ 
+ void block_run_remove(uint16_t start) {
+     uint16_t next = simple_os.free_run_next[start];
+     uint16_t prev = simple_os.free_run_prev[start];
+     if (prev != 0) {
+         simple_os.free_run_next[prev] = next;
+     } else {
+         simple_os.free_class[block_class(simple_os.free_run_len[start])] = next;
+     }
+     if (next != 0) {
+         simple_os.free_run_prev[next] = prev;
+     }
+     simple_os.free_run_len[start] = 0;
+ }
+ 
+ // Rebuild the free-space index from the bitmap
+ void block_index_build() {
+     memset(simple_os.free_run_len, 0, sizeof(simple_os.free_run_len));
+     memset(simple_os.free_class, 0, sizeof(simple_os.free_class));
+     uint32_t run = 0;
+     for (uint32_t b = 1; b <= NUM_BLOCKS; b++) {
+         if (b < NUM_BLOCKS && !block_taken(b)) {
+             run++;
+         } else if (run > 0) {
+             block_run_insert(b - run, run);
+             run = 0;
+         }
+     }
+ }
+ 
+ // First block of the longest free run, or 0 if the disk is full
+ uint16_t block_largest_run() {
+     for (int c = FREE_CLASSES - 1; c >= 0; c--) {
+         uint16_t best = 0;
+         for (uint16_t r = simple_os.free_class[c]; r != 0; r = simple_os.free_run_next[r]) {
+             if (best == 0 || simple_os.free_run_len[r] > simple_os.free_run_len[best]) {
+                 best = r;
+             }
+         }
+         if (best != 0) {
+             return best;
+         }
+     }
+     return 0;
+ }
+ 
+ // Initialize block storage
+ void block_init() {
+     memset(simple_os.disk->block_bitmap, 0, sizeof(simple_os.disk->block_bitmap));
+     memset(simple_os.disk->snapshot_bitmap, 0, sizeof(simple_os.disk->snapshot_bitmap));
+     memset(simple_os.disk->block_refs, 0, sizeof(simple_os.disk->block_refs));
+     simple_os.disk->free_blocks = NUM_BLOCKS - 1;
+     block_mark(0, 1, true);
+     block_index_build();
+ }
+ 
+ // Allocate up to count contiguous blocks: at goal if it is free, else from the
+ // smallest run that holds them all, else from the largest run there is.
+ // Returns the first block and sets *allocated, or returns 0 if the disk is full.
+ uint16_t block_alloc(uint16_t goal, uint16_t count, uint16_t* allocated) {
+     uint16_t run = 0;
+     uint16_t start = 0;
+     if (goal != 0 && goal < NUM_BLOCKS && !block_taken(goal)) {
+         run = goal;
+         while (simple_os.free_run_len[run] == 0) {
+             run--; // Only the first block of a run records its length
+         }
+         start = goal;
+     }
+     for (int c = block_class(count); run == 0 && c < FREE_CLASSES; c++) {
+         uint16_t best_len = 0;
+         for (uint16_t r = simple_os.free_class[c]; r != 0; r = simple_os.free_run_next[r]) {
+             uint16_t len = simple_os.free_run_len[r];
+             if (len >= count && (best_len == 0 || len < best_len)) {
+                 run = r;
+                 best_len = len;
+             }
+         }
+     }
+     if (run == 0) {
+         run = block_largest_run();
+     }
+     if (run == 0) {
+         return 0;
+     }
+     if (start == 0) {
+         start = run;
+     }
+     
+     uint16_t end = run + simple_os.free_run_len[run];
+     uint16_t taken = end - start < count ? end - start : count;
+     block_run_remove(run);
+     if (start > run) {
+         block_run_insert(run, start - run);
+     }
+     if (start + taken < end) {
+         block_run_insert(start + taken, end - start - taken);
+     }
+     block_mark(start, taken, true);
+     *allocated = taken;
+     return start;
+ }
+ 
+ // Add a run of blocks to the free-space index, merging it with free neighbours so runs stay maximal
+ void block_run_release(uint16_t start, uint16_t count) {
+     if (start > 1 && !block_taken(start - 1)) {
+         uint16_t left = simple_os.free_run_head[start - 1];
+         count += simple_os.free_run_len[left];
+         block_run_remove(left);
+         start = left;
+     }
+     if (start + count < NUM_BLOCKS && !block_taken(start + count)) {
+         uint16_t right = start + count;
+         count += simple_os.free_run_len[right];
+         block_run_remove(right);
+     }
+     block_run_insert(start, count);
+ }
+ 
+ // Stop using blocks; returns how many of them a snapshot still uses, which stay allocated
+ uint16_t block_free(uint16_t start, uint16_t count) {
+     if (start == 0 || count == 0) {
+         return 0;
+     }
+     block_mark(start, count, false);
+     uint16_t held = 0;
+     uint16_t end = start + count;
+     for (uint16_t b = start; b < end;) {
+         if (block_pinned(b)) {
+             held++;
+             b++;
+             continue;
+         }
+         uint16_t run = b;
+         while (b < end && !block_pinned(b)) {
+             b++;
+         }
+         block_run_release(run, b - run);
+     }
+     return held;
+ }
+ 
+ void block_read(uint16_t block, void* buffer) {
+     memcpy(buffer, simple_os.disk->blocks[block], BLOCK_SIZE);
+ }
+ 
+ // block_read and block_verify in one pass over the data
+ bool block_read_checked(uint16_t block, void* buffer) {
+     if (!simple_os.checksums_enabled) {
+         block_read(block, buffer);
+         return true;
+     }
+     return block_matches(block, crc32c_copy(0, buffer, simple_os.disk->blocks[block], BLOCK_SIZE));
+ }
+ 
+ // Start reading a block from the image file; returns the request, or -1 if the data is already in buffer
+ // and matches its checksum, or -2 if it is there but does not
+ int16_t block_read_async(uint16_t block, void* buffer) {
+ #if HAVE_MMAP
+     if (simple_os.disk_mapped) {
+         size_t offset = (uint8_t*)simple_os.disk->blocks[block] - (uint8_t*)simple_os.disk;
+         return io_submit(IO_READ, simple_os.disk_fd, buffer, BLOCK_SIZE, offset);
+     }
+ #endif
+     return block_read_checked(block, buffer) ? -1 : -2;
+ }
+ 
+ void block_write(uint16_t block, const void* buffer) {
+     uint8_t* target = simple_os.disk->blocks[block];
+ #if HAVE_MMAP
+     size_t offset = target - (uint8_t*)simple_os.disk;
+     if (simple_os.disk_mapped) {
+         io_fence(simple_os.disk_fd, offset, BLOCK_SIZE, true); // An earlier write may still be reading target
+     }
+ #endif
+     if (simple_os.checksums_enabled) {
+         simple_os.disk->block_crc[block] = crc32c_copy(0, target, buffer, BLOCK_SIZE);
+         journal_dirty(&simple_os.disk->block_crc[block], sizeof(uint32_t));
+     } else {
+         memcpy(target, buffer, BLOCK_SIZE);
+     }
+     simple_os.block_writes++;
+     if (block != simple_os.block_last_write + 1) {
+         simple_os.block_seeks++;
+     }
+     simple_os.block_last_write = block;
+     if (simple_os.disk_mapped) {
+ #if HAVE_MMAP
+         int16_t slot = io_submit(IO_WRITE, simple_os.disk_fd, target, BLOCK_SIZE, offset);
+         simple_os.io[slot].detached = true;
+ #else
+         disk_write_at(target, BLOCK_SIZE);
+ #endif
+     }
+ }
+ 
+ /* ======= INTEGRITY ======= */
+ 
+ /* Metadata is checksummed in records: BLOCK_SIZE pieces of the DiskImage
+  * metadata, and metadata pages. A commit refreshes the checksum of every
+  * record the transaction changed and logs the new checksums with it, so a
+  * record and its checksum reach the image together. Mounting checks the
+  * DiskImage metadata; metadata pages and data blocks are checked by the
+  * scrub, which walks the whole file system a batch at a time from the
+  * scheduler. Only images keep metadata checksums, since only they have a
+  * journal. A block rewritten in place reaches the image before the commit
+  * that logs its new checksum, so an unclean mount re-stamps blocks that do
+  * not match instead of reporting them. */
+ 
+ // Checksum of the metadata record holding byte offset of the image, and the record's extent
+ // Returns NULL for bytes that hold checksums themselves or are not metadata
+ uint32_t* checksum_record(size_t offset, size_t* start, size_t* len) {
+     size_t header = offsetof(DiskImage, meta_crc);
+     if (offset < header) {
+         *start = offset / BLOCK_SIZE * BLOCK_SIZE;
+         *len = header - *start < BLOCK_SIZE ? header - *start : BLOCK_SIZE;
+         return &simple_os.disk->meta_crc[offset / BLOCK_SIZE];
+     }
+     if (offset < META_PAGES_OFFSET) {
+         return NULL;
+     }
+     uint32_t page = (uint32_t)((offset - META_PAGES_OFFSET) / BLOCK_SIZE);
+     if (meta_is_checksum_page(page)) {
+         return NULL;
+     }
+     *start = META_PAGES_OFFSET + (size_t)page * BLOCK_SIZE;
+     *len = BLOCK_SIZE;
+     return meta_checksum(page);
+ }
+ 
+ // Image offset of metadata record number r: the DiskImage pieces, then the metadata pages
+ size_t checksum_record_offset(uint32_t r) {
+     if (r < META_HEADER_PIECES) {
+         return (size_t)r * BLOCK_SIZE;
+     }
+     return META_PAGES_OFFSET + (size_t)(r - META_HEADER_PIECES) * BLOCK_SIZE;
+ }
+ 
+ uint32_t checksum_compute(size_t start, size_t len) {
+     const uint8_t* record = (const uint8_t*)simple_os.disk + start;
+     if (start != 0) {
+         return crc32c(0, record, len);
+     }
+     // clean and journal_seq are written in place, not through the journal, so they are left out
+     uint8_t copy[BLOCK_SIZE];
+     memcpy(copy, record, len);
+     memset(copy + offsetof(DiskImage, clean), 0, offsetof(DiskImage, layout) - offsetof(DiskImage, clean));
+     return crc32c(0, copy, len);
+ }
+ 
+ // Bring the checksums of the records the running transaction changed up to date, adding them to it
+ void checksum_seal() {
+     uint32_t count = simple_os.journal_count; // The chunks added below hold checksums, which have none
+     uint32_t* last = NULL;
+     for (uint32_t i = 0; i < count; i++) {
+         size_t start, len;
+         uint32_t* crc = checksum_record((size_t)simple_os.journal_chunks[i] * JOURNAL_CHUNK, &start, &len);
+         if (crc == NULL || crc == last) {
+             continue; // A record's chunks are usually dirtied together
+         }
+         last = crc;
+         uint32_t value = checksum_compute(start, len);
+         if (*crc != value) {
+             *crc = value;
+             journal_dirty(crc, sizeof(uint32_t));
+         }
+     }
+ }
+ 
+ // Set every metadata checksum, for an image that is written out whole
+ void checksum_seal_all() {
+     for (uint32_t r = 0; r < META_HEADER_PIECES + simple_os.disk->meta_pages; r++) {
+         size_t start, len;
+         uint32_t* crc = checksum_record(checksum_record_offset(r), &start, &len);
+         if (crc != NULL) {
+             *crc = checksum_compute(start, len);
+         }
+     }
+ }
+ 
+ // Check metadata record r against its checksum, counting it if it does not match
+ // Records changed since the last commit are not checked; their checksums are not up to date yet
+ bool checksum_verify_record(uint32_t r) {
+     size_t start, len;
+     uint32_t* crc = checksum_record(checksum_record_offset(r), &start, &len);
+     if (crc == NULL || journal_pending(start, len) || checksum_compute(start, len) == *crc) {
+         return true;
+     }
+     simple_os.checksum_errors++;
+     if (r < META_HEADER_PIECES) {
+         snprintf(simple_os.checksum_last_error, sizeof(simple_os.checksum_last_error),
+                  "metadata bytes %zu-%zu", start, start + len - 1);
+     } else {
+         snprintf(simple_os.checksum_last_error, sizeof(simple_os.checksum_last_error), "metadata page %u",
+                  r - (uint32_t)META_HEADER_PIECES);
+     }
+     return false;
+ }
+ 
+ // Check the DiskImage metadata and metadata page 0; returns how many records are damaged
+ int checksum_verify_header() {
+     int damaged = 0;
+     for (uint32_t r = 0; r <= META_HEADER_PIECES; r++) {
+         damaged += !checksum_verify_record(r);
+     }
+     return damaged;
+ }
+ 
+ // Check data read from block against the checksum it was written with, counting it if it does not match
+ bool block_verify(uint16_t block, const void* data) {
+     return !simple_os.checksums_enabled || block_matches(block, crc32c(0, data, BLOCK_SIZE));
+ }
+ 
+ // Whether crc is the checksum block was written with, counting it if not
+ bool block_matches(uint16_t block, uint32_t crc) {
+     if (crc == simple_os.disk->block_crc[block]) {
+         return true;
+     }
+     simple_os.checksum_errors++;
+     snprintf(simple_os.checksum_last_error, sizeof(simple_os.checksum_last_error), "block %u", block);
+     return false;
+ }
+ 
+ // Whether a block holds file data, and so a checksum
+ bool block_live(uint16_t block) {
+     if (simple_os.disk->layout == FS_LAYOUT_LOG) {
+         return simple_os.disk->summary_file[block] >= 0;
+     }
+     return block != 0 && block_used(block);
+ }
+ 
+ // After a crash, take blocks that do not match their checksums as written; returns how many
+ int checksum_restamp() {
+     DiskImage* disk = simple_os.disk;
+     int count = 0;
+     for (uint16_t b = 1; b < NUM_BLOCKS; b++) {
+         if (!block_live(b)) {
+             continue;
+         }
+         uint32_t crc = crc32c(0, disk->blocks[b], BLOCK_SIZE);
+         if (crc != disk->block_crc[b]) {
+             disk->block_crc[b] = crc;
+             journal_dirty(&disk->block_crc[b], sizeof(uint32_t));
+             count++;
+         }
+     }
+     return count;
+ }
+ 
+ // Check the next count data blocks and metadata records of the scrub pass
+ // Returns false once the pass is complete
+ bool scrub_step(uint32_t count) {
+     DiskImage* disk = simple_os.disk;
+     for (uint32_t i = 0; i < count; i++) {
+         uint32_t item = simple_os.scrub_next++;
+         if (item < NUM_BLOCKS) {
+             if (block_live((uint16_t)item)) {
+                 simple_os.scrub_checked++;
+                 simple_os.scrub_errors += !block_verify((uint16_t)item, disk->blocks[item]);
+             }
+             continue;
+         }
+         uint32_t record = item - NUM_BLOCKS;
+         if (!simple_os.disk_mapped || record >= META_HEADER_PIECES + disk->meta_pages) {
+             simple_os.scrub_next = 0;
+             simple_os.scrub_passes++;
+             return false;
+         }
+         if (record < META_HEADER_PIECES || !meta_is_checksum_page(record - (uint32_t)META_HEADER_PIECES)) {
+             simple_os.scrub_checked++;
+             simple_os.scrub_errors += !checksum_verify_record(record);
+         }
+     }
+     return true;
+ }
+ 
+ // Background scrub from the scheduler
+ void scrub_tick() {
+     if (simple_os.scrub_running) {
+         simple_os.scrub_running = scrub_step(SCRUB_BATCH);
+     }
+ }
+ 
+ /* ======= LOG-STRUCTURED LAYOUT ======= */
+ 
+ /* In the log layout every block write, new or overwrite, is appended at
+  * lfs_head, so the device sees sequential writes no matter how files are
+  * updated. The inode map records where each file block currently lives, and
+  * the segment summary records which file block each log block was written
+  * for; a log block is live only while the inode map still points back at it.
+  * Segments whose blocks have all been superseded are free again. The cleaner
+  * makes more free segments by copying the live blocks of a victim segment to
+  * the head, choosing the victim with the best cost-benefit ratio
+  * (1 - u) * age / (1 + u) so that cold, mostly empty segments go first.
+  *
+  * A segment emptied since the last journal commit may still be referenced by
+  * the committed inode map, so it is not reused until the next commit. */
+ 
+ // Inode map of a file in the log layout
+ uint16_t* lfs_map(int32_t file) {
+     return (uint16_t*)meta_page(fs_entry(file)->map_page);
+ }
+ 
+ bool lfs_segment_free(int s) {
+     uint16_t head = simple_os.disk->lfs_head;
+     bool open = head % SEGMENT_BLOCKS != 0 && head / SEGMENT_BLOCKS == s;
+     // Segment 0 holds the reserved block 0 and is never part of the log
+     return s != 0 && !open && simple_os.disk->segment_live[s] == 0;
+ }
+ 
+ int lfs_free_segments() {
+     int count = 0;
+     for (int s = 1; s < NUM_SEGMENTS; s++) {
+         count += lfs_segment_free(s);
+     }
+     return count;
+ }
+ 
+ // Set up the log for a freshly formatted disk
+ void lfs_format() {
+     DiskImage* disk = simple_os.disk;
+     disk->lfs_head = 0;
+     disk->lfs_write_seq = 0;
+     memset(disk->segment_live, 0, sizeof(disk->segment_live));
+     memset(disk->segment_age, 0, sizeof(disk->segment_age));
+     for (int b = 0; b < NUM_BLOCKS; b++) {
+         disk->summary_file[b] = -1;
+     }
+     memset(simple_os.lfs_pending, 0, sizeof(simple_os.lfs_pending));
+     disk->free_blocks = (NUM_SEGMENTS - 1 - LFS_RESERVE_SEGMENTS) * SEGMENT_BLOCKS;
+ }
+ 
+ // Forget a log block that no longer holds current data
+ void lfs_kill(uint16_t block) {
+     if (block == 0) {
+         return;
+     }
+     DiskImage* disk = simple_os.disk;
+     int s = block / SEGMENT_BLOCKS;
+     disk->summary_file[block] = -1;
+     disk->segment_live[s]--;
+     if (disk->segment_live[s] == 0 && simple_os.disk_mapped) {
+         simple_os.lfs_pending[s] = true;
+     }
+     journal_dirty(&disk->summary_file[block], sizeof(int32_t));
+     journal_dirty(&disk->segment_live[s], sizeof(uint16_t));
+ }
+ 
+ // Move the head to the start of a free segment
+ void lfs_open_segment() {
+     for (int attempt = 0; attempt < 2; attempt++) {
+         for (int s = 1; s < NUM_SEGMENTS; s++) {
+             if (lfs_segment_free(s) && !simple_os.lfs_pending[s]) {
+                 simple_os.disk->lfs_head = (uint16_t)(s * SEGMENT_BLOCKS);
+                 journal_dirty(&simple_os.disk->lfs_head, sizeof(uint16_t));
+                 return;
+             }
+         }
+         // Every free segment is waiting for a commit; commit now
+         journal_commit();
+     }
+ }
+ 
+ // Append one block to the log as the new copy of block index of file
+ void lfs_append(int32_t file, uint16_t index, const void* data, uint32_t age) {
+     DiskImage* disk = simple_os.disk;
+     if (disk->lfs_head % SEGMENT_BLOCKS == 0) {
+         lfs_open_segment();
+     }
+     uint16_t block = disk->lfs_head++;
+     int s = block / SEGMENT_BLOCKS;
+     uint16_t* map = lfs_map(file);
+     block_write(block, data);
+     lfs_kill(map[index]);
+     map[index] = block;
+     disk->summary_file[block] = file;
+     disk->summary_index[block] = (uint8_t)index;
+     disk->segment_live[s]++;
+     if (age > disk->segment_age[s]) {
+         disk->segment_age[s] = age;
+     }
+     journal_dirty(&disk->lfs_head, sizeof(uint16_t));
+     journal_dirty(&map[index], sizeof(uint16_t));
+     journal_dirty(&disk->summary_file[block], sizeof(int32_t));
+     journal_dirty(&disk->summary_index[block], sizeof(uint8_t));
+     journal_dirty(&disk->segment_live[s], sizeof(uint16_t));
+     journal_dirty(&disk->segment_age[s], sizeof(uint32_t));
+ }
+ 
+ // Pick the segment to clean by cost-benefit; returns -1 if none would gain space
+ int lfs_pick_victim() {
+     DiskImage* disk = simple_os.disk;
+     uint16_t head = disk->lfs_head;
+     int victim = -1;
+     double best = 0;
+     for (int s = 1; s < NUM_SEGMENTS; s++) {
+         uint16_t live = disk->segment_live[s];
+         bool open = head % SEGMENT_BLOCKS != 0 && head / SEGMENT_BLOCKS == s;
+         if (open || live == 0 || live == SEGMENT_BLOCKS) {
+             continue;
+         }
+         double u = (double)live / SEGMENT_BLOCKS;
+         double age = (double)(disk->lfs_write_seq - disk->segment_age[s]) + 1;
+         double score = (1 - u) * age / (1 + u);
+         if (score > best) {
+             best = score;
+             victim = s;
+         }
+     }
+     return victim;
+ }
+ 
+ // Copy the live blocks of a segment to the head, leaving it free
+ void lfs_clean_segment(int s) {
+     DiskImage* disk = simple_os.disk;
+     uint8_t buffer[BLOCK_SIZE];
+     uint32_t age = disk->segment_age[s];
+     simple_os.lfs_cleaning = true;
+     for (uint16_t b = s * SEGMENT_BLOCKS; b < (s + 1) * SEGMENT_BLOCKS; b++) {
+         int32_t file = disk->summary_file[b];
+         if (file >= 0 && lfs_map(file)[disk->summary_index[b]] == b) {
+             block_read(b, buffer);
+             lfs_append(file, disk->summary_index[b], buffer, age);
+             simple_os.lfs_cleaned_blocks++;
+         }
+     }
+     simple_os.lfs_cleaning = false;
+     simple_os.lfs_cleaned_segments++;
+ }
+ 
+ // Clean until at least target segments are free or nothing more can be gained
+ void lfs_clean(int target) {
+     while (lfs_free_segments() < target) {
+         int victim = lfs_pick_victim();
+         if (victim < 0) {
+             return;
+         }
+         lfs_clean_segment(victim);
+     }
+ }
+ 
+ // Write back one file block through the log
+ void lfs_write(int32_t file, uint16_t index, const void* data) {
+     lfs_append(file, index, data, ++simple_os.disk->lfs_write_seq);
+     journal_dirty(&simple_os.disk->lfs_write_seq, sizeof(uint32_t));
+     if (!simple_os.lfs_cleaning && lfs_free_segments() < LFS_CLEAN_MIN) {
+         lfs_clean(LFS_CLEAN_MIN);
+     }
+ }
+ 
+ // Drop the blocks of a file from index first on
+ void lfs_release(int32_t file, uint16_t first, uint16_t count) {
+     uint16_t* map = lfs_map(file);
+     for (uint16_t i = first; i < first + count; i++) {
+         lfs_kill(map[i]);
+         map[i] = 0;
+     }
+     if (count > 0) {
+         journal_dirty(&map[first], count * sizeof(uint16_t));
+     }
+ }
+ 
+ // Background cleaning from the scheduler, one segment at a time
+ void lfs_tick() {
+     if (simple_os.disk->layout == FS_LAYOUT_LOG && lfs_free_segments() < LFS_CLEAN_LOW) {
+         int victim = lfs_pick_victim();
+         if (victim >= 0) {
+             lfs_clean_segment(victim);
+         }
+     }
+ }
+ 
+ /* ======= EXTENTS ======= */
+ 
+ /* In the in-place layout a file's blocks are described by a small extent
+  * tree: up to FS_INLINE_EXTENTS extents live in the FileEntry itself, and a
+  * file with more moves them all into one leaf of EXTENTS_PER_LEAF. Extents
+  * are sorted by logical block and always cover a prefix of the file, so a
+  * file that stays contiguous costs a single extent however large it is.
+  *
+  * Allocation is delayed: writes only reserve space, and blocks are chosen
+  * when the first dirty page of a file is written back. At that point the
+  * whole unallocated tail of the file is placed in one go, next to its last
+  * extent if possible, so files written a little at a time still end up
+  * contiguous. When a file cannot continue its last extent, the amount of
+  * data waiting decides where it goes: a few blocks are packed into the
+  * best-fitting free run, while ALLOC_SPREAD_BLOCKS or more start in the
+  * middle of the largest free run, leaving room to keep growing in place. */
+ 
+ // Number of blocks needed to hold size bytes
+ uint16_t fs_blocks_for(uint64_t size) {
+     return (uint16_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+ }
+ 
+ Extent* extent_list(FileEntry* file) {
+     if (file->extent_leaf != 0) {
+         return simple_os.disk->extent_leaves[file->extent_leaf - 1];
+     }
+     return file->extents;
+ }
+ 
+ // Blocks of the file that have been allocated; always a prefix
+ uint16_t extent_allocated(FileEntry* file) {
+     if (file->extent_count == 0) {
+         return 0;
+     }
+     Extent* last = &extent_list(file)[file->extent_count - 1];
+     return last->logical + last->length;
+ }
+ 
+ // Disk block holding block index of a file, or 0 if it has none yet
+ uint16_t extent_map(FileEntry* file, uint16_t index) {
+     Extent* list = extent_list(file);
+     int low = 0;
+     int high = file->extent_count - 1;
+     while (low <= high) {
+         int mid = (low + high) / 2;
+         if (index < list[mid].logical) {
+             high = mid - 1;
+         } else if (index >= list[mid].logical + list[mid].length) {
+             low = mid + 1;
+         } else {
+             return list[mid].start + (index - list[mid].logical);
+         }
+     }
+     return 0;
+ }
+ 
+ void extent_dirty(FileEntry* file) {
+     journal_dirty(file, sizeof(*file));
+     if (file->extent_leaf != 0) {
+         journal_dirty(simple_os.disk->extent_leaves[file->extent_leaf - 1], sizeof(Extent) * EXTENTS_PER_LEAF);
+     }
+ }
+ 
+ // Add blocks at the end of a file; fails if its extent tree is full
+ bool extent_append(FileEntry* file, uint16_t logical, uint16_t start, uint16_t length) {
+     Extent* list = extent_list(file);
+     if (file->extent_count > 0) {
+         Extent* last = &list[file->extent_count - 1];
+         if (last->start + last->length == start) {
+             last->length += length;
+             extent_dirty(file);
+             return true;
+         }
+     }
+     
+     if (file->extent_leaf == 0 && file->extent_count == FS_INLINE_EXTENTS) {
+         DiskImage* disk = simple_os.disk;
+         if (disk->free_leaf_count == 0) {
+             return false;
+         }
+         uint8_t leaf = disk->free_leaves[--disk->free_leaf_count];
+         memcpy(disk->extent_leaves[leaf], file->extents, sizeof(file->extents));
+         file->extent_leaf = leaf + 1;
+         list = disk->extent_leaves[leaf];
+         journal_dirty(&disk->free_leaf_count, sizeof(disk->free_leaf_count));
+     } else if (file->extent_count == (file->extent_leaf ? EXTENTS_PER_LEAF : FS_INLINE_EXTENTS)) {
+         return false;
+     }
+     list[file->extent_count].logical = logical;
+     list[file->extent_count].start = start;
+     list[file->extent_count].length = length;
+     file->extent_count++;
+     extent_dirty(file);
+     return true;
+ }
+ 
+ // Free the blocks of a file from block first on; returns how many a snapshot still holds
+ uint16_t extent_truncate(FileEntry* file, uint16_t first) {
+     Extent* list = extent_list(file);
+     uint16_t held = 0;
+     while (file->extent_count > 0) {
+         Extent* last = &list[file->extent_count - 1];
+         if (last->logical >= first) {
+             held += block_free(last->start, last->length);
+             file->extent_count--;
+         } else {
+             if (last->logical + last->length > first) {
+                 uint16_t keep = first - last->logical;
+                 held += block_free(last->start + keep, last->length - keep);
+                 last->length = keep;
+             }
+             break;
+         }
+     }
+     
+     // Move back into the FileEntry once the extents fit again
+     if (file->extent_leaf != 0 && file->extent_count <= FS_INLINE_EXTENTS) {
+         DiskImage* disk = simple_os.disk;
+         memcpy(file->extents, list, file->extent_count * sizeof(Extent));
+         disk->free_leaves[disk->free_leaf_count] = file->extent_leaf - 1;
+         journal_dirty(&disk->free_leaves[disk->free_leaf_count], sizeof(uint8_t));
+         disk->free_leaf_count++;
+         journal_dirty(&disk->free_leaf_count, sizeof(disk->free_leaf_count));
+         file->extent_leaf = 0;
+     }
+     extent_dirty(file);
+     return held;
+ }
+ 
+ // Allocate every block of the file that does not have one yet
+ bool extent_allocate(FileEntry* file) {
+     uint16_t next = extent_allocated(file);
+     uint16_t need = fs_blocks_for(file->size);
+     uint16_t goal = 0;
+     if (file->extent_count > 0) {
+         Extent* last = &extent_list(file)[file->extent_count - 1];
+         goal = last->start + last->length;
+     }
+     if ((goal == 0 || goal >= NUM_BLOCKS || block_taken(goal)) && need - next >= ALLOC_SPREAD_BLOCKS) {
+         uint16_t run = block_largest_run();
+         if (run != 0 && simple_os.free_run_len[run] >= 2 * (need - next)) {
+             goal = run + simple_os.free_run_len[run] / 2;
+         }
+     }
+     while (next < need) {
+         uint16_t got = 0;
+         uint16_t start = block_alloc(goal, need - next, &got);
+         if (start == 0) {
+             return false;
+         }
+         if (!extent_append(file, next, start, got)) {
+             block_free(start, got);
+             return false;
+         }
+         next += got;
+         goal = start + got;
+     }
+     return true;
+ }
+ 
+ /* ======= COMPRESSION ======= */
+ 
+ /* A compressed file in the in-place layout is stored in clusters of
+  * COMPRESS_CLUSTER_BLOCKS pages instead of extents. Its cluster map, one
+  * metadata page, records where each cluster lives, so any page can be found
+  * without reading the ones before it. A cluster is compressed as a whole when
+  * one of its pages is written back, and is kept raw if compression would not
+  * save a block. Reads decode the whole cluster into cluster_data, where the
+  * neighbouring pages are found when readahead or the next read asks for them.
+  *
+  * How well a cluster compresses is only known at writeback, so writes
+  * reserve space for every page of the clusters they touch and writeback
+  * returns what the compressed copy did not need. A cluster normally takes
+  * contiguous blocks; on a disk too fragmented for that it is scattered, with
+  * its block list in a header block as in ZFS gang blocks.
+  *
+  * The codec is a small LZ77 in the LZ4 sequence format: a token holding
+  * literal and match lengths, the literals, then a 16-bit match offset. A
+  * single hash table of recent positions finds matches, and runs without one
+  * are skipped over faster the longer they get. */
+ 
+ // Append one sequence; returns false if it does not fit in limit bytes
+ bool lz_emit(uint8_t* out, uint32_t* used, uint32_t limit, const uint8_t* literals, uint32_t count,
+              uint32_t offset, uint32_t length) {
+     if (*used + 1 + count + count / 255 + 1 + 2 + length / 255 + 1 > limit) {
+         return false;
+     }
+     uint8_t* p = out + *used;
+     uint32_t extra = length > 0 ? length - LZ_MIN_MATCH : 0;
+     *p++ = (uint8_t)((count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15));
+     if (count >= 15) {
+         uint32_t n = count - 15;
+         for (; n >= 255; n -= 255) {
+             *p++ = 255;
+         }
+         *p++ = (uint8_t)n;
+     }
+     if (count <= 16 && count + length >= 16 && limit - (uint32_t)(p - out) >= 16) {
+         memcpy(p, literals, 16); // The match follows the literals in the input, so 16 bytes are there
+     } else {
+         memcpy(p, literals, count);
+     }
+     p += count;
+     if (length > 0) {
+         *p++ = (uint8_t)offset;
+         *p++ = (uint8_t)(offset >> 8);
+         if (extra >= 15) {
+             uint32_t n = extra - 15;
+             for (; n >= 255; n -= 255) {
+                 *p++ = 255;
+             }
+             *p++ = (uint8_t)n;
+         }
+     }
+     *used = (uint32_t)(p - out);
+     return true;
+ }
+ 
+ // Compress len bytes, less than 64KB; returns the compressed size, or 0 if it does not fit in limit bytes
+ uint32_t lz_compress(const uint8_t* in, uint32_t len, uint8_t* out, uint32_t limit) {
+     uint16_t* table = simple_os.lz_table;
+     memset(table, 0, sizeof(simple_os.lz_table));
+     uint32_t used = 0;
+     uint32_t anchor = 0;
+     uint32_t pos = 0;
+     while (pos + LZ_MIN_MATCH <= len) {
+         uint32_t word;
+         memcpy(&word, in + pos, sizeof(word));
+         uint32_t slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+         uint32_t candidate = table[slot];
+         table[slot] = (uint16_t)(pos + 1);
+         if (candidate == 0 || memcmp(in + candidate - 1, &word, sizeof(word)) != 0) {
+             pos += 1 + ((pos - anchor) >> 5);
+             continue;
+         }
+         uint32_t match = candidate - 1;
+         uint32_t length = LZ_MIN_MATCH;
+         while (pos + length + 8 <= len) {
+             uint64_t a;
+             uint64_t b;
+             memcpy(&a, in + match + length, sizeof(a));
+             memcpy(&b, in + pos + length, sizeof(b));
+             if (a != b) {
+                 break;
+             }
+             length += 8;
+         }
+         while (pos + length < len && in[match + length] == in[pos + length]) {
+             length++;
+         }
+         if (!lz_emit(out, &used, limit, in + anchor, pos - anchor, pos - match, length)) {
+             return 0;
+         }
+         pos += length;
+         anchor = pos;
+     }
+     if (!lz_emit(out, &used, limit, in + anchor, len - anchor, 0, 0)) {
+         return 0;
+     }
+     return used;
+ }
+ 
+ // Read a sequence length extension; returns false at the end of the input
+ bool lz_length(const uint8_t* in, uint32_t len, uint32_t* i, uint32_t* length) {
+     uint8_t byte;
+     do {
+         if (*i >= len) {
+             return false;
+         }
+         byte = in[(*i)++];
+         *length += byte;
+     } while (byte == 255);
+     return true;
+ }
+ 
+ // Decompress into at most limit bytes; returns the bytes produced, or -1 if the input is corrupt
+ int32_t lz_decompress(const uint8_t* in, uint32_t len, uint8_t* out, uint32_t limit) {
+     uint32_t i = 0;
+     uint32_t o = 0;
+     while (i < len) {
+         uint8_t token = in[i++];
+         uint32_t count = token >> 4;
+         if (count == 15 && !lz_length(in, len, &i, &count)) {
+             return -1;
+         }
+         if (count > len - i || count > limit - o) {
+             return -1;
+         }
+         if (count <= 16 && len - i >= 16 && limit - o >= 16) {
+             memcpy(out + o, in + i, 16); // A fixed-size copy is a couple of moves; the excess is overwritten
+         } else {
+             memcpy(out + o, in + i, count);
+         }
+         i += count;
+         o += count;
+         if (i == len) {
+             break; // The last sequence has no match
+         }
+         if (len - i < 2) {
+             return -1;
+         }
+         uint32_t offset = in[i] | (uint32_t)in[i + 1] << 8;
+         i += 2;
+         uint32_t length = token & 15;
+         if (length == 15 && !lz_length(in, len, &i, &length)) {
+             return -1;
+         }
+         length += LZ_MIN_MATCH;
+         if (offset == 0 || offset > o || length > limit - o) {
+             return -1;
+         }
+         if (offset >= 8 && limit - o >= length + 8) {
+             for (uint32_t k = 0; k < length; k += 8) {
+                 memcpy(out + o + k, out + o + k - offset, 8);
+             }
+         } else if (offset >= length) {
+             memcpy(out + o, out + o - offset, length);
+         } else {
+             for (uint32_t k = 0; k < length; k++) {
+                 out[o + k] = out[o + k - offset]; // Overlapping matches repeat a pattern
+             }
+         }
+         o += length;
+     }
+     return (int32_t)o;
+ }
+ 
+ Cluster* cluster_map(FileEntry* file) {
+     return (Cluster*)meta_page(file->map_page);
+ }
+ 
+ // Pages of cluster c within a file of size bytes
+ uint16_t cluster_pages(uint64_t size, uint16_t c) {
+     uint16_t pages = fs_blocks_for(size);
+     uint16_t first = c * COMPRESS_CLUSTER_BLOCKS;
+     if (pages <= first) {
+         return 0;
+     }
+     return pages - first < COMPRESS_CLUSTER_BLOCKS ? pages - first : COMPRESS_CLUSTER_BLOCKS;
+ }
+ 
+ // Blocks a cluster of pages pages may take when stored: uncompressed data scattered over the
+ // disk needs one more block to list the others
+ uint16_t cluster_charge(uint16_t pages) {
+     return pages > 1 ? pages + 1 : pages;
+ }
+ 
+ // Blocks holding a stored cluster's data, in order; returns how many
+ uint16_t cluster_blocks(const Cluster* cluster, uint16_t* list) {
+     if (cluster->start == 0) {
+         return 0;
+     }
+     uint16_t count = cluster->blocks;
+     if (cluster->gang) {
+         count--;
+         memcpy(list, simple_os.disk->blocks[cluster->start], count * sizeof(uint16_t));
+     } else {
+         for (uint16_t i = 0; i < count; i++) {
+             list[i] = cluster->start + i;
+         }
+     }
+     return count;
+ }
+ 
+ // Free a cluster's blocks, leaving it describing nothing; returns how many a snapshot still holds
+ uint16_t cluster_free(Cluster* cluster) {
+     uint16_t held = 0;
+     if (cluster->gang) {
+         uint16_t list[COMPRESS_CLUSTER_BLOCKS];
+         uint16_t count = cluster_blocks(cluster, list);
+         for (uint16_t i = 0; i < count; i++) {
+             held += block_free(list[i], 1);
+         }
+         held += block_free(cluster->start, 1);
+     } else {
+         held += block_free(cluster->start, cluster->blocks);
+     }
+     cluster->start = 0;
+     cluster->blocks = 0;
+     cluster->raw = 0;
+     cluster->gang = 0;
+     return held;
+ }
+ 
+ // Blocks of a cluster's stored copy that a snapshot uses; rewriting the cluster cannot reuse them
+ uint16_t cluster_pinned(const Cluster* cluster) {
+     uint16_t list[COMPRESS_CLUSTER_BLOCKS];
+     uint16_t count = cluster_blocks(cluster, list);
+     uint16_t pinned = cluster->gang && block_pinned(cluster->start);
+     for (uint16_t i = 0; i < count; i++) {
+         pinned += block_pinned(list[i]);
+     }
+     return pinned;
+ }
+ 
+ // Make cluster_data hold cluster c of a compressed file; unstored pages read as zeros
+ // Returns false if a block of the cluster failed its checksum, leaving it all zeros
+ bool cluster_load(int32_t id, uint16_t c) {
+     if (simple_os.cluster_file == id && simple_os.cluster_index == c) {
+         return true;
+     }
+     Cluster* cluster = &cluster_map(fs_entry(id))[c];
+     uint8_t* data = simple_os.cluster_data;
+     uint16_t list[COMPRESS_CLUSTER_BLOCKS];
+     if (cluster->gang && !block_verify(cluster->start, simple_os.disk->blocks[cluster->start])) {
+         memset(data, 0, COMPRESS_CLUSTER_SIZE);
+         simple_os.cluster_file = -1;
+         return false;
+     }
+     uint16_t count = cluster_blocks(cluster, list);
+     uint8_t* target = cluster->raw ? data : simple_os.cluster_packed;
+     for (uint16_t i = 0; i < count; i++) {
+         if (!block_read_checked(list[i], target + i * BLOCK_SIZE)) {
+             memset(data, 0, COMPRESS_CLUSTER_SIZE);
+             simple_os.cluster_file = -1; // Read again, and fail again, on the next use
+             return false;
+         }
+     }
+     int32_t produced = count * BLOCK_SIZE;
+     if (!cluster->raw && count > 0) {
+         uint16_t len;
+         memcpy(&len, target, sizeof(len));
+         produced = len <= count * BLOCK_SIZE - sizeof(len)
+                  ? lz_decompress(target + sizeof(len), len, data, COMPRESS_CLUSTER_SIZE) : -1;
+         if (produced < 0) {
+             produced = 0; // A corrupt cluster reads back as zeros
+         }
+     }
+     memset(data + produced, 0, COMPRESS_CLUSTER_SIZE - produced);
+     simple_os.cluster_file = id;
+     simple_os.cluster_index = c;
+     return true;
+ }
+ 
+ // Store the first pages of cluster_data as cluster c of file id, replacing the stored copy
+ // Returns false if no blocks could be found, in which case the cluster is lost
+ bool cluster_store(int32_t id, uint16_t c, uint16_t pages) {
+     DiskImage* disk = simple_os.disk;
+     Cluster* cluster = &cluster_map(fs_entry(id))[c];
+     uint8_t* data = simple_os.cluster_data;
+     uint8_t* packed = simple_os.cluster_packed;
+     uint32_t size = pages * BLOCK_SIZE;
+     memset(data + size, 0, COMPRESS_CLUSTER_SIZE - size); // As cluster_load would leave it
+     simple_os.cluster_file = id;
+     simple_os.cluster_index = c;
+     
+     // Compression has to save at least a block, length prefix included
+     uint16_t len = 0;
+     if (pages > 1) {
+         len = (uint16_t)lz_compress(data, size, packed + sizeof(len), size - BLOCK_SIZE - sizeof(len));
+     }
+     uint16_t count = pages;
+     const uint8_t* source = data;
+     if (len > 0) {
+         memcpy(packed, &len, sizeof(len));
+         count = fs_blocks_for(len + sizeof(len));
+         memset(packed + sizeof(len) + len, 0, count * BLOCK_SIZE - sizeof(len) - len);
+         source = packed;
+     }
+     
+     // The old copy is freed first so the new one can take its place, unless a snapshot holds it
+     uint16_t goal = cluster->start;
+     cluster->charged -= cluster_free(cluster);
+     uint16_t list[COMPRESS_CLUSTER_BLOCKS + 1];
+     uint16_t total = count;
+     uint16_t have = 0;
+     while (have < total) {
+         uint16_t got = 0;
+         uint16_t start = block_alloc(goal, total - have, &got);
+         if (start == 0) {
+             break;
+         }
+         if (got < total - have && total == count) {
+             total++; // Scattered; one more block lists the others
+         }
+         for (uint16_t i = 0; i < got; i++) {
+             list[have++] = start + i;
+         }
+         goal = start + got;
+     }
+     if (have < total || total > cluster->charged + disk->free_blocks) {
+         for (uint16_t i = 0; i < have; i++) {
+             block_free(list[i], 1);
+         }
+         journal_dirty(cluster, sizeof(*cluster));
+         simple_os.cluster_file = -1;
+         return false;
+     }
+     for (uint16_t i = 0; i < count; i++) {
+         block_write(list[i], source + i * BLOCK_SIZE);
+     }
+     if (total > count) {
+         uint16_t header[BLOCK_SIZE / sizeof(uint16_t)] = { 0 };
+         memcpy(header, list, count * sizeof(uint16_t));
+         block_write(list[count], header);
+     }
+     
+     cluster->start = total > count ? list[count] : list[0];
+     cluster->blocks = total;
+     cluster->raw = len == 0;
+     cluster->gang = total > count;
+     disk->free_blocks += cluster->charged - total;
+     cluster->charged = (uint8_t)total;
+     journal_dirty(cluster, sizeof(*cluster));
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     simple_os.compress_bytes_in += size;
+     simple_os.compress_bytes_out += total * BLOCK_SIZE;
+     return true;
+ }
+ 
+ // Reserve space for a compressed file to grow to size bytes with data written from offset on:
+ // every cluster written is charged for all of its pages and a gang header until it is written
+ // back, plus the blocks of its stored copy that a snapshot keeps
+ bool cluster_reserve(FileEntry* file, uint64_t offset, uint64_t size) {
+     uint64_t end = size > file->size ? size : file->size;
+     if (offset > file->size) {
+         offset = file->size; // The gap up to offset is written with zeros
+     }
+     if (size <= offset) {
+         return true;
+     }
+     Cluster* map = cluster_map(file);
+     uint16_t first = (uint16_t)(offset / COMPRESS_CLUSTER_SIZE);
+     uint16_t last = (uint16_t)((size - 1) / COMPRESS_CLUSTER_SIZE);
+     uint32_t need = 0;
+     for (uint16_t c = first; c <= last; c++) {
+         uint16_t charge = cluster_charge(cluster_pages(end, c)) + cluster_pinned(&map[c]);
+         if (charge > map[c].charged) {
+             need += charge - map[c].charged;
+         }
+     }
+     if (need > simple_os.disk->free_blocks) {
+         return false;
+     }
+     for (uint16_t c = first; c <= last; c++) {
+         uint16_t charge = cluster_charge(cluster_pages(end, c)) + cluster_pinned(&map[c]);
+         if (charge > map[c].charged) {
+             map[c].charged = (uint8_t)charge;
+         }
+     }
+     simple_os.disk->free_blocks -= need;
+     journal_dirty(&map[first], (last - first + 1) * sizeof(Cluster));
+     journal_dirty(&simple_os.disk->free_blocks, sizeof(simple_os.disk->free_blocks));
+     return true;
+ }
+ 
+ // Give back the clusters of a compressed file of have blocks from block first on. The cluster
+ // holding first keeps its stored copy until it is next written back.
+ void cluster_release(FileEntry* file, int32_t id, uint16_t first, uint16_t have) {
+     DiskImage* disk = simple_os.disk;
+     Cluster* map = cluster_map(file);
+     for (uint16_t c = first / COMPRESS_CLUSTER_BLOCKS; c * COMPRESS_CLUSTER_BLOCKS < have; c++) {
+         Cluster* cluster = &map[c];
+         uint16_t keep = first > c * COMPRESS_CLUSTER_BLOCKS ? first - c * COMPRESS_CLUSTER_BLOCKS : 0;
+         uint8_t charged = cluster->charged;
+         uint16_t held = 0;
+         if (keep == 0) {
+             held = cluster_free(cluster);
+             cluster->charged = 0;
+         } else if (charged > keep) {
+             uint16_t need = cluster_charge(keep);
+             uint16_t floor = (need > cluster->blocks ? need : cluster->blocks) + cluster_pinned(cluster);
+             cluster->charged = (uint8_t)(floor < charged ? floor : charged);
+         }
+         disk->free_blocks += charged - cluster->charged - held;
+         journal_dirty(cluster, sizeof(*cluster));
+     }
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     if (simple_os.cluster_file == id) {
+         simple_os.cluster_file = -1;
+     }
+ }
+ 
+ /* ======= DEDUPLICATION ======= */
+ 
+ /* A deduplicated file finds its blocks through a block map instead of
+  * extents: its map page lists up to DEDUP_MAP_LEAVES pages of block
+  * numbers, added as the file grows. When a page is written back its
+  * fingerprint is looked up in an index of every deduplicated block, and a
+  * block holding the same bytes is shared instead of writing another one.
+  * Fingerprints are a fast non-cryptographic hash, so a match is confirmed by
+  * comparing the data, as ZFS does with dedup=verify. block_refs counts the
+  * map entries pointing at each block; a shared block is never written in
+  * place, so changing a page that shares it copies it to a new block.
+  *
+  * A write reserves one block for each page it touches, marked DEDUP_RESERVED
+  * in the map, because whether the page finds a duplicate or needs a new block
+  * is only known at writeback. Writeback gives the reservation back if it is
+  * not used. The index lives only in memory and is rebuilt on attach from the
+  * blocks that have references. */
+ 
+ uint64_t dedup_hash(const uint8_t* data) {
+     uint64_t hash = 0x9E3779B97F4A7C15ull;
+     for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+         uint64_t word;
+         memcpy(&word, data + i, sizeof(word));
+         hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+         hash ^= hash >> 32;
+     }
+     return hash;
+ }
+ 
+ uint32_t dedup_slot(uint64_t print) {
+     return (uint32_t)(print >> 40) & (DEDUP_INDEX_SIZE - 1);
+ }
+ 
+ void dedup_index_insert(uint16_t block, uint64_t print) {
+     uint32_t slot = dedup_slot(print);
+     while (simple_os.dedup_index[slot] != 0) {
+         slot = (slot + 1) & (DEDUP_INDEX_SIZE - 1);
+     }
+     simple_os.dedup_index[slot] = block;
+     simple_os.dedup_prints[block] = print;
+ }
+ 
+ // Remove a block from the index, moving later entries of its probe run back into the gap
+ void dedup_index_remove(uint16_t block) {
+     uint32_t slot = dedup_slot(simple_os.dedup_prints[block]);
+     while (simple_os.dedup_index[slot] != block) {
+         if (simple_os.dedup_index[slot] == 0) {
+             return; // Shared by a clone and never fingerprinted
+         }
+         slot = (slot + 1) & (DEDUP_INDEX_SIZE - 1);
+     }
+     uint32_t gap = slot;
+     for (;;) {
+         slot = (slot + 1) & (DEDUP_INDEX_SIZE - 1);
+         uint16_t next = simple_os.dedup_index[slot];
+         if (next == 0) {
+             break;
+         }
+         uint32_t home = dedup_slot(simple_os.dedup_prints[next]);
+         if (((slot - home) & (DEDUP_INDEX_SIZE - 1)) >= ((slot - gap) & (DEDUP_INDEX_SIZE - 1))) {
+             simple_os.dedup_index[gap] = next;
+             gap = slot;
+         }
+     }
+     simple_os.dedup_index[gap] = 0;
+ }
+ 
+ // Block holding the same bytes as data that can take another reference, or 0
+ uint16_t dedup_find(uint64_t print, const uint8_t* data) {
+     DiskImage* disk = simple_os.disk;
+     for (uint32_t slot = dedup_slot(print); simple_os.dedup_index[slot] != 0; slot = (slot + 1) & (DEDUP_INDEX_SIZE - 1)) {
+         uint16_t block = simple_os.dedup_index[slot];
+         if (simple_os.dedup_prints[block] == print && disk->block_refs[block] < UINT16_MAX &&
+             memcmp(disk->blocks[block], data, BLOCK_SIZE) == 0) {
+             return block;
+         }
+     }
+     return 0;
+ }
+ 
+ void dedup_index_build() {
+     memset(simple_os.dedup_index, 0, sizeof(simple_os.dedup_index));
+     for (uint16_t b = 1; b < NUM_BLOCKS; b++) {
+         if (simple_os.disk->block_refs[b] > 0) {
+             dedup_index_insert(b, dedup_hash(simple_os.disk->blocks[b]));
+         }
+     }
+ }
+ 
+ // Block map entry of page index of a deduplicated file, NULL if no map page covers it yet
+ uint16_t* dedup_entry(FileEntry* file, uint16_t index) {
+     uint32_t* leaves = (uint32_t*)meta_page(file->map_page);
+     uint32_t leaf = leaves[index / DEDUP_MAP_ENTRIES];
+     if (leaf == 0) {
+         return NULL;
+     }
+     return (uint16_t*)meta_page(leaf) + index % DEDUP_MAP_ENTRIES;
+ }
+ 
+ // Disk block holding page index of a deduplicated file, or 0 if it has none
+ uint16_t dedup_block(FileEntry* file, uint16_t index) {
+     uint16_t* entry = dedup_entry(file, index);
+     return entry ? *entry & (DEDUP_RESERVED - 1) : 0;
+ }
+ 
+ // Drop a reference to a block, freeing it with the last one
+ void dedup_unref(uint16_t block) {
+     DiskImage* disk = simple_os.disk;
+     if (block == 0) {
+         return;
+     }
+     disk->block_refs[block]--;
+     journal_dirty(&disk->block_refs[block], sizeof(uint16_t));
+     if (disk->block_refs[block] == 0) {
+         dedup_index_remove(block);
+         if (block_free(block, 1) == 0) {
+             disk->free_blocks++;
+             journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+         }
+     }
+ }
+ 
+ // Reserve a block for every page of a deduplicated file written from offset on as it grows to size
+ // bytes, adding map pages as needed; the caller has reserved DEDUP_MAP_LEAVES metadata pages
+ bool dedup_reserve(FileEntry* file, uint64_t offset, uint64_t size) {
+     DiskImage* disk = simple_os.disk;
+     if (offset > file->size) {
+         offset = file->size; // The gap up to offset is written with zeros
+     }
+     if (size <= offset) {
+         return true;
+     }
+     uint16_t first = (uint16_t)(offset / BLOCK_SIZE);
+     uint16_t last = (uint16_t)((size - 1) / BLOCK_SIZE);
+     uint32_t need = 0;
+     for (uint32_t i = first; i <= last; i++) {
+         uint16_t* entry = dedup_entry(file, (uint16_t)i);
+         if (!entry || !(*entry & DEDUP_RESERVED)) {
+             need++;
+         }
+     }
+     if (need > disk->free_blocks) {
+         return false;
+     }
+     
+     uint32_t* leaves = (uint32_t*)meta_page(file->map_page);
+     for (uint32_t l = first / DEDUP_MAP_ENTRIES; l <= last / DEDUP_MAP_ENTRIES; l++) {
+         if (leaves[l] == 0) {
+             leaves[l] = meta_alloc();
+             journal_dirty(&leaves[l], sizeof(uint32_t));
+         }
+     }
+     for (uint32_t i = first; i <= last; i++) {
+         uint16_t* entry = dedup_entry(file, (uint16_t)i);
+         *entry |= DEDUP_RESERVED;
+         journal_dirty(entry, sizeof(uint16_t));
+     }
+     disk->free_blocks -= need;
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     return true;
+ }
+ 
+ // Write back page index of a deduplicated file, sharing a block that already holds the data
+ // Returns false if a new block was needed and none is free
+ bool dedup_write(FileEntry* file, uint16_t index, const uint8_t* data) {
+     DiskImage* disk = simple_os.disk;
+     uint16_t* entry = dedup_entry(file, index);
+     uint16_t old = *entry & (DEDUP_RESERVED - 1);
+     if (*entry & DEDUP_RESERVED) {
+         disk->free_blocks++; // Given back here and taken again if a new block is needed
+     }
+     *entry = old;
+     journal_dirty(entry, sizeof(uint16_t));
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     
+     uint64_t print = dedup_hash(data);
+     uint16_t block = dedup_find(print, data);
+     if (block != 0) {
+         simple_os.dedup_hits++;
+         if (block == old) {
+             return true; // Unchanged
+         }
+         disk->block_refs[block]++;
+     } else if (old != 0 && disk->block_refs[old] == 1 && !block_pinned(old)) {
+         // Nobody else sees the old block, so it can be overwritten
+         simple_os.dedup_misses++;
+         dedup_index_remove(old);
+         block_write(old, data);
+         dedup_index_insert(old, print);
+         return true;
+     } else {
+         simple_os.dedup_misses++;
+         uint16_t before = index > 0 ? dedup_block(file, index - 1) : 0;
+         uint16_t got = 0;
+         block = disk->free_blocks > 0 ? block_alloc(before ? before + 1 : 0, 1, &got) : 0;
+         if (block == 0) {
+             return false;
+         }
+         disk->free_blocks--;
+         block_write(block, data);
+         disk->block_refs[block] = 1;
+         dedup_index_insert(block, print);
+     }
+     journal_dirty(&disk->block_refs[block], sizeof(uint16_t));
+     dedup_unref(old);
+     *entry = block;
+     return true;
+ }
+ 
+ // Give back the blocks and map pages of a deduplicated file of have blocks from block first on
+ void dedup_release(FileEntry* file, uint16_t first, uint16_t have) {
+     DiskImage* disk = simple_os.disk;
+     for (uint16_t i = first; i < have; i++) {
+         uint16_t* entry = dedup_entry(file, i);
+         if (!entry) {
+             continue;
+         }
+         if (*entry & DEDUP_RESERVED) {
+             disk->free_blocks++;
+         }
+         dedup_unref(*entry & (DEDUP_RESERVED - 1));
+         *entry = 0;
+         journal_dirty(entry, sizeof(uint16_t));
+     }
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     
+     // Map pages wholly past the end go back
+     uint32_t* leaves = (uint32_t*)meta_page(file->map_page);
+     for (uint32_t l = (first + DEDUP_MAP_ENTRIES - 1) / DEDUP_MAP_ENTRIES; l < DEDUP_MAP_LEAVES; l++) {
+         if (leaves[l] != 0) {
+             meta_release(leaves[l]);
+             leaves[l] = 0;
+             journal_dirty(&leaves[l], sizeof(uint32_t));
+         }
+     }
+ }
+ 
+ // Move an extent file's blocks into a block map, so they can be shared and are copied when written.
+ // Each keeps its one reference and stays out of the index, and pages with no block yet keep their
+ // reservation. The caller has reserved DEDUP_MAP_LEAVES + 1 metadata pages.
+ void dedup_convert(FileEntry* file) {
+     DiskImage* disk = simple_os.disk;
+     uint16_t have = fs_blocks_for(file->size);
+     file->map_page = meta_alloc();
+     uint32_t* leaves = (uint32_t*)meta_page(file->map_page);
+     for (uint32_t l = 0; l < (have + DEDUP_MAP_ENTRIES - 1) / DEDUP_MAP_ENTRIES; l++) {
+         leaves[l] = meta_alloc();
+         journal_dirty(&leaves[l], sizeof(uint32_t));
+     }
+     
+     Extent* list = extent_list(file);
+     for (uint8_t e = 0; e < file->extent_count; e++) {
+         for (uint16_t i = 0; i < list[e].length; i++) {
+             uint16_t block = list[e].start + i;
+             *dedup_entry(file, list[e].logical + i) = block;
+             disk->block_refs[block] = 1;
+             journal_dirty(&disk->block_refs[block], sizeof(uint16_t));
+         }
+     }
+     for (uint16_t i = extent_allocated(file); i < have; i++) {
+         *dedup_entry(file, i) = DEDUP_RESERVED;
+     }
+     
+     if (file->extent_leaf != 0) {
+         disk->free_leaves[disk->free_leaf_count] = file->extent_leaf - 1;
+         journal_dirty(&disk->free_leaves[disk->free_leaf_count], sizeof(uint8_t));
+         disk->free_leaf_count++;
+         journal_dirty(&disk->free_leaf_count, sizeof(disk->free_leaf_count));
+     }
+     file->extent_count = 0;
+     file->extent_leaf = 0;
+     memset(file->extents, 0, sizeof(file->extents));
+     file->is_deduped = true;
+     journal_dirty(file, sizeof(*file));
+ }
+ 
+ // Drop blocks nothing refers to from the index after a snapshot is restored; the blocks it brings
+ // back stay out of it, like converted ones, until the index is next built
+ void dedup_index_prune() {
+     for (uint16_t b = 1; b < NUM_BLOCKS; b++) {
+         if (simple_os.disk->block_refs[b] == 0) {
+             dedup_index_remove(b);
+         }
+     }
+ }
+ 
+ /* ======= PAGE CACHE ======= */
+ 
+ /* File data is read and written through a cache of block-sized pages keyed
+  * by (file, page number). Replacement follows 2Q: a page seen for the first
+  * time goes to the A1in FIFO, and only a page that is missed again shortly
+  * after leaving A1in (its key is still in the ghost table) is promoted to
+  * the Am LRU, so one large scan cannot flush the hot set. Writes only dirty
+  * pages. The scheduler runs a background flusher once more than
+  * dirty_background_ratio percent of the cache is dirty, and writers flush
+  * synchronously above dirty_ratio.
+  *
+  * Before a read, cache_readahead() checks it against per-file state in the style
+  * of Linux's on-demand readahead. A miss that continues the previous read
+  * opens a window past the request, and a marker page at the start of the
+  * window's unread part starts the next window, twice as large, while the
+  * reader still has pages in hand. A miss anywhere else collapses the
+  * window.
+  *
+  * Pages of a mounted image are filled by asynchronous reads. Until its read
+  * completes a page is pinned: it is never evicted, and cache_get sleeps on
+  * it. */
+ 
+ uint64_t cache_key(int32_t file, uint16_t index) {
+     return ((uint64_t)(uint32_t)file << 16 | index) + 1; // Never 0
+ }
+ 
+ uint32_t cache_bucket(uint64_t key, uint32_t size) {
+     return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (size - 1);
+ }
+ 
+ void cache_unlink(int16_t i) {
+     CachePage* page = &simple_os.cache[i];
+     if (page->prev >= 0) {
+         simple_os.cache[page->prev].next = page->next;
+     } else {
+         simple_os.cache_head[page->list] = page->next;
+     }
+     if (page->next >= 0) {
+         simple_os.cache[page->next].prev = page->prev;
+     } else {
+         simple_os.cache_tail[page->list] = page->prev;
+     }
+     simple_os.cache_len[page->list]--;
+ }
+ 
+ // Put a page at the most recently used end of a list
+ void cache_push(int16_t i, uint8_t list) {
+     CachePage* page = &simple_os.cache[i];
+     page->list = list;
+     page->prev = -1;
+     page->next = simple_os.cache_head[list];
+     if (page->next >= 0) {
+         simple_os.cache[page->next].prev = i;
+     } else {
+         simple_os.cache_tail[list] = i;
+     }
+     simple_os.cache_head[list] = i;
+     simple_os.cache_len[list]++;
+ }
+ 
+ // Initialize the page cache
+ void cache_init() {
+     io_drain(); // Reads in flight target pages that are about to be reset
+     for (int i = 0; i < CACHE_LISTS; i++) {
+         simple_os.cache_head[i] = -1;
+         simple_os.cache_tail[i] = -1;
+         simple_os.cache_len[i] = 0;
+     }
+     for (int i = 0; i < CACHE_HASH_SIZE; i++) {
+         simple_os.cache_hash[i] = -1;
+     }
+     memset(simple_os.cache_ghosts, 0, sizeof(simple_os.cache_ghosts));
+     for (int i = 0; i < CACHE_PAGES; i++) {
+         simple_os.cache[i].file = -1;
+         simple_os.cache[i].dirty = false;
+         simple_os.cache[i].readahead = false;
+         simple_os.cache[i].io = -1;
+         cache_push(i, CACHE_FREE);
+     }
+     memset(simple_os.readahead, 0, sizeof(simple_os.readahead));
+     for (int i = 0; i < READAHEAD_FILES; i++) {
+         simple_os.readahead[i].file = -1;
+     }
+     simple_os.cache_dirty = 0;
+     simple_os.cache_flush_hand = 0;
+     simple_os.dirty_background_ratio = 10;
+     simple_os.dirty_ratio = 40;
+     simple_os.readahead_max = READAHEAD_MAX_PAGES;
+ }
+ 
+ // Find a cached page; returns its slot or -1
+ int16_t cache_find(int32_t file, uint16_t index) {
+     int16_t i = simple_os.cache_hash[cache_bucket(cache_key(file, index), CACHE_HASH_SIZE)];
+     while (i >= 0 && (simple_os.cache[i].file != file || simple_os.cache[i].index != index)) {
+         i = simple_os.cache[i].hash_next;
+     }
+     return i;
+ }
+ 
+ void cache_hash_remove(int16_t i) {
+     CachePage* page = &simple_os.cache[i];
+     int16_t* link = &simple_os.cache_hash[cache_bucket(cache_key(page->file, page->index), CACHE_HASH_SIZE)];
+     while (*link != i) {
+         link = &simple_os.cache[*link].hash_next;
+     }
+     *link = page->hash_next;
+ }
+ 
+ // Write back a cluster of a compressed file, cleaning all of its dirty pages. The pages that are
+ // not cached come from the stored copy, since the whole cluster is compressed again.
+ void cache_writeback_cluster(int32_t file, uint16_t c) {
+     uint16_t first = c * COMPRESS_CLUSTER_BLOCKS;
+     uint16_t pages = cluster_pages(fs_entry(file)->size, c);
+     int16_t slots[COMPRESS_CLUSTER_BLOCKS];
+     bool complete = true;
+     for (uint16_t p = 0; p < COMPRESS_CLUSTER_BLOCKS; p++) {
+         slots[p] = cache_find(file, first + p);
+         complete = complete && (p >= pages || slots[p] >= 0);
+     }
+     if (!complete) {
+         cluster_load(file, c);
+     }
+     
+     uint16_t written = 0;
+     for (uint16_t p = 0; p < COMPRESS_CLUSTER_BLOCKS; p++) {
+         if (slots[p] < 0) {
+             continue;
+         }
+         CachePage* page = &simple_os.cache[slots[p]];
+         if (p < pages) {
+             memcpy(simple_os.cluster_data + p * BLOCK_SIZE, page->data, BLOCK_SIZE);
+         }
+         if (page->dirty) {
+             page->dirty = false;
+             simple_os.cache_dirty--;
+             simple_os.cache_writebacks++;
+             written++;
+         }
+     }
+     if (pages > 0 && !cluster_store(file, c, pages)) {
+         simple_os.cache_write_errors += written; // No blocks left; the data is lost
+     }
+ }
+ 
+ // Write a dirty page back to its block
+ void cache_writeback(CachePage* page) {
+     if (!page->dirty) {
+         return;
+     }
+     if (fs_entry(page->file)->is_compressed) {
+         cache_writeback_cluster(page->file, page->index / COMPRESS_CLUSTER_BLOCKS);
+         return;
+     }
+     if (simple_os.disk->layout == FS_LAYOUT_LOG) {
+         lfs_write(page->file, page->index, page->data);
+     } else if (fs_entry(page->file)->is_deduped) {
+         if (!dedup_write(fs_entry(page->file), page->index, page->data)) {
+             simple_os.cache_write_errors++; // No block left; the data is lost
+         }
+     } else {
+         FileEntry* file = fs_entry(page->file);
+         uint16_t block = extent_map(file, page->index);
+         if (block == 0 && extent_allocate(file)) {
+             block = extent_map(file, page->index);
+         }
+         if (block != 0) {
+             block_write(block, page->data);
+         } else {
+             simple_os.cache_write_errors++; // Extent tree full; the data is lost
+         }
+     }
+     page->dirty = false;
+     simple_os.cache_dirty--;
+     simple_os.cache_writebacks++;
+ }
+ 
+ // Release a page without writing it back
+ void cache_release(int16_t i) {
+     CachePage* page = &simple_os.cache[i];
+     while (page->io >= 0) {
+         io_sleep(page->io, false);
+     }
+     if (page->dirty) {
+         page->dirty = false;
+         simple_os.cache_dirty--;
+     }
+     if (page->readahead) {
+         page->readahead = false;
+         simple_os.readahead_wasted++;
+     }
+     cache_hash_remove(i);
+     cache_unlink(i);
+     page->file = -1;
+     cache_push(i, CACHE_FREE);
+ }
+ 
+ // Free one page, preferring the oldest A1in page while A1in holds over a quarter of the cache
+ int16_t cache_evict() {
+     uint8_t list = CACHE_AM;
+     if (simple_os.cache_len[CACHE_A1IN] > CACHE_PAGES / 4 || simple_os.cache_len[CACHE_AM] == 0) {
+         list = CACHE_A1IN;
+     }
+     int16_t victim = simple_os.cache_tail[list];
+     while (victim >= 0 && simple_os.cache[victim].io >= 0) {
+         victim = simple_os.cache[victim].prev; // Still being read
+     }
+     if (victim < 0) {
+         victim = simple_os.cache_tail[list];
+     }
+     CachePage* page = &simple_os.cache[victim];
+     cache_writeback(page);
+     if (list == CACHE_A1IN) {
+         uint64_t key = cache_key(page->file, page->index);
+         simple_os.cache_ghosts[cache_bucket(key, CACHE_GHOSTS)] = key;
+     }
+     cache_release(victim);
+     return victim;
+ }
+ 
+ // Load a page that is not cached, reading it from its block when fill is set
+ CachePage* cache_insert(int32_t file, uint16_t index, bool fill) {
+     int16_t i = simple_os.cache_head[CACHE_FREE];
+     if (i < 0) {
+         i = cache_evict();
+     }
+     
+     // A page evicted from A1in and wanted again is hot; promote it straight to Am
+     uint64_t key = cache_key(file, index);
+     uint64_t* ghost = &simple_os.cache_ghosts[cache_bucket(key, CACHE_GHOSTS)];
+     uint8_t list = CACHE_A1IN;
+     if (*ghost == key) {
+         *ghost = 0;
+         list = CACHE_AM;
+     }
+     
+     CachePage* page = &simple_os.cache[i];
+     cache_unlink(i);
+     page->file = file;
+     page->index = index;
+     page->dirty = false;
+     page->ra_marker = false;
+     page->damaged = false;
+     page->io = -1;
+     uint32_t bucket = cache_bucket(key, CACHE_HASH_SIZE);
+     page->hash_next = simple_os.cache_hash[bucket];
+     simple_os.cache_hash[bucket] = i;
+     cache_push(i, list);
+     if (fill && fs_entry(file)->is_compressed) {
+         // Compressed clusters are read and decoded whole, without waiting on the I/O engine
+         page->damaged = !cluster_load(file, index / COMPRESS_CLUSTER_BLOCKS);
+         memcpy(page->data, simple_os.cluster_data + index % COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+     } else if (fill) {
+         FileEntry* entry = fs_entry(file);
+         uint16_t block = simple_os.disk->layout == FS_LAYOUT_LOG ? lfs_map(file)[index]
+                        : entry->is_deduped ? dedup_block(entry, index) : extent_map(entry, index);
+         if (block != 0) {
+             page->io = block_read_async(block, page->data);
+             if (page->io == -2) {
+                 memset(page->data, 0, BLOCK_SIZE);
+                 page->damaged = true;
+                 page->io = -1;
+             }
+         } else {
+             memset(page->data, 0, BLOCK_SIZE);
+         }
+         if (page->io >= 0) {
+             simple_os.io[page->io].page = i;
+         }
+     }
+     return page;
+ }
+ 
+ // Get a page of a file, reading it from its block when fill is set
+ CachePage* cache_get(int32_t file, uint16_t index, bool fill) {
+     bool missed = false;
+     for (;;) {
+         int16_t i = cache_find(file, index);
+         if (i < 0) {
+             simple_os.cache_misses++;
+             missed = true;
+             i = (int16_t)(cache_insert(file, index, fill) - simple_os.cache);
+         }
+         CachePage* page = &simple_os.cache[i];
+         if (page->io >= 0) {
+             // Once the read completes the page may be evicted before a sleeping process runs again
+             io_sleep(page->io, true);
+             continue;
+         }
+         if (!missed) {
+             simple_os.cache_hits++;
+         }
+         if (page->readahead) {
+             page->readahead = false;
+             simple_os.readahead_hits++;
+         }
+         if (page->list == CACHE_AM && !missed) {
+             cache_unlink(i);
+             cache_push(i, CACHE_AM);
+         }
+         return page;
+     }
+ }
+ 
+ // Readahead state of a file, taking the slot over from another file if need be
+ Readahead* readahead_state(int32_t file) {
+     Readahead* ra = &simple_os.readahead[file & (READAHEAD_FILES - 1)];
+     if (ra->file != file) {
+         memset(ra, 0, sizeof(*ra));
+         ra->file = file;
+     }
+     return ra;
+ }
+ 
+ // Read the uncached pages of a file's readahead window from page first on
+ void readahead_window(int32_t file, uint16_t first) {
+     Readahead* ra = readahead_state(file);
+     uint32_t end = (uint32_t)ra->start + ra->size;
+     uint32_t pages = fs_blocks_for(fs_entry(file)->size);
+     if (end > pages) {
+         end = pages;
+     }
+     uint32_t marker = (uint32_t)ra->start + ra->size - ra->async_size;
+     for (uint32_t index = first; index < end; index++) {
+         int16_t i = cache_find(file, (uint16_t)index);
+         CachePage* page;
+         if (i >= 0) {
+             page = &simple_os.cache[i];
+         } else {
+             page = cache_insert(file, (uint16_t)index, true);
+             page->readahead = true;
+             simple_os.readahead_pages++;
+         }
+         if (index == marker) {
+             page->ra_marker = true;
+         }
+     }
+     io_flush();
+ }
+ 
+ // Size of the window after the current one
+ uint16_t readahead_grow(Readahead* ra) {
+     uint32_t size = ra->size * 2u;
+     if (ra->limit > 0 && size > ra->limit) {
+         size = ra->limit > ra->size ? ra->limit : ra->size;
+     }
+     return (uint16_t)(size < simple_os.readahead_max ? size : simple_os.readahead_max);
+ }
+ 
+ // Read ahead of a read of count pages from page index, if access looks sequential
+ void cache_readahead(int32_t file, uint16_t index, uint16_t count) {
+     Readahead* ra = readahead_state(file);
+     bool sequential = index == 0 || index == ra->next || index + 1 == ra->next;
+     ra->next = index + count;
+     if (simple_os.readahead_max == 0) {
+         return;
+     }
+     
+     bool miss = false;
+     for (uint32_t page = index; page < (uint32_t)index + count; page++) {
+         int16_t i = cache_find(file, (uint16_t)page);
+         if (i < 0) {
+             miss = true;
+         } else if (simple_os.cache[i].ra_marker) {
+             // The reader reached the marker; start the next window before it runs out of pages
+             simple_os.cache[i].ra_marker = false;
+             if (sequential && page >= ra->start && page - ra->start < ra->size) {
+                 ra->start += ra->size;
+                 ra->size = readahead_grow(ra);
+                 ra->async_size = ra->size;
+                 readahead_window(file, ra->start);
+             }
+         }
+     }
+     if (!miss) {
+         return;
+     }
+     if (!sequential) {
+         ra->size = 0;
+         return;
+     }
+     
+     // A sequential miss reads a window past the request. Missing a page the last window already
+     // read means read-ahead pages are being evicted before use, so the window shrinks instead
+     // and stops growing past that size.
+     uint32_t size = READAHEAD_MIN_PAGES * (uint32_t)count;
+     if (ra->size > 0 && index >= ra->start && index - ra->start < ra->size) {
+         size = ra->size / 2;
+         ra->limit = (uint16_t)size;
+     } else if (ra->size > 0) {
+         size = readahead_grow(ra);
+     }
+     if (size > simple_os.readahead_max) {
+         size = simple_os.readahead_max;
+     }
+     if (size <= count) {
+         ra->size = 0;
+         return;
+     }
+     ra->start = index;
+     ra->size = (uint16_t)size;
+     ra->async_size = (uint16_t)(size - count);
+     readahead_window(file, index + count);
+ }
+ 
+ // Write back up to limit dirty pages, sweeping the cache like a clock hand
+ void cache_flush(uint16_t limit) {
+     for (int scanned = 0; scanned < CACHE_PAGES && limit > 0 && simple_os.cache_dirty > 0; scanned++) {
+         CachePage* page = &simple_os.cache[simple_os.cache_flush_hand];
+         simple_os.cache_flush_hand = (simple_os.cache_flush_hand + 1) % CACHE_PAGES;
+         if (page->dirty) {
+             cache_writeback(page);
+             limit--;
+         }
+     }
+ }
+ 
+ // Write back every dirty page
+ void cache_sync() {
+     cache_flush(CACHE_PAGES);
+ }
+ 
+ void cache_mark_dirty(CachePage* page) {
+     page->damaged = false; // Whatever is written replaces the unreadable data
+     if (page->dirty) {
+         return;
+     }
+     page->dirty = true;
+     simple_os.cache_dirty++;
+     
+     // Past dirty_ratio the writer pays for writeback itself
+     uint32_t limit = (uint32_t)CACHE_PAGES * simple_os.dirty_ratio / 100;
+     if (simple_os.cache_dirty > limit) {
+         uint32_t background = (uint32_t)CACHE_PAGES * simple_os.dirty_background_ratio / 100;
+         cache_flush(simple_os.cache_dirty - background);
+     }
+ }
+ 
+ // Background writeback, run from the scheduler
+ void cache_tick() {
+     uint32_t background = (uint32_t)CACHE_PAGES * simple_os.dirty_background_ratio / 100;
+     if (simple_os.cache_dirty > background) {
+         cache_flush(CACHE_FLUSH_BATCH);
+     }
+ }
+ 
+ // Forget a file's pages from page number first onwards, discarding unwritten data
+ void cache_drop(int32_t file, uint16_t first) {
+     for (int16_t i = 0; i < CACHE_PAGES; i++) {
+         if (simple_os.cache[i].file == file && simple_os.cache[i].index >= first) {
+             cache_release(i);
+         }
+     }
+     Readahead* ra = &simple_os.readahead[file & (READAHEAD_FILES - 1)];
+     if (first == 0 && ra->file == file) {
+         ra->file = -1;
+     }
+ }
+ 
+ /* ======= FILE SYSTEM ======= */
+  
+ // Give back the blocks of a file from block index first on
+ void fs_release(int id, uint16_t first) {
+     FileEntry* file = fs_entry(id);
+     uint16_t have = fs_blocks_for(file->size);
+     if (file->is_inline || first >= have) {
+         return;
+     }
+     if (file->is_compressed) {
+         cluster_release(file, id, first, have);
+         return;
+     }
+     if (file->is_deduped) {
+         dedup_release(file, first, have);
+         return;
+     }
+     uint16_t held = 0;
+     if (simple_os.disk->layout == FS_LAYOUT_LOG) {
+         lfs_release(id, first, have - first);
+     } else {
+         held = extent_truncate(file, first);
+     }
+     simple_os.disk->free_blocks += have - first - held;
+     journal_dirty(&simple_os.disk->free_blocks, sizeof(simple_os.disk->free_blocks));
+ }
+ 
+ // Largest file the layout can hold
+ uint64_t fs_max_size() {
+     if (simple_os.disk->layout == FS_LAYOUT_LOG) {
+         return LFS_FILE_BLOCKS * BLOCK_SIZE;
+     }
+     return MAX_FILE_SIZE;
+ }
+ 
+ // Write an empty file system into the mounted image
+ void fs_format(FsLayout layout) {
+     DiskImage* disk = simple_os.disk;
+     disk->magic = DISK_MAGIC;
+     disk->version = DISK_VERSION;
+     disk->block_size = BLOCK_SIZE;
+     disk->num_blocks = NUM_BLOCKS;
+     disk->clean = 0;
+     disk->layout = layout;
+     memset(disk->snapshots, 0, sizeof(disk->snapshots));
+     disk->snapshot_restoring = 0;
+     block_init();
+     dedup_index_build();
+     if (layout == FS_LAYOUT_LOG) {
+         lfs_format();
+     }
+     disk->free_leaf_count = 0;
+     for (int i = EXTENT_LEAVES - 1; i >= 0; i--) {
+         disk->free_leaves[disk->free_leaf_count++] = (uint8_t)i;
+     }
+     
+     // Page 0 holds the root and the first free entries, page 1 the checksums of the pages after
+     // it; the image keeps any pages it has grown
+     disk->file_count = 0;
+     disk->meta_pages = 2;
+     disk->meta_free = 0;
+     disk->meta_free_count = 0;
+     memset(meta_page(0), 0, 2 * BLOCK_SIZE);
+     disk->free_entry = -1;
+     for (int32_t i = FS_ENTRIES_PER_PAGE - 1; i > FS_ROOT; i--) {
+         fs_entry(i)->parent = disk->free_entry;
+         disk->free_entry = i;
+     }
+     
+     // The root directory is its own parent and is in no directory
+     FileEntry* root = fs_entry(FS_ROOT);
+     root->parent = FS_ROOT;
+     root->in_use = true;
+     root->is_dir = true;
+     simple_os.names_valid = false;
+ }
+ 
+ // Take an unused FileEntry, adding a page of them if none is left; needs one reserved page
+ int32_t fs_entry_alloc() {
+     DiskImage* disk = simple_os.disk;
+     if (disk->free_entry < 0) {
+         int32_t first = (int32_t)(meta_alloc() * FS_ENTRIES_PER_PAGE);
+         for (int32_t i = FS_ENTRIES_PER_PAGE - 1; i >= 0; i--) {
+             fs_entry(first + i)->parent = disk->free_entry;
+             disk->free_entry = first + i;
+         }
+     }
+     int32_t id = disk->free_entry;
+     disk->free_entry = fs_entry(id)->parent;
+     journal_dirty(&disk->free_entry, sizeof(disk->free_entry));
+     return id;
+ }
+ 
+ void fs_entry_free(int32_t id) {
+     FileEntry* file = fs_entry(id);
+     file->in_use = false;
+     file->parent = simple_os.disk->free_entry;
+     simple_os.disk->free_entry = id;
+     journal_dirty(file, sizeof(*file));
+     journal_dirty(&simple_os.disk->free_entry, sizeof(simple_os.disk->free_entry));
+ }
+ 
+ // Forget the open files, cached pages and names of the file system, which is about to change under them
+ void fs_forget() {
+     fd_revoke(-1); // Open files refer to entries of the old file system
+     cache_init();
+     for (int i = 0; i < DCACHE_SIZE; i++) {
+         simple_os.dcache[i].parent = -1;
+     }
+     simple_os.cwd = FS_ROOT;
+     simple_os.cluster_file = -1;
+ }
+ 
+ // Reset the in-memory state that caches the mounted image
+ void fs_attach(DiskImage* disk, size_t size) {
+     simple_os.disk = disk;
+     simple_os.disk_size = size;
+     block_index_build();
+     dedup_index_build();
+     simple_os.names_valid = false; // Built by the first search, once the image is known to be consistent
+     fs_forget();
+ }
+ 
+ // Initialize file system
+ void fs_init() {
+     simple_os.disk_mapped = false;
+     simple_os.dcache_enabled = true;
+     simple_os.inline_enabled = true;
+     simple_os.journal_interval_ms = 5;
+     memset(simple_os.shell_fds, -1, sizeof(simple_os.shell_fds));
+     ram_disk_size = META_PAGES_OFFSET + META_MIN_PAGES * BLOCK_SIZE;
+     ram_disk = calloc(1, ram_disk_size);
+     fs_attach(ram_disk, ram_disk_size);
+     fs_format(FS_LAYOUT_INPLACE);
+ }
+ 
+ /* Each directory keeps its entries in a B+tree of metadata pages keyed by
+  * (name hash, entry number). A lookup descends to the leaf where the hash
+  * starts and compares names only along the run of equal hashes. Names are
+  * the zero-padded MAX_FILENAME_LEN bytes, so a comparison is one fixed-size
+  * memcmp the compiler turns into a few vector compares. Leaves are chained,
+  * so a listing streams a directory in hash order from a cursor instead of
+  * scanning every entry of the file system. As in ext4's hashed directories a
+  * tree never shrinks: removals leave underfull leaves behind, and the pages
+  * are freed with the directory. */
+ 
+ // Zero-padded copy of a name of len bytes, truncated like fs_create stores it
+ void fs_make_key(const char* name, size_t len, char key[MAX_FILENAME_LEN]) {
+     memset(key, 0, MAX_FILENAME_LEN);
+     if (len > MAX_FILENAME_LEN - 1) {
+         len = MAX_FILENAME_LEN - 1;
+     }
+     memcpy(key, name, len);
+ }
+ 
+ uint32_t fs_hash(int32_t parent, const char key[MAX_FILENAME_LEN]) {
+     uint64_t h = 0x9E3779B97F4A7C15ull ^ (uint64_t)(uint32_t)parent;
+     for (int i = 0; i < MAX_FILENAME_LEN; i += 8) {
+         uint64_t word;
+         memcpy(&word, key + i, sizeof(word));
+         h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+         h ^= h >> 32;
+     }
+     return (uint32_t)h;
+ }
+ 
+ DirNode* dir_node(uint32_t page) {
+     return (DirNode*)meta_page(page);
+ }
+ 
+ int dir_compare(DirKey a, DirKey b) {
+     if (a.hash != b.hash) {
+         return a.hash < b.hash ? -1 : 1;
+     }
+     return (a.id > b.id) - (a.id < b.id);
+ }
+ 
+ // Child of an interior node whose keys include key
+ int dir_child(const DirNode* node, DirKey key) {
+     int low = 0;
+     int high = node->count;
+     while (low < high) {
+         int mid = (low + high) / 2;
+         if (dir_compare(node->keys[mid], key) <= 0) {
+             low = mid + 1;
+         } else {
+             high = mid;
+         }
+     }
+     return low;
+ }
+ 
+ // Position of the first leaf entry not below key
+ int dir_position(const DirNode* leaf, DirKey key) {
+     int low = 0;
+     int high = leaf->count;
+     while (low < high) {
+         int mid = (low + high) / 2;
+         if (dir_compare(leaf->entries[mid], key) < 0) {
+             low = mid + 1;
+         } else {
+             high = mid;
+         }
+     }
+     return low;
+ }
+ 
+ // Leaf of a directory's tree that key belongs in, 0 if the tree is empty
+ uint32_t dir_leaf(int32_t dir, DirKey key) {
+     uint32_t page = fs_entry(dir)->dir_root;
+     while (page != 0 && !dir_node(page)->leaf) {
+         DirNode* node = dir_node(page);
+         page = node->children[dir_child(node, key)];
+     }
+     return page;
+ }
+ 
+ // Find the entry called key in a directory; returns its number or -1
+ int32_t dir_lookup(int32_t dir, const char key[MAX_FILENAME_LEN], uint32_t hash) {
+     DirKey first = { hash, -1 }; // Below every entry with this hash
+     uint32_t page = dir_leaf(dir, first);
+     int slot = page != 0 ? dir_position(dir_node(page), first) : 0;
+     while (page != 0) {
+         DirNode* leaf = dir_node(page);
+         for (; slot < leaf->count; slot++) {
+             DirKey entry = leaf->entries[slot];
+             if (entry.hash != hash) {
+                 return -1;
+             }
+             if (memcmp(fs_entry(entry.id)->filename, key, MAX_FILENAME_LEN) == 0) {
+                 return entry.id;
+             }
+         }
+         page = leaf->next;
+         slot = 0;
+     }
+     return -1;
+ }
+ 
+ // Journal a leaf's count and its entries from slot on
+ void dir_dirty_leaf(DirNode* leaf, int slot) {
+     journal_dirty(leaf, offsetof(DirNode, entries));
+     if (slot < leaf->count) {
+         journal_dirty(&leaf->entries[slot], (leaf->count - slot) * sizeof(DirKey));
+     }
+ }
+ 
+ // Add key to a directory's tree, splitting full nodes from the leaf up
+ // Needs DIR_MAX_HEIGHT + 1 reserved pages
+ void dir_insert(int32_t dir, DirKey key) {
+     if (fs_entry(dir)->dir_root == 0) {
+         uint32_t root = meta_alloc();
+         dir_node(root)->leaf = true;
+         fs_entry(dir)->dir_root = root;
+     }
+     uint32_t path[DIR_MAX_HEIGHT];
+     int depth = 0;
+     uint32_t page = fs_entry(dir)->dir_root;
+     while (!dir_node(page)->leaf) {
+         path[depth++] = page;
+         DirNode* node = dir_node(page);
+         page = node->children[dir_child(node, key)];
+     }
+     
+     // A full leaf moves its upper half to a new right sibling first
+     DirNode* leaf = dir_node(page);
+     uint32_t right = 0;
+     DirKey separator = key;
+     if (leaf->count == DIR_LEAF_KEYS) {
+         right = meta_alloc();
+         DirNode* sibling = dir_node(right);
+         uint16_t keep = DIR_LEAF_KEYS / 2;
+         sibling->leaf = true;
+         sibling->count = leaf->count - keep;
+         memcpy(sibling->entries, &leaf->entries[keep], sibling->count * sizeof(DirKey));
+         sibling->next = leaf->next;
+         leaf->next = right;
+         leaf->count = keep;
+         separator = sibling->entries[0];
+         if (dir_compare(key, separator) >= 0) {
+             leaf = sibling;
+         }
+         journal_dirty(dir_node(page), sizeof(DirNode));
+     }
+     int slot = dir_position(leaf, key);
+     memmove(&leaf->entries[slot + 1], &leaf->entries[slot], (leaf->count - slot) * sizeof(DirKey));
+     leaf->entries[slot] = key;
+     leaf->count++;
+     dir_dirty_leaf(leaf, slot);
+     
+     // Hand each split's separator to the parent, splitting it in turn when full
+     while (right != 0) {
+         if (depth == 0) {
+             uint32_t root = meta_alloc();
+             DirNode* node = dir_node(root);
+             node->count = 1;
+             node->keys[0] = separator;
+             node->children[0] = fs_entry(dir)->dir_root;
+             node->children[1] = right;
+             fs_entry(dir)->dir_root = root;
+             break;
+         }
+         page = path[--depth];
+         DirNode* node = dir_node(page);
+         DirKey keys[DIR_NODE_KEYS + 1];
+         uint32_t children[DIR_NODE_KEYS + 2];
+         int at = dir_child(node, separator);
+         memcpy(keys, node->keys, at * sizeof(DirKey));
+         keys[at] = separator;
+         memcpy(&keys[at + 1], &node->keys[at], (node->count - at) * sizeof(DirKey));
+         memcpy(children, node->children, (at + 1) * sizeof(uint32_t));
+         children[at + 1] = right;
+         memcpy(&children[at + 2], &node->children[at + 1], (node->count - at) * sizeof(uint32_t));
+         int count = node->count + 1;
+         right = 0;
+         if (count > DIR_NODE_KEYS) {
+             // The middle key moves up; the keys after it go to a new right sibling
+             int keep = count / 2;
+             right = meta_alloc();
+             DirNode* sibling = dir_node(right);
+             sibling->count = (uint16_t)(count - keep - 1);
+             memcpy(sibling->keys, &keys[keep + 1], sibling->count * sizeof(DirKey));
+             memcpy(sibling->children, &children[keep + 1], (sibling->count + 1) * sizeof(uint32_t));
+             separator = keys[keep];
+             count = keep;
+         }
+         node->count = (uint16_t)count;
+         memcpy(node->keys, keys, count * sizeof(DirKey));
+         memcpy(node->children, children, (count + 1) * sizeof(uint32_t));
+         journal_dirty(node, sizeof(DirNode));
+     }
+     journal_dirty(fs_entry(dir), sizeof(FileEntry));
+ }
+ 
+ // Remove key from a directory's tree
+ void dir_remove(int32_t dir, DirKey key) {
+     uint32_t page = dir_leaf(dir, key);
+     if (page == 0) {
+         return;
+     }
+     DirNode* leaf = dir_node(page);
+     int slot = dir_position(leaf, key);
+     if (slot == leaf->count || dir_compare(leaf->entries[slot], key) != 0) {
+         return;
+     }
+     leaf->count--;
+     memmove(&leaf->entries[slot], &leaf->entries[slot + 1], (leaf->count - slot) * sizeof(DirKey));
+     dir_dirty_leaf(leaf, slot);
+ }
+ 
+ // Give back every page of a directory's tree from page down
+ void dir_free(uint32_t page) {
+     if (page == 0) {
+         return;
+     }
+     DirNode* node = dir_node(page);
+     if (!node->leaf) {
+         for (int i = 0; i <= node->count; i++) {
+             dir_free(node->children[i]);
+         }
+     }
+     meta_release(page);
+ }
+ 
+ // Next entry of a directory listing, -1 at the end. The cursor resumes after the
+ // last key it returned, so entries may be added and removed between calls.
+ int32_t dir_next(int32_t dir, DirCursor* cursor) {
+     if (!cursor->started) {
+         cursor->started = true;
+         cursor->last.hash = 0;
+         cursor->last.id = -1;
+         cursor->page = fs_entry(dir)->dir_root;
+         while (cursor->page != 0 && !dir_node(cursor->page)->leaf) {
+             cursor->page = dir_node(cursor->page)->children[0];
+         }
+     }
+     while (cursor->page != 0) {
+         DirNode* leaf = dir_node(cursor->page);
+         int slot = dir_position(leaf, cursor->last);
+         if (slot < leaf->count && dir_compare(leaf->entries[slot], cursor->last) == 0) {
+             slot++;
+         }
+         if (slot < leaf->count) {
+             cursor->last = leaf->entries[slot];
+             return cursor->last.id;
+         }
+         cursor->page = leaf->next;
+     }
+     return -1;
+ }
+ 
+ /* ======= PATHS AND DENTRY CACHE ======= */
+ 
+ /* Paths are resolved one component at a time. Each component is hashed as it
+  * is scanned and looked up in a direct-mapped dentry cache keyed by
+  * (directory, component); only misses build a padded key and search the
+  * directory. Misses for names that do not exist are cached too, as negative
+  * entries, and creating or deleting a name invalidates its cache slot. */
+ 
+ uint32_t dcache_hash(const char* name, size_t len) {
+     uint32_t h = 2166136261u;
+     for (size_t i = 0; i < len; i++) {
+         h = (h ^ (uint8_t)name[i]) * 16777619u;
+     }
+     return h;
+ }
+ 
+ Dentry* dcache_slot(int32_t parent, uint32_t hash) {
+     uint32_t mix = hash ^ ((uint32_t)parent * 2654435761u);
+     return &simple_os.dcache[(mix ^ (mix >> 16)) & (DCACHE_SIZE - 1)];
+ }
+ 
+ // Drop any cached lookup of name in parent
+ void dcache_invalidate(int32_t parent, const char* name, size_t len) {
+     if (len > MAX_FILENAME_LEN - 1) {
+         len = MAX_FILENAME_LEN - 1;
+     }
+     uint32_t hash = dcache_hash(name, len);
+     Dentry* d = dcache_slot(parent, hash);
+     if (d->parent == parent && d->hash == hash && d->len == len && memcmp(d->name, name, len) == 0) {
+         d->parent = -1;
+     }
+ }
+ 
+ // Look up one path component in a directory; returns the entry or -1
+ int fs_lookup_component(int32_t dir, const char* name, size_t len) {
+     if (len > MAX_FILENAME_LEN - 1) {
+         len = MAX_FILENAME_LEN - 1;
+     }
+     uint32_t hash = dcache_hash(name, len);
+     Dentry* d = dcache_slot(dir, hash);
+     if (simple_os.dcache_enabled) {
+         if (d->parent == dir && d->hash == hash && d->len == len && memcmp(d->name, name, len) == 0) {
+             simple_os.dcache_hits++;
+             return d->child;
+         }
+         simple_os.dcache_misses++;
+     }
+     
+     char key[MAX_FILENAME_LEN];
+     fs_make_key(name, len, key);
+     int child = dir_lookup(dir, key, fs_hash(dir, key));
+     
+     if (simple_os.dcache_enabled) {
+         d->parent = dir;
+         d->child = child;
+         d->hash = hash;
+         d->len = (uint8_t)len;
+         memcpy(d->name, name, len);
+     }
+     return child;
+ }
+ 
+ // Walk a path from the root or the working directory
+ // With leaf set, stops before the last component, copies it to leaf and returns its directory
+ // Returns an entry index, or -1 if a component is missing or not a directory
+ int fs_walk(const char* path, char* leaf) {
+     int32_t dir = path[0] == '/' ? FS_ROOT : simple_os.cwd;
+     const char* p = path;
+     if (leaf) {
+         leaf[0] = '\0';
+     }
+     for (;;) {
+         while (*p == '/') {
+             p++;
+         }
+         if (*p == '\0') {
+             return dir;
+         }
+         const char* end = p;
+         while (*end != '\0' && *end != '/') {
+             end++;
+         }
+         if (end - path > MAX_PATH_LEN) {
+             return -1;
+         }
+         size_t len = end - p;
+         const char* rest = end;
+         while (*rest == '/') {
+             rest++;
+         }
+         
+         if (!fs_entry(dir)->is_dir) {
+             return -1;
+         }
+         if (leaf && *rest == '\0') {
+             if (len > MAX_FILENAME_LEN - 1) {
+                 len = MAX_FILENAME_LEN - 1;
+             }
+             memcpy(leaf, p, len);
+             leaf[len] = '\0';
+             return dir;
+         }
+         if (len == 1 && p[0] == '.') {
+             // Stay in this directory
+         } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+             dir = fs_entry(dir)->parent;
+         } else {
+             int child = fs_lookup_component(dir, p, len);
+             if (child < 0) {
+                 return -1;
+             }
+             dir = child;
+         }
+         p = end;
+     }
+ }
+ 
+ // Find a file or directory by path; returns its index or -1
+ int fs_find(const char* path) {
+     return fs_walk(path, NULL);
+ }
+ 
+ /* ======= NAME INDEX ======= */
+ 
+ /* Prefix and pattern searches use a crit-bit tree, a binary PATRICIA trie, over
+  * the (parent, padded name) key of every entry. An interior node records only
+  * the first bit where its two subtrees differ, so n names take n - 1 nodes of
+  * 12 bytes and the keys themselves stay in the file table. The names of a
+  * directory that start with a given prefix all sit in the one subtree a
+  * single descent finds, and a subtree holding h names has h - 1 nodes, so
+  * listing them costs the length of the prefix plus the number of hits.
+  * Taking clear bits first visits names in byte order. The tree lives only in
+  * memory: the first search after a mount, format or restore builds it in one
+  * pass over the sorted keys, and creates and deletes keep it current. */
+ 
+ // Key of an entry: its parent directory's number, most significant byte first, then its name
+ void name_key(int32_t id, uint8_t key[NAME_KEY_LEN]) {
+     FileEntry* file = fs_entry(id);
+     uint32_t parent = (uint32_t)file->parent;
+     for (int i = 0; i < 4; i++) {
+         key[i] = (uint8_t)(parent >> (24 - 8 * i));
+     }
+     memcpy(key + 4, file->filename, MAX_FILENAME_LEN);
+ }
+ 
+ int name_side(const NameNode* node, const uint8_t* key) {
+     return (key[node->byte] & node->mask) != 0;
+ }
+ 
+ // Whether node splits on a later bit than the mask bit of byte, so belongs below a node splitting there
+ bool name_below(const NameNode* node, uint32_t byte, uint8_t mask) {
+     return node->byte > byte || (node->byte == byte && node->mask < mask);
+ }
+ 
+ uint8_t name_mask(uint8_t a, uint8_t b) {
+     return (uint8_t)(0x80 >> (__builtin_clz((uint32_t)(a ^ b)) - 24));
+ }
+ 
+ // A node that is not in the tree, 0 if out of memory
+ uint32_t name_node_alloc() {
+     if (simple_os.names_free != 0) {
+         uint32_t n = simple_os.names_free;
+         simple_os.names_free = simple_os.names[n].child[0];
+         return n;
+     }
+     if (simple_os.names_used >= simple_os.names_size) {
+         uint32_t size = simple_os.names_size > 0 ? simple_os.names_size * 2 : 1024;
+         NameNode* nodes = realloc(simple_os.names, size * sizeof(NameNode));
+         if (!nodes) {
+             return 0;
+         }
+         simple_os.names = nodes;
+         simple_os.names_size = size;
+     }
+     return simple_os.names_used++;
+ }
+ 
+ // Give up on the index after running out of memory; the next search tries to build it again
+ void name_index_drop() {
+     free(simple_os.names);
+     simple_os.names = NULL;
+     simple_os.names_size = 0;
+     simple_os.names_valid = false;
+ }
+ 
+ void name_index_insert(int32_t id) {
+     if (!simple_os.names_valid) {
+         return;
+     }
+     uint8_t key[NAME_KEY_LEN];
+     name_key(id, key);
+     if (simple_os.names_count == 0) {
+         simple_os.names_root = NAME_LEAF | (uint32_t)id;
+         simple_os.names_count = 1;
+         return;
+     }
+     
+     // The entry a descent ends at shares the longest prefix with key of any
+     uint32_t link = simple_os.names_root;
+     while (!(link & NAME_LEAF)) {
+         const NameNode* node = &simple_os.names[link];
+         link = node->child[name_side(node, key)];
+     }
+     uint8_t other[NAME_KEY_LEN];
+     name_key((int32_t)(link & ~NAME_LEAF), other);
+     uint32_t byte = 0;
+     while (byte < NAME_KEY_LEN && key[byte] == other[byte]) {
+         byte++;
+     }
+     if (byte == NAME_KEY_LEN) {
+         return; // Already indexed
+     }
+     uint32_t n = name_node_alloc();
+     if (n == 0) {
+         name_index_drop();
+         return;
+     }
+     NameNode* node = &simple_os.names[n];
+     node->byte = (uint16_t)byte;
+     node->mask = name_mask(key[byte], other[byte]);
+     int side = name_side(node, key);
+     node->child[side] = NAME_LEAF | (uint32_t)id;
+     
+     // The new node goes above the first one that splits on a later bit
+     uint32_t* at = &simple_os.names_root;
+     while (!(*at & NAME_LEAF) && !name_below(&simple_os.names[*at], byte, node->mask)) {
+         NameNode* next = &simple_os.names[*at];
+         at = &next->child[name_side(next, key)];
+     }
+     node->child[1 - side] = *at;
+     *at = n;
+     simple_os.names_count++;
+ }
+ 
+ // Remove an entry; its parent and name must still be the ones it was indexed under
+ void name_index_remove(int32_t id) {
+     if (!simple_os.names_valid || simple_os.names_count == 0) {
+         return;
+     }
+     uint8_t key[NAME_KEY_LEN];
+     name_key(id, key);
+     uint32_t* at = &simple_os.names_root;
+     uint32_t* above = NULL;
+     int side = 0;
+     while (!(*at & NAME_LEAF)) {
+         NameNode* node = &simple_os.names[*at];
+         above = at;
+         side = name_side(node, key);
+         at = &node->child[side];
+     }
+     if (*at != (NAME_LEAF | (uint32_t)id)) {
+         return;
+     }
+     if (above != NULL) {
+         // The node splitting this entry from its sibling goes, and the sibling takes its place
+         uint32_t n = *above;
+         *above = simple_os.names[n].child[1 - side];
+         simple_os.names[n].child[0] = simple_os.names_free;
+         simple_os.names_free = n;
+     }
+     simple_os.names_count--;
+ }
+ 
+ // Gather the keys of the entries of dir and of every directory below it; false if out of memory
+ bool name_index_collect(int32_t dir, NameRecord** records, uint32_t* count, uint32_t* capacity) {
+     DirCursor cursor = {0};
+     int32_t id;
+     while ((id = dir_next(dir, &cursor)) >= 0) {
+         if (*count == *capacity) {
+             uint32_t size = *capacity > 0 ? *capacity * 2 : 1024;
+             NameRecord* grown = realloc(*records, size * sizeof(NameRecord));
+             if (!grown) {
+                 return false;
+             }
+             *records = grown;
+             *capacity = size;
+         }
+         NameRecord* record = &(*records)[(*count)++];
+         name_key(id, record->key);
+         record->id = id;
+         if (fs_entry(id)->is_dir && !name_index_collect(id, records, count, capacity)) {
+             return false;
+         }
+     }
+     return true;
+ }
+ 
+ // Sort records by key, given that they agree before byte. A radix sort one byte at a
+ // time, into scratch and back, passes over bytes every key shares in one counting pass.
+ void name_records_sort(NameRecord* records, NameRecord* scratch, uint32_t count, uint32_t byte) {
+     while (count >= 32 && byte < NAME_KEY_LEN) {
+         uint32_t start[257] = {0};
+         for (uint32_t i = 0; i < count; i++) {
+             start[records[i].key[byte] + 1]++;
+         }
+         if (start[records[0].key[byte] + 1] == count) {
+             byte++;
+             continue;
+         }
+         for (int b = 0; b < 256; b++) {
+             start[b + 1] += start[b];
+         }
+         uint32_t next[256];
+         memcpy(next, start, sizeof(next));
+         for (uint32_t i = 0; i < count; i++) {
+             scratch[next[records[i].key[byte]]++] = records[i];
+         }
+         memcpy(records, scratch, count * sizeof(NameRecord));
+         for (int b = 0; b < 256; b++) {
+             if (start[b + 1] - start[b] > 1) {
+                 name_records_sort(records + start[b], scratch + start[b], start[b + 1] - start[b], byte + 1);
+             }
+         }
+         return;
+     }
+     for (uint32_t i = 1; i < count; i++) {
+         NameRecord record = records[i];
+         uint32_t j = i;
+         while (j > 0 && memcmp(records[j - 1].key + byte, record.key + byte, NAME_KEY_LEN - byte) > 0) {
+             records[j] = records[j - 1];
+             j--;
+         }
+         records[j] = record;
+     }
+ }
+ 
+ // Index every entry of the attached file system. With the keys sorted, each node
+ // splits a key from the one before it, and goes on the path to the previous key
+ // below every node that splits on an earlier bit, so the tree grows along its
+ // right edge and its nodes are laid out in key order.
+ void name_index_build() {
+     uint32_t count = 0;
+     uint32_t capacity = simple_os.disk->file_count + 1;
+     NameRecord* records = malloc(capacity * sizeof(NameRecord));
+     simple_os.names_count = 0;
+     simple_os.names_used = 1;
+     simple_os.names_free = 0;
+     if (!records || !name_index_collect(FS_ROOT, &records, &count, &capacity)) {
+         free(records);
+         name_index_drop();
+         return;
+     }
+     NameRecord* scratch = malloc((count + 1) * sizeof(NameRecord));
+     if (simple_os.names_size < count) {
+         NameNode* nodes = realloc(simple_os.names, count * sizeof(NameNode));
+         if (nodes) {
+             simple_os.names = nodes;
+             simple_os.names_size = count;
+         }
+     }
+     if (!scratch || simple_os.names_size < count) {
+         free(scratch);
+         free(records);
+         name_index_drop();
+         return;
+     }
+     name_records_sort(records, scratch, count, 0);
+     free(scratch);
+     
+     uint32_t spine[NAME_KEY_LEN * 8]; // Nodes on the path to the previous key, each splitting on a later bit
+     int depth = 0;
+     for (uint32_t i = 0; i < count; i++) {
+         uint32_t leaf = NAME_LEAF | (uint32_t)records[i].id;
+         if (i == 0) {
+             simple_os.names_root = leaf;
+             simple_os.names_count = 1;
+             continue;
+         }
+         const uint8_t* prev = records[i - 1].key;
+         const uint8_t* key = records[i].key;
+         uint32_t byte = 0;
+         while (byte < NAME_KEY_LEN && prev[byte] == key[byte]) {
+             byte++;
+         }
+         if (byte == NAME_KEY_LEN) {
+             continue; // The same name twice, which only a damaged directory holds
+         }
+         uint32_t n = simple_os.names_used++;
+         NameNode* node = &simple_os.names[n];
+         node->byte = (uint16_t)byte;
+         node->mask = name_mask(prev[byte], key[byte]);
+         while (depth > 0 && name_below(&simple_os.names[spine[depth - 1]], byte, node->mask)) {
+             depth--;
+         }
+         uint32_t* at = depth > 0 ? &simple_os.names[spine[depth - 1]].child[1] : &simple_os.names_root;
+         node->child[0] = *at; // Every key so far below here is smaller
+         node->child[1] = leaf;
+         *at = n;
+         spine[depth++] = n;
+         simple_os.names_count++;
+     }
+     free(records);
+     simple_os.names_valid = true;
+ }
+ 
+ // Length of the next pattern element if it matches c, 0 if not: a character, ? or a [...] set
+ int fs_glob_element(const char* pattern, char c) {
+     if (pattern[0] == '\0') {
+         return 0;
+     }
+     if (pattern[0] == '?') {
+         return 1;
+     }
+     if (pattern[0] == '[') {
+         const char* p = pattern + 1;
+         bool negate = *p == '!' || *p == '^';
+         p += negate;
+         bool found = false;
+         // A ] right after the opening bracket is a member, as in the shell
+         do {
+             if (*p == '\0') {
+                 return pattern[0] == c; // No closing bracket: [ is an ordinary character
+             }
+             if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+                 found |= (uint8_t)c >= (uint8_t)p[0] && (uint8_t)c <= (uint8_t)p[2];
+                 p += 3;
+             } else {
+                 found |= *p++ == c;
+             }
+         } while (*p != ']');
+         return found != negate ? (int)(p + 1 - pattern) : 0;
+     }
+     return pattern[0] == c;
+ }
+ 
+ // Whether name matches a shell pattern: * matches any run of characters, ? any one, [...] one of a set
+ bool fs_glob_match(const char* pattern, const char* name) {
+     const char* star = NULL; // Pattern after the last *, and where in name it started matching
+     const char* resume = NULL;
+     while (*name != '\0') {
+         if (*pattern == '*') {
+             star = ++pattern;
+             resume = name;
+             continue;
+         }
+         int len = fs_glob_element(pattern, *name);
+         if (len > 0) {
+             pattern += len;
+             name++;
+         } else if (star != NULL) {
+             // Let the last * take one more character and try again from there
+             pattern = star;
+             name = ++resume;
+         } else {
+             return false;
+         }
+     }
+     while (*pattern == '*') {
+         pattern++;
+     }
+     return *pattern == '\0';
+ }
+ 
+ // Append an entry to a growing result array; false if out of memory
+ bool fs_glob_add(int32_t** ids, int32_t* count, int32_t* capacity, int32_t id) {
+     if (*count == *capacity) {
+         int32_t size = *capacity > 0 ? *capacity * 2 : 64;
+         int32_t* grown = realloc(*ids, size * sizeof(int32_t));
+         if (!grown) {
+             return false;
+         }
+         *ids = grown;
+         *capacity = size;
+     }
+     (*ids)[(*count)++] = id;
+     return true;
+ }
+ 
+ // fs_glob without the index: test every name in the directory, in directory order
+ int32_t fs_glob_scan(int32_t dir, const char* pattern, int32_t** ids) {
+     int32_t count = 0;
+     int32_t capacity = 0;
+     *ids = NULL;
+     DirCursor cursor = {0};
+     int32_t id;
+     while ((id = dir_next(dir, &cursor)) >= 0) {
+         if (fs_glob_match(pattern, fs_entry(id)->filename) && !fs_glob_add(ids, &count, &capacity, id)) {
+             free(*ids);
+             return -1;
+         }
+     }
+     return count;
+ }
+ 
+ // Find the entries of directory dir whose names match pattern, in name order
+ // Returns how many, with *ids set to an array the caller frees; -1 if out of memory
+ int32_t fs_glob(int32_t dir, const char* pattern, int32_t** ids) {
+     if (!simple_os.names_valid) {
+         name_index_build();
+         if (!simple_os.names_valid) {
+             return fs_glob_scan(dir, pattern, ids);
+         }
+     }
+     int32_t count = 0;
+     int32_t capacity = 0;
+     *ids = NULL;
+     if (simple_os.names_count == 0) {
+         return 0;
+     }
+     
+     // Every name starting with the pattern's literal prefix is below the last node
+     // the descent passes that splits inside the prefix
+     uint8_t key[NAME_KEY_LEN] = {0};
+     size_t len = strcspn(pattern, "*?[");
+     bool prefix_only = strcmp(pattern + len, "*") == 0; // Then every name below matches without looking at it
+     if (len > MAX_FILENAME_LEN - 1) {
+         len = MAX_FILENAME_LEN - 1;
+         prefix_only = false;
+     }
+     for (int i = 0; i < 4; i++) {
+         key[i] = (uint8_t)((uint32_t)dir >> (24 - 8 * i));
+     }
+     memcpy(key + 4, pattern, len);
+     len += 4;
+     uint32_t top = simple_os.names_root;
+     uint32_t link = top;
+     while (!(link & NAME_LEAF)) {
+         const NameNode* node = &simple_os.names[link];
+         link = node->child[name_side(node, key)];
+         if (node->byte < len) {
+             top = link;
+         }
+     }
+     uint8_t found[NAME_KEY_LEN];
+     name_key((int32_t)(link & ~NAME_LEAF), found);
+     if (memcmp(found, key, len) != 0) {
+         return 0;
+     }
+     
+     // Each level of the subtree splits on a later bit, so the stack never holds more than one link per bit
+     uint32_t stack[NAME_KEY_LEN * 8 + 1];
+     int depth = 0;
+     stack[depth++] = top;
+     while (depth > 0) {
+         link = stack[--depth];
+         if (link & NAME_LEAF) {
+             int32_t id = (int32_t)(link & ~NAME_LEAF);
+             if ((prefix_only || fs_glob_match(pattern, fs_entry(id)->filename)) &&
+                 !fs_glob_add(ids, &count, &capacity, id)) {
+                 free(*ids);
+                 return -1;
+             }
+         } else {
+             stack[depth++] = simple_os.names[link].child[1];
+             stack[depth++] = simple_os.names[link].child[0];
+         }
+     }
+     return count;
+ }
+ 
+ /* ======= FILE SYSTEM OPERATIONS ======= */
+ 
+ // Create a file or directory named leaf in directory parent
+ // Returns its index, -1 if the file system cannot grow, -2 if it exists
+ int fs_create_in(int32_t parent, const char* leaf, bool is_dir) {
+     if ((leaf[0] == '.' && leaf[1] == '\0') || (leaf[0] == '.' && leaf[1] == '.' && leaf[2] == '\0')) {
+         return -2;
+     }
+     
+     char key[MAX_FILENAME_LEN];
+     size_t len = strlen(leaf);
+     fs_make_key(leaf, len, key);
+     uint32_t hash = fs_hash(parent, key);
+     if (dir_lookup(parent, key, hash) >= 0) {
+         return -2; // File already exists
+     }
+     // A new page of entries, a map page and a split at every level of the directory at most
+     if (!meta_reserve(DIR_MAX_HEIGHT + 3)) {
+         return -1;
+     }
+     
+     // Create the entry
+     int32_t file_id = fs_entry_alloc();
+     FileEntry* file = fs_entry(file_id);
+     memcpy(file->filename, key, MAX_FILENAME_LEN);
+     file->name_hash = hash;
+     file->parent = parent;
+     file->child_count = 0;
+     file->size = 0;
+     file->dir_root = 0;
+     file->is_compressed = simple_os.compress_enabled && simple_os.disk->layout == FS_LAYOUT_INPLACE && !is_dir;
+     file->is_deduped = simple_os.dedup_enabled && !file->is_compressed && simple_os.disk->layout == FS_LAYOUT_INPLACE && !is_dir;
+     bool mapped = simple_os.disk->layout == FS_LAYOUT_LOG || file->is_compressed || file->is_deduped;
+     file->map_page = mapped && !is_dir ? meta_alloc() : 0;
+     file->extent_count = 0; // Blocks are allocated when data is written back
+     file->extent_leaf = 0;
+     file->is_inline = simple_os.inline_enabled && !is_dir;
+     memset(file->inline_data, 0, sizeof(file->inline_data));
+     file->in_use = true;
+     file->is_dir = is_dir;
+     DirKey entry = { hash, file_id };
+     dir_insert(parent, entry);
+     name_index_insert(file_id);
+     fs_entry(parent)->child_count++;
+     simple_os.disk->file_count++;
+     dcache_invalidate(parent, leaf, len); // Forget a cached "does not exist"
+     
+     journal_dirty(file, sizeof(*file));
+     journal_dirty(fs_entry(parent), sizeof(FileEntry));
+     journal_dirty(&simple_os.disk->file_count, sizeof(uint32_t));
+     journal_end_op();
+     return file_id;
+ }
+ 
+ // Create a file or directory at path
+ // Returns its index, -1 if the file system cannot grow, -2 if it exists, -3 if the parent is missing
+ int fs_create_entry(const char* path, bool is_dir) {
+     char leaf[MAX_FILENAME_LEN];
+     int parent = fs_walk(path, leaf);
+     if (parent < 0 || leaf[0] == '\0') {
+         return -3; // Missing parent directory or no name
+     }
+     return fs_create_in(parent, leaf, is_dir);
+ }
+ 
+ // Create a new file
+ int fs_create(const char* filename) {
+     return fs_create_entry(filename, false);
+ }
+ 
+ // Create a new directory
+ int fs_mkdir(const char* path) {
+     return fs_create_entry(path, true);
+ }
+ 
+ // Delete a file or an empty directory by entry number
+ bool fs_delete_entry(int32_t file_id) {
+     if (file_id <= FS_ROOT) {
+         return false; // File not found
+     }
+     FileEntry* file = fs_entry(file_id);
+     if (file->is_dir && file->child_count > 0) {
+         return false; // Directory not empty
+     }
+     
+     int32_t parent = file->parent;
+     cache_drop(file_id, 0);
+     fs_release(file_id, 0);
+     fd_revoke(file_id);
+     DirKey entry = { file->name_hash, file_id };
+     dir_remove(parent, entry);
+     name_index_remove(file_id);
+     dcache_invalidate(parent, file->filename, strlen(file->filename));
+     dir_free(file->dir_root);
+     if (file->map_page != 0) {
+         meta_release(file->map_page);
+     }
+     fs_entry(parent)->child_count--;
+     if (simple_os.cwd == file_id) {
+         simple_os.cwd = parent;
+     }
+     simple_os.disk->file_count--;
+     fs_entry_free(file_id);
+     journal_dirty(fs_entry(parent), sizeof(FileEntry));
+     journal_dirty(&simple_os.disk->file_count, sizeof(uint32_t));
+     journal_end_op();
+     return true;
+ }
+ 
+ // Delete a file or an empty directory
+ // Returns 0, -1 if nothing is at that path, -2 if it is a directory that is not empty, -3 for the root
+ int fs_delete(const char* filename) {
+     int id = fs_find(filename);
+     if (id < 0) {
+         return -1;
+     }
+     if (id == FS_ROOT) {
+         return -3;
+     }
+     return fs_delete_entry(id) ? 0 : -2;
+ }
+ 
+ // Find a regular file by path; returns its index or -1
+ int fs_find_file(const char* path) {
+     int id = fs_find(path);
+     if (id < 0 || fs_entry(id)->is_dir) {
+         return -1;
+     }
+     return id;
+ }
+ 
+ // Write the absolute path of an entry into buffer
+ void fs_path(int id, char* buffer, size_t size) {
+     int chain[MAX_PATH_LEN]; // Deeper paths would not fit in the buffer anyway
+     int depth = 0;
+     while (id != FS_ROOT && depth < MAX_PATH_LEN) {
+         chain[depth++] = id;
+         id = fs_entry(id)->parent;
+     }
+     size_t pos = 0;
+     buffer[0] = '\0';
+     if (depth == 0) {
+         snprintf(buffer, size, "/");
+     }
+     while (depth > 0 && pos < size) {
+         int n = snprintf(buffer + pos, size - pos, "/%s", fs_entry(chain[--depth])->filename);
+         pos += n > 0 ? (size_t)n : 0;
+     }
+ }
+ 
+ // Change the shell's working directory; returns false if path is not a directory
+ bool fs_chdir(const char* path) {
+     int id = fs_find(path);
+     if (id < 0 || !fs_entry(id)->is_dir) {
+         return false;
+     }
+     simple_os.cwd = id;
+     return true;
+ }
+ 
+ // Reserve space for a file to grow to size bytes, with data written from offset on
+ bool fs_reserve(FileEntry* file, uint64_t offset, uint64_t size) {
+     if (file->is_compressed) {
+         return cluster_reserve(file, offset, size);
+     }
+     if (file->is_deduped) {
+         return dedup_reserve(file, offset, size);
+     }
+     uint16_t have = fs_blocks_for(file->size);
+     uint16_t need = fs_blocks_for(size);
+     if (need <= have) {
+         return true;
+     }
+     // Blocks are placed when they are written back; only account for them now
+     if (need - have > simple_os.disk->free_blocks) {
+         return false;
+     }
+     simple_os.disk->free_blocks -= need - have;
+     journal_dirty(&simple_os.disk->free_blocks, sizeof(simple_os.disk->free_blocks));
+     return true;
+ }
+ 
+ // Before blocks of an extent file that a snapshot uses are written, from offset up to end, move the
+ // file to a block map so the writes go to new blocks; returns false if there is no metadata space
+ bool fs_cow_prepare(int32_t id, uint64_t offset, uint64_t end) {
+     FileEntry* file = fs_entry(id);
+     if (file->is_inline || file->is_compressed || file->is_deduped || simple_os.disk->layout != FS_LAYOUT_INPLACE) {
+         return true;
+     }
+     if (offset > file->size) {
+         offset = file->size; // The gap up to offset is written with zeros
+     }
+     if (end <= offset) {
+         return true;
+     }
+     uint16_t first = (uint16_t)(offset / BLOCK_SIZE);
+     uint16_t last = (uint16_t)((end - 1) / BLOCK_SIZE);
+     Extent* list = extent_list(file);
+     bool pinned = false;
+     for (uint8_t e = 0; e < file->extent_count && !pinned; e++) {
+         uint16_t from = list[e].logical > first ? list[e].logical : first;
+         uint16_t to = list[e].logical + list[e].length - 1;
+         for (uint32_t i = from; i <= to && i <= last && !pinned; i++) {
+             pinned = block_pinned(list[e].start + (uint16_t)(i - list[e].logical));
+         }
+     }
+     if (!pinned) {
+         return true;
+     }
+     if (!meta_reserve(DEDUP_MAP_LEAVES + 1)) {
+         return false;
+     }
+     dedup_convert(fs_entry(id));
+     return true;
+ }
+ 
+ // Copy len bytes into a file at offset through the page cache; data NULL writes zeros
+ void fs_copy_in(int id, uint64_t offset, const uint8_t* data, uint64_t len) {
+     FileEntry* file = fs_entry(id);
+     while (len > 0) {
+         uint32_t within = offset % BLOCK_SIZE;
+         uint32_t chunk = BLOCK_SIZE - within;
+         if (chunk > len) {
+             chunk = (uint32_t)len;
+         }
+         
+         // Only a partial page that already holds file data needs reading first
+         bool fill = chunk < BLOCK_SIZE && offset - within < file->size;
+         CachePage* page = cache_get(id, (uint16_t)(offset / BLOCK_SIZE), fill);
+         if (data) {
+             memcpy(page->data + within, data, chunk);
+             data += chunk;
+         } else {
+             memset(page->data + within, 0, chunk);
+         }
+         cache_mark_dirty(page);
+         offset += chunk;
+         len -= chunk;
+     }
+ }
+ 
+ /* Files start with their data inline in the FileEntry, which saves a block
+  * and a page cache lookup for the many files that never outgrow it. Inline
+  * data is journaled along with the rest of the entry. A write that takes the
+  * file past FS_INLINE_DATA moves the data out to blocks, and a file
+  * truncated to zero goes back to being inline. */
+ 
+ // Move a file's inline data out to blocks; fails if there is no space
+ bool fs_uninline(int id) {
+     FileEntry* file = fs_entry(id);
+     uint8_t data[FS_INLINE_DATA];
+     uint32_t size = (uint32_t)file->size;
+     memcpy(data, file->inline_data, size);
+     
+     memset(file->inline_data, 0, sizeof(file->inline_data));
+     file->is_inline = false;
+     file->size = 0;
+     if (!fs_reserve(file, 0, size)) {
+         memcpy(file->inline_data, data, size);
+         file->is_inline = true;
+         file->size = size;
+         return false;
+     }
+     file->size = size;
+     fs_copy_in(id, 0, data, size);
+     journal_dirty(file, sizeof(*file));
+     return true;
+ }
+ 
+ // Write len bytes at offset of file id, growing it as needed
+ // Returns the bytes written or -2 if out of space
+ int fs_write_entry(int32_t id, uint64_t offset, const void* data, uint32_t len) {
+     if (!fs_cow_prepare(id, offset, offset + len)) {
+         return -2;
+     }
+     if (fs_entry(id)->is_deduped && !meta_reserve(DEDUP_MAP_LEAVES)) {
+         return -2;
+     }
+     FileEntry* file = fs_entry(id);
+     uint64_t end = offset + len;
+     if (file->is_inline && end <= FS_INLINE_DATA) {
+         if (offset > file->size) {
+             memset(file->inline_data + file->size, 0, offset - file->size);
+         }
+         memcpy(file->inline_data + offset, data, len);
+         if (end > file->size) {
+             file->size = end;
+         }
+         journal_dirty(file, sizeof(*file));
+         journal_end_op();
+         return (int)len;
+     }
+     if (end > fs_max_size() || (file->is_inline && !fs_uninline(id)) || !fs_reserve(file, offset, end)) {
+         return -2;
+     }
+     
+     // Grow first so pages past the old end that are written back early get blocks
+     uint64_t old_size = file->size;
+     if (end > file->size) {
+         file->size = end;
+     }
+     
+     // Writing past the end leaves a hole that reads back as zeros
+     if (offset > old_size) {
+         fs_copy_in(id, old_size, NULL, offset - old_size);
+     }
+     fs_copy_in(id, offset, data, len);
+     journal_dirty(file, sizeof(*file));
+     journal_end_op();
+     return (int)len;
+ }
+ 
+ // Write len bytes at offset, growing the file as needed
+ // Returns the bytes written, -1 if the file does not exist, -2 if out of space
+ int fs_write(const char* filename, uint64_t offset, const void* data, uint32_t len) {
+     int id = fs_find_file(filename);
+     if (id < 0) {
+         return -1;
+     }
+     return fs_write_entry(id, offset, data, len);
+ }
+ 
+ // Read up to len bytes from offset of file id
+ // Returns the bytes read, or -3 if a block of the range failed its checksum
+ int fs_read_entry(int32_t id, uint64_t offset, void* data, uint32_t len) {
+     FileEntry* file = fs_entry(id);
+     if (offset >= file->size) {
+         return 0;
+     }
+     if (len > file->size - offset) {
+         len = (uint32_t)(file->size - offset);
+     }
+     if (file->is_inline) {
+         memcpy(data, file->inline_data + offset, len);
+         return (int)len;
+     }
+     
+     uint64_t first = offset / BLOCK_SIZE;
+     cache_readahead(id, (uint16_t)first, (uint16_t)((offset + len - 1) / BLOCK_SIZE - first + 1));
+     uint8_t* out = data;
+     uint32_t remaining = len;
+     while (remaining > 0) {
+         uint32_t within = offset % BLOCK_SIZE;
+         uint32_t chunk = BLOCK_SIZE - within;
+         if (chunk > remaining) {
+             chunk = remaining;
+         }
+         CachePage* page = cache_get(id, (uint16_t)(offset / BLOCK_SIZE), true);
+         if (page->damaged) {
+             return -3;
+         }
+         memcpy(out, page->data + within, chunk);
+         offset += chunk;
+         out += chunk;
+         remaining -= chunk;
+     }
+     return (int)len;
+ }
+ 
+ // Read up to len bytes from offset; returns the bytes read, -1 if the file does not exist
+ // or -3 if its data failed a checksum
+ int fs_read(const char* filename, uint64_t offset, void* data, uint32_t len) {
+     int id = fs_find_file(filename);
+     if (id < 0) {
+         return -1;
+     }
+     return fs_read_entry(id, offset, data, len);
+ }
+ 
+ // Set the size of file id, freeing blocks past the end or zero-filling new space
+ // Returns 0 or -2 if out of space
+ int fs_truncate_entry(int32_t id, uint64_t size) {
+     if (!fs_cow_prepare(id, fs_entry(id)->size, size)) {
+         return -2; // Zero-filling the last page writes it
+     }
+     if (fs_entry(id)->is_deduped && !meta_reserve(DEDUP_MAP_LEAVES)) {
+         return -2;
+     }
+     FileEntry* file = fs_entry(id);
+     if (size > fs_max_size()) {
+         return -2;
+     }
+     if (file->is_inline && size <= FS_INLINE_DATA) {
+         // Bytes past the end of inline data are kept zero
+         if (size < file->size) {
+             memset(file->inline_data + size, 0, file->size - size);
+         }
+         file->size = size;
+         journal_dirty(file, sizeof(*file));
+         journal_end_op();
+         return 0;
+     }
+     if (file->is_inline && !fs_uninline(id)) {
+         return -2;
+     }
+     if (size < file->size) {
+         uint16_t keep = fs_blocks_for(size);
+         cache_drop(id, keep);
+         fs_release(id, keep);
+         if (size == 0 && simple_os.inline_enabled) {
+             memset(file->inline_data, 0, sizeof(file->inline_data));
+             file->is_inline = true;
+         }
+     } else if (size > file->size) {
+         if (!fs_reserve(file, file->size, size)) {
+             return -2;
+         }
+         uint64_t old_size = file->size;
+         file->size = size;
+         fs_copy_in(id, old_size, NULL, size - old_size);
+     }
+     file->size = size;
+     journal_dirty(file, sizeof(*file));
+     journal_end_op();
+     return 0;
+ }
+ 
+ // Set a file's size, freeing blocks past the end or zero-filling new space
+ // Returns 0, -1 if the file does not exist, -2 if out of space
+ int fs_truncate(const char* filename, uint64_t size) {
+     int id = fs_find_file(filename);
+     if (id < 0) {
+         return -1;
+     }
+     return fs_truncate_entry(id, size);
+ }
+ 
+ // Make a new file named leaf in directory parent with the contents of file src, sharing its data
+ // blocks until either is written
+ // Returns 0, -2 if out of space, -3 if the new file cannot be created,
+ // -4 if the file cannot be cloned: the log layout and compressed files have no shared blocks
+ int fs_clone_entry(int32_t src, int32_t parent, const char* leaf) {
+     if (simple_os.disk->layout != FS_LAYOUT_INPLACE || fs_entry(src)->is_compressed) {
+         return -4;
+     }
+     cache_sync(); // The shared blocks have to hold everything written so far
+     int dst = fs_create_in(parent, leaf, false);
+     if (dst < 0) {
+         return -3;
+     }
+     FileEntry* file = fs_entry(src);
+     if (file->is_inline) {
+         uint8_t data[FS_INLINE_DATA];
+         uint32_t size = (uint32_t)file->size;
+         memcpy(data, file->inline_data, size);
+         if (size > 0 && fs_write_entry(dst, 0, data, size) < 0) {
+             fs_delete_entry(dst);
+             return -2;
+         }
+         return 0;
+     }
+     
+     // An extent file moves to a block map first, then the map is copied
+     if (!meta_reserve(2 * DEDUP_MAP_LEAVES + 2)) {
+         fs_delete_entry(dst);
+         return -2;
+     }
+     file = fs_entry(src);
+     if (!file->is_deduped) {
+         dedup_convert(file);
+     }
+     DiskImage* disk = simple_os.disk;
+     uint16_t have = fs_blocks_for(file->size);
+     for (uint16_t i = 0; i < have; i++) {
+         if (disk->block_refs[dedup_block(file, i)] == UINT16_MAX) {
+             journal_end_op();
+             fs_delete_entry(dst);
+             return -2;
+         }
+     }
+     
+     FileEntry* copy = fs_entry(dst);
+     if (copy->map_page == 0) {
+         copy->map_page = meta_alloc();
+     } else {
+         memset(meta_page(copy->map_page), 0, BLOCK_SIZE); // A cluster map, or an empty block map
+         journal_dirty(meta_page(copy->map_page), BLOCK_SIZE);
+     }
+     copy->is_inline = false;
+     copy->is_compressed = false;
+     copy->is_deduped = true;
+     memset(copy->inline_data, 0, sizeof(copy->inline_data));
+     uint32_t* from = (uint32_t*)meta_page(file->map_page);
+     uint32_t* to = (uint32_t*)meta_page(copy->map_page);
+     for (uint32_t l = 0; l < (have + DEDUP_MAP_ENTRIES - 1) / DEDUP_MAP_ENTRIES; l++) {
+         if (from[l] == 0) {
+             continue;
+         }
+         to[l] = meta_alloc();
+         journal_dirty(&to[l], sizeof(uint32_t));
+         uint16_t* source_map = (uint16_t*)meta_page(from[l]);
+         uint16_t* target_map = (uint16_t*)meta_page(to[l]);
+         for (uint32_t i = 0; i < DEDUP_MAP_ENTRIES && l * DEDUP_MAP_ENTRIES + i < have; i++) {
+             uint16_t block = source_map[i] & (DEDUP_RESERVED - 1);
+             target_map[i] = block; // A page with no block reads as zeros
+             if (block != 0) {
+                 disk->block_refs[block]++;
+                 journal_dirty(&disk->block_refs[block], sizeof(uint16_t));
+             }
+         }
+     }
+     copy->size = file->size;
+     journal_dirty(copy, sizeof(*copy));
+     journal_end_op();
+     return 0;
+ }
+ 
+ // Make target a new file with the contents of source, sharing its data blocks until either is written
+ // Returns 0, -1 if source is not a file, -2 if out of space, -3 if target cannot be created,
+ // -4 if the file cannot be cloned: the log layout and compressed files have no shared blocks
+ int fs_clone(const char* source, const char* target) {
+     int src = fs_find_file(source);
+     if (src < 0) {
+         return -1;
+     }
+     char leaf[MAX_FILENAME_LEN];
+     int parent = fs_walk(target, leaf);
+     if (parent < 0 || leaf[0] == '\0') {
+         return -3;
+     }
+     return fs_clone_entry(src, parent, leaf);
+ }
+ /* ======= TMPFS ======= */
+ 
+ /* A tmpfs mount keeps its files in host memory only. No page cache, block
+  * allocator or journal stands between a write and the data, and nothing
+  * outlives the mount, which suits scratch files. Nodes sit in a growable
+  * array and are found through a hash table keyed by (directory, padded
+  * name) like the disk's directories; each directory also links its children
+  * in creation order for listings. File data is a table of TMPFS_CHUNK-byte
+  * chunks allocated on first write: holes cost nothing, and growing a file
+  * never copies the data it already holds. Bytes of a chunk past the end of
+  * its file are kept zero, so a file that grows reads zeros there. */
+ 
+ // Take a node from the free list or the end of the array; -1 if out of memory
+ int32_t tmpfs_node_alloc(Tmpfs* fs) {
+     int32_t id = fs->free;
+     if (id >= 0) {
+         fs->free = fs->nodes[id].chain;
+     } else {
+         if (fs->used == fs->size) {
+             int32_t size = fs->size > 0 ? fs->size * 2 : 64;
+             TmpfsNode* grown = realloc(fs->nodes, size * sizeof(TmpfsNode));
+             if (!grown) {
+                 return -1;
+             }
+             fs->nodes = grown;
+             fs->size = size;
+         }
+         id = fs->used++;
+     }
+     TmpfsNode* node = &fs->nodes[id];
+     memset(node, 0, sizeof(*node));
+     node->chain = -1;
+     node->prev = -1;
+     node->next = -1;
+     node->first = -1;
+     node->last = -1;
+     return id;
+ }
+ 
+ // Double the hash table and rehash every node; false if out of memory
+ bool tmpfs_grow_buckets(Tmpfs* fs) {
+     uint32_t count = fs->bucket_count * 2;
+     int32_t* buckets = malloc(count * sizeof(int32_t));
+     if (!buckets) {
+         return false;
+     }
+     memset(buckets, -1, count * sizeof(int32_t));
+     for (int32_t id = 1; id < fs->used; id++) {
+         TmpfsNode* node = &fs->nodes[id];
+         if (node->in_use) {
+             node->chain = buckets[node->hash & (count - 1)];
+             buckets[node->hash & (count - 1)] = id;
+         }
+     }
+     free(fs->buckets);
+     fs->buckets = buckets;
+     fs->bucket_count = count;
+     return true;
+ }
+ 
+ // New empty tmpfs holding only its root; NULL if out of memory
+ void* tmpfs_mount() {
+     Tmpfs* fs = calloc(1, sizeof(Tmpfs));
+     if (!fs) {
+         return NULL;
+     }
+     fs->free = -1;
+     fs->bucket_count = 32;
+     fs->buckets = malloc(fs->bucket_count * sizeof(int32_t));
+     if (!fs->buckets || tmpfs_node_alloc(fs) != FS_ROOT) {
+         free(fs->buckets);
+         free(fs->nodes);
+         free(fs);
+         return NULL;
+     }
+     memset(fs->buckets, -1, fs->bucket_count * sizeof(int32_t));
+     fs->nodes[FS_ROOT].in_use = true;
+     fs->nodes[FS_ROOT].is_dir = true;
+     fs->nodes[FS_ROOT].parent = FS_ROOT;
+     return fs;
+ }
+ 
+ // Free the data of a node from chunk keep on
+ void tmpfs_release(Tmpfs* fs, TmpfsNode* node, uint32_t keep) {
+     for (uint32_t c = keep; c < node->chunk_count; c++) {
+         if (node->chunks[c]) {
+             free(node->chunks[c]);
+             node->chunks[c] = NULL;
+             fs->bytes -= TMPFS_CHUNK;
+         }
+     }
+     if (keep == 0) {
+         free(node->chunks);
+         node->chunks = NULL;
+         node->chunk_count = 0;
+     }
+ }
+ 
+ // Free a tmpfs and everything in it
+ void tmpfs_unmount(void* state) {
+     Tmpfs* fs = state;
+     for (int32_t id = 0; id < fs->used; id++) {
+         if (fs->nodes[id].in_use) {
+             tmpfs_release(fs, &fs->nodes[id], 0);
+         }
+     }
+     free(fs->nodes);
+     free(fs->buckets);
+     free(fs);
+ }
+ 
+ int32_t tmpfs_lookup(void* state, int32_t dir, const char* name, size_t len) {
+     Tmpfs* fs = state;
+     char key[MAX_FILENAME_LEN];
+     fs_make_key(name, len, key);
+     uint32_t hash = fs_hash(dir, key);
+     for (int32_t id = fs->buckets[hash & (fs->bucket_count - 1)]; id >= 0; id = fs->nodes[id].chain) {
+         TmpfsNode* node = &fs->nodes[id];
+         if (node->hash == hash && node->parent == dir && memcmp(node->name, key, MAX_FILENAME_LEN) == 0) {
+             return id;
+         }
+     }
+     return -1;
+ }
+ 
+ int32_t tmpfs_parent(void* state, int32_t id) {
+     Tmpfs* fs = state;
+     return fs->nodes[id].parent;
+ }
+ 
+ int32_t tmpfs_create(void* state, int32_t dir, const char* name, bool is_dir) {
+     Tmpfs* fs = state;
+     if ((name[0] == '.' && name[1] == '\0') || (name[0] == '.' && name[1] == '.' && name[2] == '\0')) {
+         return -2;
+     }
+     if (tmpfs_lookup(fs, dir, name, strlen(name)) >= 0) {
+         return -2;
+     }
+     if (fs->files + 1 > fs->bucket_count && !tmpfs_grow_buckets(fs)) {
+         return -1;
+     }
+     int32_t id = tmpfs_node_alloc(fs);
+     if (id < 0) {
+         return -1;
+     }
+     TmpfsNode* node = &fs->nodes[id];
+     fs_make_key(name, strlen(name), node->name);
+     node->hash = fs_hash(dir, node->name);
+     node->parent = dir;
+     node->in_use = true;
+     node->is_dir = is_dir;
+     node->chain = fs->buckets[node->hash & (fs->bucket_count - 1)];
+     fs->buckets[node->hash & (fs->bucket_count - 1)] = id;
+     
+     TmpfsNode* parent = &fs->nodes[dir];
+     node->prev = parent->last;
+     if (parent->last >= 0) {
+         fs->nodes[parent->last].next = id;
+     } else {
+         parent->first = id;
+     }
+     parent->last = id;
+     parent->child_count++;
+     fs->files++;
+     return id;
+ }
+ 
+ bool tmpfs_remove(void* state, int32_t id) {
+     Tmpfs* fs = state;
+     TmpfsNode* node = &fs->nodes[id];
+     if (id == FS_ROOT || (node->is_dir && node->child_count > 0)) {
+         return false;
+     }
+     int32_t* link = &fs->buckets[node->hash & (fs->bucket_count - 1)];
+     while (*link != id) {
+         link = &fs->nodes[*link].chain;
+     }
+     *link = node->chain;
+     
+     TmpfsNode* parent = &fs->nodes[node->parent];
+     if (node->prev >= 0) {
+         fs->nodes[node->prev].next = node->next;
+     } else {
+         parent->first = node->next;
+     }
+     if (node->next >= 0) {
+         fs->nodes[node->next].prev = node->prev;
+     } else {
+         parent->last = node->prev;
+     }
+     parent->child_count--;
+     fs->files--;
+     
+     tmpfs_release(fs, node, 0);
+     node->in_use = false;
+     node->chain = fs->free;
+     fs->free = id;
+     return true;
+ }
+ 
+ int tmpfs_read(void* state, int32_t id, uint64_t offset, void* data, uint32_t len) {
+     Tmpfs* fs = state;
+     TmpfsNode* node = &fs->nodes[id];
+     if (offset >= node->size) {
+         return 0;
+     }
+     if (len > node->size - offset) {
+         len = (uint32_t)(node->size - offset);
+     }
+     uint8_t* out = data;
+     for (uint32_t done = 0; done < len;) {
+         uint64_t c = (offset + done) / TMPFS_CHUNK;
+         uint32_t within = (offset + done) % TMPFS_CHUNK;
+         uint32_t chunk = TMPFS_CHUNK - within < len - done ? TMPFS_CHUNK - within : len - done;
+         if (c < node->chunk_count && node->chunks[c]) {
+             memcpy(out + done, node->chunks[c] + within, chunk);
+         } else {
+             memset(out + done, 0, chunk); // A hole
+         }
+         done += chunk;
+     }
+     return (int)len;
+ }
+ 
+ // Allocate the chunks that bytes offset up to end fall in; false if the mount is full
+ bool tmpfs_reserve(Tmpfs* fs, TmpfsNode* node, uint64_t offset, uint64_t end) {
+     if (end > TMPFS_MAX_SIZE) {
+         return false;
+     }
+     uint32_t first = (uint32_t)(offset / TMPFS_CHUNK);
+     uint32_t count = (uint32_t)((end + TMPFS_CHUNK - 1) / TMPFS_CHUNK);
+     uint32_t missing = 0;
+     for (uint32_t c = first; c < count; c++) {
+         missing += c >= node->chunk_count || !node->chunks[c];
+     }
+     if (fs->bytes + (uint64_t)missing * TMPFS_CHUNK > TMPFS_MAX_SIZE) {
+         return false;
+     }
+     if (count > node->chunk_count) {
+         uint32_t slots = node->chunk_count > 0 ? node->chunk_count : 4;
+         while (slots < count) {
+             slots *= 2;
+         }
+         uint8_t** grown = realloc(node->chunks, slots * sizeof(uint8_t*));
+         if (!grown) {
+             return false;
+         }
+         memset(grown + node->chunk_count, 0, (slots - node->chunk_count) * sizeof(uint8_t*));
+         node->chunks = grown;
+         node->chunk_count = slots;
+     }
+     for (uint32_t c = first; c < count; c++) {
+         if (!node->chunks[c]) {
+             node->chunks[c] = calloc(1, TMPFS_CHUNK);
+             if (!node->chunks[c]) {
+                 return false;
+             }
+             fs->bytes += TMPFS_CHUNK;
+         }
+     }
+     return true;
+ }
+ 
+ int tmpfs_write(void* state, int32_t id, uint64_t offset, const void* data, uint32_t len) {
+     Tmpfs* fs = state;
+     TmpfsNode* node = &fs->nodes[id];
+     if (!tmpfs_reserve(fs, node, offset, offset + len)) {
+         return -2;
+     }
+     const uint8_t* in = data;
+     for (uint32_t done = 0; done < len;) {
+         uint64_t c = (offset + done) / TMPFS_CHUNK;
+         uint32_t within = (offset + done) % TMPFS_CHUNK;
+         uint32_t chunk = TMPFS_CHUNK - within < len - done ? TMPFS_CHUNK - within : len - done;
+         memcpy(node->chunks[c] + within, in + done, chunk);
+         done += chunk;
+     }
+     if (offset + len > node->size) {
+         node->size = offset + len;
+     }
+     return (int)len;
+ }
+ 
+ int tmpfs_truncate(void* state, int32_t id, uint64_t size) {
+     Tmpfs* fs = state;
+     TmpfsNode* node = &fs->nodes[id];
+     if (size > TMPFS_MAX_SIZE) {
+         return -2;
+     }
+     if (size < node->size) {
+         uint32_t keep = (uint32_t)((size + TMPFS_CHUNK - 1) / TMPFS_CHUNK);
+         tmpfs_release(fs, node, keep);
+         uint64_t c = size / TMPFS_CHUNK;
+         if (size % TMPFS_CHUNK != 0 && c < node->chunk_count && node->chunks[c]) {
+             memset(node->chunks[c] + size % TMPFS_CHUNK, 0, TMPFS_CHUNK - size % TMPFS_CHUNK);
+         }
+     }
+     node->size = size; // Growing leaves a hole
+     return 0;
+ }
+ 
+ // The cursor holds the entry to return next, so the caller may remove the one it just got
+ int32_t tmpfs_next(void* state, int32_t dir, DirCursor* cursor) {
+     Tmpfs* fs = state;
+     if (!cursor->started) {
+         cursor->started = true;
+         cursor->page = (uint32_t)(fs->nodes[dir].first + 1);
+     }
+     if (cursor->page == 0) {
+         return -1;
+     }
+     int32_t id = (int32_t)cursor->page - 1;
+     cursor->page = (uint32_t)(fs->nodes[id].next + 1);
+     return id;
+ }
+ 
+ void tmpfs_stat(void* state, int32_t id, VfsStat* stat) {
+     Tmpfs* fs = state;
+     stat->name = fs->nodes[id].name;
+     stat->size = fs->nodes[id].size;
+     stat->is_dir = fs->nodes[id].is_dir;
+ }
+ 
+ // Children of dir whose names match pattern, in creation order
+ int32_t tmpfs_glob(void* state, int32_t dir, const char* pattern, int32_t** ids) {
+     Tmpfs* fs = state;
+     int32_t count = 0;
+     int32_t capacity = 0;
+     *ids = NULL;
+     for (int32_t id = fs->nodes[dir].first; id >= 0; id = fs->nodes[id].next) {
+         if (fs_glob_match(pattern, fs->nodes[id].name) && !fs_glob_add(ids, &count, &capacity, id)) {
+             free(*ids);
+             return -1;
+         }
+     }
+     return count;
+ }
+ 
+ const FsOps tmpfs_ops = {
+     "tmpfs", tmpfs_mount, tmpfs_unmount, tmpfs_lookup, tmpfs_parent, tmpfs_create, tmpfs_remove,
+     tmpfs_read, tmpfs_write, tmpfs_truncate, tmpfs_next, tmpfs_stat, tmpfs_glob,
+ };
+ /* ======= VIRTUAL FILE SYSTEM ======= */
+ 
+ /* Paths name entries in a tree of mounted file systems, each reached through
+  * its FsOps. Slot 0 of the mount table is the disk at the root; a tmpfs can
+  * be mounted on any directory. A path is made absolute from the working
+  * directory and its "." and ".." components are resolved by name, then the
+  * mount with the longest path prefixing it walks the rest. Mounts are kept
+  * by path rather than by the number of the directory they cover, so they
+  * stay in place while the disk under them is formatted, swapped for another
+  * image or rolled back to a snapshot. */
+ 
+ int32_t diskfs_lookup(void* fs, int32_t dir, const char* name, size_t len) {
+     (void)fs;
+     return fs_lookup_component(dir, name, len);
+ }
+ 
+ int32_t diskfs_parent(void* fs, int32_t id) {
+     (void)fs;
+     return fs_entry(id)->parent;
+ }
+ 
+ int32_t diskfs_create(void* fs, int32_t dir, const char* name, bool is_dir) {
+     (void)fs;
+     return fs_create_in(dir, name, is_dir);
+ }
+ 
+ bool diskfs_remove(void* fs, int32_t id) {
+     (void)fs;
+     return fs_delete_entry(id);
+ }
+ 
+ int diskfs_read(void* fs, int32_t id, uint64_t offset, void* data, uint32_t len) {
+     (void)fs;
+     return fs_read_entry(id, offset, data, len);
+ }
+ 
+ int diskfs_write(void* fs, int32_t id, uint64_t offset, const void* data, uint32_t len) {
+     (void)fs;
+     return fs_write_entry(id, offset, data, len);
+ }
+ 
+ int diskfs_truncate(void* fs, int32_t id, uint64_t size) {
+     (void)fs;
+     return fs_truncate_entry(id, size);
+ }
+ 
+ int32_t diskfs_next(void* fs, int32_t dir, DirCursor* cursor) {
+     (void)fs;
+     return dir_next(dir, cursor);
+ }
+ 
+ void diskfs_stat(void* fs, int32_t id, VfsStat* stat) {
+     (void)fs;
+     FileEntry* file = fs_entry(id);
+     stat->name = id == FS_ROOT ? "" : file->filename;
+     stat->size = file->size;
+     stat->is_dir = file->is_dir;
+ }
+ 
+ int32_t diskfs_glob(void* fs, int32_t dir, const char* pattern, int32_t** ids) {
+     (void)fs;
+     return fs_glob(dir, pattern, ids);
+ }
+ 
+ // The disk is mounted once at startup and never unmounted, so it has no mount or unmount
+ const FsOps diskfs_ops = {
+     "disk", NULL, NULL, diskfs_lookup, diskfs_parent, diskfs_create, diskfs_remove,
+     diskfs_read, diskfs_write, diskfs_truncate, diskfs_next, diskfs_stat, diskfs_glob,
+ };
+ 
+ void vfs_init() {
+     Mount* disk = &simple_os.mounts[0];
+     disk->in_use = true;
+     disk->ops = &diskfs_ops;
+     disk->fs = NULL;
+     disk->path[0] = '\0';
+     disk->path_len = 0;
+     simple_os.cwd_mount = 0;
+ }
+ 
+ Mount* vfs_mount_at(VfsNode node) {
+     return &simple_os.mounts[node.mount];
+ }
+ 
+ void vfs_stat(VfsNode node, VfsStat* stat) {
+     Mount* mount = vfs_mount_at(node);
+     mount->ops->stat(mount->fs, node.id, stat);
+ }
+ 
+ // The shell's working directory
+ VfsNode vfs_cwd() {
+     VfsNode node = { simple_os.cwd_mount, simple_os.cwd };
+     if (node.mount != 0) {
+         node.id = simple_os.mounts[node.mount].cwd;
+     }
+     return node;
+ }
+ 
+ // Write the absolute path of an entry into buffer
+ void vfs_path(VfsNode node, char* buffer, size_t size) {
+     Mount* mount = vfs_mount_at(node);
+     int32_t chain[MAX_PATH_LEN]; // Deeper paths would not fit in the buffer anyway
+     int depth = 0;
+     while (node.id != FS_ROOT && depth < MAX_PATH_LEN) {
+         chain[depth++] = node.id;
+         node.id = mount->ops->parent(mount->fs, node.id);
+     }
+     int n = snprintf(buffer, size, "%s", mount->path_len > 0 || depth > 0 ? mount->path : "/");
+     size_t pos = n > 0 ? (size_t)n : 0;
+     while (depth > 0 && pos < size) {
+         VfsStat stat;
+         mount->ops->stat(mount->fs, chain[--depth], &stat);
+         n = snprintf(buffer + pos, size - pos, "/%s", stat.name);
+         pos += n > 0 ? (size_t)n : 0;
+     }
+ }
+ 
+ // Mount whose path is the longest one prefixing the absolute path, at a component boundary
+ int vfs_mount_of(const char* path, size_t len) {
+     int best = 0;
+     for (int m = 1; m < MAX_MOUNTS; m++) {
+         Mount* mount = &simple_os.mounts[m];
+         if (mount->in_use && mount->path_len <= len && mount->path_len > simple_os.mounts[best].path_len &&
+             memcmp(mount->path, path, mount->path_len) == 0 &&
+             (mount->path_len == len || path[mount->path_len] == '/')) {
+             best = m;
+         }
+     }
+     return best;
+ }
+ 
+ // Walk a path from the root or the working directory, crossing into mounted file systems
+ // With leaf set, stops before the last component, copies it to leaf and finds its directory
+ // Returns false if a component is missing or not a directory, or the path is too long
+ bool vfs_walk(const char* path, char* leaf, VfsNode* node) {
+     char full[MAX_PATH_LEN + 1]; // Absolute, without "." or ".." components or a trailing slash
+     size_t len = 0;
+     if (path[0] != '/') {
+         vfs_path(vfs_cwd(), full, sizeof(full));
+         len = strlen(full);
+         len = len == 1 ? 0 : len; // The root is ""
+     }
+     size_t end = strlen(path);
+     if (leaf) {
+         while (end > 0 && path[end - 1] == '/') {
+             end--;
+         }
+         size_t start = end;
+         while (start > 0 && path[start - 1] != '/') {
+             start--;
+         }
+         size_t n = end - start < MAX_FILENAME_LEN - 1 ? end - start : MAX_FILENAME_LEN - 1;
+         memcpy(leaf, path + start, n);
+         leaf[n] = '\0';
+         end = start;
+     }
+     for (size_t p = 0; p < end;) {
+         while (p < end && path[p] == '/') {
+             p++;
+         }
+         size_t q = p;
+         while (q < end && path[q] != '/') {
+             q++;
+         }
+         if (q - p == 2 && path[p] == '.' && path[p + 1] == '.') {
+             while (len > 0 && full[--len] != '/') {
+                 // Drop the last component
+             }
+         } else if (q > p && !(q - p == 1 && path[p] == '.')) {
+             if (len + 1 + (q - p) > MAX_PATH_LEN) {
+                 return false;
+             }
+             full[len++] = '/';
+             memcpy(full + len, path + p, q - p);
+             len += q - p;
+         }
+         p = q;
+     }
+     full[len] = '\0';
+     
+     node->mount = vfs_mount_of(full, len);
+     node->id = FS_ROOT;
+     Mount* mount = vfs_mount_at(*node);
+     VfsStat stat;
+     for (size_t p = mount->path_len; p < len;) {
+         size_t q = ++p; // Past the slash
+         while (q < len && full[q] != '/') {
+             q++;
+         }
+         mount->ops->stat(mount->fs, node->id, &stat);
+         if (!stat.is_dir) {
+             return false;
+         }
+         node->id = mount->ops->lookup(mount->fs, node->id, full + p, q - p);
+         if (node->id < 0) {
+             return false;
+         }
+         p = q;
+     }
+     if (leaf) {
+         mount->ops->stat(mount->fs, node->id, &stat);
+         return stat.is_dir;
+     }
+     return true;
+ }
+ 
+ // Find a file or directory by path; returns false if there is none
+ bool vfs_find(const char* path, VfsNode* node) {
+     return vfs_walk(path, NULL, node);
+ }
+ 
+ // Find a regular file by path; returns false if there is none
+ bool vfs_find_file(const char* path, VfsNode* node) {
+     VfsStat stat;
+     if (!vfs_find(path, node)) {
+         return false;
+     }
+     vfs_stat(*node, &stat);
+     return !stat.is_dir;
+ }
+ 
+ // Create a file or directory at path, setting node to it if node is not NULL
+ // Returns its entry number, -1 if the file system is full, -2 if it exists, -3 if the parent is missing
+ int32_t vfs_create(const char* path, bool is_dir, VfsNode* node) {
+     char leaf[MAX_FILENAME_LEN];
+     VfsNode dir;
+     if (!vfs_walk(path, leaf, &dir) || leaf[0] == '\0') {
+         return -3;
+     }
+     Mount* mount = vfs_mount_at(dir);
+     int32_t id = mount->ops->create(mount->fs, dir.id, leaf, is_dir);
+     if (node) {
+         node->mount = dir.mount;
+         node->id = id;
+     }
+     return id;
+ }
+ 
+ // Whether a directory has a file system mounted on it
+ bool vfs_covered(VfsNode node) {
+     VfsStat stat;
+     vfs_stat(node, &stat);
+     if (!stat.is_dir) {
+         return false;
+     }
+     char path[MAX_PATH_LEN + 1];
+     path[0] = '\0';
+     for (int m = 1; m < MAX_MOUNTS; m++) {
+         if (simple_os.mounts[m].in_use) {
+             if (path[0] == '\0') {
+                 vfs_path(node, path, sizeof(path));
+             }
+             if (strcmp(path, simple_os.mounts[m].path) == 0) {
+                 return true;
+             }
+         }
+     }
+     return false;
+ }
+ 
+ // Delete a file or an empty directory
+ // Returns 0, -2 if it is a directory that is not empty, -3 if it is a root or a mount point
+ int vfs_delete_node(VfsNode node) {
+     Mount* mount = vfs_mount_at(node);
+     if (node.id == FS_ROOT || vfs_covered(node)) {
+         return -3;
+     }
+     int32_t parent = mount->ops->parent(mount->fs, node.id);
+     if (!mount->ops->remove(mount->fs, node.id)) {
+         return -2; // The only entries either file system refuses
+     }
+     // The disk revokes its own open files and moves its own working directory
+     if (node.mount != 0) {
+         fd_revoke_mount(node.mount, node.id);
+         if (mount->cwd == node.id) {
+             mount->cwd = parent;
+         }
+     }
+     return 0;
+ }
+ 
+ // Delete a file or an empty directory by path; returns what fs_delete does, -3 also for a mount point
+ int vfs_delete(const char* path) {
+     VfsNode node;
+     if (!vfs_find(path, &node)) {
+         return -1;
+     }
+     return vfs_delete_node(node);
+ }
+ 
+ int vfs_read_node(VfsNode node, uint64_t offset, void* data, uint32_t len) {
+     Mount* mount = vfs_mount_at(node);
+     return mount->ops->read(mount->fs, node.id, offset, data, len);
+ }
+ 
+ int vfs_write_node(VfsNode node, uint64_t offset, const void* data, uint32_t len) {
+     Mount* mount = vfs_mount_at(node);
+     return mount->ops->write(mount->fs, node.id, offset, data, len);
+ }
+ 
+ int vfs_truncate_node(VfsNode node, uint64_t size) {
+     Mount* mount = vfs_mount_at(node);
+     return mount->ops->truncate(mount->fs, node.id, size);
+ }
+ 
+ // fs_read by path on any mount
+ int vfs_read(const char* path, uint64_t offset, void* data, uint32_t len) {
+     VfsNode node;
+     if (!vfs_find_file(path, &node)) {
+         return -1;
+     }
+     return vfs_read_node(node, offset, data, len);
+ }
+ 
+ // fs_write by path on any mount
+ int vfs_write(const char* path, uint64_t offset, const void* data, uint32_t len) {
+     VfsNode node;
+     if (!vfs_find_file(path, &node)) {
+         return -1;
+     }
+     return vfs_write_node(node, offset, data, len);
+ }
+ 
+ // fs_truncate by path on any mount
+ int vfs_truncate(const char* path, uint64_t size) {
+     VfsNode node;
+     if (!vfs_find_file(path, &node)) {
+         return -1;
+     }
+     return vfs_truncate_node(node, size);
+ }
+ 
+ // Next entry of a directory listing, -1 at the end
+ int32_t vfs_next(VfsNode dir, DirCursor* cursor) {
+     Mount* mount = vfs_mount_at(dir);
+     return mount->ops->next(mount->fs, dir.id, cursor);
+ }
+ 
+ // Entries of dir whose names match pattern: in name order on the disk, in creation order on a tmpfs
+ // Returns how many, with *ids set to an array the caller frees; -1 if out of memory
+ int32_t vfs_glob(VfsNode dir, const char* pattern, int32_t** ids) {
+     Mount* mount = vfs_mount_at(dir);
+     return mount->ops->glob(mount->fs, dir.id, pattern, ids);
+ }
+ 
+ // Change the shell's working directory; returns false if path is not a directory
+ bool vfs_chdir(const char* path) {
+     VfsNode node;
+     VfsStat stat;
+     if (!vfs_find(path, &node)) {
+         return false;
+     }
+     vfs_stat(node, &stat);
+     if (!stat.is_dir) {
+         return false;
+     }
+     simple_os.cwd_mount = (uint8_t)node.mount;
+     if (node.mount == 0) {
+         simple_os.cwd = node.id;
+     } else {
+         simple_os.mounts[node.mount].cwd = node.id;
+     }
+     return true;
+ }
+ 
+ // fs_clone by path; both files must be on the disk
+ // Returns what fs_clone does, or -5 if either is on another file system
+ int vfs_clone(const char* source, const char* target) {
+     VfsNode src;
+     VfsNode dir;
+     char leaf[MAX_FILENAME_LEN];
+     if (!vfs_find_file(source, &src)) {
+         return -1;
+     }
+     if (!vfs_walk(target, leaf, &dir) || leaf[0] == '\0') {
+         return -3;
+     }
+     if (src.mount != 0 || dir.mount != 0) {
+         return -5;
+     }
+     return fs_clone_entry(src.id, dir.id, leaf);
+ }
+ 
+ // Mount a new file system of the given type on the directory at path
+ // Returns its slot, -1 if path is not a directory, -2 if one is already mounted there,
+ // -3 if the mount table is full or out of memory
+ int vfs_mount(const char* path, const FsOps* ops) {
+     VfsNode node;
+     VfsStat stat;
+     if (!vfs_find(path, &node)) {
+         return -1;
+     }
+     vfs_stat(node, &stat);
+     if (!stat.is_dir) {
+         return -1;
+     }
+     if (node.id == FS_ROOT) {
+         return -2; // Every root is the root of a mount
+     }
+     int m = 1;
+     while (m < MAX_MOUNTS && simple_os.mounts[m].in_use) {
+         m++;
+     }
+     if (m == MAX_MOUNTS) {
+         return -3;
+     }
+     Mount* mount = &simple_os.mounts[m];
+     vfs_path(node, mount->path, sizeof(mount->path));
+     mount->path_len = strlen(mount->path);
+     mount->fs = ops->mount();
+     if (!mount->fs) {
+         return -3;
+     }
+     mount->ops = ops;
+     mount->cwd = FS_ROOT;
+     mount->in_use = true;
+     return m;
+ }
+ 
+ // Unmount the file system mounted at path
+ // Returns 0, -1 if nothing is mounted there or it is the disk, -2 if a file on it is open
+ // or the working directory or another mount is inside it
+ int vfs_umount(const char* path) {
+     VfsNode node;
+     if (!vfs_find(path, &node) || node.id != FS_ROOT || node.mount == 0) {
+         return -1;
+     }
+     Mount* mount = vfs_mount_at(node);
+     if (simple_os.cwd_mount == node.mount) {
+         return -2;
+     }
+     for (int m = 1; m < MAX_MOUNTS; m++) {
+         Mount* other = &simple_os.mounts[m];
+         if (other->in_use && m != node.mount && other->path_len > mount->path_len &&
+             memcmp(other->path, mount->path, mount->path_len) == 0 && other->path[mount->path_len] == '/') {
+             return -2;
+         }
+     }
+     for (int i = 0; i < MAX_OPEN_FILES; i++) {
+         OpenFile* file = &simple_os.open_files[i];
+         if (file->in_use && file->mount == node.mount && file->file >= 0) {
+             return -2; // Its data would be lost under the descriptor
+         }
+     }
+     mount->ops->unmount(mount->fs);
+     mount->fs = NULL;
+     mount->in_use = false;
+     return 0;
+ }
+ /* ======= FILE DESCRIPTORS ======= */
+ 
+ /* Processes reach files through small integer descriptors. A descriptor
+  * indexes a table kept by the thread group leader, so every thread of a
+  * process shares it, and names an open file in a system-wide table. The
+  * open file holds the position and the file's mount and entry number, found
+  * once at open, so reads and writes through a descriptor skip the path walk. The
+  * shell has its own table under pid 0xFF. Deleting a file, or switching to
+  * another file system, revokes the open files that refer to it: entry
+  * numbers are reused, so a stale one must never reach the file system. */
+ 
+ // Descriptor table of pid's thread group, or of the shell for 0xFF
+ int8_t* fd_table(uint8_t pid) {
+     if (pid == 0xFF) {
+         return simple_os.shell_fds;
+     }
+     return simple_os.processes[simple_os.processes[pid].tgid].fds;
+ }
+ 
+ // Open file behind a descriptor, NULL if fd is not open
+ OpenFile* fd_get(uint8_t pid, int fd) {
+     if (fd < 0 || fd >= MAX_FDS || (pid != 0xFF && pid >= MAX_PROCESSES)) {
+         return NULL;
+     }
+     int8_t slot = fd_table(pid)[fd];
+     return slot < 0 ? NULL : &simple_os.open_files[slot];
+ }
+ 
+ // Open a file for pid with FD_ flags
+ // Returns the lowest free descriptor, -1 if the file does not exist or is a directory,
+ // -2 if pid has no free descriptor or the system no free open file, -3 if it cannot be created
+ int fd_open(uint8_t pid, const char* path, uint8_t flags) {
+     if (pid != 0xFF && !process_alive(pid)) {
+         return -1;
+     }
+     int8_t* fds = fd_table(pid);
+     int fd = 0;
+     while (fd < MAX_FDS && fds[fd] >= 0) {
+         fd++;
+     }
+     int slot = 0;
+     while (slot < MAX_OPEN_FILES && simple_os.open_files[slot].in_use) {
+         slot++;
+     }
+     if (fd == MAX_FDS || slot == MAX_OPEN_FILES) {
+         return -2;
+     }
+     
+     VfsNode node;
+     VfsStat stat;
+     if (!vfs_find(path, &node)) {
+         if (!(flags & FD_CREATE)) {
+             return -1;
+         }
+         if (vfs_create(path, false, &node) < 0) {
+             return -3;
+         }
+     }
+     vfs_stat(node, &stat);
+     if (stat.is_dir) {
+         return -1;
+     }
+     if ((flags & FD_TRUNCATE) && vfs_truncate_node(node, 0) < 0) {
+         return -3;
+     }
+     
+     OpenFile* file = &simple_os.open_files[slot];
+     file->in_use = true;
+     file->flags = flags;
+     file->mount = (uint8_t)node.mount;
+     file->file = node.id;
+     file->offset = 0;
+     fds[fd] = (int8_t)slot;
+     return fd;
+ }
+ 
+ // Read up to len bytes at the descriptor's position and advance it
+ // Returns the bytes read, 0 at the end of the file, -1 if fd is not open or its file was deleted,
+ // -3 if the data failed its checksum
+ int fd_read(uint8_t pid, int fd, void* data, uint32_t len) {
+     OpenFile* file = fd_get(pid, fd);
+     if (!file || file->file < 0) {
+         return -1;
+     }
+     VfsNode node = { file->mount, file->file };
+     int n = vfs_read_node(node, file->offset, data, len);
+     if (n > 0) {
+         file->offset += n;
+     }
+     return n;
+ }
+ 
+ // Write len bytes at the descriptor's position, or at the end with FD_APPEND, and advance it
+ // Returns the bytes written, -1 if fd is not open or its file was deleted, -2 if out of space
+ int fd_write(uint8_t pid, int fd, const void* data, uint32_t len) {
+     OpenFile* file = fd_get(pid, fd);
+     if (!file || file->file < 0) {
+         return -1;
+     }
+     VfsNode node = { file->mount, file->file };
+     if (file->flags & FD_APPEND) {
+         VfsStat stat;
+         vfs_stat(node, &stat);
+         file->offset = stat.size;
+     }
+     int n = vfs_write_node(node, file->offset, data, len);
+     if (n > 0) {
+         file->offset += n;
+     }
+     return n;
+ }
+ 
+ // Move the descriptor's position relative to whence (SEEK_SET, SEEK_CUR or SEEK_END)
+ // Returns the new position, or -1 if fd is not open or the position would be negative
+ int64_t fd_seek(uint8_t pid, int fd, int64_t offset, int whence) {
+     OpenFile* file = fd_get(pid, fd);
+     if (!file || file->file < 0) {
+         return -1;
+     }
+     int64_t base = 0;
+     if (whence == SEEK_CUR) {
+         base = (int64_t)file->offset;
+     } else if (whence == SEEK_END) {
+         VfsNode node = { file->mount, file->file };
+         VfsStat stat;
+         vfs_stat(node, &stat);
+         base = (int64_t)stat.size;
+     } else if (whence != SEEK_SET) {
+         return -1;
+     }
+     if (base + offset < 0) {
+         return -1;
+     }
+     file->offset = (uint64_t)(base + offset);
+     return (int64_t)file->offset;
+ }
+ 
+ // Close a descriptor; returns false if it was not open
+ bool fd_close(uint8_t pid, int fd) {
+     OpenFile* file = fd_get(pid, fd);
+     if (!file) {
+         return false;
+     }
+     file->in_use = false;
+     fd_table(pid)[fd] = -1;
+     return true;
+ }
+ 
+ // Close every descriptor of pid's thread group
+ void fd_close_all(uint8_t pid) {
+     for (int fd = 0; fd < MAX_FDS; fd++) {
+         fd_close(pid, fd);
+     }
+ }
+ 
+ // Cut open files off from entry id of a mount, or from every file of the mount when id is -1
+ void fd_revoke_mount(int32_t mount, int32_t id) {
+     for (int i = 0; i < MAX_OPEN_FILES; i++) {
+         OpenFile* file = &simple_os.open_files[i];
+         if (file->in_use && file->mount == mount && (id < 0 || file->file == id)) {
+             file->file = -1;
+         }
+     }
+ }
+ 
+ // fd_revoke_mount for the disk
+ void fd_revoke(int32_t id) {
+     fd_revoke_mount(0, id);
+ }
+ 
+ /* ======= SNAPSHOTS ======= */
+ 
+ /* A snapshot copies the metadata of the in-place layout and shares every data
+  * block with the live file system, so taking one costs the same whatever the
+  * files hold. Blocks the snapshot's bitmap marks as used are pinned in
+  * snapshot_bitmap: the allocator skips them, and the write paths never
+  * rewrite them in place. Compressed clusters and deduplicated pages already
+  * go to new blocks; an extent file about to write a pinned block moves to a
+  * block map first, so its writes are copied too. A freed block that is still
+  * pinned is "held": it counts neither as free nor against a file until the
+  * last snapshot using it is deleted.
+  *
+  * Restoring copies the metadata back. The metadata pages a snapshot takes
+  * always come from the end of the image, never from the free list, so they
+  * can never be pages that another snapshot puts back; deleting the newest
+  * snapshot hands them back to the end. Each step is its own
+  * journal operation; mounting finishes a restore and deletes a snapshot that
+  * was being taken or deleted when the system stopped. */
+ 
+ // Snapshot named name, or -1
+ int snapshot_find(const char* name) {
+     char key[MAX_FILENAME_LEN];
+     fs_make_key(name, strlen(name), key);
+     for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+         Snapshot* snap = &simple_os.disk->snapshots[i];
+         if (snap->list != 0 && memcmp(snap->name, key, MAX_FILENAME_LEN) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ // Page holding the copy listed n-th by a snapshot
+ uint32_t snapshot_copy(const Snapshot* snap, uint32_t n) {
+     uint32_t page = snap->list;
+     while (n >= SNAPSHOT_LIST_ENTRIES) {
+         page = ((SnapshotList*)meta_page(page))->next;
+         n -= SNAPSHOT_LIST_ENTRIES;
+     }
+     return ((SnapshotList*)meta_page(page))->copies[n].copy;
+ }
+ 
+ // Read len bytes of the DiskImage metadata at offset as a snapshot copied it
+ void snapshot_read_header(const Snapshot* snap, size_t offset, void* out, size_t len) {
+     uint8_t* target = out;
+     while (len > 0) {
+         size_t piece = (offset - SNAPSHOT_HEADER_START) / BLOCK_SIZE;
+         size_t within = (offset - SNAPSHOT_HEADER_START) % BLOCK_SIZE;
+         size_t chunk = BLOCK_SIZE - within < len ? BLOCK_SIZE - within : len;
+         memcpy(target, meta_page(snapshot_copy(snap, (uint32_t)piece)) + within, chunk);
+         target += chunk;
+         offset += chunk;
+         len -= chunk;
+     }
+ }
+ 
+ // Pin the blocks of every complete snapshot, and only those
+ void snapshot_pin() {
+     DiskImage* disk = simple_os.disk;
+     memset(disk->snapshot_bitmap, 0, sizeof(disk->snapshot_bitmap));
+     for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+         if (disk->snapshots[i].list != 0 && disk->snapshots[i].complete) {
+             uint8_t bitmap[NUM_BLOCKS / 8];
+             snapshot_read_header(&disk->snapshots[i], offsetof(DiskImage, block_bitmap), bitmap, sizeof(bitmap));
+             for (size_t b = 0; b < sizeof(bitmap); b++) {
+                 disk->snapshot_bitmap[b] |= bitmap[b];
+             }
+         }
+     }
+     journal_dirty(disk->snapshot_bitmap, sizeof(disk->snapshot_bitmap));
+ }
+ 
+ // Bitmap of the metadata pages below limit that hold no file system metadata: checksum pages, the
+ // pages of every snapshot and, with free_list, the free list. The caller frees it.
+ uint8_t* snapshot_skip_pages(uint32_t limit, bool free_list) {
+     DiskImage* disk = simple_os.disk;
+     uint8_t* skip = calloc(limit / 8 + 1, 1);
+     for (uint32_t page = 1; page < limit; page += META_CRC_GROUP) {
+         skip[page / 8] |= (uint8_t)(1 << (page % 8));
+     }
+     for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+         for (uint32_t page = disk->snapshots[i].list; page != 0; page = ((SnapshotList*)meta_page(page))->next) {
+             SnapshotList* list = (SnapshotList*)meta_page(page);
+             skip[page / 8] |= (uint8_t)(1 << (page % 8));
+             for (uint32_t c = 0; c < list->count; c++) {
+                 skip[list->copies[c].copy / 8] |= (uint8_t)(1 << (list->copies[c].copy % 8));
+             }
+         }
+     }
+     uint32_t page = disk->meta_free;
+     for (uint32_t n = 0; free_list && n < disk->meta_free_count; n++) {
+         skip[page / 8] |= (uint8_t)(1 << (page % 8));
+         memcpy(&page, meta_page(page), sizeof(page));
+     }
+     return skip;
+ }
+ 
+ // Make sure count pages can be taken past the last page handed out
+ bool snapshot_reserve(uint32_t count) {
+     uint32_t need = count + count / (META_CRC_GROUP - 1) + 1;
+     if (meta_capacity() - simple_os.disk->meta_pages >= need) {
+         return true;
+     }
+     return meta_grow(simple_os.disk->meta_pages + need);
+ }
+ 
+ // Take a reserved page past the last page handed out, cleared
+ uint32_t snapshot_page_alloc() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t page = disk->meta_pages++;
+     if (meta_is_checksum_page(page)) {
+         memset(meta_page(page), 0, BLOCK_SIZE);
+         journal_dirty(meta_page(page), BLOCK_SIZE);
+         page = disk->meta_pages++;
+     }
+     journal_dirty(&disk->meta_pages, sizeof(uint32_t));
+     memset(meta_page(page), 0, BLOCK_SIZE);
+     journal_dirty(meta_page(page), BLOCK_SIZE);
+     return page;
+ }
+ 
+ // Give back a page of a snapshot; the last page in use is given back by no longer counting it
+ void snapshot_page_free(uint32_t page) {
+     DiskImage* disk = simple_os.disk;
+     if (page + 1 != disk->meta_pages) {
+         meta_release(page);
+         return;
+     }
+     disk->meta_pages = meta_is_checksum_page(page - 1) ? page - 1 : page; // Nothing left for it to cover
+     journal_dirty(&disk->meta_pages, sizeof(disk->meta_pages));
+ }
+ 
+ // Unpin a snapshot's blocks, then give its pages back a batch at a time
+ void snapshot_discard(int slot) {
+     DiskImage* disk = simple_os.disk;
+     Snapshot* snap = &disk->snapshots[slot];
+     snap->complete = false;
+     journal_dirty(snap, sizeof(*snap));
+     uint16_t held = block_held();
+     snapshot_pin();
+     disk->free_blocks += held - block_held();
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     
+     // Committed before the blocks can be reused: a crash must not bring back a snapshot whose
+     // blocks have since been written over
+     journal_commit();
+     block_index_build();
+     
+     // Newest pages first, so deleting the snapshot taken last shrinks the image back
+     while (snap->list != 0) {
+         uint32_t* link = &snap->list;
+         SnapshotList* list = (SnapshotList*)meta_page(*link);
+         while (list->next != 0) {
+             link = &list->next;
+             list = (SnapshotList*)meta_page(*link);
+         }
+         for (uint32_t n = 0; n < SNAPSHOT_BATCH && list->count > 0; n++) {
+             list->count--;
+             snapshot_page_free(list->copies[list->count].copy);
+             snap->pages--;
+         }
+         journal_dirty(&list->count, sizeof(list->count));
+         if (list->count == 0) {
+             uint32_t page = *link;
+             *link = 0;
+             journal_dirty(link, sizeof(uint32_t));
+             snapshot_page_free(page);
+             snap->pages--;
+         }
+         journal_dirty(snap, sizeof(*snap));
+         journal_end_op();
+     }
+     memset(snap, 0, sizeof(*snap));
+     journal_dirty(snap, sizeof(*snap));
+     journal_end_op();
+ }
+ 
+ // Take a snapshot of the file system named name
+ // Returns 0, -1 if the name is taken, -2 if every snapshot slot is, -3 if the image cannot grow,
+ // -4 in the log layout
+ int snapshot_create(const char* name) {
+     DiskImage* disk = simple_os.disk;
+     if (disk->layout != FS_LAYOUT_INPLACE) {
+         return -4;
+     }
+     if (snapshot_find(name) >= 0) {
+         return -1;
+     }
+     int slot = 0;
+     while (slot < MAX_SNAPSHOTS && disk->snapshots[slot].list != 0) {
+         slot++;
+     }
+     if (slot == MAX_SNAPSHOTS) {
+         return -2;
+     }
+     cache_sync(); // Written data has to be in the blocks the snapshot shares
+     if (!snapshot_reserve(1)) {
+         return -3;
+     }
+     disk = simple_os.disk;
+     uint32_t limit = disk->meta_pages;
+     uint8_t* skip = snapshot_skip_pages(limit, true);
+     Snapshot* snap = &disk->snapshots[slot];
+     memset(snap, 0, sizeof(*snap));
+     fs_make_key(name, strlen(name), snap->name);
+     snap->created = (uint64_t)time(NULL);
+     snap->file_count = disk->file_count;
+     snap->list = snapshot_page_alloc();
+     snap->pages = 1;
+     journal_dirty(snap, sizeof(*snap));
+     
+     // The DiskImage pieces first, then every page in use
+     uint32_t tail = snap->list;
+     uint32_t piece = 0;
+     uint32_t page = 0;
+     while (piece < SNAPSHOT_HEADER_PIECES || page < limit) {
+         if (!snapshot_reserve(SNAPSHOT_BATCH + 1)) {
+             free(skip);
+             journal_end_op();
+             snapshot_discard(slot);
+             return -3;
+         }
+         disk = simple_os.disk;
+         snap = &disk->snapshots[slot];
+         uint32_t n = 0;
+         while (n < SNAPSHOT_BATCH && (piece < SNAPSHOT_HEADER_PIECES || page < limit)) {
+             uint32_t from = SNAPSHOT_HEADER;
+             const uint8_t* source;
+             size_t len = BLOCK_SIZE;
+             if (piece < SNAPSHOT_HEADER_PIECES) {
+                 source = (const uint8_t*)disk + SNAPSHOT_HEADER_START + (size_t)piece * BLOCK_SIZE;
+                 if (len > SNAPSHOT_HEADER_SIZE - (size_t)piece * BLOCK_SIZE) {
+                     len = SNAPSHOT_HEADER_SIZE - (size_t)piece * BLOCK_SIZE;
+                 }
+                 piece++;
+             } else if (skip[page / 8] & (1 << (page % 8))) {
+                 page++;
+                 continue;
+             } else {
+                 from = page;
+                 source = meta_page(page++);
+             }
+             SnapshotList* list = (SnapshotList*)meta_page(tail);
+             if (list->count == SNAPSHOT_LIST_ENTRIES) {
+                 list->next = snapshot_page_alloc();
+                 journal_dirty(&list->next, sizeof(list->next));
+                 tail = list->next;
+                 list = (SnapshotList*)meta_page(tail);
+                 snap->pages++;
+             }
+             uint32_t copy = snapshot_page_alloc();
+             memcpy(meta_page(copy), source, len);
+             list->copies[list->count].page = from;
+             list->copies[list->count].copy = copy;
+             journal_dirty(&list->copies[list->count], sizeof(SnapshotCopy));
+             list->count++;
+             journal_dirty(&list->count, sizeof(list->count));
+             snap->pages++;
+             n++;
+         }
+         journal_dirty(snap, sizeof(*snap));
+         journal_end_op();
+     }
+     free(skip);
+     
+     // Only now do its blocks become pinned
+     disk = simple_os.disk;
+     snap = &disk->snapshots[slot];
+     for (size_t b = 0; b < sizeof(disk->snapshot_bitmap); b++) {
+         disk->snapshot_bitmap[b] |= disk->block_bitmap[b];
+     }
+     journal_dirty(disk->snapshot_bitmap, sizeof(disk->snapshot_bitmap));
+     snap->reserved = (uint16_t)(NUM_BLOCKS - 1 - disk->free_blocks - block_held());
+     snap->complete = true;
+     journal_dirty(snap, sizeof(*snap));
+     journal_end_op();
+     return 0;
+ }
+ 
+ // Delete the snapshot named name; returns false if there is none
+ bool snapshot_delete(const char* name) {
+     int slot = snapshot_find(name);
+     if (slot < 0) {
+         return false;
+     }
+     snapshot_discard(slot);
+     return true;
+ }
+ 
+ // Put back the metadata a snapshot copied, leaving the other snapshots as they are
+ void snapshot_put_back(int slot) {
+     DiskImage* disk = simple_os.disk;
+     uint32_t limit = disk->meta_pages; // Pages taken since stay in the image, free
+     uint8_t* keep = snapshot_skip_pages(limit, false);
+     uint32_t n = 0;
+     uint32_t piece = 0;
+     for (uint32_t page = disk->snapshots[slot].list; page != 0; page = ((SnapshotList*)meta_page(page))->next) {
+         SnapshotList* list = (SnapshotList*)meta_page(page);
+         for (uint32_t c = 0; c < list->count; c++) {
+             SnapshotCopy copy = list->copies[c];
+             if (copy.page == SNAPSHOT_HEADER) {
+                 // The page counts stay current, so a restore finished on mount still sees every page
+                 size_t offset = (size_t)piece++ * BLOCK_SIZE;
+                 size_t len = SNAPSHOT_HEADER_SIZE - offset < BLOCK_SIZE ? SNAPSHOT_HEADER_SIZE - offset : BLOCK_SIZE;
+                 uint8_t* target = (uint8_t*)disk + SNAPSHOT_HEADER_START + offset;
+                 uint32_t meta[3] = { disk->meta_pages, disk->meta_free, disk->meta_free_count };
+                 memcpy(target, meta_page(copy.copy), len);
+                 disk->meta_pages = meta[0];
+                 disk->meta_free = meta[1];
+                 disk->meta_free_count = meta[2];
+                 journal_dirty(target, len);
+             } else {
+                 memcpy(meta_page(copy.page), meta_page(copy.copy), BLOCK_SIZE);
+                 journal_dirty(meta_page(copy.page), BLOCK_SIZE);
+                 keep[copy.page / 8] |= (uint8_t)(1 << (copy.page % 8));
+             }
+             if (++n % SNAPSHOT_BATCH == 0) {
+                 journal_end_op();
+             }
+         }
+     }
+     
+     // Every other page is free
+     disk->meta_free = 0;
+     disk->meta_free_count = 0;
+     for (uint32_t page = limit - 1; page > 0; page--) {
+         if (!(keep[page / 8] & (1 << (page % 8)))) {
+             meta_release(page);
+             if (++n % (SNAPSHOT_BATCH * 8) == 0) {
+                 journal_end_op();
+             }
+         }
+     }
+     free(keep);
+     
+     // The files are charged what they were; blocks used since are free again unless pinned
+     disk->free_blocks = (uint16_t)(NUM_BLOCKS - 1 - disk->snapshots[slot].reserved - block_held());
+     journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     block_index_build();
+     dedup_index_prune();
+     simple_os.names_valid = false;
+     disk->snapshot_restoring = 0;
+     journal_dirty(&disk->snapshot_restoring, sizeof(disk->snapshot_restoring));
+     journal_end_op();
+ }
+ 
+ // Return the file system to the snapshot named name; the snapshot is kept
+ // Returns 0, -1 if there is no such snapshot
+ int snapshot_restore(const char* name) {
+     int slot = snapshot_find(name);
+     if (slot < 0 || !simple_os.disk->snapshots[slot].complete) {
+         return -1;
+     }
+     
+     // Mounting finishes the restore from here on
+     simple_os.disk->snapshot_restoring = (uint32_t)slot + 1;
+     journal_dirty(&simple_os.disk->snapshot_restoring, sizeof(uint32_t));
+     journal_end_op();
+     fs_forget(); // Cached pages and names belong to files that are about to change
+     snapshot_put_back(slot);
+     return 0;
+ }
+ 
+ // Finish a restore and delete snapshots left half taken or half deleted; returns how many there were
+ int snapshot_recover() {
+     DiskImage* disk = simple_os.disk;
+     int count = 0;
+     if (disk->snapshot_restoring != 0) {
+         snapshot_put_back((int)disk->snapshot_restoring - 1);
+         count++;
+     }
+     for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+         if (simple_os.disk->snapshots[i].list != 0 && !simple_os.disk->snapshots[i].complete) {
+             snapshot_discard(i);
+             count++;
+         }
+     }
+     return count;
+ }
+ 
+ /* ======= CONSISTENCY CHECK ======= */
+ 
+ /* fsck walks the file system from the root and checks that the metadata
+  * agrees with itself: every directory entry names an entry of that
+  * directory, every entry in use is in a directory, and the block bitmap,
+  * reference counts, segment summaries, free counts and free lists are
+  * exactly what the files imply. The walk goes a directory level at a time,
+  * each level in two parallel steps over host threads: the trees of the
+  * level's directories are descended to list their leaves, then the leaves
+  * are divided between the threads, which check the entries in them and the
+  * extents, clusters and maps of their files. Dividing by leaf keeps every
+  * thread busy however the entries are spread over directories. Pages and
+  * entries are marked in shared bitmaps with atomic ORs, so anything reached
+  * twice is caught; blocks go into per-thread bitmaps that are merged and
+  * compared with the ones on disk 64 bits at a time.
+  *
+  * Repairs are collected during the walk and applied afterwards through the
+  * journal. A repair that files entries into directories changes what the
+  * walk finds, so the free lists and counts are only rebuilt from a pass that
+  * needed none, and fsck checks again until a pass comes out clean. Blocks or
+  * pages owned twice are reported but left alone, since either owner may be
+  * the right one. */
+ 
+ static const char* fsck_problem_names[FSCK_PROBLEMS] = {
+     "directory entries naming unused entries or entries of other directories",
+     "names or name hashes lookups would not find",
+     "damaged directory trees",
+     "directory leaf chains out of order",
+     "wrong entry counts",
+     "files with extents, clusters or maps outside the disk",
+     "entries in use but in no directory",
+     "blocks or extent leaves owned twice (not repaired)",
+     "blocks marked used that no file owns",
+     "blocks owned by a file but marked free",
+     "wrong block map reference counts",
+     "wrong log segment summaries",
+     "blocks pinned or unpinned for snapshots by mistake",
+     "wrong free block count",
+     "extent leaves missing from or listed twice on the free stack",
+     "metadata pages lost, or a broken free page list",
+     "metadata pages used twice (not repaired)",
+     "unused entries lost, or a broken free entry list"
+ };
+ 
+ // State of a check pass, shared by its workers
+ struct {
+     uint32_t pages;                      // Metadata pages the pass covers
+     uint32_t words;                      // Words of a bitmap with a bit per page
+     uint64_t* page_used;                 // Pages of directory trees and file maps, marked as they are reached
+     uint64_t* page_entries;              // Pages holding FileEntries
+     uint64_t* page_free;                 // Pages on the free list
+     uint64_t* page_skip;                 // Checksum and snapshot pages
+     uint64_t* entry_seen;                // Entries reached from the root
+     uint64_t* entry_free;                // Entries on the free list
+     uint32_t* dirs;                      // Directories of the level being walked
+     uint32_t dir_count;
+     uint32_t* counts;                    // Entries found in each of them
+     FsckLeaf* leaves;                    // Leaves of their trees
+     uint32_t leaf_count;
+     void (*step)(FsckWorker*, uint32_t);
+     int threads;
+     FsckWorker workers[FSCK_MAX_THREADS];
+     
+     // Merged from the workers, and what the walk implies
+     uint32_t problems[FSCK_PROBLEMS];
+     uint64_t claimed[NUM_BLOCKS / 64];
+     uint64_t owned[NUM_BLOCKS / 64];     // The block bitmap the files imply
+     uint64_t pins[NUM_BLOCKS / 64];      // The snapshot bitmap the snapshots imply
+     uint32_t refs[NUM_BLOCKS];
+     uint32_t leaves_used;
+     uint64_t entries;
+     int64_t free_blocks;
+     int32_t* orphans;                    // Entries in use that no directory holds
+     uint32_t orphan_count;
+     uint32_t orphan_size;
+     bool scan_pages;                     // Look for entries on pages nothing accounts for; only before repairs free pages
+     bool page_list_broken;               // The free page list holds pages that are not free, or holds one twice
+     uint32_t pages_lost;                 // Pages neither used nor on the free page list
+     bool entry_list_broken;
+     bool entries_freed;                  // Repairs freed entries; the free entry list is rebuilt
+ } fsck_state;
+ 
+ // Set a bit of a bitmap the workers share; returns whether it was set already
+ bool fsck_mark(uint64_t* bitmap, uint32_t bit) {
+     uint64_t mask = 1ull << (bit % 64);
+     return (__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+ }
+ 
+ bool fsck_bit(const uint64_t* bitmap, uint32_t bit) {
+     return (bitmap[bit / 64] >> (bit % 64)) & 1;
+ }
+ 
+ // Append an item of size bytes to a list, growing it as needed; returns it, or NULL if out of memory
+ void* fsck_append(void** list, uint32_t* count, uint32_t* size, size_t item) {
+     if (*count == *size) {
+         uint32_t grown = *size ? *size * 2 : 64;
+         void* bigger = realloc(*list, grown * item);
+         if (!bigger) {
+             return NULL;
+         }
+         *list = bigger;
+         *size = grown;
+     }
+     return (uint8_t*)*list + (size_t)(*count)++ * item;
+ }
+ 
+ // Record a problem and the repair for it
+ void fsck_fix(FsckWorker* w, FsckProblem problem, FsckFixKind kind, int32_t id, uint32_t at, DirKey key) {
+     w->problems[problem]++;
+     FsckFix* fix = fsck_append((void**)&w->fixes, &w->fix_count, &w->fix_size, sizeof(FsckFix));
+     if (!fix) {
+         w->failed = true;
+         return;
+     }
+     fix->kind = (uint8_t)kind;
+     fix->id = id;
+     fix->at = at;
+     fix->key = key;
+ }
+ 
+ // Take a metadata page for a directory node or a map; false if it cannot be one or is taken already
+ bool fsck_page(uint32_t page) {
+     return page != 0 && page < fsck_state.pages && !meta_is_checksum_page(page) &&
+            !fsck_mark(fsck_state.page_used, page);
+ }
+ 
+ // Read a flag of a FileEntry that may be on a page holding something else
+ bool fsck_flag(const bool* flag) {
+     uint8_t byte;
+     memcpy(&byte, flag, sizeof(byte));
+     return byte == 1;
+ }
+ 
+ // Whether an entry number can name an entry: its page exists and is not a checksum page
+ bool fsck_entry_valid(int32_t id) {
+     return id >= 0 && (uint32_t)id / FS_ENTRIES_PER_PAGE < fsck_state.pages &&
+            !meta_is_checksum_page((uint32_t)id / FS_ENTRIES_PER_PAGE);
+ }
+ 
+ // Record that a file owns count blocks from start, a word of the bitmap at a time
+ void fsck_claim(FsckWorker* w, uint32_t start, uint32_t count) {
+     uint32_t end = start + count;
+     while (start < end) {
+         uint32_t bits = 64 - start % 64 < end - start ? 64 - start % 64 : end - start;
+         uint64_t mask = (bits == 64 ? ~0ull : (1ull << bits) - 1) << (start % 64);
+         w->crossed[start / 64] |= w->claimed[start / 64] & mask;
+         w->claimed[start / 64] |= mask;
+         start += bits;
+     }
+ }
+ 
+ // Check the extents of an extent file of have blocks
+ void fsck_extents(FsckWorker* w, int32_t id, FileEntry* file, uint16_t have) {
+     DirKey none = { 0, 0 };
+     Extent* list = file->extents;
+     uint32_t limit = FS_INLINE_EXTENTS;
+     if (file->extent_leaf != 0) {
+         uint32_t leaf = file->extent_leaf - 1u;
+         if (leaf >= EXTENT_LEAVES) {
+             fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_EXTENTS, id, 0, none);
+             return;
+         }
+         w->leaves_crossed |= w->leaves & (1u << leaf);
+         w->leaves |= 1u << leaf;
+         list = simple_os.disk->extent_leaves[leaf];
+         limit = EXTENTS_PER_LEAF;
+     }
+     uint32_t next = 0;
+     uint32_t e = 0;
+     for (; e < file->extent_count && e < limit; e++) {
+         Extent extent = list[e];
+         if (extent.logical != next || extent.length == 0 || extent.start == 0 ||
+             extent.start + extent.length > NUM_BLOCKS || next + extent.length > have) {
+             break;
+         }
+         fsck_claim(w, extent.start, extent.length);
+         next += extent.length;
+     }
+     if (e < file->extent_count) {
+         fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_EXTENTS, id, e, none);
+     }
+ }
+ 
+ // Check the clusters of a compressed file
+ void fsck_clusters(FsckWorker* w, int32_t id, FileEntry* file) {
+     DirKey none = { 0, 0 };
+     Cluster* map = cluster_map(file);
+     for (uint16_t c = 0; c < COMPRESS_CLUSTERS; c++) {
+         Cluster cluster = map[c];
+         w->charged += cluster.charged;
+         if (cluster.start == 0) {
+             continue;
+         }
+         uint16_t list[COMPRESS_CLUSTER_BLOCKS + 1];
+         uint16_t count = cluster.blocks - cluster.gang;
+         bool valid = cluster.blocks > cluster.gang && count <= COMPRESS_CLUSTER_BLOCKS && cluster.start < NUM_BLOCKS;
+         if (valid && cluster.gang) {
+             memcpy(list, simple_os.disk->blocks[cluster.start], count * sizeof(uint16_t));
+             for (uint16_t i = 0; i < count && valid; i++) {
+                 valid = list[i] != 0 && list[i] < NUM_BLOCKS;
+             }
+         } else if (valid) {
+             valid = cluster.start + count <= NUM_BLOCKS;
+         }
+         if (!valid) {
+             fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_CLUSTER, id, c, none);
+         } else if (cluster.gang) {
+             fsck_claim(w, cluster.start, 1);
+             for (uint16_t i = 0; i < count; i++) {
+                 fsck_claim(w, list[i], 1);
+             }
+         } else {
+             fsck_claim(w, cluster.start, count);
+         }
+     }
+ }
+ 
+ // Check the block map of a deduplicated file, counting its references
+ void fsck_block_map(FsckWorker* w, int32_t id, FileEntry* file) {
+     DirKey none = { 0, 0 };
+     uint32_t* pages = (uint32_t*)meta_page(file->map_page);
+     for (uint32_t l = 0; l < DEDUP_MAP_LEAVES; l++) {
+         if (pages[l] == 0) {
+             continue;
+         }
+         if (!fsck_page(pages[l])) {
+             fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_MAP_PAGE, id, l, none);
+             continue;
+         }
+         uint16_t* entries = (uint16_t*)meta_page(pages[l]);
+         for (uint32_t i = 0; i < DEDUP_MAP_ENTRIES; i++) {
+             uint16_t block = entries[i] & (DEDUP_RESERVED - 1);
+             w->charged += (entries[i] & DEDUP_RESERVED) != 0;
+             if (block >= NUM_BLOCKS) {
+                 fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_MAP, id, l * DEDUP_MAP_ENTRIES + i, none);
+             } else if (block != 0) {
+                 w->refs[block]++;
+             }
+         }
+     }
+ }
+ 
+ // Check the inode map of a log layout file of have blocks against the segment summaries
+ void fsck_inode_map(FsckWorker* w, int32_t id, uint16_t have) {
+     DiskImage* disk = simple_os.disk;
+     DirKey none = { 0, 0 };
+     DirKey owner = { 0, id };
+     uint16_t* map = lfs_map(id);
+     for (uint16_t i = 0; i < LFS_FILE_BLOCKS; i++) {
+         uint16_t block = map[i];
+         if (block == 0) {
+             continue;
+         }
+         if (block < SEGMENT_BLOCKS || block >= NUM_BLOCKS || i >= have) {
+             fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_MAP, id, i, none);
+             continue;
+         }
+         fsck_claim(w, block, 1);
+         if (disk->summary_file[block] != id || disk->summary_index[block] != i) {
+             fsck_fix(w, FSCK_BAD_SUMMARY, FSCK_FIX_SUMMARY, block, i, owner);
+         }
+     }
+ }
+ 
+ // Check where a file's data is and claim its blocks
+ // Returns false if its map is lost, so none of its data can be found
+ bool fsck_file(FsckWorker* w, int32_t id, FileEntry* file) {
+     DirKey none = { 0, 0 };
+     if (file->is_dir) {
+         return true; // Its tree is checked with the next level
+     }
+     bool log = simple_os.disk->layout == FS_LAYOUT_LOG;
+     if ((log || file->is_compressed || file->is_deduped) && !fsck_page(file->map_page)) {
+         return false;
+     }
+     if (file->is_inline) {
+         if (file->size > FS_INLINE_DATA) {
+             fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_SIZE, id, 0, none);
+         }
+         return true;
+     }
+     if (file->size > fs_max_size()) {
+         return false;
+     }
+     uint16_t have = fs_blocks_for(file->size);
+     if (file->is_compressed) {
+         fsck_clusters(w, id, file);
+     } else if (file->is_deduped) {
+         fsck_block_map(w, id, file);
+     } else if (log) {
+         w->charged += have;
+         fsck_inode_map(w, id, have);
+     } else {
+         w->charged += have;
+         fsck_extents(w, id, file, have);
+     }
+     return true;
+ }
+ 
+ // Check one key of directory dir and the entry it names; returns whether it counts as an entry of dir
+ bool fsck_entry(FsckWorker* w, int32_t dir, DirKey key) {
+     int32_t id = key.id;
+     FileEntry* file = fsck_entry_valid(id) && id != FS_ROOT ? fs_entry(id) : NULL;
+     if (!file || !fsck_flag(&file->in_use) || file->parent != dir || fsck_mark(fsck_state.entry_seen, (uint32_t)id)) {
+         fsck_fix(w, FSCK_STRAY_KEY, FSCK_FIX_KEY, dir, 0, key);
+         return false;
+     }
+     fsck_mark(fsck_state.page_entries, (uint32_t)id / FS_ENTRIES_PER_PAGE);
+     if (!fsck_file(w, id, file)) {
+         fsck_fix(w, FSCK_BAD_FILE, FSCK_FIX_DROP, id, (uint32_t)dir, key);
+         return false;
+     }
+     char name[MAX_FILENAME_LEN];
+     fs_make_key(file->filename, strnlen(file->filename, MAX_FILENAME_LEN), name);
+     uint32_t hash = fs_hash(dir, name);
+     if (name[0] == '\0' || memcmp(name, file->filename, MAX_FILENAME_LEN) != 0 || file->name_hash != hash ||
+         key.hash != hash) {
+         fsck_fix(w, FSCK_BAD_NAME, FSCK_FIX_NAME, id, (uint32_t)dir, key);
+     }
+     w->entries++;
+     if (file->is_dir) {
+         uint32_t* next = fsck_append((void**)&w->dir_list, &w->dir_count, &w->dir_size, sizeof(uint32_t));
+         if (!next) {
+             w->failed = true;
+         } else {
+             *next = (uint32_t)id;
+         }
+     }
+     return true;
+ }
+ 
+ // List the leaves under a node of a directory tree in key order, taking its pages
+ // Returns false if the tree is damaged
+ bool fsck_tree(FsckWorker* w, uint32_t page, uint32_t dir, int depth) {
+     if (depth == DIR_MAX_HEIGHT || !fsck_page(page)) {
+         return false;
+     }
+     DirNode* node = dir_node(page);
+     if (node->leaf) {
+         FsckLeaf* leaf = fsck_append((void**)&w->leaf_list, &w->leaf_count, &w->leaf_size, sizeof(FsckLeaf));
+         if (!leaf) {
+             w->failed = true;
+             return false;
+         }
+         leaf->page = page;
+         leaf->dir = dir;
+         return node->count <= DIR_LEAF_KEYS;
+     }
+     if (node->count == 0 || node->count > DIR_NODE_KEYS) {
+         return false;
+     }
+     for (int i = 0; i <= node->count; i++) {
+         if (!fsck_tree(w, node->children[i], dir, depth + 1)) {
+             return false;
+         }
+     }
+     return true;
+ }
+ 
+ // Tree step: list the leaves of directory i of the level and check their chain
+ void fsck_step_tree(FsckWorker* w, uint32_t i) {
+     DirKey none = { 0, 0 };
+     int32_t dir = (int32_t)fsck_state.dirs[i];
+     uint32_t root = fs_entry(dir)->dir_root;
+     uint32_t first = w->leaf_count;
+     if (root == 0) {
+         return;
+     }
+     if (!fsck_tree(w, root, i, 0)) {
+         w->leaf_count = first;
+         if (!w->failed) {
+             fsck_fix(w, FSCK_BAD_TREE, FSCK_FIX_TREE, dir, 0, none);
+         }
+         return;
+     }
+     for (uint32_t l = first; l < w->leaf_count; l++) {
+         uint32_t next = l + 1 < w->leaf_count ? w->leaf_list[l + 1].page : 0;
+         if (dir_node(w->leaf_list[l].page)->next != next) {
+             fsck_fix(w, FSCK_BAD_CHAIN, FSCK_FIX_CHAIN, (int32_t)next, w->leaf_list[l].page, none);
+         }
+     }
+ }
+ 
+ // Leaf step: check the entries of leaf i of the level
+ void fsck_step_leaf(FsckWorker* w, uint32_t i) {
+     FsckLeaf leaf = fsck_state.leaves[i];
+     int32_t dir = (int32_t)fsck_state.dirs[leaf.dir];
+     DirNode* node = dir_node(leaf.page);
+     uint32_t found = 0;
+     for (int slot = 0; slot < node->count; slot++) {
+         found += fsck_entry(w, dir, node->entries[slot]);
+     }
+     __atomic_fetch_add(&fsck_state.counts[leaf.dir], found, __ATOMIC_RELAXED);
+ }
+ 
+ // Run a worker's share of the current step
+ void* fsck_thread(void* arg) {
+     FsckWorker* w = arg;
+     for (uint32_t i = w->first; i < w->last; i++) {
+         fsck_state.step(w, i);
+     }
+     return NULL;
+ }
+ 
+ // Run step on items 0 to count - 1, divided between the threads; small steps stay on this one
+ void fsck_parallel(void (*step)(FsckWorker*, uint32_t), uint32_t count) {
+     int threads = fsck_state.threads;
+     if (count / FSCK_SLICE < (uint32_t)threads) {
+         threads = count / FSCK_SLICE > 1 ? (int)(count / FSCK_SLICE) : 1;
+     }
+     fsck_state.step = step;
+     uint32_t first = 0;
+     for (int t = 0; t < threads; t++) {
+         fsck_state.workers[t].first = first;
+         first += (count - first) / (uint32_t)(threads - t);
+         fsck_state.workers[t].last = first;
+     }
+ #if HAVE_MMAP
+     pthread_t ids[FSCK_MAX_THREADS];
+     bool started[FSCK_MAX_THREADS] = { false };
+     for (int t = 1; t < threads; t++) {
+         started[t] = pthread_create(&ids[t], NULL, fsck_thread, &fsck_state.workers[t]) == 0;
+     }
+     fsck_thread(&fsck_state.workers[0]);
+     for (int t = 1; t < threads; t++) {
+         if (started[t]) {
+             pthread_join(ids[t], NULL);
+         } else {
+             fsck_thread(&fsck_state.workers[t]); // No thread to spare; do its share here
+         }
+     }
+ #else
+     for (int t = 0; t < threads; t++) {
+         fsck_thread(&fsck_state.workers[t]);
+     }
+ #endif
+ }
+ 
+ // Walk every directory reachable from the root, a level at a time; returns false if out of memory
+ bool fsck_walk() {
+     DirKey none = { 0, 0 };
+     uint32_t count = 1;
+     uint32_t* dirs = malloc(sizeof(uint32_t));
+     if (!dirs) {
+         return false;
+     }
+     dirs[0] = FS_ROOT;
+     fsck_mark(fsck_state.entry_seen, FS_ROOT);
+     fsck_mark(fsck_state.page_entries, 0);
+     while (count > 0) {
+         fsck_state.dirs = dirs;
+         fsck_state.dir_count = count;
+         fsck_state.counts = calloc(count, sizeof(uint32_t));
+         for (int t = 0; t < fsck_state.threads; t++) {
+             fsck_state.workers[t].leaf_count = 0;
+             fsck_state.workers[t].dir_count = 0;
+         }
+         if (fsck_state.counts) {
+             fsck_parallel(fsck_step_tree, count);
+         }
+         
+         // Gather the leaves the threads found, and check them
+         uint32_t leaves = 0;
+         for (int t = 0; t < fsck_state.threads; t++) {
+             leaves += fsck_state.workers[t].leaf_count;
+         }
+         fsck_state.leaves = malloc(((size_t)leaves + 1) * sizeof(FsckLeaf));
+         bool failed = !fsck_state.counts || !fsck_state.leaves;
+         for (int t = 0; t < fsck_state.threads; t++) {
+             failed |= fsck_state.workers[t].failed;
+         }
+         if (failed) {
+             free(fsck_state.counts);
+             free(fsck_state.leaves);
+             free(dirs);
+             return false;
+         }
+         fsck_state.leaf_count = 0;
+         for (int t = 0; t < fsck_state.threads; t++) {
+             FsckWorker* w = &fsck_state.workers[t];
+             if (w->leaf_count > 0) {
+                 memcpy(fsck_state.leaves + fsck_state.leaf_count, w->leaf_list, w->leaf_count * sizeof(FsckLeaf));
+                 fsck_state.leaf_count += w->leaf_count;
+             }
+         }
+         fsck_parallel(fsck_step_leaf, leaves);
+         free(fsck_state.leaves);
+         fsck_state.leaves = NULL;
+         
+         for (uint32_t i = 0; i < count; i++) {
+             if (fs_entry((int32_t)dirs[i])->child_count != fsck_state.counts[i]) {
+                 fsck_fix(&fsck_state.workers[0], FSCK_BAD_COUNT, FSCK_FIX_COUNT, (int32_t)dirs[i],
+                          fsck_state.counts[i], none);
+             }
+         }
+         free(fsck_state.counts);
+         fsck_state.counts = NULL;
+         free(dirs);
+         
+         // The directories found make up the next level
+         count = 0;
+         for (int t = 0; t < fsck_state.threads; t++) {
+             failed |= fsck_state.workers[t].failed;
+             count += fsck_state.workers[t].dir_count;
+         }
+         dirs = malloc(((size_t)count + 1) * sizeof(uint32_t));
+         if (failed || !dirs) {
+             free(dirs);
+             return false;
+         }
+         count = 0;
+         for (int t = 0; t < fsck_state.threads; t++) {
+             FsckWorker* w = &fsck_state.workers[t];
+             if (w->dir_count > 0) {
+                 memcpy(dirs + count, w->dir_list, w->dir_count * sizeof(uint32_t));
+                 count += w->dir_count;
+             }
+         }
+     }
+     free(dirs);
+     return true;
+ }
+ 
+ // Merge what the workers found about blocks and compare it with the bitmaps, counts and summaries on disk
+ void fsck_blocks() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t* problems = fsck_state.problems;
+     uint64_t crossed[NUM_BLOCKS / 64] = { 0 };
+     uint64_t shared[NUM_BLOCKS / 64] = { 0 };   // Blocks with block map references
+     uint32_t leaves_crossed = 0;
+     uint64_t charged = 0;
+     memset(fsck_state.claimed, 0, sizeof(fsck_state.claimed));
+     memset(fsck_state.refs, 0, sizeof(fsck_state.refs));
+     fsck_state.leaves_used = 0;
+     fsck_state.entries = 0;
+     for (int t = 0; t < fsck_state.threads; t++) {
+         FsckWorker* w = &fsck_state.workers[t];
+         for (int i = 0; i < NUM_BLOCKS / 64; i++) {
+             crossed[i] |= w->crossed[i] | (fsck_state.claimed[i] & w->claimed[i]);
+             fsck_state.claimed[i] |= w->claimed[i];
+         }
+         for (int b = 0; b < NUM_BLOCKS; b++) {
+             fsck_state.refs[b] += w->refs[b];
+         }
+         leaves_crossed |= w->leaves_crossed | (fsck_state.leaves_used & w->leaves);
+         fsck_state.leaves_used |= w->leaves;
+         charged += w->charged;
+         fsck_state.entries += w->entries;
+         for (int p = 0; p < FSCK_PROBLEMS; p++) {
+             problems[p] += w->problems[p];
+         }
+     }
+     for (int b = 0; b < NUM_BLOCKS; b++) {
+         shared[b / 64] |= (uint64_t)(fsck_state.refs[b] > 0) << (b % 64);
+         problems[FSCK_BAD_REFS] += fsck_state.refs[b] != disk->block_refs[b];
+     }
+     
+     // Snapshots pin the union of their bitmaps
+     memset(fsck_state.pins, 0, sizeof(fsck_state.pins));
+     for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+         if (disk->snapshots[s].list != 0 && disk->snapshots[s].complete) {
+             uint64_t bitmap[NUM_BLOCKS / 64];
+             snapshot_read_header(&disk->snapshots[s], offsetof(DiskImage, block_bitmap), bitmap, sizeof(bitmap));
+             for (int i = 0; i < NUM_BLOCKS / 64; i++) {
+                 fsck_state.pins[i] |= bitmap[i];
+             }
+         }
+     }
+     
+     // The log layout's bitmap only ever marks block 0; its files own blocks through the summaries
+     bool log = disk->layout == FS_LAYOUT_LOG;
+     uint64_t held = 0;
+     uint64_t owned_count = 0;
+     for (int i = 0; i < NUM_BLOCKS / 64; i++) {
+         uint64_t used;
+         uint64_t pinned;
+         memcpy(&used, disk->block_bitmap + i * sizeof(uint64_t), sizeof(used));
+         memcpy(&pinned, disk->snapshot_bitmap + i * sizeof(uint64_t), sizeof(pinned));
+         uint64_t owned = (log ? 0 : fsck_state.claimed[i] | shared[i]) | (i == 0);
+         crossed[i] |= fsck_state.claimed[i] & shared[i];
+         fsck_state.owned[i] = owned;
+         problems[FSCK_CROSSLINK] += (uint32_t)__builtin_popcountll(crossed[i]);
+         problems[FSCK_BLOCK_LEAK] += (uint32_t)__builtin_popcountll(used & ~owned);
+         problems[FSCK_BLOCK_LOST] += (uint32_t)__builtin_popcountll(owned & ~used);
+         problems[FSCK_BAD_PINS] += (uint32_t)__builtin_popcountll(pinned ^ fsck_state.pins[i]);
+         held += (uint64_t)__builtin_popcountll(fsck_state.pins[i] & ~owned);
+         owned_count += (uint64_t)__builtin_popcountll(shared[i]);
+     }
+     problems[FSCK_CROSSLINK] += (uint32_t)__builtin_popcount(leaves_crossed);
+     
+     if (log) {
+         for (int s = 0; s < NUM_SEGMENTS; s++) {
+             uint32_t live = 0;
+             for (int b = s * SEGMENT_BLOCKS; b < (s + 1) * SEGMENT_BLOCKS; b++) {
+                 bool claimed = fsck_bit(fsck_state.claimed, (uint32_t)b);
+                 live += claimed;
+                 problems[FSCK_BAD_SUMMARY] += disk->summary_file[b] >= 0 && !claimed;
+             }
+             problems[FSCK_BAD_SUMMARY] += disk->segment_live[s] != live;
+         }
+         fsck_state.free_blocks = (int64_t)(NUM_SEGMENTS - 1 - LFS_RESERVE_SEGMENTS) * SEGMENT_BLOCKS - (int64_t)charged;
+     } else {
+         // Every block map block counts once however many pages share it
+         fsck_state.free_blocks = NUM_BLOCKS - 1 - (int64_t)held - (int64_t)charged - (int64_t)owned_count;
+     }
+     if (fsck_state.free_blocks < 0) {
+         fsck_state.free_blocks = 0;
+     }
+     problems[FSCK_BAD_FREE] += disk->free_blocks != fsck_state.free_blocks;
+     
+     // The free stack holds exactly the extent leaves no file uses
+     uint32_t stacked = 0;
+     bool broken = disk->free_leaf_count > EXTENT_LEAVES;
+     for (uint32_t i = 0; i < disk->free_leaf_count && !broken; i++) {
+         uint8_t leaf = disk->free_leaves[i];
+         broken = leaf >= EXTENT_LEAVES || (stacked & (1u << leaf));
+         stacked |= leaf < EXTENT_LEAVES ? 1u << leaf : 0;
+     }
+     uint32_t all = EXTENT_LEAVES == 32 ? ~0u : (1u << EXTENT_LEAVES) - 1;
+     problems[FSCK_BAD_LEAVES] += broken ? 1 : (uint32_t)__builtin_popcount(stacked ^ (all & ~fsck_state.leaves_used));
+ }
+ 
+ // Whether an entry no directory holds still looks like one: in use, with a parent and a name
+ // that hashes to the hash it keeps
+ bool fsck_plausible(int32_t id) {
+     FileEntry* file = fs_entry(id);
+     return fsck_flag(&file->in_use) && file->parent != id && fsck_entry_valid(file->parent) && file->filename[0] != '\0' &&
+            file->filename[MAX_FILENAME_LEN - 1] == '\0' && file->name_hash == fs_hash(file->parent, file->filename);
+ }
+ 
+ // Account for every metadata page and entry: in use, free, or lost
+ bool fsck_pages() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t* problems = fsck_state.problems;
+     uint32_t pages = fsck_state.pages;
+     uint32_t words = fsck_state.words;
+     uint64_t* used = fsck_state.page_used;
+     uint64_t* entries = fsck_state.page_entries;
+     uint64_t* skip = fsck_state.page_skip;
+     uint64_t* listed = fsck_state.page_free;
+     
+     uint8_t* bytes = snapshot_skip_pages(pages, false);
+     if (!bytes) {
+         return false;
+     }
+     memcpy(skip, bytes, pages / 8 + 1 < (size_t)words * 8 ? pages / 8 + 1 : (size_t)words * 8);
+     free(bytes);
+     for (uint32_t i = 0; i < words; i++) {
+         problems[FSCK_PAGE_CONFLICT] += (uint32_t)__builtin_popcountll((used[i] & entries[i]) | ((used[i] | entries[i]) & skip[i]));
+     }
+     
+     // The free page list may only hold pages nothing else uses, once each
+     uint32_t page = disk->meta_free;
+     uint32_t n = 0;
+     bool broken = false;
+     for (; n < disk->meta_free_count && !broken; n++) {
+         broken = page == 0 || page >= pages || meta_is_checksum_page(page) || fsck_bit(used, page) ||
+                  fsck_bit(entries, page) || fsck_bit(skip, page) || fsck_mark(listed, page);
+         if (!broken) {
+             memcpy(&page, meta_page(page), sizeof(page));
+         }
+     }
+     fsck_state.page_list_broken = broken || page != 0;
+     
+     // So may the free entry list; the pages it runs through hold entries
+     int32_t id = disk->free_entry;
+     broken = false;
+     while (id >= 0 && !broken) {
+         uint32_t holder = (uint32_t)id / FS_ENTRIES_PER_PAGE;
+         broken = id == FS_ROOT || !fsck_entry_valid(id) || fsck_bit(used, holder) || fsck_bit(skip, holder) ||
+                  fsck_bit(listed, holder) || fsck_flag(&fs_entry(id)->in_use) || fsck_mark(fsck_state.entry_free, (uint32_t)id);
+         if (!broken) {
+             fsck_mark(entries, holder);
+             id = fs_entry(id)->parent;
+         }
+     }
+     fsck_state.entry_list_broken = broken || id != -1;
+     
+     // A page no one accounts for may hold entries the walk did not reach. Unless the free list
+     // is whole, it may as well be a freed page still holding a snapshot's copy of some entries.
+     for (uint32_t p = 2; p < pages && fsck_state.scan_pages && !fsck_state.page_list_broken; p++) {
+         if (!fsck_bit(used, p) && !fsck_bit(entries, p) && !fsck_bit(skip, p) && !fsck_bit(listed, p)) {
+             for (int32_t s = 0; s < FS_ENTRIES_PER_PAGE; s++) {
+                 if (fsck_plausible((int32_t)p * FS_ENTRIES_PER_PAGE + s)) {
+                     fsck_mark(entries, p);
+                 }
+             }
+         }
+     }
+     
+     // Entries of those pages are reached, free, orphaned, or lost
+     DirKey none = { 0, 0 };
+     fsck_state.orphan_count = 0;
+     for (uint32_t p = 0; p < pages; p++) {
+         if (!fsck_bit(entries, p)) {
+             continue;
+         }
+         for (int32_t s = 0; s < FS_ENTRIES_PER_PAGE; s++) {
+             id = (int32_t)p * FS_ENTRIES_PER_PAGE + s;
+             if (fsck_bit(fsck_state.entry_seen, (uint32_t)id)) {
+                 continue;
+             }
+             if (fsck_plausible(id)) {
+                 int32_t* orphan = fsck_append((void**)&fsck_state.orphans, &fsck_state.orphan_count,
+                                               &fsck_state.orphan_size, sizeof(int32_t));
+                 if (!orphan) {
+                     return false;
+                 }
+                 *orphan = id;
+                 problems[FSCK_ORPHAN]++;
+             } else if (fs_entry(id)->in_use) {
+                 fsck_fix(&fsck_state.workers[0], FSCK_ORPHAN, FSCK_FIX_FREE, id, 0, none);
+             } else if (!fsck_bit(fsck_state.entry_free, (uint32_t)id)) {
+                 fsck_state.entry_list_broken = true;
+                 problems[FSCK_ENTRY_LEAK]++;
+             }
+         }
+     }
+     problems[FSCK_ENTRY_LEAK] += fsck_state.entry_list_broken && problems[FSCK_ENTRY_LEAK] == 0;
+     
+     // Pages neither used nor free are lost
+     uint32_t lost = 0;
+     for (uint32_t i = 0; i < words; i++) {
+         uint64_t valid = i + 1 < words || pages % 64 == 0 ? ~0ull : (1ull << (pages % 64)) - 1;
+         lost += (uint32_t)__builtin_popcountll(~(used[i] | entries[i] | skip[i] | listed[i]) & valid);
+     }
+     problems[FSCK_PAGE_LEAK] += lost > 0 ? lost : fsck_state.page_list_broken;
+     fsck_state.pages_lost = lost;
+     return !fsck_state.workers[0].failed;
+ }
+ 
+ // Release what a pass allocated
+ void fsck_release() {
+     free(fsck_state.page_used);
+     free(fsck_state.entry_seen);
+     fsck_state.page_used = NULL;
+     fsck_state.entry_seen = NULL;
+     for (int t = 0; t < FSCK_MAX_THREADS; t++) {
+         FsckWorker* w = &fsck_state.workers[t];
+         free(w->leaf_list);
+         free(w->dir_list);
+         free(w->fixes);
+         memset(w, 0, sizeof(*w));
+     }
+     free(fsck_state.orphans);
+     fsck_state.orphans = NULL;
+     fsck_state.orphan_size = 0;
+     fsck_state.orphan_count = 0;
+ }
+ 
+ // Check the whole file system once, leaving what was found in fsck_state; returns false if out of memory
+ bool fsck_pass(int threads) {
+     fsck_release();
+     fsck_state.threads = threads;
+     fsck_state.pages = simple_os.disk->meta_pages;
+     fsck_state.words = (fsck_state.pages + 63) / 64;
+     memset(fsck_state.problems, 0, sizeof(fsck_state.problems));
+     
+     // One allocation holds every page bitmap, another the entry bitmaps
+     size_t words = fsck_state.words;
+     fsck_state.page_used = calloc(4 * words, sizeof(uint64_t));
+     fsck_state.entry_seen = calloc(2 * words * FS_ENTRIES_PER_PAGE, sizeof(uint64_t));
+     if (!fsck_state.page_used || !fsck_state.entry_seen) {
+         return false;
+     }
+     fsck_state.page_entries = fsck_state.page_used + words;
+     fsck_state.page_free = fsck_state.page_used + 2 * words;
+     fsck_state.page_skip = fsck_state.page_used + 3 * words;
+     fsck_state.entry_free = fsck_state.entry_seen + words * FS_ENTRIES_PER_PAGE;
+     if (!fsck_walk()) {
+         return false;
+     }
+     fsck_blocks();
+     return fsck_pages();
+ }
+ 
+ // File entry id in directory dir under its name, or in the root as "#id" if dir is -1 or has the name
+ // already; frees the entry if neither can take it. Returns false if there is no metadata space.
+ bool fsck_link(int32_t id, int32_t dir) {
+     if (!meta_reserve(DIR_MAX_HEIGHT + 1)) {
+         return false;
+     }
+     FileEntry* file = fs_entry(id);
+     char name[MAX_FILENAME_LEN];
+     fs_make_key(file->filename, strnlen(file->filename, MAX_FILENAME_LEN), name);
+     uint32_t hash = dir >= 0 ? fs_hash(dir, name) : 0;
+     if (dir < 0 || name[0] == '\0' || dir_lookup(dir, name, hash) >= 0) {
+         char lost[MAX_FILENAME_LEN];
+         snprintf(lost, sizeof(lost), "#%d", id);
+         dir = FS_ROOT;
+         fs_make_key(lost, strlen(lost), name);
+         hash = fs_hash(dir, name);
+         if (dir_lookup(dir, name, hash) >= 0) {
+             file->in_use = false;
+             journal_dirty(file, sizeof(*file));
+             return true;
+         }
+     }
+     memcpy(file->filename, name, MAX_FILENAME_LEN);
+     file->name_hash = hash;
+     file->parent = dir;
+     journal_dirty(file, sizeof(*file));
+     DirKey key = { hash, id };
+     dir_insert(dir, key);
+     return true;
+ }
+ 
+ // Stop using an entry that no directory holds any more
+ void fsck_free_entry(int32_t id) {
+     cache_drop(id, 0);
+     fd_revoke(id);
+     fs_entry(id)->in_use = false;
+     journal_dirty(fs_entry(id), sizeof(FileEntry));
+     if (simple_os.cwd == id) {
+         simple_os.cwd = FS_ROOT;
+     }
+     fsck_state.entries_freed = true;
+ }
+ 
+ // Apply one repair that files no entries; returns whether it changes what a walk would reach
+ bool fsck_apply(FsckFix* fix) {
+     DiskImage* disk = simple_os.disk;
+     FileEntry* file = NULL;
+     if (fix->kind != FSCK_FIX_KEY && fix->kind != FSCK_FIX_CHAIN && fix->kind != FSCK_FIX_SUMMARY) {
+         file = fs_entry(fix->id);
+     }
+     switch (fix->kind) {
+         case FSCK_FIX_KEY:
+             dir_remove(fix->id, fix->key);
+             return false;
+         case FSCK_FIX_TREE:
+             file->dir_root = 0;
+             journal_dirty(file, sizeof(*file));
+             return true; // Its entries become orphans and are filed again
+         case FSCK_FIX_CHAIN:
+             dir_node(fix->at)->next = (uint32_t)fix->id;
+             journal_dirty(&dir_node(fix->at)->next, sizeof(uint32_t));
+             return false;
+         case FSCK_FIX_DROP:
+             dir_remove((int32_t)fix->at, fix->key);
+             fsck_free_entry(fix->id);
+             return false;
+         case FSCK_FIX_FREE:
+             fsck_free_entry(fix->id);
+             return false;
+         case FSCK_FIX_SIZE:
+             file->size = FS_INLINE_DATA;
+             break;
+         case FSCK_FIX_EXTENTS:
+             if (file->extent_leaf > EXTENT_LEAVES) {
+                 file->extent_leaf = 0;
+             }
+             file->extent_count = file->extent_leaf == 0 && fix->at > FS_INLINE_EXTENTS ? FS_INLINE_EXTENTS : (uint8_t)fix->at;
+             break;
+         case FSCK_FIX_CLUSTER: {
+             Cluster* cluster = &cluster_map(file)[fix->at];
+             cluster->start = 0;
+             cluster->blocks = 0;
+             cluster->raw = 0;
+             cluster->gang = 0; // Its charge stays, as for a cluster not written back yet
+             journal_dirty(cluster, sizeof(*cluster));
+             return false;
+         }
+         case FSCK_FIX_MAP: {
+             uint16_t* entry = file->is_deduped ? dedup_entry(file, (uint16_t)fix->at) : &lfs_map(fix->id)[fix->at];
+             *entry &= file->is_deduped ? DEDUP_RESERVED : 0; // A reservation stays charged
+             journal_dirty(entry, sizeof(uint16_t));
+             return false;
+         }
+         case FSCK_FIX_MAP_PAGE: {
+             uint32_t* pages = (uint32_t*)meta_page(file->map_page);
+             pages[fix->at] = 0;
+             journal_dirty(&pages[fix->at], sizeof(uint32_t));
+             return false;
+         }
+         case FSCK_FIX_SUMMARY:
+             disk->summary_file[fix->id] = fix->key.id;
+             disk->summary_index[fix->id] = (uint8_t)fix->at;
+             journal_dirty(&disk->summary_file[fix->id], sizeof(int32_t));
+             journal_dirty(&disk->summary_index[fix->id], sizeof(uint8_t));
+             return false;
+         case FSCK_FIX_COUNT:
+             file->child_count = fix->at;
+             break;
+     }
+     journal_dirty(file, sizeof(*file));
+     return false;
+ }
+ 
+ // Rebuild the bitmaps, counts and free lists from a pass whose repairs filed no entries
+ void fsck_rebuild() {
+     DiskImage* disk = simple_os.disk;
+     uint32_t* problems = fsck_state.problems;
+     if (problems[FSCK_BLOCK_LEAK] + problems[FSCK_BLOCK_LOST] > 0) {
+         memcpy(disk->block_bitmap, fsck_state.owned, sizeof(disk->block_bitmap));
+         journal_dirty(disk->block_bitmap, sizeof(disk->block_bitmap));
+     }
+     if (problems[FSCK_BAD_PINS] > 0) {
+         memcpy(disk->snapshot_bitmap, fsck_state.pins, sizeof(disk->snapshot_bitmap));
+         journal_dirty(disk->snapshot_bitmap, sizeof(disk->snapshot_bitmap));
+     }
+     for (int b = 0; b < NUM_BLOCKS && problems[FSCK_BAD_REFS] > 0; b++) {
+         uint16_t refs = fsck_state.refs[b] < UINT16_MAX ? (uint16_t)fsck_state.refs[b] : UINT16_MAX;
+         if (disk->block_refs[b] != refs) {
+             disk->block_refs[b] = refs;
+             journal_dirty(&disk->block_refs[b], sizeof(uint16_t));
+         }
+     }
+     if (disk->layout == FS_LAYOUT_LOG && problems[FSCK_BAD_SUMMARY] > 0) {
+         for (int s = 0; s < NUM_SEGMENTS; s++) {
+             uint16_t live = 0;
+             for (int b = s * SEGMENT_BLOCKS; b < (s + 1) * SEGMENT_BLOCKS; b++) {
+                 if (!fsck_bit(fsck_state.claimed, (uint32_t)b)) {
+                     if (disk->summary_file[b] >= 0) {
+                         disk->summary_file[b] = -1;
+                         journal_dirty(&disk->summary_file[b], sizeof(int32_t));
+                     }
+                 } else {
+                     live++;
+                 }
+             }
+             if (disk->segment_live[s] != live) {
+                 disk->segment_live[s] = live;
+                 journal_dirty(&disk->segment_live[s], sizeof(uint16_t));
+             }
+         }
+     }
+     if (disk->free_blocks != fsck_state.free_blocks) {
+         disk->free_blocks = (uint16_t)fsck_state.free_blocks;
+         journal_dirty(&disk->free_blocks, sizeof(disk->free_blocks));
+     }
+     if (problems[FSCK_BAD_LEAVES] > 0) {
+         disk->free_leaf_count = 0;
+         for (int i = EXTENT_LEAVES - 1; i >= 0; i--) {
+             if (!(fsck_state.leaves_used & (1u << i))) {
+                 disk->free_leaves[disk->free_leaf_count++] = (uint8_t)i;
+             }
+         }
+         journal_dirty(disk->free_leaves, sizeof(disk->free_leaves));
+         journal_dirty(&disk->free_leaf_count, sizeof(disk->free_leaf_count));
+     }
+     if (disk->file_count != fsck_state.entries) {
+         disk->file_count = (uint32_t)fsck_state.entries;
+         journal_dirty(&disk->file_count, sizeof(disk->file_count));
+     }
+     
+     // The free lists are rebuilt in page order, so the lowest pages and entries are reused first
+     if (fsck_state.page_list_broken || fsck_state.pages_lost > 0) {
+         disk->meta_free = 0;
+         disk->meta_free_count = 0;
+         for (uint32_t p = fsck_state.pages - 1; p > 0; p--) {
+             if (!fsck_bit(fsck_state.page_used, p) && !fsck_bit(fsck_state.page_entries, p) &&
+                 !fsck_bit(fsck_state.page_skip, p)) {
+                 meta_release(p);
+             }
+         }
+         journal_dirty(&disk->meta_free, sizeof(uint32_t));
+         journal_dirty(&disk->meta_free_count, sizeof(uint32_t));
+     }
+     if (fsck_state.entry_list_broken || fsck_state.entries_freed) {
+         disk->free_entry = -1;
+         for (uint32_t p = fsck_state.pages; p-- > 0;) {
+             if (!fsck_bit(fsck_state.page_entries, p)) {
+                 continue;
+             }
+             for (int32_t id = (int32_t)p * FS_ENTRIES_PER_PAGE + FS_ENTRIES_PER_PAGE - 1; id >= (int32_t)p * FS_ENTRIES_PER_PAGE; id--) {
+                 FileEntry* file = fs_entry(id);
+                 if (id != FS_ROOT && !file->in_use) {
+                     file->parent = disk->free_entry;
+                     disk->free_entry = id;
+                     journal_dirty(&file->parent, sizeof(file->parent));
+                 }
+             }
+         }
+         journal_dirty(&disk->free_entry, sizeof(disk->free_entry));
+     }
+ }
+ 
+ // Apply what the last pass found; returns false if out of metadata space
+ bool fsck_repair() {
+     DiskImage* disk = simple_os.disk;
+     bool again = false; // Entries were filed; counts and free lists wait for the next pass
+     fsck_state.entries_freed = false;
+     if (fsck_state.page_list_broken) {
+         // Pages are taken from the end until the list is rebuilt; the ones on it are found again then
+         disk->meta_free = 0;
+         disk->meta_free_count = 0;
+         journal_dirty(&disk->meta_free, sizeof(uint32_t));
+         journal_dirty(&disk->meta_free_count, sizeof(uint32_t));
+     }
+     
+     // Stray keys go first, so that lookups made while filing entries only meet entries that exist
+     for (int t = 0; t < fsck_state.threads; t++) {
+         FsckWorker* w = &fsck_state.workers[t];
+         for (uint32_t i = 0; i < w->fix_count; i++) {
+             if (w->fixes[i].kind != FSCK_FIX_NAME) {
+                 again |= fsck_apply(&w->fixes[i]);
+             }
+         }
+     }
+     bool ok = true;
+     for (int t = 0; t < fsck_state.threads && ok; t++) {
+         FsckWorker* w = &fsck_state.workers[t];
+         for (uint32_t i = 0; i < w->fix_count && ok; i++) {
+             FsckFix* fix = &w->fixes[i];
+             if (fix->kind == FSCK_FIX_NAME) {
+                 dir_remove((int32_t)fix->at, fix->key);
+                 ok = fsck_link(fix->id, (int32_t)fix->at);
+                 again = true;
+             }
+         }
+     }
+     
+     // Orphans go back to their directory if it was reached; failing that, those whose parent is
+     // gone go to the root, and failing that the parents form a cycle, and one directory on it does
+     uint32_t linked = 0;
+     for (uint32_t i = 0; i < fsck_state.orphan_count && ok; i++) {
+         int32_t parent = fs_entry(fsck_state.orphans[i])->parent;
+         if (fsck_bit(fsck_state.entry_seen, (uint32_t)parent) && fs_entry(parent)->is_dir) {
+             ok = fsck_link(fsck_state.orphans[i], parent);
+             linked++;
+         }
+     }
+     for (uint32_t i = 0; i < fsck_state.orphan_count && ok && linked == 0; i++) {
+         FileEntry* parent = fs_entry(fs_entry(fsck_state.orphans[i])->parent);
+         if (!fsck_flag(&parent->in_use) || !fsck_flag(&parent->is_dir)) {
+             ok = fsck_link(fsck_state.orphans[i], -1);
+             linked++;
+         }
+     }
+     if (fsck_state.orphan_count > 0 && linked == 0 && ok) {
+         int32_t id = fsck_state.orphans[0];
+         for (uint32_t i = 0; i < fsck_state.orphan_count; i++) {
+             int32_t parent = fs_entry(id)->parent; // An orphaned directory, so this ends up on the cycle
+             if (!fsck_entry_valid(parent) || fsck_bit(fsck_state.entry_seen, (uint32_t)parent)) {
+                 break;
+             }
+             id = parent;
+         }
+         ok = fsck_link(id, -1);
+     }
+     again |= fsck_state.orphan_count > 0;
+     
+     if (!again && ok) {
+         fsck_rebuild();
+     }
+     block_index_build();
+     dedup_index_build();
+     for (int i = 0; i < DCACHE_SIZE; i++) {
+         simple_os.dcache[i].parent = -1;
+     }
+     simple_os.names_valid = false;
+     simple_os.cluster_file = -1;
+     journal_end_op();
+     return ok;
+ }
+ 
+ // Threads a check uses by default: one per host core
+ int fsck_threads() {
+     long cores = 1;
+ #if HAVE_MMAP && defined(_SC_NPROCESSORS_ONLN)
+     cores = sysconf(_SC_NPROCESSORS_ONLN);
+ #endif
+     return cores < 1 ? 1 : cores > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : (int)cores;
+ }
+ 
+ // Check the file system on threads host threads and, with repair, fix what is found until a pass
+ // comes out clean. Returns 0, -1 if out of memory, -2 if the root is damaged beyond repair, -3 if
+ // a snapshot is half taken, deleted or restored; mounting finishes those.
+ int fsck_run(bool repair, int threads, FsckReport* report) {
+     DiskImage* disk = simple_os.disk;
+     memset(report, 0, sizeof(*report));
+     FileEntry* root = fs_entry(FS_ROOT);
+     if (!root->in_use || !root->is_dir || root->parent != FS_ROOT) {
+         return -2;
+     }
+     if (disk->snapshot_restoring != 0) {
+         return -3;
+     }
+     for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+         if (disk->snapshots[s].list != 0 && !disk->snapshots[s].complete) {
+             return -3;
+         }
+     }
+     if (threads < 1 || threads > FSCK_MAX_THREADS) {
+         threads = fsck_threads();
+     }
+ #if !HAVE_MMAP
+     threads = 1;
+ #endif
+     if (repair) {
+         cache_sync(); // Writeback must not allocate blocks while they are being accounted for
+     }
+     
+     int result = 0;
+     uint64_t start = bench_now_ns();
+     report->threads = threads;
+     report->bytes = META_PAGES_OFFSET + (uint64_t)disk->meta_pages * BLOCK_SIZE;
+     while (report->passes < FSCK_MAX_PASSES) {
+         uint64_t pass_start = bench_now_ns();
+         fsck_state.scan_pages = report->passes == 0;
+         if (!fsck_pass(threads)) {
+             result = -1;
+             break;
+         }
+         uint32_t* problems = fsck_state.problems;
+         if (report->passes++ == 0) {
+             memcpy(report->found, problems, sizeof(report->found));
+             report->entries = fsck_state.entries;
+             report->check_ns = bench_now_ns() - pass_start;
+         }
+         report->left = 0;
+         for (int p = 0; p < FSCK_PROBLEMS; p++) {
+             report->left += problems[p];
+         }
+         uint32_t repairable = report->left - problems[FSCK_CROSSLINK] - problems[FSCK_PAGE_CONFLICT];
+         if (!repair || repairable == 0 || report->passes == FSCK_MAX_PASSES) {
+             break;
+         }
+         if (!fsck_repair()) {
+             result = -1;
+             break;
+         }
+     }
+     fsck_release();
+     report->total_ns = bench_now_ns() - start;
+     return result;
+ }
+ 
+ /* ======= DISK IMAGES ======= */
+ 
+ /* A disk image is a DiskImage written to a host file. Mounting maps the file
+  * privately into memory, so it costs the same for any image size; pages are
+  * faulted in as the file system touches them. Changes reach the file only
+  * through page cache writeback and the journal. */
+ 
+ // Write all cached data to the mounted image and commit the journal
+ void disk_sync() {
+     cache_sync();
+     if (!simple_os.disk_mapped) {
+         return;
+     }
+     journal_commit();
+     disk_barrier();
+ }
+ 
+ void disk_close() {
+ #if HAVE_MMAP
+     io_drain(); // Block writes still in flight point into the mapping
+     munmap(simple_os.disk, simple_os.disk_size);
+     close(simple_os.disk_fd);
+ #else
+     free(simple_os.disk);
+     fclose(simple_os.disk_file);
+ #endif
+ }
+ 
+ // Unmount the current image, marking it clean, and return to the RAM file system
+ void disk_unmount() {
+     if (!simple_os.disk_mapped) {
+         return;
+     }
+     disk_sync();
+     journal_checkpoint();
+     simple_os.disk->clean = 1;
+     disk_write_at(&simple_os.disk->clean, sizeof(simple_os.disk->clean));
+     disk_barrier();
+     disk_close();
+     simple_os.disk_mapped = false;
+     fs_attach(ram_disk, ram_disk_size);
+ }
+ 
+ // Mount an image file, formatting it if it is empty or new
+ // Returns 0, 1 if the image was not cleanly unmounted, -1 if it cannot be opened, -2 if it is not a SimpleOS image
+ int disk_mount(const char* path) {
+     DiskImage* image;
+     size_t size;
+     bool fresh;
+ #if HAVE_MMAP
+     int fd = open(path, O_RDWR | O_CREAT, 0644);
+     if (fd < 0) {
+         return -1;
+     }
+     struct stat st;
+     if (fstat(fd, &st) != 0) {
+         close(fd);
+         return -1;
+     }
+     fresh = st.st_size == 0;
+     size = fresh ? META_PAGES_OFFSET + META_MIN_PAGES * BLOCK_SIZE : (size_t)st.st_size;
+     if (!fresh && (size < META_PAGES_OFFSET + BLOCK_SIZE || (size - META_PAGES_OFFSET) % BLOCK_SIZE != 0)) {
+         close(fd);
+         return -2;
+     }
+     if (fresh && ftruncate(fd, (off_t)size) != 0) {
+         close(fd);
+         return -1;
+     }
+     image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+     if (image == MAP_FAILED) {
+         close(fd);
+         return -1;
+     }
+ #else
+     FILE* f = fopen(path, "r+b");
+     if (!f) {
+         f = fopen(path, "w+b");
+     }
+     if (!f) {
+         return -1;
+     }
+     fseek(f, 0, SEEK_END);
+     long end = ftell(f);
+     rewind(f);
+     fresh = end <= 0;
+     size = fresh ? META_PAGES_OFFSET + META_MIN_PAGES * BLOCK_SIZE : (size_t)end;
+     if (!fresh && (size < META_PAGES_OFFSET + BLOCK_SIZE || (size - META_PAGES_OFFSET) % BLOCK_SIZE != 0)) {
+         fclose(f);
+         return -2;
+     }
+     image = calloc(1, size);
+     if (!image) {
+         fclose(f);
+         return -1;
+     }
+     if (!fresh && fread(image, 1, size, f) != size) {
+         fresh = true;
+     }
+ #endif
+     
+     if (!fresh && (image->magic != DISK_MAGIC || image->version != DISK_VERSION ||
+                    image->block_size != BLOCK_SIZE || image->num_blocks != NUM_BLOCKS ||
+                    image->meta_pages > (size - META_PAGES_OFFSET) / BLOCK_SIZE)) {
+ #if HAVE_MMAP
+         munmap(image, size);
+         close(fd);
+ #else
+         free(image);
+         fclose(f);
+ #endif
+         return -2;
+     }
+     
+     // Leave the current file system consistent before switching
+     if (simple_os.disk_mapped) {
+         disk_unmount();
+     } else {
+         cache_sync();
+     }
+     fs_attach(image, size);
+     simple_os.disk_mapped = true;
+     journal_reset();
+     journal_resize();
+ #if HAVE_MMAP
+     simple_os.disk_fd = fd;
+ #else
+     simple_os.disk_file = f;
+ #endif
+     snprintf(simple_os.disk_path, sizeof(simple_os.disk_path), "%s", path);
+     simple_os.journal_head = 0;
+     simple_os.journal_seq = image->journal_seq;
+     simple_os.journal_ops = 0;
+     simple_os.journal_last_commit = bench_now_ns();
+     
+     int result = 0;
+     if (fresh) {
+         fs_format(FS_LAYOUT_INPLACE);
+         journal_reset();
+         checksum_seal_all();
+         disk_write_at(image, META_SIZE);
+         disk_write_at(meta_page(0), 2 * BLOCK_SIZE);
+     } else {
+         int replayed = journal_recover();
+         if (replayed > 0) {
+             printf("Journal: replayed %d transaction(s)\n", replayed);
+             block_index_build(); // The bitmap may have changed under the index
+             dedup_index_build();
+         }
+         int damaged = checksum_verify_header();
+         if (damaged > 0) {
+             printf("Checksums: %d metadata record(s) damaged\n", damaged);
+         }
+         result = image->clean ? 0 : 1;
+         if (result == 1) {
+             int restamped = checksum_restamp();
+             if (restamped > 0) {
+                 printf("Checksums: %d block(s) rewritten before the crash re-stamped\n", restamped);
+             }
+         }
+         int interrupted = snapshot_recover();
+         if (interrupted > 0) {
+             printf("Snapshots: finished %d interrupted operation(s)\n", interrupted);
+         }
+     }
+     
+     // Stays 0 until a clean unmount, so a crash leaves the image marked dirty
+     image->clean = 0;
+     disk_write_at(&image->clean, sizeof(image->clean));
+     disk_barrier();
+     return result;
+ }
+ 
+ // Erase the mounted file system, image or RAM, and format it with layout
+ void disk_format(FsLayout layout) {
+     fs_attach(simple_os.disk, simple_os.disk_size); // Cached pages belong to files that are about to vanish
+     fs_format(layout);
+     journal_dirty(simple_os.disk, META_SIZE);
+     journal_dirty(meta_page(0), 2 * BLOCK_SIZE);
+     journal_commit();
+ }
+ 
+ /* ======= BENCHMARKS ======= */
+ 
+ uint64_t bench_samples[BENCH_MAX_SAMPLES];
+ 
+ // Current monotonic time in nanoseconds
+ uint64_t bench_now_ns() {
+     struct timespec ts;
+ #ifdef CLOCK_MONOTONIC
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+ #else
+     timespec_get(&ts, TIME_UTC);
+ #endif
+     return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+ }
+ 
+ int bench_compare_u64(const void* a, const void* b) {
+     uint64_t x = *(const uint64_t*)a;
+     uint64_t y = *(const uint64_t*)b;
+     return (x > y) - (x < y);
+ }
+ 
+ // Print throughput and latency percentiles for a set of samples
+ void bench_report(const char* label, uint64_t* samples, int count, uint64_t ops, uint64_t total_ns) {
+     if (count == 0 || total_ns == 0) {
+         printf("%-24s no samples\n", label);
+         return;
+     }
+     qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+     printf("%-24s %12.0f ops/s  p50 %6llu ns  p99 %6llu ns\n", label,
+            (double)ops * 1e9 / (double)total_ns,
+            (unsigned long long)samples[count / 2],
+            (unsigned long long)samples[(count * 99) / 100]);
+ }
+ 
+ // Kill, wait for and reclaim processes started by a benchmark
+ void bench_reap(uint8_t* pids, uint8_t n) {
+     for (uint8_t i = 0; i < n; i++) {
+         process_terminate(pids[i]);
+         process_wait(0xFF, pids[i], NULL);
+     }
+     rcu_quiescent();
+ }
+ 
+ // Measure process creation, one at a time and in batches
+ void bench_spawn(int rounds) {
+     uint8_t pids[MAX_PROCESSES];
+     uint8_t free_slots = MAX_PROCESSES - simple_os.process_count;
+     if (free_slots == 0) {
+         printf("bench spawn: no free process slots\n");
+         return;
+     }
+     
+     // Single spawns through process_create
+     int count = 0;
+     uint64_t ops = 0;
+     uint64_t total = 0;
+     for (int r = 0; r < rounds; r++) {
+         uint8_t n = 0;
+         for (; n < free_slots; n++) {
+             uint64_t start = bench_now_ns();
+             pids[n] = process_create("bench");
+             uint64_t elapsed = bench_now_ns() - start;
+             if (pids[n] == 0xFF) {
+                 break;
+             }
+             total += elapsed;
+             if (count < BENCH_MAX_SAMPLES) {
+                 bench_samples[count++] = elapsed;
+             }
+         }
+         ops += n;
+         bench_reap(pids, n);
+     }
+     bench_report("spawn (single)", bench_samples, count, ops, total);
+     
+     // Batch spawns; latency is the per-process share of each batch
+     count = 0;
+     ops = 0;
+     total = 0;
+     for (int r = 0; r < rounds; r++) {
+         uint64_t start = bench_now_ns();
+         uint8_t n = process_create_batch(0xFF, "bench", free_slots, pids);
+         uint64_t elapsed = bench_now_ns() - start;
+         if (n == 0) {
+             break;
+         }
+         total += elapsed;
+         ops += n;
+         if (count < BENCH_MAX_SAMPLES) {
+             bench_samples[count++] = elapsed / n;
+         }
+         bench_reap(pids, n);
+     }
+     bench_report("spawn (batch)", bench_samples, count, ops, total);
+ }
+ 
+ // Compare creating threads in one process with creating whole processes
+ // Each round fills the free slots; latency is the per-create share of a round
+ void bench_thread(int rounds) {
+     uint8_t ids[MAX_PROCESSES];
+     uint8_t free_slots = MAX_PROCESSES - simple_os.process_count;
+     if (free_slots < 2) {
+         printf("bench thread: need at least two free process slots\n");
+         return;
+     }
+     
+     int count = 0;
+     uint64_t ops = 0;
+     uint64_t total = 0;
+     for (int r = 0; r < rounds; r++) {
+         // Leave one slot spare so both loops create the same number of entries
+         uint8_t n = 0;
+         uint64_t start = bench_now_ns();
+         for (; n < free_slots - 1; n++) {
+             ids[n] = process_create("spin");
+         }
+         uint64_t elapsed = bench_now_ns() - start;
+         total += elapsed;
+         ops += n;
+         if (count < BENCH_MAX_SAMPLES) {
+             bench_samples[count++] = elapsed / n;
+         }
+         bench_reap(ids, n);
+     }
+     bench_report("process_create", bench_samples, count, ops, total);
+     
+     count = 0;
+     ops = 0;
+     total = 0;
+     for (int r = 0; r < rounds; r++) {
+         uint8_t leader = process_create("spin");
+         uint8_t n = 0;
+         uint64_t start = bench_now_ns();
+         for (; n < free_slots - 1; n++) {
+             thread_create(leader, program_spin);
+         }
+         uint64_t elapsed = bench_now_ns() - start;
+         total += elapsed;
+         ops += n;
+         if (count < BENCH_MAX_SAMPLES) {
+             bench_samples[count++] = elapsed / n;
+         }
+         bench_reap(&leader, 1); // Killing the leader ends its threads
+     }
+     bench_report("thread_create", bench_samples, count, ops, total);
+ }
+ 
+ // Measure mutex lock/unlock pairs with and without contention
+ void bench_futex(uint32_t iterations) {
+     uint8_t leader = process_create("contend");
+     if (leader == 0xFF) {
+         printf("bench futex: no free process slots\n");
+         return;
+     }
+     uint16_t base = simple_os.processes[leader].memory_start;
+     uint32_t* shared = (uint32_t*)process_memory(leader);
+     memset(shared, 0, CONTEND_ROUNDS);
+     
+     // Uncontended: the shell takes the leader's mutex directly
+     uint64_t waits = simple_os.futex_waits;
+     uint64_t wakes = simple_os.futex_wakes;
+     uint64_t start = bench_now_ns();
+     for (uint32_t i = 0; i < iterations; i++) {
+         mutex_lock(base + CONTEND_MUTEX);
+         shared[CONTEND_COUNTER / 4]++;
+         mutex_unlock(base + CONTEND_MUTEX);
+     }
+     uint64_t elapsed = bench_now_ns() - start;
+     printf("%-24s %8.1f ns/op  futex calls %llu\n", "mutex (uncontended)",
+            (double)elapsed / iterations,
+            (unsigned long long)(simple_os.futex_waits - waits + simple_os.futex_wakes - wakes));
+     
+     // Contended: the contend program's workers yield while holding the lock
+     shared[CONTEND_ROUNDS / 4] = iterations / 100;
+     waits = simple_os.futex_waits;
+     wakes = simple_os.futex_wakes;
+     start = bench_now_ns();
+     while (process_alive(leader)) {
+         process_schedule();
+     }
+     elapsed = bench_now_ns() - start;
+     uint64_t ops = (uint64_t)shared[CONTEND_COUNTER / 4];
+     printf("%-24s %8.1f ns/op  futex waits %.2f/op  wakes %.2f/op\n", "mutex (contended)",
+            (double)elapsed / ops,
+            (double)(simple_os.futex_waits - waits) / ops,
+            (double)(simple_os.futex_wakes - wakes) / ops);
+     process_wait(0xFF, leader, NULL);
+     rcu_quiescent();
+ }
+ 
+ // Small xorshift generator so benchmarks do not depend on rand()
+ uint32_t bench_random(uint32_t* state) {
+     uint32_t x = *state;
+     x ^= x << 13;
+     x ^= x >> 17;
+     x ^= x << 5;
+     *state = x;
+     return x;
+ }
+ 
+ // Name lookup by walking every entry of the current directory, for comparison
+ int32_t bench_find_linear(const char* filename) {
+     DirCursor cursor = {0};
+     int32_t id;
+     while ((id = dir_next(simple_os.cwd, &cursor)) >= 0) {
+         if (strncmp(fs_entry(id)->filename, filename, MAX_FILENAME_LEN) == 0) {
+             return id;
+         }
+     }
+     return -1;
+ }
+ 
+ // Create, look up and delete files through the directory index
+ void bench_names(uint32_t operations) {
+     static char names[2048][16]; // Half are created, half stay missing
+     const int files = sizeof(names) / sizeof(names[0]) / 2;
+     for (int i = 0; i < files * 2; i++) {
+         snprintf(names[i], sizeof(names[i]), "bench_%d", i);
+     }
+     for (int i = 0; i < files; i++) {
+         fs_create(names[i]);
+     }
+     
+     uint32_t seed = 99;
+     volatile int sink = 0;
+     uint64_t start = bench_now_ns();
+     for (uint32_t i = 0; i < operations; i++) {
+         sink += fs_find(names[bench_random(&seed) % files]);
+     }
+     uint64_t hit = bench_now_ns() - start;
+     
+     start = bench_now_ns();
+     for (uint32_t i = 0; i < operations; i++) {
+         sink += fs_find(names[files + bench_random(&seed) % files]);
+     }
+     uint64_t miss = bench_now_ns() - start;
+     
+     start = bench_now_ns();
+     for (uint32_t i = 0; i < operations; i++) {
+         sink += bench_find_linear(names[bench_random(&seed) % files]);
+     }
+     uint64_t linear = bench_now_ns() - start;
+     
+     // Replace one file at a time so the directory keeps its size
+     start = bench_now_ns();
+     for (uint32_t i = 0; i < operations; i++) {
+         int victim = bench_random(&seed) % files;
+         fs_delete(names[victim]);
+         sink += fs_create(names[victim]);
+     }
+     uint64_t churn = bench_now_ns() - start;
+     (void)sink;
+     
+     printf("%d files, %u operations each\n", files, operations);
+     printf("%-24s %8.1f ns/op\n", "lookup (hit)", (double)hit / operations);
+     printf("%-24s %8.1f ns/op\n", "lookup (miss)", (double)miss / operations);
+     printf("%-24s %8.1f ns/op\n", "lookup (linear scan)", (double)linear / operations);
+     printf("%-24s %8.1f ns/op\n", "delete + create", (double)churn / operations);
+     for (int i = 0; i < files; i++) {
+         fs_delete(names[i]);
+     }
+ }
+ 
+ // Create files on the mounted image at several group commit intervals
+ void bench_journal(uint32_t creates) {
+     if (!simple_os.disk_mapped) {
+         printf("bench journal: mount a disk image first\n");
+         return;
+     }
+     const int files = 64;
+     char names[files][16];
+     for (int i = 0; i < files; i++) {
+         snprintf(names[i], sizeof(names[i]), "bench_%d", i);
+     }
+     
+     static const uint32_t intervals[] = {0, 1, 10, 100};
+     uint32_t saved = simple_os.journal_interval_ms;
+     printf("%u creates per interval, %d files live at most\n", creates, files);
+     for (size_t k = 0; k < sizeof(intervals) / sizeof(intervals[0]); k++) {
+         simple_os.journal_interval_ms = intervals[k];
+         disk_sync();
+         uint64_t commits = simple_os.journal_commits;
+         uint64_t fsyncs = simple_os.journal_fsyncs;
+         
+         // Delete the oldest file once all are live so every create succeeds
+         uint64_t start = bench_now_ns();
+         for (uint32_t i = 0; i < creates; i++) {
+             if (i >= (uint32_t)files) {
+                 fs_delete(names[i % files]);
+             }
+             fs_create(names[i % files]);
+         }
+         disk_sync();
+         uint64_t elapsed = bench_now_ns() - start;
+         
+         char label[32];
+         snprintf(label, sizeof(label), "interval %u ms", intervals[k]);
+         printf("%-24s %12.0f creates/s  %6llu commits  %6llu fsyncs\n", label,
+                (double)creates * 1e9 / (double)elapsed,
+                (unsigned long long)(simple_os.journal_commits - commits),
+                (unsigned long long)(simple_os.journal_fsyncs - fsyncs));
+         for (int i = 0; i < files && (uint32_t)i < creates; i++) {
+             fs_delete(names[i]);
+         }
+     }
+     simple_os.journal_interval_ms = saved;
+     disk_sync();
+ }
+ 
+ // Resolve paths of increasing depth with and without the dentry cache
+ void bench_paths(uint32_t lookups) {
+     const int max_depth = 32;
+     char path[MAX_PATH_LEN + 1];
+     size_t len = 0;
+     int depth = 0;
+     
+     // Build /.b/.b/... as deep as the file table allows
+     for (; depth < max_depth; depth++) {
+         len += snprintf(path + len, sizeof(path) - len, "/.b");
+         if (fs_mkdir(path) < 0) {
+             path[len -= 3] = '\0';
+             break;
+         }
+     }
+     if (depth == 0) {
+         printf("bench paths: cannot create directories\n");
+         return;
+     }
+     
+     printf("%-8s %12s %12s %12s\n", "depth", "dcache", "no dcache", "miss");
+     bool saved = simple_os.dcache_enabled;
+     for (int d = 1; d <= depth; d *= 2) {
+         path[d * 3] = '\0';
+         double ns[3];
+         for (int mode = 0; mode < 3; mode++) {
+             // The third run looks up a missing name under the deepest directory
+             simple_os.dcache_enabled = mode != 1;
+             const char* target = path;
+             char missing[MAX_PATH_LEN + 8];
+             if (mode == 2) {
+                 snprintf(missing, sizeof(missing), "%s/none", path);
+                 target = missing;
+             }
+             volatile int sink = 0;
+             uint64_t start = bench_now_ns();
+             for (uint32_t i = 0; i < lookups; i++) {
+                 sink += fs_find(target);
+             }
+             ns[mode] = (double)(bench_now_ns() - start) / lookups;
+             (void)sink;
+         }
+         printf("%-8d %9.1f ns %9.1f ns %9.1f ns\n", d, ns[0], ns[1], ns[2]);
+         path[d * 3] = '/';
+         if (d < depth && d * 2 > depth) {
+             d = depth / 2; // Always finish with the deepest path
+         }
+     }
+     simple_os.dcache_enabled = saved;
+     
+     // Remove the chain from the deepest directory up
+     path[depth * 3] = '\0';
+     for (int d = depth; d > 0; d--) {
+         path[d * 3] = '\0';
+         fs_delete(path);
+     }
+ }
+ 
+ uint8_t bench_io_buffer[16384];
+ 
+ // Empty the page cache and its counters so a measurement starts cold
+ void bench_cache_reset() {
+     cache_sync();
+     for (int16_t i = 0; i < CACHE_PAGES; i++) {
+         if (simple_os.cache[i].file >= 0) {
+             cache_release(i);
+         }
+     }
+     for (int i = 0; i < READAHEAD_FILES; i++) {
+         simple_os.readahead[i].file = -1;
+     }
+     memset(simple_os.cache_ghosts, 0, sizeof(simple_os.cache_ghosts));
+     simple_os.cache_hits = 0;
+     simple_os.cache_misses = 0;
+     simple_os.readahead_pages = 0;
+     simple_os.readahead_hits = 0;
+     simple_os.readahead_wasted = 0;
+ }
+ 
+ // Page cache hit rate for random reads over working sets of growing size
+ void bench_cache(uint32_t reads) {
+     const uint32_t file_size = 32768;
+     const int max_files = 32;
+     char name[16];
+     int files = 0;
+     memset(bench_io_buffer, 'c', sizeof(bench_io_buffer));
+     for (; files < max_files; files++) {
+         snprintf(name, sizeof(name), "cache.%d", files);
+         if (fs_create(name) < 0 || fs_write(name, 0, bench_io_buffer, 16384) < 0 ||
+             fs_write(name, 16384, bench_io_buffer, 16384) < 0) {
+             fs_delete(name);
+             break;
+         }
+     }
+     
+     printf("cache %u KB, %u reads of %u bytes per working set\n",
+            CACHE_PAGES * BLOCK_SIZE / 1024, reads, BLOCK_SIZE);
+     printf("%-14s %10s %10s\n", "working set", "hit rate", "MB/s");
+     uint32_t pages_per_file = file_size / BLOCK_SIZE;
+     for (int n = 2; n <= files; n *= 2) {
+         bench_cache_reset();
+         uint32_t seed = 7;
+         uint64_t start = bench_now_ns();
+         for (uint32_t i = 0; i < reads; i++) {
+             uint32_t page = bench_random(&seed) % (n * pages_per_file);
+             snprintf(name, sizeof(name), "cache.%u", page / pages_per_file);
+             fs_read(name, (page % pages_per_file) * BLOCK_SIZE, bench_io_buffer, BLOCK_SIZE);
+         }
+         uint64_t elapsed = bench_now_ns() - start;
+         printf("%8u KB %9.1f%% %10.0f\n", n * file_size / 1024,
+                100.0 * simple_os.cache_hits / (simple_os.cache_hits + simple_os.cache_misses),
+                (double)reads * BLOCK_SIZE * 1e3 / elapsed);
+     }
+     
+     // A hot file read between passes of a one-off scan larger than the cache
+     if (files > 2) {
+         bench_cache_reset();
+         uint64_t hot_hits = 0;
+         uint64_t hot_reads = 0;
+         uint32_t seed = 11;
+         for (int pass = 0; pass < 4; pass++) {
+             for (int f = 1; f < files; f++) {
+                 snprintf(name, sizeof(name), "cache.%d", f);
+                 for (uint32_t off = 0; off < file_size; off += BLOCK_SIZE) {
+                     fs_read(name, off, bench_io_buffer, BLOCK_SIZE);
+                 }
+                 for (int i = 0; i < 64; i++) {
+                     uint64_t hits = simple_os.cache_hits;
+                     fs_read("cache.0", (bench_random(&seed) % pages_per_file) * BLOCK_SIZE, bench_io_buffer, BLOCK_SIZE);
+                     hot_hits += simple_os.cache_hits - hits;
+                     hot_reads++;
+                 }
+             }
+         }
+         printf("%-14s %9.1f%%  (hot file read during large scans)\n", "hot + scan",
+                100.0 * hot_hits / hot_reads);
+     }
+     
+     for (int i = 0; i < files; i++) {
+         snprintf(name, sizeof(name), "cache.%d", i);
+         fs_delete(name);
+     }
+ }
+ 
+ // Sequential and random file throughput at several request sizes
+ void bench_io(uint32_t total_bytes) {
+     const char* name = "bench.io";
+     const uint32_t file_size = 32768;
+     const uint32_t sizes[] = { 512, 1024, 4096, 16384 };
+     if (fs_create(name) < 0) {
+         printf("bench io: cannot create %s\n", name);
+         return;
+     }
+     memset(bench_io_buffer, 'x', sizeof(bench_io_buffer));
+     if (fs_write(name, 0, bench_io_buffer, 16384) < 0 || fs_write(name, 16384, bench_io_buffer, 16384) < 0) {
+         printf("bench io: out of space\n");
+         fs_delete(name);
+         return;
+     }
+     
+     printf("%-8s %10s %10s %10s %10s\n", "size", "seq write", "seq read", "rnd write", "rnd read");
+     for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+         uint32_t size = sizes[s];
+         uint32_t ops = total_bytes / size;
+         uint32_t slots = file_size / size;
+         double mbps[4];
+         for (int mode = 0; mode < 4; mode++) {
+             uint32_t seed = 12345;
+             uint64_t start = bench_now_ns();
+             for (uint32_t i = 0; i < ops; i++) {
+                 uint32_t slot = mode < 2 ? i % slots : bench_random(&seed) % slots;
+                 if (mode % 2 == 0) {
+                     fs_write(name, slot * size, bench_io_buffer, size);
+                 } else {
+                     fs_read(name, slot * size, bench_io_buffer, size);
+                 }
+             }
+             uint64_t elapsed = bench_now_ns() - start;
+             mbps[mode] = (double)ops * size * 1e3 / (double)elapsed;
+         }
+         printf("%-8u %7.0f MB/s %5.0f MB/s %5.0f MB/s %5.0f MB/s\n", size, mbps[0], mbps[1], mbps[2], mbps[3]);
+     }
+     fs_delete(name);
+ }
+ 
+ // The real file system and device counters while a benchmark runs on a scratch disk,
+ // so layout benchmarks leave the real one alone
+ struct {
+     DiskImage* disk;
+     size_t size;
+     bool mapped;
+     int32_t cwd;
+     uint8_t cwd_mount;
+     uint64_t stats[5];
+ } bench_saved;
+ 
+ void bench_scratch_begin() {
+     cache_sync();
+     bench_saved.disk = simple_os.disk;
+     bench_saved.size = simple_os.disk_size;
+     bench_saved.mapped = simple_os.disk_mapped;
+     bench_saved.cwd = simple_os.cwd;
+     bench_saved.cwd_mount = simple_os.cwd_mount;
+     simple_os.cwd_mount = 0; // Relative paths of the benchmarks name files on the scratch disk
+     bench_saved.stats[0] = simple_os.block_writes;
+     bench_saved.stats[1] = simple_os.block_seeks;
+     bench_saved.stats[2] = simple_os.cache_writebacks;
+     bench_saved.stats[3] = simple_os.lfs_cleaned_blocks;
+     bench_saved.stats[4] = simple_os.lfs_cleaned_segments;
+     simple_os.disk_mapped = false;
+ }
+ 
+ // Start a measurement on an empty scratch disk
+ void bench_scratch_format(FsLayout layout) {
+     if (simple_os.disk != bench_saved.disk) {
+         free(simple_os.disk);
+     }
+     size_t size = META_PAGES_OFFSET + META_MIN_PAGES * BLOCK_SIZE;
+     fs_attach(calloc(1, size), size);
+     fs_format(layout);
+     simple_os.block_writes = 0;
+     simple_os.block_seeks = 0;
+     simple_os.cache_writebacks = 0;
+     simple_os.lfs_cleaned_blocks = 0;
+ }
+ 
+ void bench_scratch_end() {
+     if (simple_os.disk != bench_saved.disk) {
+         free(simple_os.disk);
+     }
+     fs_attach(bench_saved.disk, bench_saved.size);
+     simple_os.disk_mapped = bench_saved.mapped;
+     simple_os.cwd = bench_saved.cwd;
+     simple_os.cwd_mount = bench_saved.cwd_mount;
+     simple_os.block_writes = bench_saved.stats[0];
+     simple_os.block_seeks = bench_saved.stats[1];
+     simple_os.cache_writebacks = bench_saved.stats[2];
+     simple_os.lfs_cleaned_blocks = bench_saved.stats[3];
+     simple_os.lfs_cleaned_segments = bench_saved.stats[4];
+ }
+ 
+ // Many small appends spread over many files, once per layout
+ void bench_log(uint32_t total_bytes) {
+     const int files = 32;
+     const uint32_t rotate_size = 57344; // Files are truncated once they reach this size
+     static const FsLayout layouts[] = { FS_LAYOUT_INPLACE, FS_LAYOUT_LOG };
+     static const char* layout_names[] = { "in place", "log" };
+     
+     bench_scratch_begin();
+     memset(bench_io_buffer, 'a', sizeof(bench_io_buffer));
+     
+     printf("%u bytes appended in 16-256 byte records across %d files\n", total_bytes, files);
+     printf("%-10s %10s %12s %8s %10s %10s\n", "layout", "MB/s", "disk writes", "seeks", "write amp", "cleaned");
+     for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+         bench_scratch_format(layouts[l]);
+         char name[16];
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "log.%d", f);
+             fs_create(name);
+         }
+         
+         uint32_t seed = 4242;
+         uint32_t written = 0;
+         uint64_t start = bench_now_ns();
+         while (written < total_bytes) {
+             int f = bench_random(&seed) % files;
+             uint32_t len = 16 + bench_random(&seed) % 241;
+             snprintf(name, sizeof(name), "log.%d", f);
+             FileEntry* file = fs_entry(fs_find(name));
+             if (file->size + len > rotate_size || fs_write(name, file->size, bench_io_buffer, len) < 0) {
+                 fs_truncate(name, 0);
+                 continue;
+             }
+             written += len;
+         }
+         cache_sync();
+         uint64_t elapsed = bench_now_ns() - start;
+         
+         printf("%-10s %10.1f %12llu %7.1f%% %10.2f %10llu\n", layout_names[l],
+                (double)written * 1e3 / (double)elapsed,
+                (unsigned long long)simple_os.block_writes,
+                simple_os.block_writes ? 100.0 * simple_os.block_seeks / simple_os.block_writes : 0.0,
+                (double)simple_os.block_writes * BLOCK_SIZE / written,
+                (unsigned long long)simple_os.lfs_cleaned_blocks);
+     }
+     
+     bench_scratch_end();
+ }
+ 
+ // Grow several large files in interleaved appends and count the extents they end up with
+ void bench_alloc(uint32_t file_size) {
+     const int files = 8;
+     const uint32_t append = 4096;
+     static const char* modes[] = { "delayed", "flush each append" };
+     
+     bench_scratch_begin();
+     memset(bench_io_buffer, 'e', sizeof(bench_io_buffer));
+     printf("%d files grown to %u KB in interleaved %u byte appends\n", files, file_size / 1024, append);
+     printf("%-18s %10s %12s %12s %14s\n", "allocation", "MB/s", "extents/file", "max extents", "extent bytes/MB");
+     for (int mode = 0; mode < 2; mode++) {
+         bench_scratch_format(FS_LAYOUT_INPLACE);
+         char name[16];
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "big.%d", f);
+             fs_create(name);
+         }
+         
+         // Flushing after every append forces blocks to be placed as soon as they are written
+         uint64_t start = bench_now_ns();
+         for (uint32_t offset = 0; offset < file_size; offset += append) {
+             for (int f = 0; f < files; f++) {
+                 snprintf(name, sizeof(name), "big.%d", f);
+                 fs_write(name, offset, bench_io_buffer, append);
+                 if (mode == 1) {
+                     cache_sync();
+                 }
+             }
+         }
+         cache_sync();
+         uint64_t elapsed = bench_now_ns() - start;
+         
+         int total = 0;
+         int most = 0;
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "big.%d", f);
+             int extents = fs_entry(fs_find(name))->extent_count;
+             total += extents;
+             most = extents > most ? extents : most;
+         }
+         printf("%-18s %10.1f %12.1f %12d %14.1f\n", modes[mode],
+                (double)files * file_size * 1e3 / (double)elapsed, (double)total / files, most,
+                (double)total * sizeof(Extent) * 1024 * 1024 / ((double)files * file_size));
+     }
+     bench_scratch_end();
+ }
+ 
+ // Create many tiny files and cat them back, with and without inline data
+ void bench_small(int rounds) {
+     const int files = 48;
+     const uint32_t file_size = 40;
+     static const char* modes[] = { "blocks", "inline" };
+     bool saved_inline = simple_os.inline_enabled;
+     
+     bench_scratch_begin();
+     memset(bench_io_buffer, 's', sizeof(bench_io_buffer));
+     printf("%d files of %u bytes, each read whole %d times\n", files, file_size, rounds);
+     printf("%-8s %12s %12s %12s %12s\n", "storage", "create ns", "cold ns", "warm ns", "blocks used");
+     for (int mode = 0; mode < 2; mode++) {
+         simple_os.inline_enabled = mode == 1;
+         bench_scratch_format(FS_LAYOUT_INPLACE);
+         uint32_t free_before = simple_os.disk->free_blocks;
+         char name[16];
+         uint64_t start = bench_now_ns();
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "small.%d", f);
+             fs_create(name);
+             fs_write(name, 0, bench_io_buffer, file_size);
+         }
+         cache_sync();
+         uint64_t create = bench_now_ns() - start;
+         
+         // Cold reads start from an empty page cache; warm reads find every page resident
+         uint64_t cold = 0;
+         uint64_t warm = 0;
+         for (int r = 0; r < rounds; r++) {
+             bench_cache_reset();
+             start = bench_now_ns();
+             for (int f = 0; f < files; f++) {
+                 snprintf(name, sizeof(name), "small.%d", f);
+                 fs_read(name, 0, bench_io_buffer, BLOCK_SIZE);
+             }
+             cold += bench_now_ns() - start;
+             start = bench_now_ns();
+             for (int f = 0; f < files; f++) {
+                 snprintf(name, sizeof(name), "small.%d", f);
+                 fs_read(name, 0, bench_io_buffer, BLOCK_SIZE);
+             }
+             warm += bench_now_ns() - start;
+         }
+         printf("%-8s %12.0f %12.0f %12.0f %12u\n", modes[mode], (double)create / files,
+                (double)cold / ((double)files * rounds), (double)warm / ((double)files * rounds),
+                free_before - simple_os.disk->free_blocks);
+     }
+     simple_os.inline_enabled = saved_inline;
+     bench_scratch_end();
+ }
+ 
+ // Streaming, interleaved and random reads with readahead off and on
+ void bench_readahead(uint32_t total_bytes) {
+     const int files = 4;
+     const uint32_t file_size = 256 * 1024;
+     const uint32_t request = 4096;
+     static const char* patterns[] = { "sequential", "4 streams", "random" };
+     uint16_t saved_max = simple_os.readahead_max;
+     
+     bench_scratch_begin();
+     bench_scratch_format(FS_LAYOUT_INPLACE);
+     memset(bench_io_buffer, 'r', sizeof(bench_io_buffer));
+     char name[16];
+     for (int f = 0; f < files; f++) {
+         snprintf(name, sizeof(name), "stream.%d", f);
+         fs_create(name);
+         for (uint32_t offset = 0; offset < file_size; offset += request) {
+             fs_write(name, offset, bench_io_buffer, request);
+         }
+     }
+     
+     printf("%u bytes read in %u byte requests from %d files of %u KB\n", total_bytes, request, files,
+            file_size / 1024);
+     printf("%-11s %-4s %10s %8s %12s %8s %8s\n", "pattern", "ra", "MB/s", "misses", "read ahead", "used", "wasted");
+     for (int pattern = 0; pattern < 3; pattern++) {
+         for (int mode = 0; mode < 2; mode++) {
+             simple_os.readahead_max = mode == 0 ? 0 : saved_max;
+             bench_cache_reset();
+             uint32_t seed = 99;
+             uint32_t offsets[4] = { 0, 0, 0, 0 };
+             uint64_t start = bench_now_ns();
+             for (uint32_t done = 0; done < total_bytes; done += request) {
+                 int f;
+                 uint32_t offset;
+                 if (pattern == 0) {
+                     f = (done / file_size) % files;
+                     offset = done % file_size;
+                 } else if (pattern == 1) {
+                     f = (done / request) % files;
+                     offset = offsets[f];
+                     offsets[f] = (offsets[f] + request) % file_size;
+                 } else {
+                     f = bench_random(&seed) % files;
+                     offset = bench_random(&seed) % (file_size / request) * request;
+                 }
+                 snprintf(name, sizeof(name), "stream.%d", f);
+                 fs_read(name, offset, bench_io_buffer, request);
+             }
+             uint64_t elapsed = bench_now_ns() - start;
+             printf("%-11s %-4s %10.1f %8llu %12llu %7.1f%% %7.1f%%\n", patterns[pattern], mode ? "on" : "off",
+                    (double)total_bytes * 1e3 / (double)elapsed, (unsigned long long)simple_os.cache_misses,
+                    (unsigned long long)simple_os.readahead_pages,
+                    simple_os.readahead_pages ? 100.0 * simple_os.readahead_hits / simple_os.readahead_pages : 0.0,
+                    simple_os.readahead_pages ? 100.0 * simple_os.readahead_wasted / simple_os.readahead_pages : 0.0);
+         }
+     }
+     simple_os.readahead_max = saved_max;
+     bench_scratch_end();
+ }
+ 
+ // Repeated small sequential reads of one file, by path and through a descriptor
+ void bench_fd(uint32_t reads) {
+     const uint32_t request = 64;
+     const uint32_t file_size = 4096;
+     static const int depths[] = { 1, 4, 16 };
+     char path[MAX_PATH_LEN];
+     memset(bench_io_buffer, 'd', sizeof(bench_io_buffer));
+     
+     printf("%u reads of %u bytes from a %u byte file\n", reads, request, file_size);
+     printf("%-8s %12s %12s %10s\n", "depth", "by path", "by fd", "speedup");
+     for (size_t k = 0; k < sizeof(depths) / sizeof(depths[0]); k++) {
+         // Directories /.f/.f/... hold the file at the given depth
+         size_t len = 0;
+         int made = 0;
+         for (; made < depths[k] - 1; made++) {
+             len += snprintf(path + len, sizeof(path) - len, "/.f");
+             if (fs_mkdir(path) < 0) {
+                 break;
+             }
+         }
+         snprintf(path + len, sizeof(path) - len, "/bench.fd");
+         int fd = -1;
+         if (made == depths[k] - 1 && fs_create(path) >= 0 && fs_write(path, 0, bench_io_buffer, file_size) > 0) {
+             fd = fd_open(0xFF, path, 0);
+         }
+         if (fd < 0) {
+             printf("bench fd: cannot create %s\n", path);
+         } else {
+             uint64_t start = bench_now_ns();
+             for (uint32_t i = 0, offset = 0; i < reads; i++, offset = (offset + request) % file_size) {
+                 fs_read(path, offset, bench_io_buffer, request);
+             }
+             double by_path = (double)(bench_now_ns() - start) / reads;
+             
+             start = bench_now_ns();
+             for (uint32_t i = 0; i < reads; i++) {
+                 if (fd_read(0xFF, fd, bench_io_buffer, request) == 0) {
+                     fd_seek(0xFF, fd, 0, SEEK_SET);
+                     fd_read(0xFF, fd, bench_io_buffer, request);
+                 }
+             }
+             double by_fd = (double)(bench_now_ns() - start) / reads;
+             fd_close(0xFF, fd);
+             printf("%-8d %9.1f ns %9.1f ns %9.1fx\n", depths[k], by_path, by_fd, by_path / by_fd);
+         }
+         
+         fs_delete(path);
+         for (; made > 0; made--) {
+             path[made * 3] = '\0';
+             fs_delete(path);
+         }
+     }
+ }
+ 
+ // Create, look up and list ever more files in one directory of a scratch disk
+ void bench_files(uint32_t max_files) {
+     char name[16];
+     uint32_t seed = 7;
+     uint32_t count = 0;
+     
+     bench_scratch_begin();
+     bench_scratch_format(FS_LAYOUT_INPLACE);
+     printf("%-10s %12s %12s %14s %10s\n", "files", "creates/s", "lookup ns", "listed/s", "meta MB");
+     for (uint32_t step = 10000; step <= max_files; step *= 10) {
+         uint32_t before = count;
+         uint64_t start = bench_now_ns();
+         for (; count < step; count++) {
+             snprintf(name, sizeof(name), "f%u", count);
+             if (fs_create(name) < 0) {
+                 break;
+             }
+         }
+         uint64_t create = bench_now_ns() - start;
+         if (count < step) {
+             printf("bench files: out of memory after %u files\n", count);
+             break;
+         }
+         
+         const uint32_t lookups = 100000;
+         volatile int32_t sink = 0;
+         start = bench_now_ns();
+         for (uint32_t i = 0; i < lookups; i++) {
+             snprintf(name, sizeof(name), "f%u", bench_random(&seed) % count);
+             sink ^= fs_find(name);
+         }
+         uint64_t lookup = bench_now_ns() - start;
+         (void)sink;
+         
+         DirCursor cursor = {0};
+         uint32_t listed = 0;
+         start = bench_now_ns();
+         while (dir_next(FS_ROOT, &cursor) >= 0) {
+             listed++;
+         }
+         uint64_t list = bench_now_ns() - start;
+         
+         printf("%-10u %12.0f %12.1f %14.0f %10.1f\n", count, (double)(count - before) * 1e9 / create,
+                (double)lookup / lookups, (double)listed * 1e9 / list,
+                (double)simple_os.disk->meta_pages * BLOCK_SIZE / (1024 * 1024));
+     }
+     bench_scratch_end();
+ }
+ 
+ // Pattern searches through the name index versus a scan of the directory, in a namespace
+ // of files names, then deleting many files by one pattern versus one name at a time
+ void bench_glob(uint32_t files) {
+     static const char* formats[] = { "log_%u", "tmp_%u", "img%u.png", "data_%u.csv" };
+     static const char* patterns[] = { "log_123456", "tmp_1234?", "img12*", "log_1*", "tmp_*", "*.csv", "*_7?7*" };
+     char name[MAX_FILENAME_LEN];
+     
+     bench_scratch_begin();
+     bench_scratch_format(FS_LAYOUT_INPLACE);
+     for (uint32_t i = 0; i < files; i++) {
+         snprintf(name, sizeof(name), formats[i % 4], i / 4);
+         if (fs_create(name) < 0) {
+             printf("bench glob: out of memory after %u files\n", i);
+             bench_scratch_end();
+             return;
+         }
+     }
+     uint64_t start = bench_now_ns();
+     name_index_build(); // What the first search after a mount pays
+     uint64_t build = bench_now_ns() - start;
+     printf("%u names, index built in %.1f ms, %.1f MB\n", files, (double)build / 1e6,
+            (double)simple_os.names_used * sizeof(NameNode) / (1024 * 1024));
+     
+     printf("%-12s %10s %12s %12s %12s\n", "pattern", "hits", "index ms", "scan ms", "index ns/hit");
+     for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+         int32_t* ids;
+         start = bench_now_ns();
+         int32_t hits = fs_glob(FS_ROOT, patterns[p], &ids);
+         uint64_t indexed = bench_now_ns() - start;
+         free(ids);
+         start = bench_now_ns();
+         int32_t scanned_hits = fs_glob_scan(FS_ROOT, patterns[p], &ids);
+         uint64_t scanned = bench_now_ns() - start;
+         free(ids);
+         if (hits < 0 || scanned_hits != hits) {
+             printf("bench glob: %s found %d names through the index and %d by scanning\n", patterns[p], hits,
+                    scanned_hits);
+             break;
+         }
+         printf("%-12s %10d %12.3f %12.3f %12.1f\n", patterns[p], hits, (double)indexed / 1e6, (double)scanned / 1e6,
+                hits > 0 ? (double)indexed / hits : 0.0);
+     }
+     
+     // The same number of files each way: tmp_1* and data_1* cover the same numbers
+     int32_t* ids;
+     start = bench_now_ns();
+     int32_t count = fs_glob(FS_ROOT, "tmp_1*", &ids);
+     for (int32_t i = 0; i < count; i++) {
+         fs_delete_entry(ids[i]);
+     }
+     uint64_t by_pattern = bench_now_ns() - start;
+     free(ids);
+     uint32_t deleted = 0;
+     start = bench_now_ns();
+     for (uint32_t i = 3; i < files; i += 4) {
+         snprintf(name, sizeof(name), formats[3], i / 4);
+         if (name[5] == '1') {
+             deleted += fs_delete(name) == 0;
+         }
+     }
+     uint64_t by_name = bench_now_ns() - start;
+     printf("rm tmp_1*:           %d files in %.1f ms (%.2f us each)\n", count, (double)by_pattern / 1e6,
+            count > 0 ? (double)by_pattern / count / 1000 : 0.0);
+     printf("rm data_1* by name:  %u files in %.1f ms (%.2f us each)\n", deleted, (double)by_name / 1e6,
+            deleted > 0 ? (double)by_name / deleted / 1000 : 0.0);
+     bench_scratch_end();
+ }
+ 
+ // Space taken and throughput of a text file and a random one, with compression off and on
+ void bench_compress(uint32_t total_bytes) {
+     const uint32_t file_size = 1024 * 1024;
+     const uint32_t request = 4096;
+     static const char* words[] = { "the ", "file ", "system ", "writes ", "a ", "block ", "to ", "cache ",
+                                    "and ", "reads ", "compressed ", "clusters ", "of ", "data ", "in ", "pages.\n" };
+     static const char* contents[] = { "text", "random" };
+     static uint8_t source[65536];
+     bool saved_compress = simple_os.compress_enabled;
+     uint32_t passes = total_bytes / file_size > 0 ? total_bytes / file_size : 1;
+     
+     bench_scratch_begin();
+     printf("%u KB file written and read %u times in %u byte requests\n", file_size / 1024, passes, request);
+     printf("%-7s %-9s %10s %10s %10s %8s %7s\n", "data", "compress", "write MB/s", "read MB/s", "rand MB/s",
+            "blocks", "ratio");
+     for (int content = 0; content < 2; content++) {
+         uint32_t seed = 2024;
+         for (uint32_t i = 0; i < sizeof(source);) {
+             if (content == 0) {
+                 const char* word = words[bench_random(&seed) % (sizeof(words) / sizeof(words[0]))];
+                 while (*word && i < sizeof(source)) {
+                     source[i++] = (uint8_t)*word++;
+                 }
+             } else {
+                 source[i++] = (uint8_t)bench_random(&seed);
+             }
+         }
+         for (int mode = 0; mode < 2; mode++) {
+             simple_os.compress_enabled = mode == 1;
+             bench_scratch_format(FS_LAYOUT_INPLACE);
+             int32_t id = fs_create("data");
+             
+             uint64_t start = bench_now_ns();
+             for (uint32_t pass = 0; pass < passes; pass++) {
+                 for (uint32_t offset = 0; offset < file_size; offset += request) {
+                     fs_write_entry(id, offset, source + offset % sizeof(source), request);
+                 }
+                 cache_sync();
+             }
+             uint64_t write = bench_now_ns() - start;
+             uint32_t used = NUM_BLOCKS - 1 - simple_os.disk->free_blocks;
+             
+             start = bench_now_ns();
+             for (uint32_t pass = 0; pass < passes; pass++) {
+                 bench_cache_reset();
+                 for (uint32_t offset = 0; offset < file_size; offset += request) {
+                     fs_read_entry(id, offset, bench_io_buffer, request);
+                 }
+             }
+             uint64_t read = bench_now_ns() - start;
+             
+             bench_cache_reset();
+             uint32_t reads = passes * (file_size / request);
+             start = bench_now_ns();
+             for (uint32_t i = 0; i < reads; i++) {
+                 fs_read_entry(id, bench_random(&seed) % (file_size / request) * request, bench_io_buffer, request);
+             }
+             uint64_t random = bench_now_ns() - start;
+             
+             double bytes = (double)passes * file_size;
+             printf("%-7s %-9s %10.1f %10.1f %10.1f %8u %6.2fx\n", contents[content], mode ? "on" : "off",
+                    bytes * 1e3 / (double)write, bytes * 1e3 / (double)read, bytes * 1e3 / (double)random, used,
+                    (double)fs_blocks_for(file_size) / used);
+         }
+     }
+     simple_os.compress_enabled = saved_compress;
+     bench_scratch_end();
+ }
+ 
+ // CRC32C speed over single blocks, then file write and read throughput with checksums off and on
+ void bench_checksum(uint32_t total_bytes) {
+     const uint32_t file_size = 1024 * 1024;
+     const uint32_t request = 4096;
+     static uint8_t source[64 * 1024];
+     uint32_t seed = 46;
+     for (uint32_t i = 0; i < sizeof(source); i++) {
+         source[i] = (uint8_t)bench_random(&seed);
+     }
+     
+     uint32_t blocks = total_bytes / BLOCK_SIZE;
+     uint32_t sink = 0;
+     printf("%-22s %10s\n", "CRC32C of 512 bytes", "MB/s");
+     for (int hardware = simple_os.crc32c_hardware; hardware >= 0; hardware--) {
+         bool saved = simple_os.crc32c_hardware;
+         simple_os.crc32c_hardware = hardware;
+         uint64_t start = bench_now_ns();
+         for (uint32_t i = 0; i < blocks; i++) {
+             sink += crc32c(0, source + i % (sizeof(source) / BLOCK_SIZE) * BLOCK_SIZE, BLOCK_SIZE);
+         }
+         uint64_t elapsed = bench_now_ns() - start;
+         simple_os.crc32c_hardware = saved;
+         printf("%-22s %10.1f\n", hardware ? "instructions, 3 streams" : "slicing-by-8 tables",
+                (double)blocks * BLOCK_SIZE * 1e3 / (double)elapsed);
+     }
+     
+     // Passes alternate between checksums off and on so both see the same warm caches, and the
+     // fastest of each is kept since the host may run other work. Every pass rewrites the whole
+     // file, so one with checksums on never reads a block written without.
+     uint32_t passes = total_bytes / 4 / file_size > 0 ? total_bytes / 4 / file_size : 1;
+     uint64_t write[2] = { UINT64_MAX, UINT64_MAX };
+     uint64_t read[2] = { UINT64_MAX, UINT64_MAX };
+     bench_scratch_begin();
+     bench_scratch_format(FS_LAYOUT_INPLACE);
+     int32_t id = fs_create("data");
+     for (uint32_t pass = 0; pass < 2 * passes; pass++) {
+         int mode = pass % 2;
+         simple_os.checksums_enabled = mode == 1;
+         uint64_t start = bench_now_ns();
+         for (uint32_t offset = 0; offset < file_size; offset += request) {
+             fs_write_entry(id, offset, source + (offset + pass * BLOCK_SIZE) % (sizeof(source) - request), request);
+         }
+         cache_sync();
+         uint64_t elapsed = bench_now_ns() - start;
+         write[mode] = elapsed < write[mode] ? elapsed : write[mode];
+         
+         bench_cache_reset();
+         start = bench_now_ns();
+         for (uint32_t offset = 0; offset < file_size; offset += request) {
+             if (fs_read_entry(id, offset, bench_io_buffer, request) < 0) {
+                 sink++;
+             }
+         }
+         elapsed = bench_now_ns() - start;
+         read[mode] = elapsed < read[mode] ? elapsed : read[mode];
+     }
+     simple_os.checksums_enabled = true;
+     bench_scratch_end();
+     
+     double bytes = file_size;
+     printf("\n%u KB file written and read %u times in %u byte requests, fastest pass\n", file_size / 1024,
+            passes, request);
+     printf("%-10s %10s %10s\n", "checksums", "write MB/s", "read MB/s");
+     for (int mode = 0; mode < 2; mode++) {
+         printf("%-10s %10.1f %10.1f\n", mode ? "on" : "off", bytes * 1e3 / (double)write[mode],
+                bytes * 1e3 / (double)read[mode]);
+     }
+     printf("Overhead:  %9.1f%% %9.1f%%\n", ((double)write[1] / write[0] - 1) * 100,
+            ((double)read[1] / read[0] - 1) * 100);
+     if (sink == 1) {
+         printf("\n"); // Keeps the checksums from being optimized away
+     }
+ }
+ 
+ // Write many near-identical files and many unique ones, with deduplication off and on
+ void bench_dedup(uint32_t total_bytes) {
+     const int files = 24;
+     const uint32_t file_size = 64 * 1024;
+     const uint32_t request = 4096;
+     const int edits = 4; // Small changes that make each copy differ from the original
+     static const char* contents[] = { "copies", "unique" };
+     static uint8_t source[64 * 1024];
+     bool saved_dedup = simple_os.dedup_enabled;
+     bool saved_compress = simple_os.compress_enabled;
+     uint32_t rounds = total_bytes / (files * file_size) > 0 ? total_bytes / (files * file_size) : 1;
+     simple_os.compress_enabled = false;
+     
+     bench_scratch_begin();
+     printf("%d files of %u KB written %u times in %u byte requests\n", files, file_size / 1024, rounds, request);
+     printf("%-7s %-6s %10s %8s %7s\n", "data", "dedup", "write MB/s", "blocks", "ratio");
+     for (int content = 0; content < 2; content++) {
+         for (int mode = 0; mode < 2; mode++) {
+             simple_os.dedup_enabled = mode == 1;
+             bench_scratch_format(FS_LAYOUT_INPLACE);
+             uint32_t used = 0;
+             uint64_t elapsed = 0;
+             char name[16];
+             for (uint32_t round = 0; round < rounds; round++) {
+                 uint32_t seed = 77;
+                 for (uint32_t i = 0; i < sizeof(source); i++) {
+                     source[i] = (uint8_t)bench_random(&seed);
+                 }
+                 for (int f = 0; f < files; f++) {
+                     snprintf(name, sizeof(name), "copy.%d", f);
+                     int32_t id = fs_create(name);
+                     for (int k = 0; k < (content == 0 ? edits : (int)(file_size / 8)); k++) {
+                         uint32_t at = bench_random(&seed) % (file_size - 8);
+                         memcpy(source + at, &seed, sizeof(seed));
+                     }
+                     uint64_t start = bench_now_ns();
+                     for (uint32_t offset = 0; offset < file_size; offset += request) {
+                         fs_write_entry(id, offset, source + offset, request);
+                     }
+                     elapsed += bench_now_ns() - start;
+                 }
+                 uint64_t start = bench_now_ns();
+                 cache_sync();
+                 elapsed += bench_now_ns() - start;
+                 used = NUM_BLOCKS - 1 - simple_os.disk->free_blocks;
+                 for (int f = 0; f < files; f++) {
+                     snprintf(name, sizeof(name), "copy.%d", f);
+                     fs_delete(name);
+                 }
+             }
+             printf("%-7s %-6s %10.1f %8u %6.2fx\n", contents[content], mode ? "on" : "off",
+                    (double)rounds * files * file_size * 1e3 / (double)elapsed, used,
+                    (double)files * fs_blocks_for(file_size) / used);
+         }
+     }
+     simple_os.dedup_enabled = saved_dedup;
+     simple_os.compress_enabled = saved_compress;
+     bench_scratch_end();
+ }
+ 
+ // Snapshot and clone times for the same files holding more and more data
+ void bench_snapshot(int rounds) {
+     const int files = 32;
+     static const uint32_t sizes[] = { 1024, 4096, 12288, 24576 };
+     static uint8_t data[24576];
+     bool saved_dedup = simple_os.dedup_enabled;
+     bool saved_compress = simple_os.compress_enabled;
+     simple_os.dedup_enabled = false;
+     simple_os.compress_enabled = false;
+     uint32_t seed = 47;
+     for (uint32_t i = 0; i < sizeof(data); i++) {
+         data[i] = (uint8_t)bench_random(&seed);
+     }
+     
+     bench_scratch_begin();
+     printf("%d files; snapshot times averaged over %d rounds, clone and copy times per file\n", files, rounds);
+     printf("%-9s %8s %10s %10s %10s %10s %10s\n", "file size", "data KB", "create us", "restore us", "delete us",
+            "reflink us", "copy us");
+     for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+         bench_scratch_format(FS_LAYOUT_INPLACE);
+         char name[24];
+         char copy[24];
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "data.%d", f);
+             fs_write_entry(fs_create(name), 0, data, sizes[s]);
+         }
+         cache_sync();
+         
+         uint64_t elapsed[3] = { 0, 0, 0 };
+         for (int r = 0; r < rounds; r++) {
+             uint64_t start = bench_now_ns();
+             snapshot_create("bench");
+             uint64_t created = bench_now_ns();
+             snapshot_restore("bench");
+             uint64_t restored = bench_now_ns();
+             snapshot_delete("bench");
+             elapsed[0] += created - start;
+             elapsed[1] += restored - created;
+             elapsed[2] += bench_now_ns() - restored;
+         }
+         
+         uint64_t start = bench_now_ns();
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "data.%d", f);
+             snprintf(copy, sizeof(copy), "clone.%d", f);
+             fs_clone(name, copy);
+         }
+         uint64_t reflink = bench_now_ns() - start;
+         start = bench_now_ns();
+         for (int f = 0; f < files; f++) {
+             snprintf(name, sizeof(name), "data.%d", f);
+             snprintf(copy, sizeof(copy), "copy.%d", f);
+             int32_t id = fs_create(copy);
+             for (uint32_t offset = 0; offset < sizes[s]; offset += BLOCK_SIZE * 8) {
+                 uint8_t buffer[BLOCK_SIZE * 8];
+                 int n = fs_read(name, offset, buffer, sizeof(buffer));
+                 fs_write_entry(id, offset, buffer, (uint32_t)n);
+             }
+         }
+         cache_sync();
+         uint64_t copied = bench_now_ns() - start;
+         printf("%-9u %8u %10.1f %10.1f %10.1f %10.2f %10.2f\n", sizes[s], files * sizes[s] / 1024,
+                elapsed[0] / 1e3 / rounds, elapsed[1] / 1e3 / rounds, elapsed[2] / 1e3 / rounds,
+                reflink / 1e3 / files, copied / 1e3 / files);
+     }
+     simple_os.dedup_enabled = saved_dedup;
+     simple_os.compress_enabled = saved_compress;
+     bench_scratch_end();
+ }
+ 
+ // Check times on one thread and on every host core as a file system grows to files files
+ // spread over directories, a few of them with data blocks
+ void bench_fsck(uint32_t files) {
+     const uint32_t dirs = 1000;
+     static uint8_t data[BLOCK_SIZE];
+     char path[48];
+     uint32_t count = 0;
+     int threads = fsck_threads();
+     
+     bench_scratch_begin();
+     bench_scratch_format(FS_LAYOUT_INPLACE);
+     for (uint32_t d = 0; d < dirs; d++) {
+         snprintf(path, sizeof(path), "/d%u", d);
+         fs_mkdir(path);
+     }
+     char label[24];
+     snprintf(label, sizeof(label), "%d threads ms", threads);
+     if (threads > 1) {
+         printf("%-10s %10s %12s %14s %9s %10s\n", "files", "image MB", "1 thread ms", label, "speedup", "MB/s");
+     } else {
+         printf("One CPU, so no parallel pass\n%-10s %10s %12s %10s\n", "files", "image MB", "1 thread ms", "MB/s");
+     }
+     for (uint32_t step = 10000; step <= files; step *= 10) {
+         for (; count < step; count++) {
+             snprintf(path, sizeof(path), "/d%u/f%u", count % dirs, count / dirs);
+             int32_t id = fs_create(path);
+             if (id < 0) {
+                 break;
+             }
+             if (count % 512 == 0) {
+                 fs_write_entry(id, 0, data, sizeof(data));
+             }
+         }
+         if (count < step) {
+             printf("bench fsck: out of memory after %u files\n", count);
+             break;
+         }
+         cache_sync();
+         
+         // A first pass warms the caches. The passes then run 1, N, N, 1 threads so neither
+         // count gains from going second, and the faster pass of each count is kept.
+         FsckReport report;
+         uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+         bool failed = fsck_run(false, threads, &report) != 0 || report.left > 0;
+         for (int pass = 0; pass < 4 && !failed; pass++) {
+             int parallel = pass == 1 || pass == 2;
+             if (parallel && threads == 1) {
+                 continue;
+             }
+             failed = fsck_run(false, parallel ? threads : 1, &report) != 0 || report.left > 0;
+             best[parallel] = report.check_ns < best[parallel] ? report.check_ns : best[parallel];
+         }
+         if (failed) {
+             printf("bench fsck: the check failed or found problems\n");
+             break;
+         }
+         double mb = (double)report.bytes / (1024 * 1024);
+         if (threads > 1) {
+             printf("%-10u %10.1f %12.1f %14.1f %8.2fx %10.0f\n", count, mb, best[0] / 1e6, best[1] / 1e6,
+                    (double)best[0] / best[1], mb / (best[1] / 1e9));
+         } else {
+             printf("%-10u %10.1f %12.1f %10.0f\n", count, mb, best[0] / 1e6, mb / (best[0] / 1e9));
+         }
+     }
+     bench_scratch_end();
+ }
+ 
+ // The same small-file workload on a directory of the disk and on a tmpfs mounted beside it
+ void bench_vfs(uint32_t files) {
+     const uint32_t live = 64; // Files created before the batch is written, read and deleted
+     const uint32_t file_size = 4096;
+     static const char* dirs[] = { "/.vfs_disk", "/.vfs_tmpfs" };
+     char names[2][64][MAX_PATH_LEN];
+     memset(bench_io_buffer, 'v', file_size);
+     
+     if (vfs_create(dirs[0], true, NULL) < 0) {
+         printf("bench vfs: cannot create %s\n", dirs[0]);
+         return;
+     }
+     if (vfs_create(dirs[1], true, NULL) < 0 || vfs_mount(dirs[1], &tmpfs_ops) < 0) {
+         printf("bench vfs: cannot mount a tmpfs on %s\n", dirs[1]);
+         vfs_delete(dirs[1]);
+         vfs_delete(dirs[0]);
+         return;
+     }
+     for (int k = 0; k < 2; k++) {
+         for (uint32_t i = 0; i < live; i++) {
+             snprintf(names[k][i], MAX_PATH_LEN, "%s/f%u", dirs[k], i);
+         }
+     }
+     
+     printf("%u files of %u bytes, %u at a time\n", files, file_size, live);
+     if (!simple_os.disk_mapped) {
+         printf("No image is mounted, so the disk does not journal either\n");
+     }
+     printf("%-8s %12s %12s %12s %12s %10s\n", "mount", "creates/s", "writes/s", "reads/s", "deletes/s", "commits");
+     for (int k = 0; k < 2; k++) {
+         uint64_t elapsed[4] = {0};
+         uint32_t failed = 0;
+         disk_sync();
+         uint64_t commits = simple_os.journal_commits;
+         for (uint32_t done = 0; done < files; done += live) {
+             uint32_t count = files - done < live ? files - done : live;
+             uint64_t start = bench_now_ns();
+             for (uint32_t i = 0; i < count; i++) {
+                 failed += vfs_create(names[k][i], false, NULL) < 0;
+             }
+             uint64_t now = bench_now_ns();
+             elapsed[0] += now - start;
+             start = now;
+             for (uint32_t i = 0; i < count; i++) {
+                 failed += vfs_write(names[k][i], 0, bench_io_buffer, file_size) < 0;
+             }
+             now = bench_now_ns();
+             elapsed[1] += now - start;
+             start = now;
+             for (uint32_t i = 0; i < count; i++) {
+                 failed += vfs_read(names[k][i], 0, bench_io_buffer, file_size) < 0;
+             }
+             now = bench_now_ns();
+             elapsed[2] += now - start;
+             start = now;
+             for (uint32_t i = 0; i < count; i++) {
+                 failed += vfs_delete(names[k][i]) != 0;
+             }
+             elapsed[3] += bench_now_ns() - start;
+         }
+         disk_sync();
+         VfsNode dir;
+         vfs_find(dirs[k], &dir);
+         printf("%-8s", vfs_mount_at(dir)->ops->type);
+         for (int phase = 0; phase < 4; phase++) {
+             printf(" %12.0f", elapsed[phase] ? (double)files * 1e9 / (double)elapsed[phase] : 0.0);
+         }
+         printf(" %10llu\n", (unsigned long long)(simple_os.journal_commits - commits));
+         if (failed > 0) {
+             printf("bench vfs: %u operations failed on the %s\n", failed, vfs_mount_at(dir)->ops->type);
+         }
+     }
+     
+     vfs_umount(dirs[1]);
+     vfs_delete(dirs[1]);
+     vfs_delete(dirs[0]);
+ }
+ #if HAVE_MMAP
+ // Random reads of a host file at growing queue depths on each I/O backend, then
+ // the same reads issued by sleeping processes when an image is mounted
+ void bench_aio(uint32_t reads) {
+     const uint32_t request = 4096;
+     const uint64_t file_size = 64ull * 1024 * 1024;
+     static const char* backends[] = { "sync", "threads", "uring" };
+     char path[] = "/tmp/simpleos-aio-XXXXXX";
+     int fd = mkstemp(path);
+     if (fd < 0) {
+         printf("bench aio: cannot create a file in /tmp\n");
+         return;
+     }
+     memset(bench_io_buffer, 'q', sizeof(bench_io_buffer));
+     for (uint64_t offset = 0; offset < file_size; offset += sizeof(bench_io_buffer)) {
+         if (pwrite(fd, bench_io_buffer, sizeof(bench_io_buffer), (off_t)offset) != sizeof(bench_io_buffer)) {
+             printf("bench aio: cannot fill %s\n", path);
+             close(fd);
+             unlink(path);
+             return;
+         }
+     }
+     fsync(fd);
+     
+     // Bypass the host page cache where the file system allows it
+     int direct = -1;
+ #ifdef O_DIRECT
+     direct = open(path, O_RDONLY | O_DIRECT);
+ #endif
+     unlink(path);
+     int read_fd = direct >= 0 ? direct : fd;
+     uint8_t* buffers = NULL;
+     uint64_t* samples = malloc(reads * sizeof(uint64_t));
+     if (posix_memalign((void**)&buffers, 4096, (size_t)IO_QUEUE_DEPTH * request) != 0 || !samples) {
+         printf("bench aio: out of memory\n");
+         free(samples);
+         close(fd);
+         return;
+     }
+     
+     IoBackend saved = simple_os.io_backend;
+     printf("%u random %u byte reads of a %llu MB host file%s\n", reads, request,
+            (unsigned long long)(file_size >> 20), direct >= 0 ? " with O_DIRECT" : "");
+     for (int b = 0; b < 3; b++) {
+         if (!io_set_backend((IoBackend)b)) {
+             printf("%-24s not available\n", backends[b]);
+             continue;
+         }
+         for (int depth = 1; depth <= IO_QUEUE_DEPTH; depth *= 4) {
+             int16_t slots[IO_QUEUE_DEPTH];
+             for (int k = 0; k < depth; k++) {
+                 slots[k] = -1;
+             }
+             uint32_t seed = 5;
+             uint32_t submitted = 0;
+             uint32_t completed = 0;
+             uint64_t start = bench_now_ns();
+             while (completed < reads) {
+                 for (int k = 0; k < depth && submitted < reads; k++) {
+                     if (slots[k] < 0) {
+                         uint64_t offset = (uint64_t)(bench_random(&seed) % (file_size / request)) * request;
+                         slots[k] = io_submit(IO_READ, read_fd, buffers + (size_t)k * request, request, offset);
+                         submitted++;
+                     }
+                 }
+                 io_flush();
+                 io_reap(true);
+                 for (int k = 0; k < depth; k++) {
+                     if (slots[k] >= 0 && simple_os.io[slots[k]].state == IO_DONE) {
+                         samples[completed++] = simple_os.io[slots[k]].latency_ns;
+                         io_wait(slots[k]);
+                         slots[k] = -1;
+                     }
+                 }
+             }
+             uint64_t elapsed = bench_now_ns() - start;
+             char label[32];
+             snprintf(label, sizeof(label), "%s qd %d", backends[b], depth);
+             bench_report(label, samples, completed, completed, elapsed);
+         }
+     }
+     io_set_backend(saved);
+     free(buffers);
+     free(samples);
+     if (direct >= 0) {
+         close(direct);
+     }
+     close(fd);
+     
+     // Each ioread process sleeps on its own read, so more processes keep more reads in flight
+     if (!simple_os.disk_mapped) {
+         printf("Mount an image to also time reads from sleeping processes\n");
+         return;
+     }
+     printf("%u random %u byte reads of the mounted image by ioread processes\n", reads, BLOCK_SIZE);
+     for (int n = 1; n <= 8; n *= 2) {
+         uint8_t pids[8];
+         int started = 0;
+         for (int i = 0; i < n; i++) {
+             pids[i] = process_create("ioread");
+             if (pids[i] == 0xFF) {
+                 break;
+             }
+             uint32_t count = reads / n;
+             memcpy(process_memory(pids[i]) + IOREAD_COUNT, &count, sizeof(count));
+             started++;
+         }
+         uint64_t batches = simple_os.io_batches;
+         uint64_t start = bench_now_ns();
+         bool running = true;
+         while (running) {
+             process_schedule();
+             running = false;
+             for (int i = 0; i < started; i++) {
+                 running = running || process_alive(pids[i]);
              }
          }
+         uint64_t elapsed = bench_now_ns() - start;
+         printf("%d processes %12.0f reads/s  %6.1f reads per batch\n", started,
+                (double)(reads / n) * started * 1e9 / (double)elapsed,
+                (double)(reads / n) * started / (double)(simple_os.io_batches - batches));
+         bench_reap(pids, started);
+     }
+ }
+ #endif
+ 
+ Context bench_main_context;
+ Context bench_peer_context;
+ 
+ // Peer coroutine for the raw context-switch benchmark
+ void bench_ctxsw_peer() {
+     for (;;) {
+         context_switch(&bench_peer_context, &bench_main_context);
+     }
+ }
+ 
+ // Measure coroutine switches, bare and through the scheduler
+ void bench_ctxsw(uint32_t switches) {
+     // Bare ping-pong between two contexts
+     uint8_t* stack = malloc(PROCESS_STACK_SIZE);
+     context_make(&bench_peer_context, stack, PROCESS_STACK_SIZE, bench_ctxsw_peer);
+     uint64_t start = bench_now_ns();
+     for (uint32_t i = 0; i < switches / 2; i++) {
+         context_switch(&bench_main_context, &bench_peer_context);
+     }
+     uint64_t elapsed = bench_now_ns() - start;
+     printf("%-24s %8.1f ns/switch\n", "ctxsw (bare)", (double)elapsed / (double)(switches / 2 * 2));
+     free(stack);
+ 
+     // Two processes yielding to each other through process_schedule
+     uint8_t pids[2];
+     if (process_create_batch(0xFF, "yield", 2, pids) != 2) {
+         printf("bench ctxsw: need two free process slots\n");
+         return;
+     }
+     uint32_t yields = switches / 4;
+     for (int i = 0; i < 2; i++) {
+         memcpy(process_memory(pids[i]), &yields, sizeof(yields));
+     }
+     uint64_t slices = 0;
+     start = bench_now_ns();
+     while (process_alive(pids[0]) || process_alive(pids[1])) {
+         process_schedule();
+         slices++;
      }
-     return false; // File not found
+     elapsed = bench_now_ns() - start;
+     printf("%-24s %8.1f ns/switch  (%llu slices)\n", "ctxsw (scheduled)",
+            (double)elapsed / (double)(slices * 2), (unsigned long long)slices);
+     bench_reap(pids, 2);
  }
  
  /* ======= SHELL ======= */
@@ -283,37 +10211,143 @@
          printf("SimpleOS Commands:\n");
          printf("  help                 - Display this help message\n");
          printf("  ps                   - List all processes\n");
-         printf("  run [program]        - Run a program\n");
+         printf("  run [program]        - Run a program (hello, counter, spin, workers, contend, ioread)\n");
+         printf("  run -n [N] [program] - Run N copies of a program\n");
+         printf("  thread [pid] [prog]  - Start a thread running prog in process pid\n");
          printf("  kill [pid]           - Terminate a process\n");
-         printf("  ls                   - List all files\n");
+         printf("  wait [pid]           - Collect the exit status of a child\n");
+         printf("  ls [path]            - List a directory, or the names matching a pattern (log_*)\n");
          printf("  touch [filename]     - Create a new file\n");
-         printf("  rm [filename]        - Delete a file\n");
+         printf("  mkdir [path]         - Create a directory\n");
+         printf("  cd [path]            - Change the working directory\n");
+         printf("  pwd                  - Print the working directory\n");
+         printf("  rm [filename]        - Delete a file, an empty directory or names matching a pattern\n");
+         printf("  write [file] [text]  - Replace a file's contents with text\n");
+         printf("  cat [filename]       - Print a file's contents\n");
+         printf("  cp [src] [dst]       - Copy a file; --reflink shares its blocks instead\n");
+         printf("  fd                   - List the shell's open file descriptors\n");
+         printf("  fd open [file]       - Open a file, creating it if needed\n");
+         printf("  fd read [fd] [n]     - Read and print n bytes at the descriptor's position\n");
+         printf("  fd write [fd] [text] - Write text at the descriptor's position\n");
+         printf("  fd seek [fd] [pos]   - Move the descriptor's position\n");
+         printf("  fd close [fd]        - Close a descriptor\n");
+         printf("  cache                - Show page cache statistics\n");
+         printf("  cache dirty [bg] [n] - Set background and blocking dirty ratios\n");
+         printf("  cache flush          - Write back all dirty pages\n");
+         printf("  cache readahead [n]  - Set the largest readahead window in pages, 0 disables\n");
+         printf("  mount [image]        - Mount a disk image file, creating it if needed\n");
+         printf("  umount               - Unmount the disk image\n");
+         printf("  mount -t tmpfs [dir] - Mount an empty in-memory file system on a directory\n");
+         printf("  umount [dir]         - Unmount the file system mounted on a directory\n");
+         printf("  mount                - List the mounted file systems\n");
+         printf("  sync                 - Write cached data and commit the journal\n");
+         printf("  format [inplace|log] - Erase the file system and choose its block layout\n");
+         printf("  df                   - Show free space and block device statistics\n");
+         printf("  stat [path]          - Show a file's size and extents\n");
+         printf("  compress [on|off]    - Compress new files, or show compression statistics\n");
+         printf("  dedup [on|off]       - Deduplicate new files, or show deduplication statistics\n");
+         printf("  scrub [start|stop]   - Verify checksums in the background, or show scrub statistics\n");
+         printf("  scrub now            - Verify every block and metadata record now\n");
+         printf("  fsck [-n]            - Check the file system and repair it; -n only reports\n");
+         printf("  snapshot             - List snapshots\n");
+         printf("  snapshot create [n]  - Snapshot the file system as n\n");
+         printf("  snapshot restore [n] - Return the file system to snapshot n\n");
+         printf("  snapshot delete [n]  - Delete snapshot n\n");
+         printf("  journal              - Show metadata journal statistics\n");
+         printf("  journal interval [n] - Group commit every n ms (0 commits every operation)\n");
+         printf("  io                   - Show async I/O statistics\n");
+         printf("  io backend [name]    - Use the uring, threads or sync I/O backend\n");
+         printf("  step [n]             - Run the scheduler for n time slices\n");
+         printf("  bench spawn          - Benchmark process creation\n");
+         printf("  bench ctxsw          - Benchmark coroutine context switches\n");
+         printf("  bench thread         - Benchmark thread versus process creation\n");
+         printf("  bench futex          - Benchmark uncontended and contended mutexes\n");
+         printf("  bench io             - Benchmark sequential and random file I/O\n");
+         printf("  bench names          - Benchmark filename create, lookup and delete\n");
+         printf("  bench paths          - Benchmark path lookup at depths 1-32\n");
+         printf("  bench cache          - Page cache hit rate by working set size\n");
+         printf("  bench journal        - Creates per second at several commit intervals\n");
+         printf("  bench log            - Small appends on the in-place and log layouts\n");
+         printf("  bench alloc          - Extents per file with and without delayed allocation\n");
+         printf("  bench small          - Tiny file create and cat, in blocks and inline\n");
+         printf("  bench readahead      - Sequential and random reads with and without readahead\n");
+         printf("  bench fd             - Small reads by path versus through a descriptor\n");
+         printf("  bench files [n]      - Create, look up and list up to n files (default 10M)\n");
+         printf("  bench glob [n]       - Pattern search and delete among n names (default 1M)\n");
+         printf("  bench aio            - Host read IOPS and latency at queue depths 1-256\n");
+         printf("  bench compress       - Space and throughput with compression off and on\n");
+         printf("  bench dedup          - Space and write throughput with deduplication off and on\n");
+         printf("  bench checksum       - CRC32C speed, and file throughput with checksums off and on\n");
+         printf("  bench snapshot       - Snapshot and clone times as the data grows\n");
+         printf("  bench fsck [n]       - Check times on one and all cores up to n files (default 1M)\n");
+         printf("  bench vfs [n]        - Create, write, read and delete n files on the disk and a tmpfs (default 100K)\n");
          printf("  exit                 - Shut down the system\n");
          return;
      }
      
      // Compare with "ps" command
      if (command[0] == 'p' && command[1] == 's' && (command[2] == '\0' || command[2] == ' ')) {
-         printf("PID  STATE     NAME\n");
-         printf("---  --------  ----------------\n");
+         printf("PID  TGID  PPID  STATE     NAME\n");
+         printf("---  ----  ----  --------  ----------------\n");
+         rcu_read_lock();
          for (int i = 0; i < MAX_PROCESSES; i++) {
-             if (simple_os.processes[i].state != PROCESS_TERMINATED) {
+             Process* p = &simple_os.processes[i];
+             if (p->state != PROCESS_TERMINATED && p->state != PROCESS_REAPED) {
                  const char* state_str = "UNKNOWN";
-                 switch (simple_os.processes[i].state) {
+                 switch (p->state) {
                      case PROCESS_READY: state_str = "READY"; break;
                      case PROCESS_RUNNING: state_str = "RUNNING"; break;
                      case PROCESS_BLOCKED: state_str = "BLOCKED"; break;
+                     case PROCESS_ZOMBIE: state_str = "ZOMBIE"; break;
+                     case PROCESS_REAPED: state_str = "REAPED"; break;
                      case PROCESS_TERMINATED: state_str = "TERM"; break;
                  }
-                 printf("%3d  %-8s  %s\n", i, state_str, simple_os.processes[i].name);
+                 if (p->parent_id == 0xFF) {
+                     printf("%3d  %4d     -  %-8s  %s\n", i, p->tgid, state_str, p->name);
+                 } else {
+                     printf("%3d  %4d  %4d  %-8s  %s\n", i, p->tgid, p->parent_id, state_str, p->name);
+                 }
              }
          }
+         rcu_read_unlock();
          return;
      }
      
      // Compare with "run" command
      if (command[0] == 'r' && command[1] == 'u' && command[2] == 'n' && command[3] == ' ') {
          const char* program_name = &command[4];
+         
+         // "run -n N name" starts N copies in one batch
+         if (program_name[0] == '-' && program_name[1] == 'n' && program_name[2] == ' ') {
+             int count = 0;
+             int i = 3;
+             while (program_name[i] >= '0' && program_name[i] <= '9') {
+                 if (count <= MAX_PROCESSES) { // Any larger count is clamped below anyway
+                     count = count * 10 + (program_name[i] - '0');
+                 }
+                 i++;
+             }
+             while (program_name[i] == ' ') {
+                 i++;
+             }
+             if (count <= 0 || program_name[i] == '\0') {
+                 printf("Usage: run -n [N] [program]\n");
+                 return;
+             }
+             if (count > MAX_PROCESSES) {
+                 count = MAX_PROCESSES;
+             }
+             uint8_t pids[MAX_PROCESSES];
+             uint8_t started = process_create_batch(0xFF, &program_name[i], (uint8_t)count, pids);
+             for (uint8_t j = 0; j < started; j++) {
+                 printf("Started process %d: %s\n", pids[j], &program_name[i]);
+             }
+             if (started < count) {
+                 printf("Failed to start %d of %d processes\n", count - started, count);
+             }
+             return;
+         }
+         
          uint8_t pid = process_create(program_name);
          if (pid != 0xFF) {
              printf("Started process %d: %s\n", pid, program_name);
@@ -323,6 +10357,30 @@
          return;
      }
      
+     // Compare with "thread" command
+     if (command[0] == 't' && command[1] == 'h' && command[2] == 'r' && command[3] == 'e' &&
+         command[4] == 'a' && command[5] == 'd' && command[6] == ' ') {
+         int pid = 0;
+         int i = 7;
+         while (command[i] >= '0' && command[i] <= '9') {
+             if (pid < MAX_PROCESSES) { // Already out of range otherwise
+                 pid = pid * 10 + (command[i] - '0');
+             }
+             i++;
+         }
+         while (command[i] == ' ') {
+             i++;
+         }
+         ProgramEntry entry = program_lookup(&command[i]);
+         uint8_t tid = pid < MAX_PROCESSES ? thread_create(pid, entry) : 0xFF;
+         if (tid != 0xFF) {
+             printf("Started thread %d in process %d\n", tid, pid);
+         } else {
+             printf("Failed to start thread\n");
+         }
+         return;
+     }
+     
      // Compare with "kill" command
      if (command[0] == 'k' && command[1] == 'i' && command[2] == 'l' && command[3] == 'l' && command[4] == ' ') {
          int pid = 0;
@@ -331,7 +10389,7 @@
              pid = pid * 10 + (command[i] - '0');
              i++;
          }
-         if (pid >= 0 && pid < MAX_PROCESSES && simple_os.processes[pid].state != PROCESS_TERMINATED) {
+         if (pid >= 0 && process_alive(pid)) {
              process_terminate(pid);
              printf("Terminated process %d\n", pid);
          } else {
@@ -340,45 +10398,932 @@
          return;
      }
      
+     // Compare with "step" command
+     if (command[0] == 's' && command[1] == 't' && command[2] == 'e' && command[3] == 'p' &&
+         (command[4] == '\0' || command[4] == ' ')) {
+         int slices = 0;
+         int i = 5;
+         while (command[4] == ' ' && command[i] >= '0' && command[i] <= '9') {
+             if (slices < SHELL_MAX_STEPS) {
+                 slices = slices * 10 + (command[i] - '0');
+             }
+             i++;
+         }
+         if (slices == 0) {
+             slices = 1;
+         } else if (slices > SHELL_MAX_STEPS) {
+             slices = SHELL_MAX_STEPS;
+         }
+         for (int n = 0; n < slices; n++) {
+             process_schedule();
+         }
+         return;
+     }
+     
+     // Compare with "wait" command
+     if (command[0] == 'w' && command[1] == 'a' && command[2] == 'i' && command[3] == 't' &&
+         (command[4] == '\0' || command[4] == ' ')) {
+         uint8_t target = 0xFF;
+         if (command[4] == ' ' && command[5] >= '0' && command[5] <= '9') {
+             int pid = 0;
+             int i = 5;
+             while (command[i] >= '0' && command[i] <= '9') {
+                 if (pid < MAX_PROCESSES) { // Already out of range otherwise
+                     pid = pid * 10 + (command[i] - '0');
+                 }
+                 i++;
+             }
+             target = pid < MAX_PROCESSES ? pid : 0xFE;
+         }
+         int status = 0;
+         int result = process_wait(0xFF, target, &status);
+         if (result >= 0) {
+             printf("Process %d exited with status %d\n", result, status);
+         } else if (result == -2) {
+             printf("No child has exited yet\n");
+         } else {
+             printf("No such child process\n");
+         }
+         return;
+     }
+     
      // Compare with "ls" command
      if (command[0] == 'l' && command[1] == 's' && (command[2] == '\0' || command[2] == ' ')) {
+         const char* path = command[2] == ' ' ? &command[3] : ".";
+         char pattern[MAX_FILENAME_LEN];
+         bool glob = strpbrk(path, "*?[") != NULL; // A pattern lists the matching names of its directory
+         VfsNode dir;
+         VfsStat stat;
+         if (!vfs_walk(path, glob ? pattern : NULL, &dir)) {
+             printf("Failed: No such file or directory\n");
+             return;
+         }
+         vfs_stat(dir, &stat);
+         if (!glob && !stat.is_dir) {
+             printf("%s (%llu bytes)\n", stat.name, (unsigned long long)stat.size);
+             return;
+         }
+         int32_t* matches = NULL;
+         int32_t match_count = glob ? vfs_glob(dir, pattern, &matches) : 0;
+         if (match_count < 0) {
+             printf("Failed: Out of memory\n");
+             return;
+         }
          int file_count = 0;
          printf("FILES:\n");
          printf("---------------------\n");
-         for (int i = 0; i < MAX_FILES; i++) {
-             if (simple_os.file_table[i].in_use) {
-                 printf("%s (%d bytes)\n", simple_os.file_table[i].filename, simple_os.file_table[i].size);
-                 file_count++;
+         DirCursor cursor = {0};
+         int32_t id;
+         while ((id = glob ? (file_count < match_count ? matches[file_count] : -1) : vfs_next(dir, &cursor)) >= 0) {
+             VfsNode node = { dir.mount, id };
+             vfs_stat(node, &stat);
+             if (stat.is_dir) {
+                 printf("%s/\n", stat.name);
+             } else {
+                 printf("%s (%llu bytes)\n", stat.name, (unsigned long long)stat.size);
              }
+             file_count++;
          }
+         free(matches);
          if (file_count == 0) {
              printf("No files found\n");
          }
          return;
      }
      
-     // Compare with "touch" command
-     if (command[0] == 't' && command[1] == 'o' && command[2] == 'u' && command[3] == 'c' && 
-         command[4] == 'h' && command[5] == ' ') {
+     // Compare with "touch" and "mkdir" commands
+     bool is_touch = command[0] == 't' && command[1] == 'o' && command[2] == 'u' && command[3] == 'c' &&
+                     command[4] == 'h' && command[5] == ' ';
+     bool is_mkdir = command[0] == 'm' && command[1] == 'k' && command[2] == 'd' && command[3] == 'i' &&
+                     command[4] == 'r' && command[5] == ' ';
+     if (is_touch || is_mkdir) {
          const char* filename = &command[6];
-         int result = fs_create(filename);
+         int result = vfs_create(filename, is_mkdir, NULL);
          if (result >= 0) {
-             printf("Created file: %s\n", filename);
+             printf("Created %s: %s\n", is_mkdir ? "directory" : "file", filename);
          } else if (result == -1) {
              printf("Failed: File system full\n");
-         } else {
+         } else if (result == -2) {
              printf("Failed: File already exists\n");
+         } else {
+             printf("Failed: No such directory\n");
+         }
+         return;
+     }
+     
+     // Compare with "cd" command
+     if (command[0] == 'c' && command[1] == 'd' && (command[2] == '\0' || command[2] == ' ')) {
+         const char* path = command[2] == ' ' ? &command[3] : "/";
+         if (!vfs_chdir(path)) {
+             printf("Failed: Not a directory\n");
          }
          return;
      }
      
+     // Compare with "pwd" command
+     if (command[0] == 'p' && command[1] == 'w' && command[2] == 'd' && (command[3] == '\0' || command[3] == ' ')) {
+         char path[MAX_PATH_LEN + 1];
+         vfs_path(vfs_cwd(), path, sizeof(path));
+         printf("%s\n", path);
+         return;
+     }
+     
      // Compare with "rm" command
      if (command[0] == 'r' && command[1] == 'm' && command[2] == ' ') {
          const char* filename = &command[3];
-         if (fs_delete(filename)) {
+         if (strpbrk(filename, "*?[")) {
+             char pattern[MAX_FILENAME_LEN];
+             VfsNode dir;
+             int32_t* matches = NULL;
+             int32_t count = vfs_walk(filename, pattern, &dir) ? vfs_glob(dir, pattern, &matches) : 0;
+             if (count < 0) {
+                 printf("Failed: Out of memory\n");
+                 return;
+             }
+             if (count == 0) {
+                 printf("Failed: File not found\n");
+                 return;
+             }
+             int32_t deleted = 0;
+             for (int32_t i = 0; i < count; i++) {
+                 VfsNode node = { dir.mount, matches[i] };
+                 deleted += vfs_delete_node(node) == 0;
+             }
+             free(matches);
+             if (deleted == count) {
+                 printf("Deleted %d file(s) matching %s\n", deleted, filename);
+             } else {
+                 printf("Deleted %d of %d entries matching %s; the others are non-empty directories or mount points\n",
+                        deleted, count, filename);
+             }
+             return;
+         }
+         int result = vfs_delete(filename);
+         if (result == 0) {
              printf("Deleted file: %s\n", filename);
+         } else if (result == -2) {
+             printf("Failed: Directory not empty\n");
+         } else if (result == -3) {
+             printf("Failed: %s is a mount point\n", filename);
+         } else {
+             printf("Failed: File not found\n");
+         }
+         return;
+     }
+     
+     // Compare with "write" command
+     if (command[0] == 'w' && command[1] == 'r' && command[2] == 'i' && command[3] == 't' &&
+         command[4] == 'e' && command[5] == ' ') {
+         char filename[MAX_PATH_LEN + 1];
+         int i = 6;
+         int j = 0;
+         while (command[i] != '\0' && command[i] != ' ' && j < MAX_PATH_LEN) {
+             filename[j++] = command[i++];
+         }
+         filename[j] = '\0';
+         if (command[i] != '\0' && command[i] != ' ') {
+             printf("Failed: Path longer than %d characters\n", MAX_PATH_LEN);
+             return;
+         }
+         if (command[i] == ' ') {
+             i++;
+         }
+         const char* text = &command[i];
+         uint32_t len = (uint32_t)strlen(text);
+         int result = vfs_truncate(filename, 0);
+         if (result == 0) {
+             result = vfs_write(filename, 0, text, len);
+         }
+         if (result >= 0) {
+             printf("Wrote %u bytes to %s\n", len, filename);
+         } else if (result == -1) {
+             printf("Failed: File not found\n");
+         } else {
+             printf("Failed: No space left\n");
+         }
+         return;
+     }
+     
+     // Compare with "cat" command
+     if (command[0] == 'c' && command[1] == 'a' && command[2] == 't' && command[3] == ' ') {
+         const char* filename = &command[4];
+         char buffer[BLOCK_SIZE];
+         uint32_t offset = 0;
+         int n;
+         char last = '\n';
+         while ((n = vfs_read(filename, offset, buffer, sizeof(buffer))) > 0) {
+             fwrite(buffer, 1, n, stdout);
+             last = buffer[n - 1];
+             offset += n;
+         }
+         if (n == -3) {
+             printf("%sFailed: Data at offset %u does not match its checksum\n", last != '\n' ? "\n" : "", offset);
+         } else if (n < 0) {
+             printf("Failed: File not found\n");
+         } else if (last != '\n') {
+             printf("\n");
+         }
+         return;
+     }
+     
+     // Compare with "cp" command
+     if (command[0] == 'c' && command[1] == 'p' && command[2] == ' ') {
+         const char* arg = &command[3];
+         bool reflink = strncmp(arg, "--reflink ", 10) == 0;
+         if (reflink) {
+             arg += 10;
+         }
+         char source[MAX_PATH_LEN];
+         int i = 0;
+         while (arg[i] != '\0' && arg[i] != ' ' && i < MAX_PATH_LEN - 1) {
+             source[i] = arg[i];
+             i++;
+         }
+         source[i] = '\0';
+         const char* target = arg[i] == ' ' ? &arg[i + 1] : "";
+         if (source[0] == '\0' || target[0] == '\0') {
+             printf("Usage: cp [--reflink] [src] [dst]\n");
+             return;
+         }
+         int result;
+         VfsNode from;
+         VfsNode to;
+         if (reflink) {
+             result = vfs_clone(source, target);
+             result = result == -5 ? -6 : result;
+         } else if (!vfs_find_file(source, &from)) {
+             result = -1;
          } else {
+             result = vfs_create(target, false, &to) < 0 ? -3 : 0;
+             char buffer[BLOCK_SIZE];
+             int n = 0;
+             for (uint64_t offset = 0; result == 0 && (n = vfs_read_node(from, offset, buffer, sizeof(buffer))) > 0; offset += n) {
+                 result = vfs_write_node(to, offset, buffer, (uint32_t)n) < 0 ? -2 : 0;
+             }
+             if (n == -3) {
+                 result = -5;
+             }
+         }
+         if (result == 0) {
+             printf("Copied %s to %s%s\n", source, target, reflink ? ", sharing its blocks" : "");
+         } else if (result == -1) {
              printf("Failed: File not found\n");
+         } else if (result == -2) {
+             printf("Failed: No space left\n");
+         } else if (result == -3) {
+             printf("Failed: Cannot create %s\n", target);
+         } else if (result == -4) {
+             printf("Failed: Only uncompressed files of the in-place layout can share blocks\n");
+         } else if (result == -6) {
+             printf("Failed: Only files on the disk can share blocks\n");
+         } else {
+             printf("Failed: Data of %s does not match its checksum\n", source);
+         }
+         return;
+     }
+     
+     // Compare with "fd" command
+     if (command[0] == 'f' && command[1] == 'd' && (command[2] == '\0' || command[2] == ' ')) {
+         const char* arg = command[2] == ' ' ? &command[3] : "";
+         if (strncmp(arg, "open ", 5) == 0) {
+             int fd = fd_open(0xFF, arg + 5, FD_CREATE);
+             if (fd >= 0) {
+                 printf("Opened %s as fd %d\n", arg + 5, fd);
+             } else if (fd == -1) {
+                 printf("Failed: %s is a directory\n", arg + 5);
+             } else if (fd == -2) {
+                 printf("Failed: Too many open files\n");
+             } else {
+                 printf("Failed: Cannot create %s\n", arg + 5);
+             }
+             return;
+         }
+         if (strncmp(arg, "read ", 5) == 0) {
+             int fd = 0;
+             int len = BLOCK_SIZE;
+             char buffer[BLOCK_SIZE];
+             if (sscanf(arg + 5, "%d %d", &fd, &len) < 1 || len < 0 || len > BLOCK_SIZE) {
+                 printf("Usage: fd read [fd] [0-%d bytes]\n", BLOCK_SIZE);
+                 return;
+             }
+             int n = fd_read(0xFF, fd, buffer, (uint32_t)len);
+             if (n == -3) {
+                 printf("Failed: Data does not match its checksum\n");
+                 return;
+             }
+             if (n < 0) {
+                 printf("Failed: Bad file descriptor\n");
+                 return;
+             }
+             fwrite(buffer, 1, n, stdout);
+             printf("\n");
+             return;
+         }
+         if (strncmp(arg, "write ", 6) == 0) {
+             char* text;
+             int fd = (int)strtol(arg + 6, &text, 10);
+             if (*text == ' ') {
+                 text++;
+             }
+             int n = fd_write(0xFF, fd, text, (uint32_t)strlen(text));
+             if (n >= 0) {
+                 printf("Wrote %d bytes\n", n);
+             } else if (n == -1) {
+                 printf("Failed: Bad file descriptor\n");
+             } else {
+                 printf("Failed: No space left\n");
+             }
+             return;
+         }
+         if (strncmp(arg, "seek ", 5) == 0) {
+             int fd = 0;
+             long long offset = 0;
+             if (sscanf(arg + 5, "%d %lld", &fd, &offset) != 2 || fd_seek(0xFF, fd, offset, SEEK_SET) < 0) {
+                 printf("Failed: Bad file descriptor or position\n");
+             }
+             return;
+         }
+         if (strncmp(arg, "close ", 6) == 0) {
+             if (!fd_close(0xFF, atoi(arg + 6))) {
+                 printf("Failed: Bad file descriptor\n");
+             }
+             return;
+         }
+         printf("FD  POSITION    FILE\n");
+         for (int fd = 0; fd < MAX_FDS; fd++) {
+             OpenFile* file = fd_get(0xFF, fd);
+             if (!file) {
+                 continue;
+             }
+             char path[MAX_PATH_LEN];
+             if (file->file >= 0) {
+                 VfsNode node = { file->mount, file->file };
+                 vfs_path(node, path, sizeof(path));
+             } else {
+                 snprintf(path, sizeof(path), "(deleted)");
+             }
+             printf("%-3d %-11llu %s\n", fd, (unsigned long long)file->offset, path);
+         }
+         return;
+     }
+     
+     // Compare with "cache" command
+     if (command[0] == 'c' && command[1] == 'a' && command[2] == 'c' && command[3] == 'h' &&
+         command[4] == 'e' && (command[5] == '\0' || command[5] == ' ')) {
+         const char* arg = command[5] == ' ' ? &command[6] : "";
+         if (strcmp(arg, "flush") == 0) {
+             cache_sync();
+             printf("Page cache flushed\n");
+             return;
+         }
+         if (strncmp(arg, "readahead ", 10) == 0) {
+             int pages = atoi(arg + 10);
+             if (pages < 0 || pages > CACHE_PAGES / 4) {
+                 printf("Usage: cache readahead [0-%d pages]\n", CACHE_PAGES / 4);
+                 return;
+             }
+             simple_os.readahead_max = (uint16_t)pages;
+             return;
+         }
+         if (strncmp(arg, "dirty ", 6) == 0) {
+             int background = 0;
+             int ratio = 0;
+             if (sscanf(arg + 6, "%d %d", &background, &ratio) != 2 ||
+                 background < 0 || ratio < background || ratio > 100) {
+                 printf("Usage: cache dirty [background%%] [ratio%%]\n");
+                 return;
+             }
+             simple_os.dirty_background_ratio = (uint8_t)background;
+             simple_os.dirty_ratio = (uint8_t)ratio;
+             return;
+         }
+         uint64_t lookups = simple_os.cache_hits + simple_os.cache_misses;
+         printf("Pages:       %d (%d A1in, %d Am, %d free)\n", CACHE_PAGES,
+                simple_os.cache_len[CACHE_A1IN], simple_os.cache_len[CACHE_AM], simple_os.cache_len[CACHE_FREE]);
+         printf("Dirty:       %d (background %d%%, blocking %d%%)\n", simple_os.cache_dirty,
+                simple_os.dirty_background_ratio, simple_os.dirty_ratio);
+         printf("Hits:        %llu\n", (unsigned long long)simple_os.cache_hits);
+         printf("Misses:      %llu\n", (unsigned long long)simple_os.cache_misses);
+         printf("Hit rate:    %.1f%%\n", lookups ? 100.0 * simple_os.cache_hits / lookups : 0.0);
+         printf("Writebacks:  %llu\n", (unsigned long long)simple_os.cache_writebacks);
+         printf("Readahead:   %llu pages, %llu used, %llu wasted (window up to %u)\n",
+                (unsigned long long)simple_os.readahead_pages, (unsigned long long)simple_os.readahead_hits,
+                (unsigned long long)simple_os.readahead_wasted, simple_os.readahead_max);
+         return;
+     }
+     
+     // Compare with "mount" command
+     if (command[0] == 'm' && command[1] == 'o' && command[2] == 'u' && command[3] == 'n' &&
+         command[4] == 't' && (command[5] == '\0' || command[5] == ' ')) {
+         const char* path = command[5] == ' ' ? &command[6] : "";
+         if (path[0] == '\0') {
+             printf("MOUNT                TYPE\n");
+             for (int m = 0; m < MAX_MOUNTS; m++) {
+                 Mount* mount = &simple_os.mounts[m];
+                 if (!mount->in_use) {
+                     continue;
+                 }
+                 printf("%-20s %s", m == 0 ? "/" : mount->path, mount->ops->type);
+                 if (m == 0) {
+                     printf(" (%s)", simple_os.disk_mapped ? simple_os.disk_path : "in memory");
+                 }
+                 printf("\n");
+             }
+             return;
+         }
+         if (strncmp(path, "-t ", 3) == 0) {
+             if (strncmp(path + 3, "tmpfs ", 6) != 0) {
+                 printf("Usage: mount -t tmpfs [dir]\n");
+                 return;
+             }
+             path += 9;
+             int result = vfs_mount(path, &tmpfs_ops);
+             if (result >= 0) {
+                 printf("Mounted tmpfs on %s\n", path);
+             } else if (result == -1) {
+                 printf("Failed: %s is not a directory\n", path);
+             } else if (result == -2) {
+                 printf("Failed: A file system is already mounted on %s\n", path);
+             } else {
+                 printf("Failed: Too many mounts\n");
+             }
+             return;
+         }
+         int result = disk_mount(path);
+         if (result >= 0) {
+             printf("Mounted %s\n", path);
+             if (result == 1) {
+                 printf("Warning: %s was not cleanly unmounted\n", path);
+             }
+         } else if (result == -1) {
+             printf("Failed: Cannot open %s\n", path);
+         } else {
+             printf("Failed: %s is not a SimpleOS disk image\n", path);
+         }
+         return;
+     }
+     
+     // Compare with "umount" command
+     if (command[0] == 'u' && command[1] == 'm' && command[2] == 'o' && command[3] == 'u' &&
+         command[4] == 'n' && command[5] == 't' && (command[6] == '\0' || command[6] == ' ')) {
+         const char* path = command[6] == ' ' ? &command[7] : "";
+         int result = path[0] != '\0' ? vfs_umount(path) : -1;
+         if (result == 0) {
+             printf("Unmounted %s\n", path);
+         } else if (result == -2) {
+             printf("Failed: %s is in use\n", path);
+         } else if (path[0] != '\0' && (!simple_os.disk_mapped || strcmp(path, simple_os.disk_path) != 0)) {
+             printf("Failed: Nothing is mounted on %s\n", path);
+         } else if (simple_os.disk_mapped) {
+             printf("Unmounted %s\n", simple_os.disk_path);
+             disk_unmount();
+         } else {
+             printf("No disk image mounted\n");
+         }
+         return;
+     }
+     
+     // Compare with "sync" command
+     if (command[0] == 's' && command[1] == 'y' && command[2] == 'n' && command[3] == 'c' &&
+         (command[4] == '\0' || command[4] == ' ')) {
+         disk_sync();
+         return;
+     }
+     
+     // Compare with "format" command
+     if (command[0] == 'f' && command[1] == 'o' && command[2] == 'r' && command[3] == 'm' &&
+         command[4] == 'a' && command[5] == 't' && (command[6] == '\0' || command[6] == ' ')) {
+         const char* arg = command[6] == ' ' ? &command[7] : "";
+         if (strcmp(arg, "") == 0 || strcmp(arg, "inplace") == 0) {
+             disk_format(FS_LAYOUT_INPLACE);
+         } else if (strcmp(arg, "log") == 0) {
+             disk_format(FS_LAYOUT_LOG);
+         } else {
+             printf("Usage: format [inplace|log]\n");
+             return;
+         }
+         printf("Formatted %s\n", simple_os.disk_mapped ? simple_os.disk_path : "RAM disk");
+         return;
+     }
+     
+     // Compare with "compress" command
+     if (command[0] == 'c' && command[1] == 'o' && command[2] == 'm' && command[3] == 'p' &&
+         command[4] == 'r' && command[5] == 'e' && command[6] == 's' && command[7] == 's' &&
+         (command[8] == '\0' || command[8] == ' ')) {
+         const char* arg = command[8] == ' ' ? &command[9] : "";
+         if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+             simple_os.compress_enabled = arg[1] == 'n';
+             if (simple_os.compress_enabled && simple_os.disk->layout != FS_LAYOUT_INPLACE) {
+                 printf("Note: only files in the in-place layout are compressed\n");
+             }
+             return;
+         }
+         if (arg[0] != '\0') {
+             printf("Usage: compress [on|off]\n");
+             return;
+         }
+         printf("New files:   %s\n", simple_os.compress_enabled ? "compressed" : "not compressed");
+         printf("Written:     %llu KB in %llu KB of blocks (%.2fx)\n",
+                (unsigned long long)simple_os.compress_bytes_in / 1024,
+                (unsigned long long)simple_os.compress_bytes_out / 1024,
+                simple_os.compress_bytes_out ? (double)simple_os.compress_bytes_in / simple_os.compress_bytes_out : 0.0);
+         return;
+     }
+     
+     // Compare with "dedup" command
+     if (command[0] == 'd' && command[1] == 'e' && command[2] == 'd' && command[3] == 'u' && command[4] == 'p' &&
+         (command[5] == '\0' || command[5] == ' ')) {
+         const char* arg = command[5] == ' ' ? &command[6] : "";
+         if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+             simple_os.dedup_enabled = arg[1] == 'n';
+             if (simple_os.dedup_enabled && simple_os.compress_enabled) {
+                 printf("Note: new files are compressed instead while compression is on\n");
+             }
+             return;
+         }
+         if (arg[0] != '\0') {
+             printf("Usage: dedup [on|off]\n");
+             return;
+         }
+         uint32_t blocks = 0;
+         uint32_t refs = 0;
+         for (uint16_t b = 1; b < NUM_BLOCKS; b++) {
+             blocks += simple_os.disk->block_refs[b] > 0;
+             refs += simple_os.disk->block_refs[b];
+         }
+         printf("New files:   %s\n", simple_os.dedup_enabled ? "deduplicated" : "not deduplicated");
+         printf("Blocks:      %u pages in %u blocks (%.2fx), %u blocks saved\n", refs, blocks,
+                blocks ? (double)refs / blocks : 0.0, refs - blocks);
+         printf("Writebacks:  %llu found a duplicate, %llu did not\n", (unsigned long long)simple_os.dedup_hits,
+                (unsigned long long)simple_os.dedup_misses);
+         return;
+     }
+     
+     // Compare with "scrub" command
+     if (command[0] == 's' && command[1] == 'c' && command[2] == 'r' && command[3] == 'u' && command[4] == 'b' &&
+         (command[5] == '\0' || command[5] == ' ')) {
+         const char* arg = command[5] == ' ' ? &command[6] : "";
+         if (strcmp(arg, "start") == 0) {
+             simple_os.scrub_next = 0;
+             simple_os.scrub_running = true;
+             return;
+         }
+         if (strcmp(arg, "stop") == 0) {
+             simple_os.scrub_running = false;
+             return;
+         }
+         if (strcmp(arg, "now") == 0) {
+             uint64_t checked = simple_os.scrub_checked;
+             uint64_t errors = simple_os.scrub_errors;
+             uint64_t start = bench_now_ns();
+             simple_os.scrub_next = 0;
+             while (scrub_step(SCRUB_BATCH)) {
+             }
+             simple_os.scrub_running = false;
+             printf("Checked %llu blocks and metadata records in %.1f ms, %llu damaged\n",
+                    (unsigned long long)(simple_os.scrub_checked - checked), (bench_now_ns() - start) / 1e6,
+                    (unsigned long long)(simple_os.scrub_errors - errors));
+             return;
+         }
+         if (arg[0] != '\0') {
+             printf("Usage: scrub [start|stop|now]\n");
+             return;
+         }
+         printf("CRC32C:      %s\n", simple_os.crc32c_hardware ? "CPU instructions, three streams" : "tables");
+         if (simple_os.scrub_running) {
+             printf("Scrub:       running, %u of %u blocks and records\n", simple_os.scrub_next,
+                    (uint32_t)(NUM_BLOCKS + META_HEADER_PIECES + simple_os.disk->meta_pages));
+         } else {
+             printf("Scrub:       idle\n");
+         }
+         printf("Passes:      %u complete, %llu checked, %llu damaged\n", simple_os.scrub_passes,
+                (unsigned long long)simple_os.scrub_checked, (unsigned long long)simple_os.scrub_errors);
+         printf("Errors:      %llu", (unsigned long long)simple_os.checksum_errors);
+         if (simple_os.checksum_errors > 0) {
+             printf(", last in %s", simple_os.checksum_last_error);
+         }
+         printf("\n");
+         if (!simple_os.disk_mapped) {
+             printf("Note: metadata checksums are kept only for mounted images\n");
+         }
+         return;
+     }
+     
+     // Compare with "fsck" command
+     if (command[0] == 'f' && command[1] == 's' && command[2] == 'c' && command[3] == 'k' &&
+         (command[4] == '\0' || command[4] == ' ')) {
+         const char* arg = command[4] == ' ' ? &command[5] : "";
+         if (arg[0] != '\0' && strcmp(arg, "-n") != 0) {
+             printf("Usage: fsck [-n]\n");
+             return;
+         }
+         bool repair = arg[0] == '\0';
+         FsckReport report;
+         int result = fsck_run(repair, 0, &report);
+         if (result == -1) {
+             printf("fsck: out of memory\n");
+             return;
+         }
+         if (result == -2) {
+             printf("fsck: the root directory is damaged beyond repair\n");
+             return;
+         }
+         if (result == -3) {
+             printf("fsck: a snapshot is being taken, deleted or restored; remount to finish it first\n");
+             return;
+         }
+         printf("Checked %llu entries in %.1f MB of metadata in %.1f ms on %d thread%s (%.0f MB/s)\n",
+                (unsigned long long)report.entries, report.bytes / (1024.0 * 1024), report.check_ns / 1e6,
+                report.threads, report.threads == 1 ? "" : "s", report.bytes / (1024.0 * 1024) / (report.check_ns / 1e9));
+         for (int p = 0; p < FSCK_PROBLEMS; p++) {
+             if (report.found[p] > 0) {
+                 printf("  %8u %s\n", report.found[p], fsck_problem_names[p]);
+             }
+         }
+         if (report.passes == 1 && report.left == 0) {
+             printf("No problems found\n");
+         } else if (!repair) {
+             printf("Run fsck without -n to repair\n");
+         } else if (report.left == 0) {
+             printf("Repaired in %u passes, %.1f ms\n", report.passes, report.total_ns / 1e6);
+         } else {
+             printf("%u problems remain after %u passes\n", report.left, report.passes);
+         }
+         return;
+     }
+     
+     // Compare with "snapshot" command
+     if (strncmp(command, "snapshot", 8) == 0 && (command[8] == '\0' || command[8] == ' ')) {
+         const char* arg = command[8] == ' ' ? &command[9] : "";
+         if (strncmp(arg, "create ", 7) == 0) {
+             int result = snapshot_create(arg + 7);
+             if (result == 0) {
+                 printf("Created snapshot %s\n", arg + 7);
+             } else if (result == -1) {
+                 printf("Failed: Snapshot %s exists\n", arg + 7);
+             } else if (result == -2) {
+                 printf("Failed: At most %d snapshots\n", MAX_SNAPSHOTS);
+             } else if (result == -3) {
+                 printf("Failed: No space left for metadata\n");
+             } else {
+                 printf("Failed: Snapshots need the in-place layout\n");
+             }
+             return;
+         }
+         if (strncmp(arg, "restore ", 8) == 0) {
+             if (snapshot_restore(arg + 8) == 0) {
+                 printf("Restored snapshot %s\n", arg + 8);
+             } else {
+                 printf("Failed: Snapshot not found\n");
+             }
+             return;
+         }
+         if (strncmp(arg, "delete ", 7) == 0) {
+             if (snapshot_delete(arg + 7)) {
+                 printf("Deleted snapshot %s\n", arg + 7);
+             } else {
+                 printf("Failed: Snapshot not found\n");
+             }
+             return;
+         }
+         if (arg[0] != '\0' && strcmp(arg, "list") != 0) {
+             printf("Usage: snapshot [create|restore|delete] [name]\n");
+             return;
+         }
+         printf("NAME                              FILES  META KB  CREATED\n");
+         for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+             Snapshot* snap = &simple_os.disk->snapshots[i];
+             if (snap->list != 0 && snap->complete) {
+                 char when[32];
+                 time_t created = (time_t)snap->created;
+                 strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+                 printf("%-32.32s  %5u  %7u  %s\n", snap->name, snap->file_count, snap->pages * BLOCK_SIZE / 1024, when);
+             }
+         }
+         printf("Held:        %u blocks only snapshots use\n", block_held());
+         return;
+     }
+     
+     // Compare with "df" command
+     if (command[0] == 'd' && command[1] == 'f' && (command[2] == '\0' || command[2] == ' ')) {
+         DiskImage* disk = simple_os.disk;
+         uint32_t capacity = NUM_BLOCKS - 1;
+         if (disk->layout == FS_LAYOUT_LOG) {
+             capacity = (NUM_SEGMENTS - 1 - LFS_RESERVE_SEGMENTS) * SEGMENT_BLOCKS;
+         }
+         printf("Layout:      %s\n", disk->layout == FS_LAYOUT_LOG ? "log" : "in place");
+         printf("Free:        %u of %u blocks\n", disk->free_blocks, capacity);
+         printf("Files:       %u in %u metadata pages (%u free)\n", disk->file_count, disk->meta_pages,
+                disk->meta_free_count);
+         printf("Writes:      %llu blocks, %llu seeks\n", (unsigned long long)simple_os.block_writes,
+                (unsigned long long)simple_os.block_seeks);
+         if (simple_os.cache_writebacks > 0) {
+             printf("Write amp:   %.2f disk writes per page written back\n",
+                    (double)simple_os.block_writes / simple_os.cache_writebacks);
+         }
+         if (simple_os.cache_write_errors > 0) {
+             printf("Errors:      %llu pages could not be written back\n",
+                    (unsigned long long)simple_os.cache_write_errors);
+         }
+         if (disk->layout == FS_LAYOUT_INPLACE) {
+             int runs = 0;
+             for (int c = 0; c < FREE_CLASSES; c++) {
+                 for (uint16_t r = simple_os.free_class[c]; r != 0; r = simple_os.free_run_next[r]) {
+                     runs++;
+                 }
+             }
+             uint16_t largest = block_largest_run();
+             printf("Free runs:   %d, largest %u blocks\n", runs, largest ? simple_os.free_run_len[largest] : 0);
+             printf("Leaves:      %d of %d extent leaves in use\n", EXTENT_LEAVES - disk->free_leaf_count, EXTENT_LEAVES);
+         }
+         if (disk->layout == FS_LAYOUT_LOG) {
+             printf("Segments:    %d free of %d\n", lfs_free_segments(), NUM_SEGMENTS - 1);
+             printf("Cleaned:     %llu segments, %llu blocks copied\n",
+                    (unsigned long long)simple_os.lfs_cleaned_segments,
+                    (unsigned long long)simple_os.lfs_cleaned_blocks);
+         }
+         return;
+     }
+     
+     // Compare with "stat" command
+     if (command[0] == 's' && command[1] == 't' && command[2] == 'a' && command[3] == 't' &&
+         command[4] == ' ') {
+         const char* path = &command[5];
+         VfsNode node;
+         if (!vfs_find(path, &node)) {
+             printf("Failed: %s not found\n", path);
+             return;
+         }
+         if (node.mount != 0) {
+             VfsStat stat;
+             vfs_stat(node, &stat);
+             printf("Type:        %s\n", stat.is_dir ? "directory" : "file");
+             printf("Size:        %llu bytes\n", (unsigned long long)stat.size);
+             printf("Data:        in memory, on the %s at %s\n", simple_os.mounts[node.mount].ops->type,
+                    simple_os.mounts[node.mount].path);
+             return;
+         }
+         FileEntry* file = fs_entry(node.id);
+         printf("Type:        %s\n", file->is_dir ? "directory" : "file");
+         printf("Size:        %llu bytes, %u blocks\n", (unsigned long long)file->size, file->is_inline ? 0 : fs_blocks_for(file->size));
+         if (file->is_inline) {
+             printf("Data:        inline, %d bytes available\n", FS_INLINE_DATA);
+         } else if (file->is_compressed) {
+             Cluster* map = cluster_map(file);
+             uint32_t stored = 0;
+             uint32_t pages = 0;
+             int written = 0;
+             int raw = 0;
+             int gang = 0;
+             for (uint16_t c = 0; c < COMPRESS_CLUSTERS; c++) {
+                 if (map[c].start != 0) {
+                     written++;
+                     stored += map[c].blocks;
+                     pages += cluster_pages(file->size, c);
+                     raw += map[c].raw;
+                     gang += map[c].gang;
+                 }
+             }
+             printf("Clusters:    %d of %d written back, %d raw, %d scattered\n", written,
+                    (fs_blocks_for(file->size) + COMPRESS_CLUSTER_BLOCKS - 1) / COMPRESS_CLUSTER_BLOCKS, raw, gang);
+             printf("Compressed:  %u pages in %u blocks (%.2fx)\n", pages, stored, stored ? (double)pages / stored : 0.0);
+         } else if (file->is_deduped) {
+             int mapped = 0;
+             int shared = 0;
+             for (uint16_t i = 0; i < fs_blocks_for(file->size); i++) {
+                 uint16_t block = dedup_block(file, i);
+                 mapped += block != 0;
+                 shared += block != 0 && simple_os.disk->block_refs[block] > 1;
+             }
+             printf("Dedup:       %d pages written back, %d in shared blocks\n", mapped, shared);
+         } else if (simple_os.disk->layout == FS_LAYOUT_INPLACE && !file->is_dir) {
+             printf("Extents:     %u%s, %u blocks allocated\n", file->extent_count,
+                    file->extent_leaf ? " (in a leaf)" : "", extent_allocated(file));
+             Extent* list = extent_list(file);
+             for (int i = 0; i < file->extent_count; i++) {
+                 printf("  %5u: blocks %u-%u\n", list[i].logical, list[i].start, list[i].start + list[i].length - 1);
+             }
+         }
+         return;
+     }
+     
+     // Compare with "io" command
+     if (command[0] == 'i' && command[1] == 'o' && (command[2] == '\0' || command[2] == ' ')) {
+ #if HAVE_MMAP
+         static const char* backends[] = { "sync", "threads", "uring" };
+         const char* arg = command[2] == ' ' ? &command[3] : "";
+         if (strncmp(arg, "backend ", 8) == 0) {
+             for (int b = 0; b < 3; b++) {
+                 if (strcmp(arg + 8, backends[b]) == 0) {
+                     if (!io_set_backend((IoBackend)b)) {
+                         printf("Failed: %s backend not available\n", backends[b]);
+                     }
+                     return;
+                 }
+             }
+             printf("Usage: io backend [uring|threads|sync]\n");
+             return;
+         }
+         printf("Backend:     %s\n", backends[simple_os.io_backend]);
+         printf("In flight:   %u (%u queued)\n", simple_os.io_inflight, simple_os.io_queued);
+         printf("Requests:    %llu submitted, %llu completed, %llu failed\n",
+                (unsigned long long)simple_os.io_submitted, (unsigned long long)simple_os.io_completed,
+                (unsigned long long)simple_os.io_errors);
+         printf("Batches:     %llu (%.1f requests each)\n", (unsigned long long)simple_os.io_batches,
+                simple_os.io_batches ? (double)simple_os.io_submitted / simple_os.io_batches : 0.0);
+         printf("Latency:     %.1f us average\n",
+                simple_os.io_completed ? simple_os.io_latency_ns / 1e3 / simple_os.io_completed : 0.0);
+ #else
+         printf("Async I/O is not available on this host\n");
+ #endif
+         return;
+     }
+     
+     // Compare with "journal" command
+     if (command[0] == 'j' && command[1] == 'o' && command[2] == 'u' && command[3] == 'r' &&
+         command[4] == 'n' && command[5] == 'a' && command[6] == 'l' &&
+         (command[7] == '\0' || command[7] == ' ')) {
+         const char* arg = command[7] == ' ' ? &command[8] : "";
+         if (strncmp(arg, "interval ", 9) == 0) {
+             int interval = atoi(arg + 9);
+             if (interval < 0) {
+                 printf("Usage: journal interval [ms]\n");
+                 return;
+             }
+             simple_os.journal_interval_ms = (uint32_t)interval;
+             return;
+         }
+         if (!simple_os.disk_mapped) {
+             printf("No disk image mounted\n");
+             return;
+         }
+         printf("Interval:    %u ms\n", simple_os.journal_interval_ms);
+         printf("In use:      %u of %d bytes\n", simple_os.journal_head, JOURNAL_SIZE);
+         printf("Operations:  %llu (%u pending)\n", (unsigned long long)simple_os.journal_total_ops,
+                simple_os.journal_ops);
+         printf("Commits:     %llu\n", (unsigned long long)simple_os.journal_commits);
+         printf("Fsyncs:      %llu\n", (unsigned long long)simple_os.journal_fsyncs);
+         return;
+     }
+     
+     // Compare with "bench" command
+     if (command[0] == 'b' && command[1] == 'e' && command[2] == 'n' && command[3] == 'c' &&
+         command[4] == 'h' && command[5] == ' ') {
+         const char* name = &command[6];
+         if (strcmp(name, "spawn") == 0) {
+             bench_spawn(10000);
+         } else if (strcmp(name, "ctxsw") == 0) {
+             bench_ctxsw(10000000);
+         } else if (strcmp(name, "thread") == 0) {
+             bench_thread(10000);
+         } else if (strcmp(name, "futex") == 0) {
+             bench_futex(1000000);
+         } else if (strcmp(name, "io") == 0) {
+             bench_io(64 * 1024 * 1024);
+         } else if (strcmp(name, "names") == 0) {
+             bench_names(1000000);
+         } else if (strcmp(name, "paths") == 0) {
+             bench_paths(1000000);
+         } else if (strcmp(name, "cache") == 0) {
+             bench_cache(1000000);
+         } else if (strcmp(name, "journal") == 0) {
+             bench_journal(2000);
+         } else if (strcmp(name, "log") == 0) {
+             bench_log(16 * 1024 * 1024);
+         } else if (strcmp(name, "alloc") == 0) {
+             bench_alloc(192 * 1024);
+         } else if (strcmp(name, "small") == 0) {
+             bench_small(2000);
+         } else if (strcmp(name, "readahead") == 0) {
+             bench_readahead(64 * 1024 * 1024);
+         } else if (strcmp(name, "fd") == 0) {
+             bench_fd(1000000);
+         } else if (strncmp(name, "files", 5) == 0 && (name[5] == '\0' || name[5] == ' ')) {
+             int files = name[5] == ' ' ? atoi(&name[6]) : 0;
+             bench_files(files > 0 ? (uint32_t)files : 10000000);
+         } else if (strncmp(name, "glob", 4) == 0 && (name[4] == '\0' || name[4] == ' ')) {
+             int files = name[4] == ' ' ? atoi(&name[5]) : 0;
+             bench_glob(files > 0 ? (uint32_t)files : 1000000);
+         } else if (strcmp(name, "compress") == 0) {
+             bench_compress(64 * 1024 * 1024);
+         } else if (strcmp(name, "dedup") == 0) {
+             bench_dedup(64 * 1024 * 1024);
+         } else if (strcmp(name, "checksum") == 0) {
+             bench_checksum(256 * 1024 * 1024);
+         } else if (strcmp(name, "snapshot") == 0) {
+             bench_snapshot(200);
+         } else if (strncmp(name, "fsck", 4) == 0 && (name[4] == '\0' || name[4] == ' ')) {
+             int files = name[4] == ' ' ? atoi(&name[5]) : 0;
+             bench_fsck(files > 0 ? (uint32_t)files : 1000000);
+         } else if (strncmp(name, "vfs", 3) == 0 && (name[3] == '\0' || name[3] == ' ')) {
+             int files = name[3] == ' ' ? atoi(&name[4]) : 0;
+             bench_vfs(files > 0 ? (uint32_t)files : 100000);
+ #if HAVE_MMAP
+         } else if (strcmp(name, "aio") == 0) {
+             bench_aio(20000);
+ #endif
+         } else {
+             printf("Unknown benchmark: %s\n", name);
          }
          return;
      }
@@ -404,6 +11349,8 @@
      printf("Type 'help' for available commands\n\n");
      
      while (simple_os.system_running) {
+         // Nothing ticks while the shell waits for input, so commit first
+         journal_commit();
          printf("SimpleOS> ");
          
          // Get input (simplified - in a real OS, this would handle input properly)
@@ -429,7 +11376,10 @@
      // Initialize subsystems
      memory_init();
      process_init();
+     io_init();
+     checksum_init();
      fs_init();
+     vfs_init();
      
      // Set system as running
      simple_os.system_running = true;
@@ -438,14 +11388,22 @@
  }
  
  // Main function - OS entry point
- int main() {
+ int main(int argc, char** argv) {
      // Initialize the OS
      os_init();
      
+     // An image given on the command line is mounted before the shell starts
+     if (argc > 1) {
+         char command[SHELL_BUFFER_SIZE];
+         snprintf(command, sizeof(command), "mount %s", argv[1]);
+         shell_process_command(command);
+     }
+     
      // Run the shell
      shell_run();
      
      // OS shutdown
+     disk_unmount();
      printf("SimpleOS shutdown complete\n");
      return 0;
  }
\ No newline at end of file